@@ -0,0 +1,369 @@
+// bundle turns a directory of web assets into C source for httpresponse_asset:
+//
+//   ./bundle www assets assets.c
+//
+// defines "const HttpBundle assets" with every file below www, its gzip variant
+// (when it is worth it), strong ETags, MIME types, Last-Modified and a perfect
+// hash of the paths. a directory's index.html is also served as "dir/".
+// everything ends up in read-only data, the server needs no files and no heap.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "httpd.h"
+
+typedef struct
+{
+  char*           path;       // as requested, "/css/site.css"
+  int             file;       // index of the file, aliases share it
+} Entry;
+
+typedef struct
+{
+  char*           name;       // on disk
+  const char*     mime;
+  unsigned char*  data;
+  size_t          size;
+  unsigned char*  gzip;
+  size_t          gzipSize;
+  unsigned long long hash;
+  time_t          mtime;
+} File;
+
+static File*  files = 0;
+static int    n_files = 0;
+static Entry* entries = 0;
+static int    n_entries = 0;
+
+static const struct
+{
+  const char* ext;
+  const char* mime;
+}
+mimetypes[] =
+{
+  { "html", "text/html; charset=utf-8" },
+  { "htm",  "text/html; charset=utf-8" },
+  { "css",  "text/css; charset=utf-8" },
+  { "js",   "text/javascript; charset=utf-8" },
+  { "mjs",  "text/javascript; charset=utf-8" },
+  { "json", "application/json" },
+  { "map",  "application/json" },
+  { "txt",  "text/plain; charset=utf-8" },
+  { "xml",  "text/xml" },
+  { "svg",  "image/svg+xml" },
+  { "png",  "image/png" },
+  { "jpg",  "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "gif",  "image/gif" },
+  { "webp", "image/webp" },
+  { "ico",  "image/x-icon" },
+  { "woff", "font/woff" },
+  { "woff2","font/woff2" },
+  { "ttf",  "font/ttf" },
+  { "wasm", "application/wasm" },
+  { "pdf",  "application/pdf" },
+};
+
+static const char* mimetype( const char* _name )
+{
+  const char* dot = strrchr(_name, '.');
+  if (dot && 0 == strchr(dot, '/'))
+  {
+    for (unsigned int i = 0; i < sizeof(mimetypes) / sizeof(mimetypes[0]); ++i)
+    {
+      if (0 == strcasecmp(dot + 1, mimetypes[i].ext)) return mimetypes[i].mime;
+    }
+  }
+  return "application/octet-stream";
+}
+
+static void* xrealloc( void* _memory, size_t _size )
+{
+  void* p = realloc(_memory, _size);
+  if (0 == p)
+  {
+    fprintf(stderr, "bundle: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void add_entry( const char* _path, int _file )
+{
+  entries = (Entry*) xrealloc(entries, (n_entries + 1) * sizeof(Entry));
+  entries[n_entries].path = strdup(_path);
+  entries[n_entries].file = _file;
+  n_entries++;
+}
+
+// gzip with the maximum compression, kept if it saves at least a tenth
+static void compress_file( File* _file )
+{
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (Z_OK != deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY)) return;
+  size_t capacity = deflateBound(&z, (uLong)_file->size);
+  unsigned char* out = (unsigned char*) xrealloc(0, capacity);
+  z.next_in = _file->data;
+  z.avail_in = (uInt)_file->size;
+  z.next_out = out;
+  z.avail_out = (uInt)capacity;
+  if (Z_STREAM_END == deflate(&z, Z_FINISH) && z.total_out < _file->size - _file->size / 10)
+  {
+    _file->gzip = out;
+    _file->gzipSize = z.total_out;
+  }
+  else
+  {
+    free(out);
+  }
+  deflateEnd(&z);
+}
+
+static void add_file( const char* _name, const char* _path, const struct stat* _st )
+{
+  FILE* f = fopen(_name, "rb");
+  if (0 == f)
+  {
+    fprintf(stderr, "bundle: can't read %s\n", _name);
+    exit(1);
+  }
+  files = (File*) xrealloc(files, (n_files + 1) * sizeof(File));
+  File* file = &files[n_files];
+  memset(file, 0, sizeof(File));
+  file->name = strdup(_name);
+  file->mime = mimetype(_name);
+  file->size = (size_t)_st->st_size;
+  file->data = (unsigned char*) xrealloc(0, file->size + 1);
+  if (file->size != fread(file->data, 1, file->size, f))
+  {
+    fprintf(stderr, "bundle: can't read %s\n", _name);
+    exit(1);
+  }
+  fclose(f);
+  file->mtime = _st->st_mtime;
+
+  // fnv-1a of the content is the strong validator
+  file->hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < file->size; ++i)
+  {
+    file->hash = (file->hash ^ file->data[i]) * 1099511628211ULL;
+  }
+  compress_file(file);
+
+  add_entry(_path, n_files);
+  const char* slash = strrchr(_path, '/');
+  if (0 == strcmp(slash + 1, "index.html"))
+  {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash + 1 - _path), _path);
+    add_entry(dir, n_files);
+  }
+  n_files++;
+}
+
+static void scan( const char* _dir, const char* _prefix )
+{
+  DIR* dir = opendir(_dir);
+  if (0 == dir)
+  {
+    fprintf(stderr, "bundle: can't open %s\n", _dir);
+    exit(1);
+  }
+  struct dirent* de;
+  while ((de = readdir(dir)))
+  {
+    // dot files (.git, .DS_Store) aren't served
+    if (de->d_name[0] == '.') continue;
+    char name[4096], path[4096];
+    snprintf(name, sizeof(name), "%s/%s", _dir, de->d_name);
+    snprintf(path, sizeof(path), "%s/%s", _prefix, de->d_name);
+    struct stat st;
+    if (stat(name, &st)) continue;
+    if (S_ISDIR(st.st_mode)) scan(name, path);
+    else if (S_ISREG(st.st_mode)) add_file(name, path, &st);
+  }
+  closedir(dir);
+}
+
+// hash and displace: the paths are put into buckets by their plain hash, then
+// each bucket, the largest first, gets the first seed that sends all of its
+// paths to free slots
+static unsigned short* seeds = 0;
+static unsigned short* slots = 0;
+static unsigned int n_seeds = 0;
+static unsigned int n_slots = 0;
+
+static int* bucket_of = 0;
+static int* bucket_count = 0;
+
+static int bucket_size( const void* _a, const void* _b )
+{
+  return bucket_count[*(const int*)_b] - bucket_count[*(const int*)_a];
+}
+
+static bool place( void )
+{
+  bucket_of = (int*) xrealloc(bucket_of, (n_entries + 1) * sizeof(int));
+  bucket_count = (int*) xrealloc(0, n_seeds * sizeof(int));
+  int* order = (int*) xrealloc(0, n_seeds * sizeof(int));
+  unsigned int* taken = (unsigned int*) xrealloc(0, (n_entries + 1) * sizeof(unsigned int));
+  memset(bucket_count, 0, n_seeds * sizeof(int));
+  memset(seeds, 0, n_seeds * sizeof(unsigned short));
+  memset(slots, 0, n_slots * sizeof(unsigned short));
+  for (int i = 0; i < n_entries; ++i)
+  {
+    bucket_of[i] = (int)(httpbundle_hash(entries[i].path, 0) % n_seeds);
+    bucket_count[bucket_of[i]]++;
+  }
+  for (unsigned int b = 0; b < n_seeds; ++b) order[b] = (int)b;
+  qsort(order, n_seeds, sizeof(int), bucket_size);
+
+  bool ok = true;
+  for (unsigned int k = 0; ok && k < n_seeds && bucket_count[order[k]]; ++k)
+  {
+    int b = order[k];
+    ok = false;
+    for (unsigned int seed = 1; !ok && seed < 65536; ++seed)
+    {
+      int n = 0;
+      ok = true;
+      for (int i = 0; ok && i < n_entries; ++i)
+      {
+        if (bucket_of[i] != b) continue;
+        unsigned int slot = httpbundle_hash(entries[i].path, seed) & (n_slots - 1);
+        ok = 0 == slots[slot];
+        for (int j = 0; ok && j < n; ++j) ok = taken[j] != slot;
+        taken[n++] = slot;
+      }
+      if (ok)
+      {
+        seeds[b] = (unsigned short)seed;
+        n = 0;
+        for (int i = 0; i < n_entries; ++i)
+        {
+          if (bucket_of[i] == b) slots[taken[n++]] = (unsigned short)(i + 1);
+        }
+      }
+    }
+  }
+  free(order);
+  free(taken);
+  free(bucket_count);
+  return ok;
+}
+
+static void perfect_hash( void )
+{
+  n_seeds = n_entries / 4 + 1;
+  n_slots = 1;
+  while (n_slots < (unsigned int)(n_entries + n_entries / 4)) n_slots <<= 1;
+  for (;;)
+  {
+    seeds = (unsigned short*) xrealloc(seeds, n_seeds * sizeof(unsigned short));
+    slots = (unsigned short*) xrealloc(slots, n_slots * sizeof(unsigned short));
+    if (place()) return;
+    n_slots <<= 1;
+  }
+}
+
+static void emit_bytes( FILE* _out, const char* _name, const unsigned char* _data, size_t _size )
+{
+  fprintf(_out, "static const unsigned char %s[%lu] =\n{", _name, (unsigned long)(_size ? _size : 1));
+  for (size_t i = 0; i < _size; ++i)
+  {
+    fprintf(_out, "%s0x%02x,", i % 16 ? "" : "\n  ", _data[i]);
+  }
+  fprintf(_out, "%s\n};\n\n", _size ? "" : "  0");
+}
+
+static void emit_string( FILE* _out, const char* _text )
+{
+  fputc('"', _out);
+  for (const char* p = _text; *p; ++p)
+  {
+    if (*p == '"' || *p == '\\') fputc('\\', _out);
+    fputc(*p, _out);
+  }
+  fputc('"', _out);
+}
+
+int main (int argc, const char * argv[])
+{
+  if (argc != 4)
+  {
+    fprintf(stderr, "usage: bundle <directory> <name> <output.c>\n");
+    return 1;
+  }
+  const char* name = argv[2];
+  scan(argv[1], "");
+  perfect_hash();
+
+  FILE* out = fopen(argv[3], "w");
+  if (0 == out)
+  {
+    fprintf(stderr, "bundle: can't write %s\n", argv[3]);
+    return 1;
+  }
+  fprintf(out, "// generated by bundle from %s, don't edit\n\n#include \"httpd.h\"\n\n", argv[1]);
+  for (int i = 0; i < n_files; ++i)
+  {
+    char symbol[256];
+    fprintf(out, "// %s\n", files[i].name);
+    snprintf(symbol, sizeof(symbol), "%s_%d", name, i);
+    emit_bytes(out, symbol, files[i].data, files[i].size);
+    if (files[i].gzip)
+    {
+      snprintf(symbol, sizeof(symbol), "%s_%d_gz", name, i);
+      emit_bytes(out, symbol, files[i].gzip, files[i].gzipSize);
+    }
+  }
+
+  fprintf(out, "static const HttpAsset %s_assets[%d] =\n{\n", name, n_entries ? n_entries : 1);
+  for (int i = 0; i < n_entries; ++i)
+  {
+    const File* f = &files[entries[i].file];
+    char modified[64];
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&f->mtime));
+    fprintf(out, "  { ");
+    emit_string(out, entries[i].path);
+    fprintf(out, ", \"%s\", %s_%d, %lu, ", f->mime, name, entries[i].file, (unsigned long)f->size);
+    if (f->gzip) fprintf(out, "%s_%d_gz, %lu, ", name, entries[i].file, (unsigned long)f->gzipSize);
+    else fprintf(out, "0, 0, ");
+    fprintf(out, "\"\\\"%016llx\\\"\", \"\\\"%016llx-gz\\\"\", \"%s\", %lldLL },\n",
+            f->hash, f->hash, modified, (long long)f->mtime);
+  }
+  fprintf(out, "%s};\n\n", n_entries ? "" : "  { 0 }\n");
+
+  fprintf(out, "static const unsigned short %s_seeds[%u] =\n{", name, n_seeds);
+  for (unsigned int i = 0; i < n_seeds; ++i) fprintf(out, "%s%u,", i % 16 ? " " : "\n  ", seeds[i]);
+  fprintf(out, "\n};\n\n");
+  fprintf(out, "static const unsigned short %s_slots[%u] =\n{", name, n_slots);
+  for (unsigned int i = 0; i < n_slots; ++i) fprintf(out, "%s%u,", i % 16 ? " " : "\n  ", slots[i]);
+  fprintf(out, "\n};\n\n");
+  fprintf(out, "extern const HttpBundle %s;\nconst HttpBundle %s = { %s_assets, %d, %s_seeds, %u, %s_slots, %u };\n",
+          name, name, name, n_entries, name, n_seeds, name, n_slots);
+  fclose(out);
+
+  // every path has to find itself
+  HttpAsset* assets = (HttpAsset*) xrealloc(0, (n_entries + 1) * sizeof(HttpAsset));
+  for (int i = 0; i < n_entries; ++i) assets[i].path = entries[i].path;
+  HttpBundle check = { assets, (unsigned int)n_entries, seeds, n_seeds, slots, n_slots };
+  for (int i = 0; i < n_entries; ++i)
+  {
+    if (httpbundle_find(&check, entries[i].path) != &assets[i])
+    {
+      fprintf(stderr, "bundle: %s isn't found\n", entries[i].path);
+      return 1;
+    }
+  }
+  fprintf(stderr, "bundle: %d files, %d paths, %u slots\n", n_files, n_entries, n_slots);
+  return 0;
+}
@@ -25,6 +25,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE  // splice, pipe2
+#endif
+
 #include "httpd.h"
 
 #include <string.h> // strcat, strcmp, strstr, strchr, strlen, strcpy
@@ -32,9 +36,21 @@
 #include <errno.h>  // fprintf, printf, strerror, gethostbyname, memcpy, htons
 #include <stdio.h>  // close(socket), send, recv, socket, setsockopt, bind, listen, accept, select, connect
 #include <stdlib.h> // calloc, free, qsort, vsprintf, sprintf, bsearch
+#include <stdint.h> // uint64_t
+#include <stddef.h> // ptrdiff_t
+#include <time.h>   // clock_gettime
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
 
 #ifdef WIN32
-#  include <winsock.h>
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  include <io.h>
+#  define poll WSAPoll
+#  define strcasecmp _stricmp
+#  define strncasecmp _strnicmp
 typedef int socklen_t;
 #else
 #  include <netdb.h>
@@ -43,7 +59,142 @@ typedef int socklen_t;
 #  include <arpa/inet.h>
 #  include <resolv.h>
 #  include <unistd.h>
+#  include <strings.h>
+#  include <signal.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <sys/un.h>
+#  include <netinet/tcp.h>
+#  include <sys/stat.h>
+#  include <sys/uio.h>
+#  include <pthread.h>
+#  ifdef __linux__
+#    include <sys/sendfile.h>
+#    define HTTPD_SPLICE 1
+#  endif
+#  if defined(HTTPD_WITH_URING) && defined(__linux__)
+#    define HTTPD_URING 1
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#  endif
 #  define closesocket close
+#  define SOCKET_ERROR -1
+#endif
+
+#ifndef HTTPD_TLS_HANDSHAKE_TIMEOUT
+#  define HTTPD_TLS_HANDSHAKE_TIMEOUT 10000  // ms
+#endif
+#ifndef HTTPD_TLS_CACHE_SIZE
+#  define HTTPD_TLS_CACHE_SIZE 1024         // resumable sessions
+#endif
+#ifndef HTTPD_TLS_SESSION_TIMEOUT
+#  define HTTPD_TLS_SESSION_TIMEOUT 3600    // seconds
+#endif
+#ifndef HTTPD_LOW_WATERMARK
+#  define HTTPD_LOW_WATERMARK (16*1024)     // per connection output queue
+#endif
+#ifndef HTTPD_HIGH_WATERMARK
+#  define HTTPD_HIGH_WATERMARK (256*1024)
+#endif
+#ifndef HTTPD_SERVER
+#  define HTTPD_SERVER "dbalster/httpd"     // the Server header of every response
+#endif
+#ifndef HTTPD_SEND_TIMEOUT
+#  define HTTPD_SEND_TIMEOUT 30000          // ms a full queue waits for the client
+#endif
+#ifndef HTTPD_HEADER_TIMEOUT
+#  define HTTPD_HEADER_TIMEOUT 10000        // ms from the first byte to the end of the header
+#endif
+#ifndef HTTPD_BODY_TIMEOUT
+#  define HTTPD_BODY_TIMEOUT 30000          // ms for the request body
+#endif
+#ifndef HTTPD_IDLE_TIMEOUT
+#  define HTTPD_IDLE_TIMEOUT 60000          // ms a keep-alive connection waits for the next request
+#endif
+#ifndef HTTPD_DRAIN_IDLE_TIMEOUT
+#  define HTTPD_DRAIN_IDLE_TIMEOUT 1000     // ms the same while the server drains
+#endif
+#ifndef HTTPD_TIMER_TICK
+#  define HTTPD_TIMER_TICK 64               // ms, resolution of all timeouts
+#endif
+#ifndef HTTPD_MAX_HEADER
+#  define HTTPD_MAX_HEADER (8*1024)
+#endif
+#ifndef HTTPD_MAX_BODY
+#  define HTTPD_MAX_BODY (1024*1024)
+#endif
+#ifndef HTTPD_BACKLOG
+#  define HTTPD_BACKLOG SOMAXCONN           // connections the kernel queues for accept
+#endif
+#ifndef HTTPD_MAX_CONNECTIONS
+#  define HTTPD_MAX_CONNECTIONS 0           // open sockets, 0: no limit
+#endif
+#ifndef HTTPD_MAX_INFLIGHT
+#  define HTTPD_MAX_INFLIGHT 0              // requests answered at once, 0: no limit
+#endif
+#ifndef HTTPD_MAX_LISTENERS
+#  define HTTPD_MAX_LISTENERS 8             // sockets one server accepts on
+#endif
+#ifndef HTTPD_FASTOPEN_QUEUE
+#  define HTTPD_FASTOPEN_QUEUE 256          // pending TCP_FASTOPEN handshakes per listener
+#endif
+#ifndef HTTPD_ACCEPT_BATCH
+#  define HTTPD_ACCEPT_BATCH 64             // connections accepted per httpd_process
+#endif
+#ifndef HTTPD_RETRY_AFTER
+#  define HTTPD_RETRY_AFTER "1"             // seconds, sent with 503
+#endif
+#ifndef HTTPD_CODEL_TARGET
+#  define HTTPD_CODEL_TARGET 0              // ms a request may wait before it is served, 0: no shedding
+#endif
+#ifndef HTTPD_CODEL_INTERVAL
+#  define HTTPD_CODEL_INTERVAL 100          // ms the wait has to stay above target
+#endif
+#ifndef HTTPD_RATE_SLOTS
+#  define HTTPD_RATE_SLOTS 16384            // token buckets of the rate limits, a power of two
+#endif
+#ifndef HTTPD_LOG_RING
+#  define HTTPD_LOG_RING 4096               // access log records per thread, a power of two
+#endif
+#ifndef HTTPD_LOG_INTERVAL
+#  define HTTPD_LOG_INTERVAL 50             // ms between two writes of the access log
+#endif
+#ifndef HTTPD_HANDOFF_TIMEOUT
+#  define HTTPD_HANDOFF_TIMEOUT 5000        // ms a new process waits for the listening socket
+#endif
+#ifndef HTTPD_PROXY_TIMEOUT
+#  define HTTPD_PROXY_TIMEOUT 30000         // ms for the connect and every wait for an upstream
+#endif
+#ifndef HTTPD_PROXY_IDLE_TIMEOUT
+#  define HTTPD_PROXY_IDLE_TIMEOUT 15000    // ms a pooled upstream connection stays open
+#endif
+#ifndef HTTPD_PROXY_MAX_IDLE
+#  define HTTPD_PROXY_MAX_IDLE 16           // pooled connections per upstream
+#endif
+#ifndef HTTPD_PROXY_RETRY
+#  define HTTPD_PROXY_RETRY 2000            // ms an upstream that refused a connection is skipped
+#endif
+#ifndef HTTPD_FETCH_TIMEOUT
+#  define HTTPD_FETCH_TIMEOUT 30000         // ms a httprequest_submit waits for the next bit of progress
+#endif
+#ifndef HTTPD_BATCH_IOV
+#  define HTTPD_BATCH_IOV 1024              // pieces per gather write of httprequest_execute_batch, <= IOV_MAX
+#endif
+#ifndef HTTPD_URING_ENTRIES
+#  define HTTPD_URING_ENTRIES 1024          // io_uring submission queue
+#endif
+#ifndef HTTPD_URING_BUFFERS
+#  define HTTPD_URING_BUFFERS 512           // provided receive buffers, a power of 2
+#endif
+#ifndef HTTPD_URING_BUFSIZE
+#  define HTTPD_URING_BUFSIZE 4096
+#endif
+
+#ifdef MSG_NOSIGNAL
+#  define HTTPD_SEND_FLAGS MSG_NOSIGNAL
+#else
+#  define HTTPD_SEND_FLAGS 0
 #endif
 
 static int hexnibble( const char c )
@@ -82,46 +233,251 @@ static char* uri_decode_inplace( char* _text )
   return _text;
 }
 
-static void quoting_strncpy_append( const char* _text, char* _output, size_t _size, size_t* _index )
+// escaping for html and json output. the scanners return the number of
+// leading bytes that can be copied as they are; plain text is the common
+// case, so it is scanned a vector (or word) at a time.
+
+// "a byte of x is zero" for all bytes at once: (x - 0x01..) & ~x & 0x80..
+#define SWAR_ONES 0x0101010101010101ull
+#define SWAR_HIGHS 0x8080808080808080ull
+#define SWAR_ZERO(_x) (((_x) - SWAR_ONES) & ~(_x) & SWAR_HIGHS)
+
+// the five characters that can end a text node or an attribute value
+static size_t html_entity( unsigned char _c, char* _out )
 {
-  if (_output)
+  switch (_c)
   {
-    // TODO range check, prevent buffer overflow (_output+_size < _output+_index+strlen(_text))
-    strcat(_output,_text);
+    case '&': memcpy(_out, "&amp;", 5); return 5;
+    case '<': memcpy(_out, "&lt;", 4); return 4;
+    case '>': memcpy(_out, "&gt;", 4); return 4;
+    case '"': memcpy(_out, "&quot;", 6); return 6;
+    case '\'': memcpy(_out, "&#39;", 5); return 5;
+    default: return 0;
   }
-  *_index += strlen(_text);
 }
 
-static size_t quoting_strncpy( char* _output, const char* _input, size_t _size )
+static size_t html_plain( const char* _text, size_t _size )
 {
-  size_t i=0;
-  size_t o=0;
-  char c[2];
-  c[1] = 0;
-  
-  if (_output) *_output = 0; // clear output buffer
-  
-  while ( (*c = _input[i++]) )
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+  const __m128i quot = _mm_set1_epi8('"'), apos = _mm_set1_epi8('\'');
+  for (; i + 16 <= _size; i += 16)
   {
-    switch (*c)
-    {
-      case '\'': quoting_strncpy_append("&apos;",_output,_size,&o); break;
-      case '"': quoting_strncpy_append("&quot;",_output,_size,&o); break;
-      case '<': quoting_strncpy_append("&lt;",_output,_size,&o); break;
-      case '>': quoting_strncpy_append("&gt;",_output,_size,&o); break;
-      case '&': quoting_strncpy_append("&amp;",_output,_size,&o); break;
-      case ' ': quoting_strncpy_append("&nbsp;",_output,_size,&o); break;
-      case '\t': quoting_strncpy_append("&nbsp;&nbsp;",_output,_size,&o); break;
-      default: quoting_strncpy_append(c,_output,_size,&o); break;
-    }
+    __m128i v = _mm_loadu_si128((const __m128i*)(_text + i));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, apos))));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask) return i + __builtin_ctz(mask);
   }
-  
-  return o;
+#endif
+  for (; i + 8 <= _size; i += 8)
+  {
+    uint64_t v;
+    memcpy(&v, _text + i, 8);
+    uint64_t hit = SWAR_ZERO(v ^ (SWAR_ONES * '&')) | SWAR_ZERO(v ^ (SWAR_ONES * '<')) | SWAR_ZERO(v ^ (SWAR_ONES * '>'))
+                 | SWAR_ZERO(v ^ (SWAR_ONES * '"')) | SWAR_ZERO(v ^ (SWAR_ONES * '\''));
+    if (hit) break;
+  }
+  char scratch[8];
+  while (i < _size && 0 == html_entity((unsigned char)_text[i], scratch)) ++i;
+  return i;
+}
+
+// quotes, backslashes and control characters, everything else (utf-8
+// included) goes into a json string unchanged
+static size_t json_entity( unsigned char _c, char* _out )
+{
+  static const char hex[] = "0123456789abcdef";
+  _out[0] = '\\';
+  switch (_c)
+  {
+    case '"': _out[1] = '"'; return 2;
+    case '\\': _out[1] = '\\'; return 2;
+    case '\n': _out[1] = 'n'; return 2;
+    case '\r': _out[1] = 'r'; return 2;
+    case '\t': _out[1] = 't'; return 2;
+    case '\b': _out[1] = 'b'; return 2;
+    case '\f': _out[1] = 'f'; return 2;
+    default:
+      if (_c >= 0x20) return 0;
+      memcpy(_out + 1, "u00", 3);
+      _out[4] = hex[_c >> 4];
+      _out[5] = hex[_c & 15];
+      return 6;
+  }
+}
+
+static size_t json_plain( const char* _text, size_t _size )
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i quot = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1f);
+  for (; i + 16 <= _size; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(_text + i));
+    // unsigned v <= 0x1f iff max(v, 0x1f) == 0x1f
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, backslash)),
+                               _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i + 8 <= _size; i += 8)
+  {
+    uint64_t v;
+    memcpy(&v, _text + i, 8);
+    // bytes below 0x20 borrow from the subtraction, bytes with the high bit set are excluded
+    uint64_t hit = SWAR_ZERO(v ^ (SWAR_ONES * '"')) | SWAR_ZERO(v ^ (SWAR_ONES * '\\')) | ((v - SWAR_ONES * 0x20) & ~v & SWAR_HIGHS);
+    if (hit) break;
+  }
+  char scratch[8];
+  while (i < _size && 0 == json_entity((unsigned char)_text[i], scratch)) ++i;
+  return i;
+}
+
+// transport: every socket is either plain or wrapped in a tls session.
+// like send/recv these return SOCKET_ERROR and leave EAGAIN behind when a
+// non-blocking socket can't make progress right now.
+
+static bool set_nonblocking( int _socket )
+{
+#ifdef WIN32
+  u_long on = 1;
+  return 0 == ioctlsocket(_socket, FIONBIO, &on);
+#else
+  int flags = fcntl(_socket, F_GETFL, 0);
+  return flags != -1 && 0 == fcntl(_socket, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+static bool would_block( void )
+{
+#ifdef WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static int net_tls_result( int _ret )
+{
+  if (_ret >= 0) return _ret;
+#ifdef WIN32
+  WSASetLastError(_ret == HTTPTLS_ERROR ? WSAECONNRESET : WSAEWOULDBLOCK);
+#else
+  errno = _ret == HTTPTLS_ERROR ? ECONNRESET : EAGAIN;
+#endif
+  return SOCKET_ERROR;
+}
+
+static int net_send( int _socket, const HttpTlsBackend* _tls, void* _session, const void* _memory, int _size )
+{
+  if (_tls)
+  {
+    return net_tls_result(_tls->write(_session, _memory, _size));
+  }
+  return send(_socket, (const char*)_memory, _size, HTTPD_SEND_FLAGS);
+}
+
+static int net_recv( int _socket, const HttpTlsBackend* _tls, void* _session, void* _memory, int _size )
+{
+  if (_tls)
+  {
+    return net_tls_result(_tls->read(_session, _memory, _size));
+  }
+  return recv(_socket, (char*)_memory, _size, 0);
+}
+
+// zero copy where possible: sendfile for plain sockets, and for tls sessions
+// as soon as the kernel took over the encryption (ktls). anything else goes
+// through a bounce buffer.
+static long net_sendfile( int _socket, const HttpTlsBackend* _tls, void* _session, int _fd, off_t _offset, size_t _size )
+{
+  if (_tls && _tls->sendfile)
+  {
+    long ret = _tls->sendfile(_session, _fd, _offset, _size);
+    if (ret != HTTPTLS_UNSUPPORTED) return ret < 0 ? net_tls_result((int)ret) : ret;
+  }
+#ifdef __linux__
+  if (0 == _tls)
+  {
+    off_t offset = _offset;
+    return (long)sendfile(_socket, _fd, &offset, _size);
+  }
+#endif
+  char buf[16*1024];
+  if (_size > sizeof(buf)) _size = sizeof(buf);
+#ifdef WIN32
+  _lseeki64(_fd, _offset, SEEK_SET);
+  int bytes = _read(_fd, buf, (unsigned int)_size);
+#else
+  int bytes = (int)pread(_fd, buf, _size, _offset);
+#endif
+  if (bytes <= 0)
+  {
+    errno = EIO;
+    return SOCKET_ERROR;
+  }
+  return net_send(_socket, _tls, _session, buf, bytes);
+}
+
+static void net_close( int _socket, const HttpTlsBackend* _tls, void* _session )
+{
+  if (_tls && _session)
+  {
+    _tls->close(_session);
+  }
+  closesocket(_socket);
+}
+
+// growable byte string
+typedef struct
+{
+  char*   data;
+  size_t  length;
+  size_t  size;
+} HttpBytes;
+
+static bool httpbytes_append( HttpBytes* _bytes, const void* _data, size_t _size )
+{
+  if (_bytes->length + _size > _bytes->size)
+  {
+    size_t size = _bytes->size ? _bytes->size : 256;
+    while (size < _bytes->length + _size) size *= 2;
+    char* data = (char*) realloc(_bytes->data, size);
+    if (0 == data) return false;
+    _bytes->data = data;
+    _bytes->size = size;
+  }
+  if (_size)
+  {
+    memcpy(_bytes->data + _bytes->length, _data, _size);
+  }
+  _bytes->length += _size;
+  return true;
+}
+
+static void httpbytes_free( HttpBytes* _bytes )
+{
+  free(_bytes->data);
+  _bytes->data = 0;
+  _bytes->length = _bytes->size = 0;
 }
 
+typedef struct _Http2Session Http2Session;
+typedef struct _Http2Stream Http2Stream;
+typedef struct _HttpConn HttpConn;
+typedef struct _HttpRelay HttpRelay;
+typedef struct _HttpFetch HttpFetch;
+typedef struct _HttpRateLimit HttpRateLimit;
+
 struct _HttpResponse
 {
+  Httpd* server;    // 0 for responses created outside of httpd_process
   int netsocket;
+  const HttpTlsBackend* tls;
+  void* tlsSession;
   char* memory;
   char* method;		// GET, POST, PUT, FINDPROP, ...
   char* location;	// /path/to/page
@@ -130,160 +486,673 @@ struct _HttpResponse
   int n_headers;
   HttpHeader* headers;
   bool chunked;
+  Http2Session* h2;       // set for requests that arrived on an http/2 stream
+  Http2Stream* h2stream;
+  HttpConn* conn;         // owns the socket once output had to be queued
+  HttpWritableHandler writable;
+  void* writableData;
+  HttpWritableHandler closed;   // the client went away while the response waited
+  void* closedData;
+  bool suspended;         // ... for httpresponse_on_writable, without a callback
+  char* content;          // the request body, terminated
+  size_t contentLength;
+  bool keepalive;         // the client didn't ask to close the connection
+  bool framed;            // the response has a known length, the next one can follow
+  bool discard;           // a HEAD request: whatever follows the header isn't sent
+  unsigned int status;    // for the access log
+  unsigned long long sent;// response bytes handed to the connection
+  uint64_t began;         // us, when the handler got the request, 0 if nobody logs it
+  uint64_t wait;          // us the request waited for the event loop before that
 };
 
-static const struct
-{
-	unsigned short code;
-	const char* message;
-} 
-HttpErrorMessages[] =  
+static HttpConn* httpresponse_connection( HttpResponse* _context );
+static int httpconn_write( HttpConn* _conn, const void* _memory, size_t _size );
+static int httpresponse_send( HttpResponse* _context, const void* _memory, int _size );
+static bool httpresponse_full( HttpResponse* _context );
+static bool httpconn_sendfile( HttpConn* _conn, int _fd, off_t _offset, size_t _size );
+static bool httpconn_write_static( HttpConn* _conn, const void* _memory, size_t _size );
+static void httpconn_finish( HttpConn* _conn, bool _keepalive );
+static int http2_write( HttpResponse* _context, const void* _memory, int _size );
+static void http2_end( HttpResponse* _context );
+
+// status lines are serialized at compile time
+#define HTTPSTATUS(_code, _text) \
+  case _code: *_line = "HTTP/1.1 " #_code " " _text "\r\n"; return sizeof("HTTP/1.1 " #_code " " _text "\r\n") - 1;
+
+// what every response head starts with after the status line
+static const char httpd_head[] =
+  "Server: " HTTPD_SERVER "\r\n"
+  "Cache-Control: no-cache\r\n";
+
+// status line of _code, "HTTP/1.1 nnn ???" for codes the switch doesn't know
+static size_t httpstatus_line( unsigned int _code, char* _unknown, const char** _line )
 {
-  { 100, "Continue" }, 
-  { 200, "OK" }, 
-  { 206, "Partial Content" },
-  { 220, "OK" }, 
-  { 302, "Found" }, 
-  { 303, "See Other" }, 
-  { 400, "Bad Request" }, 
-  { 403, "Forbidden" }, 
-  { 404, "Not Found" }, 
-  { 405, "Method Not Allowed" }, 
-  { 408, "Request Timeout" }, 
-  { 500, "Internal Server Error" }, 
-  { 505, "HTTP Version Not Supported" }, 
-};
+  switch (_code)
+  {
+  HTTPSTATUS(100, "Continue")
+  HTTPSTATUS(200, "OK")
+  HTTPSTATUS(201, "Created")
+  HTTPSTATUS(204, "No Content")
+  HTTPSTATUS(206, "Partial Content")
+  HTTPSTATUS(220, "OK")
+  HTTPSTATUS(301, "Moved Permanently")
+  HTTPSTATUS(302, "Found")
+  HTTPSTATUS(303, "See Other")
+  HTTPSTATUS(304, "Not Modified")
+  HTTPSTATUS(400, "Bad Request")
+  HTTPSTATUS(401, "Unauthorized")
+  HTTPSTATUS(403, "Forbidden")
+  HTTPSTATUS(404, "Not Found")
+  HTTPSTATUS(405, "Method Not Allowed")
+  HTTPSTATUS(408, "Request Timeout")
+  HTTPSTATUS(413, "Payload Too Large")
+  HTTPSTATUS(429, "Too Many Requests")
+  HTTPSTATUS(500, "Internal Server Error")
+  HTTPSTATUS(502, "Bad Gateway")
+  HTTPSTATUS(503, "Service Unavailable")
+  HTTPSTATUS(504, "Gateway Timeout")
+  HTTPSTATUS(505, "HTTP Version Not Supported")
+  }
+  *_line = _unknown;
+  return sprintf(_unknown, "HTTP/1.1 %03u ???\r\n", _code % 1000);
+}
 
-HTTPD_C_API HttpResponse*	httpresponse_create (unsigned int _socket)
+#undef HTTPSTATUS
+
+// decimal digits of _value, two at a time
+static size_t httpd_utoa( char* _out, unsigned long long _value )
 {
-	HttpResponse* wr = (HttpResponse*) calloc(1,sizeof(HttpResponse));
-  if (wr)
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char digits[20];
+  char* p = digits + sizeof(digits);
+  while (_value >= 100)
   {
-    wr->netsocket = _socket;
-    wr->chunked = false;
-    wr->memory = 0;
-    wr->method = 0;
-    wr->location = 0;
-    wr->n_args = 0;
-    wr->args = 0;
-    wr->n_headers = 0;
-    wr->headers = 0;
+    const char* pair = pairs + (_value % 100) * 2;
+    _value /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
   }
-	return wr;
+  if (_value >= 10)
+  {
+    *--p = pairs[_value * 2 + 1];
+    *--p = pairs[_value * 2];
+  }
+  else
+  {
+    *--p = (char)('0' + _value);
+  }
+  size_t length = digits + sizeof(digits) - p;
+  memcpy(_out, p, length);
+  return length;
 }
 
-HTTPD_C_API void httpresponse_destroy (HttpResponse* _context)
+// shortest round trip doubles (grisu2): the digits that read back as the
+// same double, without printf, locales or allocations.
+
+typedef struct
 {
-	free (_context->memory);
-	closesocket(_context->netsocket); 
-	free (_context);
+  uint64_t f;
+  int e;
+} HttpDiyFp;
+
+static HttpDiyFp diyfp( uint64_t _f, int _e )
+{
+  HttpDiyFp r;
+  r.f = _f;
+  r.e = _e;
+  return r;
 }
 
-HTTPD_C_API int httpresponse_write(HttpResponse* _context, const void* _memory, const int _size)
+static HttpDiyFp diyfp_multiply( HttpDiyFp _x, HttpDiyFp _y )
 {
-  int sendButes = 0;
-  while(sendButes < _size)
-  {
-	  int ret = send(_context->netsocket, &(((const char*)_memory)[sendButes]), (int)_size - sendButes, 0);
-	  if (ret != SOCKET_ERROR)
-	  {
-		  sendButes += ret;
-	  }
-	  else
-		  return -1;
-  }
-  return sendButes;
+  const uint64_t M32 = 0xffffffffu;
+  uint64_t a = _x.f >> 32, b = _x.f & M32, c = _y.f >> 32, d = _y.f & M32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1u << 31);
+  return diyfp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), _x.e + _y.e + 64);
 }
 
-static int httpresponse_read(HttpResponse* _context, void* _memory, const int _size)
+static HttpDiyFp diyfp_normalize( HttpDiyFp _x )
 {
-  return recv(_context->netsocket, (char*)_memory, (int)_size, 0);
+  int s = __builtin_clzll(_x.f);
+  return diyfp(_x.f << s, _x.e - s);
 }
 
-static int comparePairs(const void* l, const void* r)
+// 10^k for k = -348, -340, ... 340, normalized to 64 bits
+static HttpDiyFp diyfp_cached_power( int _e, int* _k )
 {
-  const HttpHeader* pl = (const HttpHeader*)l;
-  const HttpHeader* pr = (const HttpHeader*)r;
-  return strcmp(pl->name, pr->name);
+  static const uint64_t significands[] =
+  {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull, 0xcf42894a5dce35eaull,
+    0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull, 0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full,
+    0xbe5691ef416bd60cull, 0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull, 0xc21094364dfb5637ull,
+    0x9096ea6f3848984full, 0xd77485cb25823ac7ull, 0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull,
+    0xb23867fb2a35b28eull, 0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull, 0xb5b5ada8aaff80b8ull,
+    0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull, 0x964e858c91ba2655ull, 0xdff9772470297ebdull,
+    0xa6dfbd9fb8e5b88full, 0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull, 0xaa242499697392d3ull,
+    0xfd87b5f28300ca0eull, 0xbce5086492111aebull, 0x8cbccc096f5088ccull, 0xd1b71758e219652cull,
+    0x9c40000000000000ull, 0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull, 0x9f4f2726179a2245ull,
+    0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull, 0x83c7088e1aab65dbull, 0xc45d1df942711d9aull,
+    0x924d692ca61be758ull, 0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull, 0x952ab45cfa97a0b3ull,
+    0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull, 0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull,
+    0x88fcf317f22241e2ull, 0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull, 0x8bab8eefb6409c1aull,
+    0xd01fef10a657842cull, 0x9b10a4e5e9913129ull, 0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull,
+    0x80444b5e7aa7cf85ull, 0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull
+  };
+  static const short exponents[] =
+  {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901, -874, -847, -821,
+    -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502, -475, -449, -422, -396,
+    -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+  };
+  double dk = (-61 - _e) * 0.30102999566398114 + 347;
+  int k = (int)dk;
+  if (dk - k > 0.0) ++k;
+  unsigned index = (unsigned)((k >> 3) + 1);
+  *_k = -(-348 + (int)index * 8);
+  return diyfp(significands[index], exponents[index]);
 }
 
-HTTPD_C_API bool httpresponse_parse(HttpResponse* _context)
+static const uint64_t grisu_pow10[] =
 {
-  // TODO: context, make buffer configurable
-  const static int RECEIVE_BUFFER_SIZE = 8 * 1024;
-  char buffer[RECEIVE_BUFFER_SIZE];
-  int bytesRead = httpresponse_read(_context, buffer, RECEIVE_BUFFER_SIZE - 1);
-  if (bytesRead <= 0)
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+  10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+  1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull
+};
+
+static void grisu_round( char* _buffer, int _length, uint64_t _delta, uint64_t _rest, uint64_t _tenKappa, uint64_t _wpw )
+{
+  while (_rest < _wpw && _delta - _rest >= _tenKappa &&
+         (_rest + _tenKappa < _wpw || _wpw - _rest > _rest + _tenKappa - _wpw))
   {
-    return httpresponse_response(_context, 500, 0, 0, 0);
+    _buffer[_length - 1]--;
+    _rest += _tenKappa;
   }
-  buffer[bytesRead] = 0;
+}
 
-  // extract method
-  char* method = buffer;
-  char* eom = strchr(method, ' ');
-  if (0 == eom)
+static int grisu_digits( HttpDiyFp _w, HttpDiyFp _mp, uint64_t _delta, char* _buffer, int* _k )
+{
+  HttpDiyFp one = diyfp(1ull << -_mp.e, _mp.e);
+  uint64_t wpw = _mp.f - _w.f;
+  uint32_t p1 = (uint32_t)(_mp.f >> -one.e);
+  uint64_t p2 = _mp.f & (one.f - 1);
+  int kappa = 1;
+  while (kappa < 10 && p1 >= grisu_pow10[kappa]) ++kappa;
+  int length = 0;
+  while (kappa > 0)
   {
-    return httpresponse_response(_context, 500, 0, 0, 0);
+    uint32_t d = (uint32_t)(p1 / grisu_pow10[kappa - 1]);
+    p1 = (uint32_t)(p1 % grisu_pow10[kappa - 1]);
+    if (d || length) _buffer[length++] = (char)('0' + d);
+    --kappa;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= _delta)
+    {
+      *_k += kappa;
+      grisu_round(_buffer, length, _delta, rest, grisu_pow10[kappa] << -one.e, wpw);
+      return length;
+    }
   }
-  *eom++ = 0; // terminate method
-
-  // extract location and (optional) arguments
-  char* location = eom;
-  char* eol = strstr(location, " HTTP/1.1\r\n");
-  if (0 == eol)
+  for (;;)
   {
-    return httpresponse_response(_context, 500, 0, 0, 0);
+    p2 *= 10;
+    _delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || length) _buffer[length++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    --kappa;
+    if (p2 < _delta)
+    {
+      *_k += kappa;
+      grisu_round(_buffer, length, _delta, p2, one.f, -kappa < 20 ? wpw * grisu_pow10[-kappa] : 0);
+      return length;
+    }
   }
-  *eol = 0;	// terminate location
+}
 
-  char* args = strchr(location, '?');
-  if (args)
+// the digits of a positive, finite double given by its bits; the value is digits * 10^k
+static int grisu2( uint64_t _bits, char* _buffer, int* _k )
+{
+  const uint64_t hidden = 1ull << 52;
+  int biased = (int)((_bits >> 52) & 0x7ff);
+  uint64_t significand = _bits & (hidden - 1);
+  HttpDiyFp v = biased ? diyfp(significand + hidden, biased - 1075) : diyfp(significand, -1074);
+  
+  // the boundaries halfway to the neighbouring doubles
+  HttpDiyFp plus = diyfp_normalize(diyfp((v.f << 1) + 1, v.e - 1));
+  HttpDiyFp minus = v.f == hidden ? diyfp((v.f << 2) - 1, v.e - 2) : diyfp((v.f << 1) - 1, v.e - 1);
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+  
+  HttpDiyFp c = diyfp_cached_power(plus.e, _k);
+  HttpDiyFp w = diyfp_multiply(diyfp_normalize(v), c);
+  HttpDiyFp wp = diyfp_multiply(plus, c);
+  HttpDiyFp wm = diyfp_multiply(minus, c);
+  wm.f++;
+  wp.f--;
+  return grisu_digits(w, wp, wp.f - wm.f, _buffer, _k);
+}
+
+// formats like javascript: 0.001, 1234.5, 1e+21, 1.5e-7. NaN and the
+// infinities have no json representation and come out as null.
+static size_t httpd_dtoa( char* _out, double _value )
+{
+  uint64_t bits;
+  memcpy(&bits, &_value, 8);
+  if (((bits >> 52) & 0x7ff) == 0x7ff)
   {
-    *args++ = 0; // args is now pointing to the argument list
+    memcpy(_out, "null", 4);
+    return 4;
   }
-  else
+  char* p = _out;
+  if (bits >> 63)
   {
-    args = eol;	// empty arguments
+    *p++ = '-';
+    bits &= ~(1ull << 63);
   }
-  eol += strlen(" HTTP/1.1\r\n");
-
-  char* eoh = 0;			// end of header
-
-  if (0 == strcmp(method, "POST") || 0 == strcmp(method, "GET") || 0 == strcmp(method, "OPTIONS"))
+  if (0 == bits)
   {
-    // mozilla sends the header in two chunks, yeah.
-    eoh = strstr(eol, "\r\n\r\n");
-    if(0 == eoh)
-    {
-      bytesRead += httpresponse_read(_context, buffer + bytesRead, RECEIVE_BUFFER_SIZE - bytesRead - 1);
-      buffer[bytesRead] = 0;
-      eoh = strstr(eol, "\r\n\r\n");
-    }
-    
-    if (0 == eoh)
-      return httpresponse_response(_context, 500, 0, 0, 0);
-    
-    eoh += 4; // end-of-header now points directly to the first byte of content
+    *p++ = '0';
+    return p - _out;
   }
-  else
+  char digits[24];
+  int k;
+  int length = grisu2(bits, digits, &k);
+  int point = length + k; // 10^(point-1) <= value < 10^point
+  
+  if (k >= 0 && point <= 21)
   {
-    return httpresponse_response(_context, 500, "unsupported method", 0, 0);
+    memcpy(p, digits, length);
+    memset(p + length, '0', k);
+    p += point;
   }
-
-  // method .. eom : size of method
-  // args .. eol : size of GET arguments
-  // eol .. eoh-2 : size of headers
-  // eoh .. buffer+bytesRead ; size of POST arguments
-
-  _context->n_headers = -1;
-  int hchars = 0;
-  char* headers = eol;
-  for (; headers[hchars]; ++hchars)
+  else if (point > 0 && point <= 21)
   {
-    if (headers[hchars] == '\r')
+    memcpy(p, digits, point);
+    p[point] = '.';
+    memcpy(p + point + 1, digits + point, length - point);
+    p += length + 1;
+  }
+  else if (point > -6 && point <= 0)
+  {
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -point);
+    memcpy(p - point, digits, length);
+    p += length - point;
+  }
+  else
+  {
+    *p++ = digits[0];
+    if (length > 1)
     {
-      _context->n_headers++;
+      *p++ = '.';
+      memcpy(p, digits + 1, length - 1);
+      p += length - 1;
+    }
+    int e = point - 1;
+    *p++ = 'e';
+    *p++ = e < 0 ? '-' : '+';
+    p += httpd_utoa(p, (unsigned long long)(e < 0 ? -e : e));
+  }
+  return p - _out;
+}
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", formatted at most once a second
+#ifdef _MSC_VER
+#  define HTTPD_THREAD_LOCAL __declspec(thread)
+#else
+#  define HTTPD_THREAD_LOCAL __thread
+#endif
+
+// servers on other threads have caches of their own
+static const char* httpd_date( void )
+{
+  static HTTPD_THREAD_LOCAL char date[64];
+  static HTTPD_THREAD_LOCAL time_t cached = -1;
+  time_t now = time(0);
+  if (now != cached)
+  {
+    static const char days[] = "ThuFriSatSunMonTueWed";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    long long z = (long long)now / 86400;
+    int secs = (int)((long long)now % 86400);
+    const char* day = days + (z % 7) * 3;
+    // days since 1970 to the civil date, march based years
+    z += 719468;
+    long long era = z / 146097;
+    unsigned int doe = (unsigned int)(z - era * 146097);
+    unsigned int yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    unsigned int doy = doe - (365*yoe + yoe/4 - yoe/100);
+    unsigned int mp = (5*doy + 2) / 153;
+    unsigned int mday = doy - (153*mp + 2)/5 + 1;
+    unsigned int month = mp < 10 ? mp + 3 : mp - 9;
+    int year = (int)(yoe + era * 400) + (month <= 2);
+    sprintf(date, "Date: %.3s, %02u %.3s %04d %02d:%02d:%02d GMT\r\n",
+            day, mday, months + (month - 1) * 3, year, secs / 3600, secs / 60 % 60, secs % 60);
+    cached = now;
+  }
+  return date;
+}
+
+// a response head is put together with memcpy and written at once
+typedef struct
+{
+  char    data[1024];
+  size_t  length;
+} HttpHead;
+
+static void httphead_add( HttpResponse* _context, HttpHead* _head, const char* _text, size_t _size )
+{
+  if (_head->length + _size > sizeof(_head->data))
+  {
+    httpresponse_send(_context, _head->data, (int)_head->length);
+    _head->length = 0;
+    if (_size > sizeof(_head->data))
+    {
+      httpresponse_send(_context, _text, (int)_size);
+      return;
+    }
+  }
+  memcpy(_head->data + _head->length, _text, _size);
+  _head->length += _size;
+}
+
+// a HEAD request gets the header and nothing else
+static bool httphead_only( HttpResponse* _context )
+{
+  return _context->method && 0 == strcmp(_context->method, "HEAD");
+}
+
+static void httphead_send( HttpResponse* _context, HttpHead* _head )
+{
+  httpresponse_send(_context, _head->data, (int)_head->length);
+  _context->discard = httphead_only(_context);
+}
+
+// status line, the constant headers, Date and "Connection: close" if the
+// connection ends with this response
+static void httphead_begin( HttpResponse* _context, HttpHead* _head, unsigned int _code )
+{
+  char unknown[32];
+  const char* line;
+  size_t length = httpstatus_line(_code, unknown, &line);
+  _context->status = _code;
+  _head->length = 0;
+  httphead_add(_context, _head, line, length);
+  httphead_add(_context, _head, httpd_head, sizeof(httpd_head) - 1);
+  httphead_add(_context, _head, httpd_date(), 37);
+  if (_context->conn && !_context->keepalive)
+  {
+    httphead_add(_context, _head, "Connection: close\r\n", 19);
+  }
+}
+
+// the end of the heads the server answers on its own before closing
+static const char httpd_close_head[] =
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+#define HTTPD_CLOSING_HEAD 256  // what httpd_closing_head needs, _extra is at most 64
+
+// the whole head of an empty response that closes the connection, _extra
+// are header lines of its own or 0
+static size_t httpd_closing_head( char* _text, unsigned int _code, const char* _extra )
+{
+  const char* line;
+  size_t len = httpstatus_line(_code, _text, &line);
+  if (line != _text) memcpy(_text, line, len);
+  memcpy(_text + len, httpd_head, sizeof(httpd_head) - 1);
+  len += sizeof(httpd_head) - 1;
+  memcpy(_text + len, httpd_date(), 37);
+  len += 37;
+  if (_extra)
+  {
+    size_t n = strlen(_extra);
+    memcpy(_text + len, _extra, n);
+    len += n;
+  }
+  memcpy(_text + len, httpd_close_head, sizeof(httpd_close_head) - 1);
+  return len + sizeof(httpd_close_head) - 1;
+}
+
+HTTPD_C_API HttpResponse*	httpresponse_create (unsigned int _socket)
+{
+	HttpResponse* wr = (HttpResponse*) calloc(1,sizeof(HttpResponse));
+  if (wr)
+  {
+    wr->netsocket = _socket;
+    wr->chunked = false;
+    wr->memory = 0;
+    wr->method = 0;
+    wr->location = 0;
+    wr->n_args = 0;
+    wr->args = 0;
+    wr->n_headers = 0;
+    wr->headers = 0;
+  }
+	return wr;
+}
+
+static void httpresponse_log( HttpResponse* _context );
+
+HTTPD_C_API void httpresponse_destroy (HttpResponse* _context)
+{
+  if (_context->closed && (_context->writable || _context->suspended))
+  {
+    // the client went away first
+    _context->closed(_context, _context->closedData);
+  }
+  if (_context->began)
+  {
+    httpresponse_log(_context);
+  }
+	free (_context->memory);
+  if (_context->conn)
+  {
+    // whatever is still queued goes out before the connection is closed or reused
+    httpconn_finish(_context->conn, _context->keepalive && _context->framed && !_context->chunked);
+  }
+  else if (-1 != _context->netsocket)
+  {
+    net_close(_context->netsocket, _context->tls, _context->tlsSession);
+  }
+	free (_context);
+}
+
+HTTPD_C_API int httpresponse_write(HttpResponse* _context, const void* _memory, const int _size)
+{
+  if (httpresponse_full(_context)) return 0;
+  return httpresponse_send(_context, _memory, _size);
+}
+
+// httpresponse_write without the high watermark, for headers, chunk framing
+// and other writes of bounded size the response can't do without
+static int httpresponse_send( HttpResponse* _context, const void* _memory, int _size )
+{
+  if (_context->discard)
+  {
+    return _size;
+  }
+  _context->sent += _size;
+  if (_context->h2)
+  {
+    return http2_write(_context, _memory, _size);
+  }
+  if (_context->conn)
+  {
+    return httpconn_write(_context->conn, _memory, _size);
+  }
+  int sendButes = 0;
+  while(sendButes < _size)
+  {
+	  int ret = net_send(_context->netsocket, _context->tls, _context->tlsSession, &(((const char*)_memory)[sendButes]), (int)_size - sendButes);
+	  if (ret != SOCKET_ERROR)
+	  {
+		  sendButes += ret;
+	  }
+	  else if (would_block() && _context->server)
+	  {
+      // a slow client: the rest is queued and httpd_process sends it
+      HttpConn* conn = httpresponse_connection(_context);
+      if (0 == conn || httpconn_write(conn, &(((const char*)_memory)[sendButes]), _size - sendButes) < 0) return -1;
+      return _size;
+	  }
+	  else
+		  return -1;
+  }
+  return sendButes;
+}
+
+HTTPD_C_API long httpresponse_sendfile(HttpResponse* _context, int _fd, off_t _offset, size_t _size)
+{
+  if (_context->discard)
+  {
+    return (long)_size;
+  }
+  _context->sent += _size;
+  if (_context->chunked && _size)
+  {
+    char num[20];
+    sprintf(num, "%lx\r\n", (unsigned long)_size);
+    httpresponse_send(_context, num, (int)strlen(num));
+  }
+  
+  size_t sent = 0;
+  while (_context->h2 && sent < _size)
+  {
+    // frames are built in memory anyway
+    char buf[16*1024];
+    size_t n = _size - sent < sizeof(buf) ? _size - sent : sizeof(buf);
+#ifdef WIN32
+    _lseeki64(_fd, _offset + sent, SEEK_SET);
+    int bytes = _read(_fd, buf, (unsigned int)n);
+#else
+    int bytes = (int)pread(_fd, buf, n, _offset + sent);
+#endif
+    if (bytes <= 0 || http2_write(_context, buf, bytes) < 0) return -1;
+    sent += bytes;
+  }
+  while (sent < _size)
+  {
+    if (_context->conn)
+    {
+      // queued as a file range, this takes no memory
+      if (!httpconn_sendfile(_context->conn, _fd, _offset + sent, _size - sent)) return -1;
+      sent = _size;
+      break;
+    }
+    long ret = net_sendfile(_context->netsocket, _context->tls, _context->tlsSession, _fd, _offset + sent, _size - sent);
+    if (ret == SOCKET_ERROR)
+    {
+      if (!would_block()) return -1;
+      if (_context->server && 0 == httpresponse_connection(_context)) return -1;
+      continue;
+    }
+    sent += ret;
+  }
+  
+  if (_context->chunked && _size)
+  {
+    httpresponse_send(_context, "\r\n", 2);
+  }
+  return (long)sent;
+}
+
+static int httpresponse_read(HttpResponse* _context, void* _memory, const int _size)
+{
+  return net_recv(_context->netsocket, _context->tls, _context->tlsSession, _memory, (int)_size);
+}
+
+static int comparePairs(const void* l, const void* r)
+{
+  const HttpHeader* pl = (const HttpHeader*)l;
+  const HttpHeader* pr = (const HttpHeader*)r;
+  return strcmp(pl->name, pr->name);
+}
+
+// header names are case insensitive (and arrive in lower case over http/2)
+static int compareHeaders(const void* l, const void* r)
+{
+  const HttpHeader* pl = (const HttpHeader*)l;
+  const HttpHeader* pr = (const HttpHeader*)r;
+  return strcasecmp(pl->name, pr->name);
+}
+
+// parse a complete request from memory. the buffer is modified in place.
+static bool httpresponse_parse_request(HttpResponse* _context, char* buffer, int bytesRead)
+{
+  // extract method
+  char* method = buffer;
+  char* eom = strchr(method, ' ');
+  if (0 == eom)
+  {
+    return httpresponse_response(_context, 500, 0, 0, 0);
+  }
+  *eom++ = 0; // terminate method
+
+  // extract location and (optional) arguments
+  char* location = eom;
+  char* eol = strstr(location, " HTTP/1.1\r\n");
+  if (0 == eol)
+  {
+    return httpresponse_response(_context, 500, 0, 0, 0);
+  }
+  *eol = 0;	// terminate location
+
+  char* args = strchr(location, '?');
+  if (args)
+  {
+    *args++ = 0; // args is now pointing to the argument list
+  }
+  else
+  {
+    args = eol;	// empty arguments
+  }
+  eol += strlen(" HTTP/1.1\r\n");
+
+  char* eoh = 0;			// end of header
+
+  if (0 == strcmp(method, "POST") || 0 == strcmp(method, "GET") || 0 == strcmp(method, "HEAD") || 0 == strcmp(method, "OPTIONS"))
+  {
+    eoh = strstr(eol, "\r\n\r\n");
+    if (0 == eoh)
+      return httpresponse_response(_context, 500, 0, 0, 0);
+    
+    eoh += 4; // end-of-header now points directly to the first byte of content
+  }
+  else
+  {
+    return httpresponse_response(_context, 500, "unsupported method", 0, 0);
+  }
+
+  // method .. eom : size of method
+  // args .. eol : size of GET arguments
+  // eol .. eoh-2 : size of headers
+  // eoh .. buffer+bytesRead ; size of POST arguments
+
+  _context->n_headers = -1;
+  int hchars = 0;
+  char* headers = eol;
+  for (; headers[hchars]; ++hchars)
+  {
+    if (headers[hchars] == '\r')
+    {
+      _context->n_headers++;
     }
   }
 
@@ -308,9 +1177,12 @@ HTTPD_C_API bool httpresponse_parse(HttpResponse* _context)
   int locLen = (int)strlen(location) + 1;
   int metLen = (int)strlen(method) + 1;
 
-  _context->memory = (char*) calloc (1,_context->n_args * sizeof(HttpHeader) + _context->n_headers * sizeof(HttpHeader) + hchars + 1 + chars + bytesLeft + 1 + locLen + metLen);
+  _context->memory = (char*) calloc (1,_context->n_args * sizeof(HttpHeader) + _context->n_headers * sizeof(HttpHeader) + hchars + 1 + chars + bytesLeft + 1 + locLen + metLen + bytesLeft + 1);
   _context->location = _context->memory + _context->n_headers * sizeof(HttpHeader) + _context->n_args * sizeof(HttpHeader) + hchars + 1 + chars + bytesLeft + 1;
   _context->method = _context->location + locLen;
+  _context->content = _context->method + metLen;
+  _context->contentLength = bytesLeft;
+  memcpy(_context->content, eoh, bytesLeft);
   _context->args = (HttpHeader*)(_context->memory);
   _context->headers = (HttpHeader*)(_context->memory + _context->n_args * sizeof(HttpHeader));
 
@@ -352,14 +1224,10 @@ HTTPD_C_API bool httpresponse_parse(HttpResponse* _context)
       strings[i] = 0;
     }
     
-    for (int i=0; i<_context->n_headers; ++i)
-    {
-    	uri_decode_inplace(_context->headers[i].name);
-    	uri_decode_inplace(_context->headers[i].value);
-    }
+    // header values are not uri encoded ('+' is significant in base64 keys)
     
     if (_context->n_headers)
-      qsort(_context->headers, _context->n_headers, sizeof(HttpHeader), &comparePairs);
+      qsort(_context->headers, _context->n_headers, sizeof(HttpHeader), &compareHeaders);
   }
 
 
@@ -410,119 +1278,643 @@ HTTPD_C_API bool httpresponse_parse(HttpResponse* _context)
   return true;
 }
 
-HTTPD_C_API int httpresponse_writef(HttpResponse* _context, const char* _fmt, ...)
-{
-  char buf[4096];
-  va_list ap;
-
-  va_start(ap, _fmt);
-  int len = vsprintf(buf, _fmt, ap);
-  va_end(ap);
-
-  if (0 == len)
-  return 0;
-
-  if (_context->chunked && len)
-  {
-    char num[10];
-    sprintf(num, "%x\r\n", len);
-    httpresponse_write(_context, num, (int)strlen(num));
-    len = httpresponse_write(_context, buf, len);
-    httpresponse_write(_context, "\r\n", 2);
-    return len;
-  }
-
-  return httpresponse_write(_context, buf, len);
-}
-
-HTTPD_C_API bool httpresponse_response (HttpResponse* _context, unsigned int _code, const char* _content, const size_t _contentLength, const char* _userHeader)
+HTTPD_C_API bool httpresponse_parse(HttpResponse* _context)
 {
-  _context->chunked = false;
-
-  const char* message = "???";
-  // for this few messages we don't need binsearch
-  for (unsigned int i = 0; i < sizeof(HttpErrorMessages) / sizeof(HttpErrorMessages[0]); ++i)
+  // TODO: context, make buffer configurable
+  const static int RECEIVE_BUFFER_SIZE = 8 * 1024;
+  char buffer[RECEIVE_BUFFER_SIZE];
+  int bytesRead = httpresponse_read(_context, buffer, RECEIVE_BUFFER_SIZE - 1);
+  if (bytesRead <= 0)
   {
-    if (HttpErrorMessages[i].code == _code)
-    {
-      message = HttpErrorMessages[i].message;
-      break;
-    }
+    return httpresponse_response(_context, 500, 0, 0, 0);
   }
+  buffer[bytesRead] = 0;
 
-  // setup automatic parameters
-  size_t contentLength = (0 == _contentLength && _content) ? strlen(_content) : _contentLength;
-  const char* userHeader = _userHeader ? _userHeader : "Content-Type: text/html\r\n";
-
-  // send HTTP header
-  httpresponse_writef(_context, "HTTP/1.1 %03d %s\r\n"
-           "Server: dbalster/httpd\r\n"
-           "Cache-Control: no-cache\r\n"
-           "Content-Length: %d\r\n"
-           "%s"
-           "\r\n", _code, message, contentLength, userHeader);
-
-  // write the actual content (the "page")
-  if (_content)
+  // mozilla sends the header in two chunks, yeah.
+  if (0 == strstr(buffer, "\r\n\r\n"))
   {
-    httpresponse_write(_context, _content, (int)contentLength);
+    int more = httpresponse_read(_context, buffer + bytesRead, RECEIVE_BUFFER_SIZE - bytesRead - 1);
+    if (more > 0) bytesRead += more;
+    buffer[bytesRead] = 0;
   }
 
-  return false;
+  return httpresponse_parse_request(_context, buffer, bytesRead);
 }
 
-HTTPD_C_API const char* httpresponse_location (HttpResponse* _context)
+// writers collect output in their buffer and send it in one write (one
+// chunk) per HTTPWRITER_SIZE bytes. room is kept in front for the chunk
+// size line and behind for its CRLF.
+
+HTTPD_C_API void httpwriter_init(HttpWriter* _writer, HttpResponse* _context)
 {
-	return _context->location;
+  _writer->context = _context;
+  _writer->total = 0;
+  _writer->length = 0;
+  _writer->depth = 0;
+  _writer->values = 0;
+  _writer->key = false;
 }
 
-HTTPD_C_API const char*	httpresponse_method(HttpResponse* _context)
+HTTPD_C_API int httpwriter_flush(HttpWriter* _writer)
 {
-	return _context->method;
+  if (0 == _writer->length) return _writer->total;
+  char* body = _writer->data + 8;
+  char* p = body;
+  if (_writer->context->chunked)
+  {
+    static const char hex[] = "0123456789abcdef";
+    *--p = '\n';
+    *--p = '\r';
+    for (size_t v = _writer->length; v; v >>= 4) *--p = hex[v & 15];
+    body[_writer->length] = '\r';
+    body[_writer->length + 1] = '\n';
+  }
+  size_t n = (body - p) + _writer->length + (_writer->context->chunked ? 2 : 0);
+  httpresponse_send(_writer->context, p, (int)n);
+  _writer->total += (int)_writer->length;
+  _writer->length = 0;
+  return _writer->total;
 }
 
-HTTPD_C_API int httpresponse_get_n_args(HttpResponse* _context)
+// room for at least _size bytes at the end of the buffer
+static char* httpwriter_reserve( HttpWriter* _writer, size_t _size )
 {
-	return _context->n_args;
+  if (HTTPWRITER_SIZE - _writer->length < _size) httpwriter_flush(_writer);
+  return _writer->data + 8 + _writer->length;
 }
 
-HTTPD_C_API int httpresponse_get_n_headers(HttpResponse* _context)
+static void httpwriter_add( HttpWriter* _writer, const char* _data, size_t _size )
 {
-	return _context->n_headers;
+  while (_size)
+  {
+    size_t n = HTTPWRITER_SIZE - _writer->length;
+    if (n > _size) n = _size;
+    memcpy(_writer->data + 8 + _writer->length, _data, n);
+    _writer->length += n;
+    _data += n;
+    _size -= n;
+    if (_size) httpwriter_flush(_writer);
+  }
 }
 
-HTTPD_C_API void httpresponse_begin(HttpResponse* _context, unsigned int _code, const char* _userHeader)
+// plain runs are copied in bulk, only the exceptions are replaced
+static void httpwriter_escape( HttpWriter* _writer, const char* _data, size_t _size,
+                               size_t (*_plain)( const char*, size_t ), size_t (*_entity)( unsigned char, char* ) )
 {
-  const char* message = "???";
-  // for this few messages we don't need binsearch
-  for (unsigned int i = 0; i < sizeof(HttpErrorMessages) / sizeof(HttpErrorMessages[0]); ++i)
+  size_t i = 0;
+  while (i < _size)
   {
-    if (HttpErrorMessages[i].code == _code)
+    // the longest replacement has to fit behind the plain run
+    httpwriter_reserve(_writer, 16);
+    size_t room = HTTPWRITER_SIZE - 8 - _writer->length;
+    size_t plain = _plain(_data + i, _size - i < room ? _size - i : room);
+    memcpy(_writer->data + 8 + _writer->length, _data + i, plain);
+    _writer->length += plain;
+    i += plain;
+    if (i < _size)
     {
-      message = HttpErrorMessages[i].message;
-      break;
+      size_t length = _entity((unsigned char)_data[i], _writer->data + 8 + _writer->length);
+      if (length)
+      {
+        _writer->length += length;
+        ++i;
+      }
     }
   }
-
-  const char* userHeader = _userHeader ? _userHeader : "Content-Type: text/html\r\n";
-
-  // send HTTP header
-  httpresponse_writef(_context, "HTTP/1.1 %03d %s\r\n"
-           "Server: dbalster/http\r\n"
-           "Cache-Control: no-cache\r\n"
-           "Transfer-Encoding: chunked\r\n"
-           "%s"
-           "\r\n", _code, message, userHeader);
-
-  _context->chunked = true;
 }
 
-HTTPD_C_API void httpresponse_end(HttpResponse* _context )
+// one printf conversion, straight into the buffer when it fits
+static void httpwriter_spec( HttpWriter* _writer, const char* _spec, ... )
 {
-    httpresponse_write(_context, "0\r\n\r\n", 5);
-    _context->chunked = false;
-}
-
+  va_list ap, again;
+  va_start(ap, _spec);
+  va_copy(again, ap);
+  size_t room = HTTPWRITER_SIZE - _writer->length;
+  int len = vsnprintf(_writer->data + 8 + _writer->length, room + 1, _spec, ap);
+  if (len > 0 && (size_t)len <= room)
+  {
+    _writer->length += len;
+  }
+  else if (len > 0)
+  {
+    char* p = (char*) malloc(len + 1);
+    if (p)
+    {
+      vsnprintf(p, len + 1, _spec, again);
+      httpwriter_add(_writer, p, len);
+      free(p);
+    }
+  }
+  va_end(again);
+  va_end(ap);
+}
+
+// printf with one addition: %H writes a string html escaped, %.*H takes
+// its length from the arguments. plain %d, %u, %s and %f don't go
+// through the c library.
+static void httpwriter_vformat( HttpWriter* _writer, const char* _fmt, va_list _ap )
+{
+  va_list ap;
+  va_copy(ap, _ap);
+  while (*_fmt)
+  {
+    const char* start = _fmt;
+    while (*_fmt && *_fmt != '%') ++_fmt;
+    httpwriter_add(_writer, start, _fmt - start);
+    if (0 == *_fmt) break;
+    
+    // collect the conversion, '*' is resolved so the spec takes one argument
+    char spec[64];
+    size_t n = 0;
+    int precision = -1;
+    spec[n++] = *_fmt++;
+    while (*_fmt && strchr("-+ #0", *_fmt) && n < 32) spec[n++] = *_fmt++;
+    if (*_fmt == '*') { n += sprintf(spec + n, "%d", va_arg(ap, int)); ++_fmt; }
+    while (*_fmt >= '0' && *_fmt <= '9' && n < 40) spec[n++] = *_fmt++;
+    if (*_fmt == '.')
+    {
+      spec[n++] = *_fmt++;
+      if (*_fmt == '*') { precision = va_arg(ap, int); n += sprintf(spec + n, "%d", precision); ++_fmt; }
+      else precision = (int)strtol(_fmt, 0, 10);
+      while (*_fmt >= '0' && *_fmt <= '9' && n < 50) spec[n++] = *_fmt++;
+    }
+    bool plain = 1 == n;
+    char size = 0;
+    while (*_fmt && strchr("hljztL", *_fmt) && n < 54)
+    {
+      size = (size == 'l' && *_fmt == 'l') ? 'q' : *_fmt;
+      spec[n++] = *_fmt++;
+    }
+    char conversion = *_fmt;
+    if (0 == conversion) break;
+    spec[n++] = *_fmt++;
+    spec[n] = 0;
+    
+    switch (conversion)
+    {
+      case '%': httpwriter_add(_writer, "%", 1); break;
+      case 'H':
+      {
+        const char* s = va_arg(ap, const char*);
+        if (s) httpwriter_escape(_writer, s, precision >= 0 ? strnlen(s, precision) : strlen(s), html_plain, html_entity);
+        break;
+      }
+      case 's':
+      {
+        const char* s = va_arg(ap, const char*);
+        if (plain && s) httpwriter_add(_writer, s, strlen(s));
+        else httpwriter_spec(_writer, spec, s);
+        break;
+      }
+      case 'p': httpwriter_spec(_writer, spec, va_arg(ap, void*)); break;
+      case 'n': (void) va_arg(ap, void*); break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        if (size == 'L') httpwriter_spec(_writer, spec, va_arg(ap, long double));
+        else httpwriter_spec(_writer, spec, va_arg(ap, double));
+        break;
+      case 'd': case 'i': case 'u':
+        if (plain && (size == 0 || size == 'l' || size == 'q' || size == 'z'))
+        {
+          long long v = size == 'l' ? va_arg(ap, long) : size == 'q' ? va_arg(ap, long long) : size == 'z' ? (long long)va_arg(ap, size_t) : va_arg(ap, int);
+          char* p = httpwriter_reserve(_writer, 24);
+          if (conversion == 'u')
+          {
+            // the argument was read signed, only its width counts
+            unsigned long long u = size == 0 ? (unsigned)v : size == 'l' ? (unsigned long)v : (unsigned long long)v;
+            _writer->length += httpd_utoa(p, u);
+          }
+          else
+          {
+            if (size == 'z') v = (long long)(ptrdiff_t)v;
+            if (v < 0)
+            {
+              *p++ = '-';
+              _writer->length++;
+            }
+            _writer->length += httpd_utoa(p, v < 0 ? 0ull - (unsigned long long)v : (unsigned long long)v);
+          }
+          break;
+        }
+        // fall through
+      default:
+        switch (size)
+        {
+          case 'l': httpwriter_spec(_writer, spec, va_arg(ap, long)); break;
+          case 'q': httpwriter_spec(_writer, spec, va_arg(ap, long long)); break;
+          case 'j': httpwriter_spec(_writer, spec, va_arg(ap, intmax_t)); break;
+          case 'z': httpwriter_spec(_writer, spec, va_arg(ap, size_t)); break;
+          case 't': httpwriter_spec(_writer, spec, va_arg(ap, ptrdiff_t)); break;
+          default: httpwriter_spec(_writer, spec, va_arg(ap, int)); break;
+        }
+        break;
+    }
+  }
+  va_end(ap);
+}
+
+HTTPD_C_API void httpwriter_printf(HttpWriter* _writer, const char* _fmt, ...)
+{
+  va_list ap;
+  va_start(ap, _fmt);
+  httpwriter_vformat(_writer, _fmt, ap);
+  va_end(ap);
+}
+
+HTTPD_C_API void httpwriter_text(HttpWriter* _writer, const char* _text, size_t _size)
+{
+  httpwriter_add(_writer, _text, 0 == _size ? strlen(_text) : _size);
+}
+
+HTTPD_C_API void httpwriter_html(HttpWriter* _writer, const char* _text, size_t _size)
+{
+  httpwriter_escape(_writer, _text, 0 == _size ? strlen(_text) : _size, html_plain, html_entity);
+}
+
+// json: every value inside an object or array but the first is preceded by
+// a comma, a bit per level remembers whether that level has one already.
+static void httpwriter_value( HttpWriter* _writer )
+{
+  if (_writer->key)
+  {
+    _writer->key = false;
+  }
+  else if (_writer->depth && _writer->depth <= 64)
+  {
+    unsigned long long bit = 1ull << (_writer->depth - 1);
+    if (_writer->values & bit)
+    {
+      *httpwriter_reserve(_writer, 1) = ',';
+      _writer->length++;
+    }
+    _writer->values |= bit;
+  }
+}
+
+static void httpwriter_open( HttpWriter* _writer, char _bracket )
+{
+  httpwriter_value(_writer);
+  *httpwriter_reserve(_writer, 1) = _bracket;
+  _writer->length++;
+  _writer->depth++;
+  if (_writer->depth <= 64) _writer->values &= ~(1ull << (_writer->depth - 1));
+}
+
+static void httpwriter_close( HttpWriter* _writer, char _bracket )
+{
+  if (_writer->depth) _writer->depth--;
+  *httpwriter_reserve(_writer, 1) = _bracket;
+  _writer->length++;
+}
+
+HTTPD_C_API void httpwriter_begin_object(HttpWriter* _writer) { httpwriter_open(_writer, '{'); }
+HTTPD_C_API void httpwriter_end_object(HttpWriter* _writer) { httpwriter_close(_writer, '}'); }
+HTTPD_C_API void httpwriter_begin_array(HttpWriter* _writer) { httpwriter_open(_writer, '['); }
+HTTPD_C_API void httpwriter_end_array(HttpWriter* _writer) { httpwriter_close(_writer, ']'); }
+
+HTTPD_C_API void httpwriter_string(HttpWriter* _writer, const char* _text, size_t _size)
+{
+  httpwriter_value(_writer);
+  if (0 == _text)
+  {
+    httpwriter_add(_writer, "null", 4);
+    return;
+  }
+  httpwriter_add(_writer, "\"", 1);
+  httpwriter_escape(_writer, _text, 0 == _size ? strlen(_text) : _size, json_plain, json_entity);
+  httpwriter_add(_writer, "\"", 1);
+}
+
+HTTPD_C_API void httpwriter_key(HttpWriter* _writer, const char* _key)
+{
+  httpwriter_string(_writer, _key, 0);
+  httpwriter_add(_writer, ":", 1);
+  _writer->key = true;
+}
+
+HTTPD_C_API void httpwriter_int(HttpWriter* _writer, long long _value)
+{
+  httpwriter_value(_writer);
+  char* p = httpwriter_reserve(_writer, 24);
+  if (_value < 0)
+  {
+    *p++ = '-';
+    _writer->length++;
+  }
+  _writer->length += httpd_utoa(p, _value < 0 ? 0ull - (unsigned long long)_value : (unsigned long long)_value);
+}
+
+HTTPD_C_API void httpwriter_uint(HttpWriter* _writer, unsigned long long _value)
+{
+  httpwriter_value(_writer);
+  _writer->length += httpd_utoa(httpwriter_reserve(_writer, 24), _value);
+}
+
+HTTPD_C_API void httpwriter_double(HttpWriter* _writer, double _value)
+{
+  httpwriter_value(_writer);
+  _writer->length += httpd_dtoa(httpwriter_reserve(_writer, 32), _value);
+}
+
+HTTPD_C_API void httpwriter_bool(HttpWriter* _writer, bool _value)
+{
+  httpwriter_value(_writer);
+  httpwriter_add(_writer, _value ? "true" : "false", _value ? 4 : 5);
+}
+
+HTTPD_C_API void httpwriter_null(HttpWriter* _writer)
+{
+  httpwriter_value(_writer);
+  httpwriter_add(_writer, "null", 4);
+}
+
+HTTPD_C_API int httpresponse_writef(HttpResponse* _context, const char* _fmt, ...)
+{
+  HttpWriter writer;
+  httpwriter_init(&writer, _context);
+  va_list ap;
+  va_start(ap, _fmt);
+  httpwriter_vformat(&writer, _fmt, ap);
+  va_end(ap);
+  return httpwriter_flush(&writer);
+}
+
+HTTPD_C_API int httpresponse_write_escaped(HttpResponse* _context, const char* _text, size_t _size)
+{
+  HttpWriter writer;
+  httpwriter_init(&writer, _context);
+  httpwriter_html(&writer, _text, _size);
+  return httpwriter_flush(&writer);
+}
+
+HTTPD_C_API bool httpresponse_response (HttpResponse* _context, unsigned int _code, const char* _content, const size_t _contentLength, const char* _userHeader)
+{
+  _context->chunked = false;
+  _context->framed = true;
+
+  // setup automatic parameters
+  size_t contentLength = (0 == _contentLength && _content) ? strlen(_content) : _contentLength;
+  const char* userHeader = _userHeader ? _userHeader : "Content-Type: text/html\r\n";
+
+  // send HTTP header
+  HttpHead head;
+  char number[40] = "Content-Length: ";
+  size_t length = 16 + httpd_utoa(number + 16, contentLength);
+  number[length++] = '\r';
+  number[length++] = '\n';
+  httphead_begin(_context, &head, _code);
+  httphead_add(_context, &head, number, length);
+  httphead_add(_context, &head, userHeader, strlen(userHeader));
+  httphead_add(_context, &head, "\r\n", 2);
+
+  // write the actual content (the "page"), a small one along with the header
+  if (_content && !httphead_only(_context) && head.length + contentLength <= sizeof(head.data))
+  {
+    httphead_add(_context, &head, _content, contentLength);
+    _content = 0;
+  }
+  httphead_send(_context, &head);
+  if (_content)
+  {
+    httpresponse_send(_context, _content, (int)contentLength);
+  }
+
+  return false;
+}
+
+HTTPD_C_API const char* httpresponse_location (HttpResponse* _context)
+{
+	return _context->location;
+}
+
+HTTPD_C_API const char*	httpresponse_method(HttpResponse* _context)
+{
+	return _context->method;
+}
+
+HTTPD_C_API int httpresponse_get_n_args(HttpResponse* _context)
+{
+	return _context->n_args;
+}
+
+HTTPD_C_API int httpresponse_get_n_headers(HttpResponse* _context)
+{
+	return _context->n_headers;
+}
+
+HTTPD_C_API void httpresponse_begin(HttpResponse* _context, unsigned int _code, const char* _userHeader)
+{
+  const char* userHeader = _userHeader ? _userHeader : "Content-Type: text/html\r\n";
+
+  // send HTTP header
+  HttpHead head;
+  httphead_begin(_context, &head, _code);
+  httphead_add(_context, &head, "Transfer-Encoding: chunked\r\n", 28);
+  httphead_add(_context, &head, userHeader, strlen(userHeader));
+  httphead_add(_context, &head, "\r\n", 2);
+  httphead_send(_context, &head);
+
+  // http/2 has its own framing, the header is dropped when it's translated
+  _context->chunked = 0 == _context->h2;
+  _context->framed = true;
+}
+
+HTTPD_C_API void httpresponse_end(HttpResponse* _context )
+{
+    if (_context->h2)
+    {
+      http2_end(_context);
+      return;
+    }
+    httpresponse_send(_context, "0\r\n\r\n", 5);
+    _context->chunked = false;
+}
+
+HTTPD_C_API int httpresponse_write_body(HttpResponse* _context, const void* _memory, size_t _size)
+{
+  if (httpresponse_full(_context)) return 0;
+  if (_context->chunked && _size)
+  {
+    char num[20];
+    int n = sprintf(num, "%lx\r\n", (unsigned long)_size);
+    if (httpresponse_send(_context, num, n) < 0 || httpresponse_send(_context, _memory, (int)_size) < 0) return -1;
+    return httpresponse_send(_context, "\r\n", 2) < 0 ? -1 : (int)_size;
+  }
+  return httpresponse_send(_context, _memory, (int)_size);
+}
+
+HTTPD_C_API int httpresponse_write_static(HttpResponse* _context, const void* _memory, size_t _size)
+{
+  if (_context->h2 || 0 == _context->conn || _context->discard)
+  {
+    // frames are built in memory anyway, and a plain socket writes directly
+    return httpresponse_send(_context, _memory, (int)_size);
+  }
+  if (_context->chunked && _size)
+  {
+    char num[20];
+    sprintf(num, "%lx\r\n", (unsigned long)_size);
+    httpresponse_send(_context, num, (int)strlen(num));
+  }
+  _context->sent += _size;
+  if (!httpconn_write_static(_context->conn, _memory, _size)) return -1;
+  if (_context->chunked && _size)
+  {
+    httpresponse_send(_context, "\r\n", 2);
+  }
+  return (int)_size;
+}
+
+// static assets. the bundle tool generates the HttpBundle: every file with
+// its gzip variant, validators and a perfect hash of the paths.
+
+HTTPD_C_API unsigned int httpbundle_hash(const char* _path, unsigned int _seed)
+{
+  unsigned int h = 2166136261u ^ (_seed * 0x9e3779b1u);
+  for (const unsigned char* p = (const unsigned char*)_path; *p; ++p)
+  {
+    h = (h ^ *p) * 16777619u;
+  }
+  // fnv leaves the low bits poorly mixed
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+HTTPD_C_API const HttpAsset* httpbundle_find(const HttpBundle* _bundle, const char* _path)
+{
+  if (0 == _bundle->n_assets) return 0;
+  // the bucket's seed sends every path of the bucket to a slot of its own
+  unsigned int seed = _bundle->seeds[httpbundle_hash(_path, 0) % _bundle->n_seeds];
+  unsigned int slot = _bundle->slots[httpbundle_hash(_path, seed) & (_bundle->n_slots - 1)];
+  if (0 == slot) return 0;
+  const HttpAsset* asset = &_bundle->assets[slot - 1];
+  return 0 == strcmp(asset->path, _path) ? asset : 0;
+}
+
+// is _token in a comma separated header value, and not excluded with q=0?
+static bool header_accepts( const char* _value, const char* _token )
+{
+  size_t n = strlen(_token);
+  while (_value && *_value)
+  {
+    while (*_value == ' ' || *_value == ',') ++_value;
+    size_t len = strcspn(_value, ",; ");
+    bool match = (len == n && 0 == strncasecmp(_value, _token, n)) || (len == 1 && *_value == '*');
+    _value += len;
+    bool zero = false;
+    while (*_value && *_value != ',')
+    {
+      if (*_value == 'q' && _value[1] == '=')
+      {
+        const char* q = _value + 2;
+        zero = *q == '0';
+        if (zero && q[1] == '.') for (q += 2; *q >= '0' && *q <= '9'; ++q) zero = zero && *q == '0';
+      }
+      ++_value;
+    }
+    if (match) return !zero;
+  }
+  return false;
+}
+
+// does an If-None-Match list name _etag? weak comparison, as for GET
+static bool etag_matches( const char* _list, const char* _etag )
+{
+  size_t n = strlen(_etag);
+  while (_list && *_list)
+  {
+    while (*_list == ' ' || *_list == ',') ++_list;
+    if (*_list == '*') return true;
+    if (0 == strncmp(_list, "W/", 2)) _list += 2;
+    size_t len = strcspn(_list, ", ");
+    if (len == n && 0 == strncmp(_list, _etag, n)) return true;
+    _list += len;
+  }
+  return false;
+}
+
+// seconds since 1970 of an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), -1 if it isn't one
+static long long http_date_parse( const char* _date )
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int day, year, h, m, sec;
+  if (6 != sscanf(_date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, month, &year, &h, &m, &sec)) return -1;
+  const char* found = strstr(months, month);
+  if (0 == found || (found - months) % 3) return -1;
+  int mon = (int)(found - months) / 3 + 1;
+  // the civil date to days since 1970, march based years
+  int y = year - (mon <= 2);
+  int era = y / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+  long long days = (long long)era * 146097 + doe - 719468;
+  return days * 86400 + h * 3600 + m * 60 + sec;
+}
+
+HTTPD_C_API bool httpresponse_asset(HttpResponse* _context, const HttpBundle* _bundle)
+{
+  const HttpAsset* asset = httpbundle_find(_bundle, httpresponse_location(_context));
+  if (0 == asset) return false;
+  
+  const char* method = httpresponse_method(_context);
+  if (!httphead_only(_context) && 0 != strcmp(method, "GET"))
+  {
+    httpresponse_response(_context, 405, 0, 0, "Allow: GET, HEAD\r\n");
+    return true;
+  }
+  
+  bool gzip = asset->gzip && header_accepts(httpresponse_get_header(_context, "Accept-Encoding"), "gzip");
+  const char* etag = gzip ? asset->gzipEtag : asset->etag;
+  const unsigned char* data = gzip ? asset->gzip : asset->data;
+  size_t size = gzip ? asset->gzipSize : asset->size;
+  
+  // If-None-Match decides, If-Modified-Since only counts without it
+  const char* match = httpresponse_get_header(_context, "If-None-Match");
+  const char* since = httpresponse_get_header(_context, "If-Modified-Since");
+  bool fresh = match ? etag_matches(match, etag) : since && http_date_parse(since) >= asset->modified;
+  
+  HttpHead h;
+  httphead_begin(_context, &h, fresh ? 304 : 200);
+  if (!fresh)
+  {
+    char number[40] = "Content-Length: ";
+    size_t length = 16 + httpd_utoa(number + 16, size);
+    number[length++] = '\r';
+    number[length++] = '\n';
+    httphead_add(_context, &h, number, length);
+    httphead_add(_context, &h, "Content-Type: ", 14);
+    httphead_add(_context, &h, asset->mime, strlen(asset->mime));
+    httphead_add(_context, &h, "\r\n", 2);
+  }
+  if (gzip)
+  {
+    httphead_add(_context, &h, "Content-Encoding: gzip\r\n", 24);
+  }
+  if (asset->gzip)
+  {
+    httphead_add(_context, &h, "Vary: Accept-Encoding\r\n", 23);
+  }
+  httphead_add(_context, &h, "ETag: ", 6);
+  httphead_add(_context, &h, etag, strlen(etag));
+  httphead_add(_context, &h, "\r\nLast-Modified: ", 17);
+  httphead_add(_context, &h, asset->lastModified, strlen(asset->lastModified));
+  httphead_add(_context, &h, "\r\n\r\n", 4);
+  
+  _context->chunked = false;
+  _context->framed = true;
+  httphead_send(_context, &h);
+  if (!fresh)
+  {
+    httpresponse_write_static(_context, data, size);
+  }
+  return true;
+}
+
 HTTPD_C_API const char* httpresponse_get_arg(HttpResponse* _context, const char* _key) 
 {
 	HttpHeader p;
@@ -542,7 +1934,7 @@ HTTPD_C_API const char* httpresponse_get_header(HttpResponse* _context, const ch
 {
 	HttpHeader p;
 	p.name = ((char*)_key);
-	const HttpHeader* result = (const HttpHeader*)bsearch(&p, _context->headers, _context->n_headers, sizeof(HttpHeader), &comparePairs);
+	const HttpHeader* result = (const HttpHeader*)bsearch(&p, _context->headers, _context->n_headers, sizeof(HttpHeader), &compareHeaders);
   if (result) return result->value;
   return 0;
 }
@@ -553,306 +1945,7341 @@ HTTPD_C_API const HttpHeader* httpresponse_get_header_by_index(HttpResponse* _co
   return &(_context->headers[_index]);
 }
 
+HTTPD_C_API const char* httpresponse_get_content(HttpResponse* _context, size_t* _size)
+{
+  if (_size) *_size = _context->contentLength;
+  return _context->content ? _context->content : "";
+}
+
 // httpd
 
-struct _Httpd
+typedef struct _HttpBuffer HttpBuffer;
+typedef struct _HttpRing HttpRing;
+#ifdef HTTPD_URING
+static void httpring_destroy( HttpRing* _ring );
+#endif
+static void httpd_handoff (Httpd* _server);
+
+// hierarchical timing wheel. every level has 64 slots, a slot on level n
+// spans 64^n ticks. timers are only moved down a level when their slot comes
+// up, so adding, re-arming and removing a timer are O(1) list operations and
+// none of them needs the clock: the event loop reads it once per iteration.
+
+#define HTTPWHEEL_BITS    6
+#define HTTPWHEEL_SLOTS   (1 << HTTPWHEEL_BITS)
+#define HTTPWHEEL_LEVELS  4
+
+typedef struct _HttpTimer HttpTimer;
+
+struct _HttpTimer
+{
+  HttpTimer*    next;
+  HttpTimer**   pprev;    // 0 while the timer isn't armed
+  uint64_t      expires;  // tick
+  void          (*expired)( void* _owner );
+  void*         owner;
+};
+
+typedef struct
+{
+  uint64_t      now;      // the next tick to process
+  int           count;
+  HttpTimer*    slots[HTTPWHEEL_LEVELS][HTTPWHEEL_SLOTS];
+} HttpWheel;
+
+static uint64_t httpd_clock( void )
+{
+#ifdef WIN32
+  return GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// the same in us, for durations
+static uint64_t httpd_micros( void )
+{
+#ifdef WIN32
+  return GetTickCount64() * 1000;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// us since 1970
+static uint64_t httpd_realtime( void )
+{
+#ifdef WIN32
+  return (uint64_t)time(0) * 1000000;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void httpwheel_insert( HttpWheel* _wheel, HttpTimer* _timer )
+{
+  uint64_t expires = _timer->expires < _wheel->now ? _wheel->now : _timer->expires;
+  uint64_t delta = expires - _wheel->now;
+  int level = 0;
+  while (level < HTTPWHEEL_LEVELS - 1 && delta >> (HTTPWHEEL_BITS * (level + 1)))
+  {
+    ++level;
+  }
+  if (delta >> (HTTPWHEEL_BITS * HTTPWHEEL_LEVELS))
+  {
+    // beyond the range of the wheel, it comes around again later
+    expires = _wheel->now + ((uint64_t)1 << (HTTPWHEEL_BITS * HTTPWHEEL_LEVELS)) - 1;
+  }
+  HttpTimer** slot = &_wheel->slots[level][(expires >> (HTTPWHEEL_BITS * level)) & (HTTPWHEEL_SLOTS - 1)];
+  _timer->next = *slot;
+  if (_timer->next) _timer->next->pprev = &_timer->next;
+  _timer->pprev = slot;
+  *slot = _timer;
+}
+
+static void httpwheel_remove( HttpWheel* _wheel, HttpTimer* _timer )
+{
+  if (_timer->pprev)
+  {
+    *_timer->pprev = _timer->next;
+    if (_timer->next) _timer->next->pprev = _timer->pprev;
+    _timer->next = 0;
+    _timer->pprev = 0;
+    _wheel->count--;
+  }
+}
+
+static void httpwheel_add( HttpWheel* _wheel, HttpTimer* _timer, uint64_t _tick )
+{
+  httpwheel_remove(_wheel, _timer);
+  _timer->expires = _tick;
+  httpwheel_insert(_wheel, _timer);
+  _wheel->count++;
+}
+
+// move the timers of the current slot on _level one level down
+static void httpwheel_cascade( HttpWheel* _wheel, int _level )
+{
+  HttpTimer** slot = &_wheel->slots[_level][(_wheel->now >> (HTTPWHEEL_BITS * _level)) & (HTTPWHEEL_SLOTS - 1)];
+  HttpTimer* timer = *slot;
+  *slot = 0;
+  while (timer)
+  {
+    HttpTimer* next = timer->next;
+    httpwheel_insert(_wheel, timer);
+    timer = next;
+  }
+}
+
+// fire every timer that expired up to and including _tick
+static void httpwheel_advance( HttpWheel* _wheel, uint64_t _tick )
+{
+  while (_wheel->now <= _tick)
+  {
+    if (0 == _wheel->count)
+    {
+      _wheel->now = _tick + 1;
+      break;
+    }
+    int index = (int)(_wheel->now & (HTTPWHEEL_SLOTS - 1));
+    for (int level = 1; 0 == index && level < HTTPWHEEL_LEVELS; ++level)
+    {
+      httpwheel_cascade(_wheel, level);
+      index = (int)((_wheel->now >> (HTTPWHEEL_BITS * level)) & (HTTPWHEEL_SLOTS - 1));
+    }
+    HttpTimer** slot = &_wheel->slots[0][_wheel->now & (HTTPWHEEL_SLOTS - 1)];
+    while (*slot)
+    {
+      HttpTimer* timer = *slot;
+      httpwheel_remove(_wheel, timer);
+      timer->expired(timer->owner);
+    }
+    _wheel->now++;
+  }
+}
+
+// ticks until the wheel needs attention again, -1 if it's empty. this looks
+// at most at one round of the lowest level, whatever the number of timers.
+static int httpwheel_next( HttpWheel* _wheel )
+{
+  if (0 == _wheel->count) return -1;
+  int left = HTTPWHEEL_SLOTS - (int)(_wheel->now & (HTTPWHEEL_SLOTS - 1));
+  for (int i = 0; i < left; ++i)
+  {
+    if (_wheel->slots[0][(_wheel->now + i) & (HTTPWHEEL_SLOTS - 1)]) return i;
+  }
+  return left;  // the next cascade
+}
+
+// codel (rfc 8289) applied to requests instead of packets: the sojourn time is
+// how long a request waited before its handler ran. a single slow request
+// doesn't matter, only a wait that stays above target for a whole interval.
+// then requests are shed at a rate that grows with the square root of the
+// number of drops, until a request is served in time again.
+
+typedef struct
+{
+  int           target;     // ms, 0: disabled
+  int           interval;   // ms
+  uint64_t      firstAbove; // when the wait counts as persistent, 0 while below target
+  uint64_t      dropNext;
+  unsigned int  count;      // drops since dropping started
+  unsigned int  lastCount;
+  bool          dropping;
+} HttpCodel;
+
+static unsigned int isqrt( unsigned int _x )
+{
+  unsigned int r = 0;
+  for (unsigned int bit = 1u << 30; bit; bit >>= 2)
+  {
+    if (_x >= r + bit)
+    {
+      _x -= r + bit;
+      r = (r >> 1) + bit;
+    }
+    else
+    {
+      r >>= 1;
+    }
+  }
+  return r;
+}
+
+static uint64_t httpcodel_control( HttpCodel* _codel, uint64_t _t )
+{
+  // interval / sqrt(count), in 1/256 ms
+  unsigned int count = _codel->count < 65536 ? _codel->count : 65535;
+  return _t + (uint64_t)_codel->interval * 256 / isqrt(count << 16);
+}
+
+static bool httpcodel_shed( HttpCodel* _codel, uint64_t _now, uint64_t _sojourn )
+{
+  bool above = false;
+  if (_sojourn < (uint64_t)_codel->target)
+  {
+    _codel->firstAbove = 0;
+  }
+  else if (0 == _codel->firstAbove)
+  {
+    _codel->firstAbove = _now + _codel->interval;
+  }
+  else
+  {
+    above = _now >= _codel->firstAbove;
+  }
+
+  if (_codel->dropping)
+  {
+    if (!above)
+    {
+      _codel->dropping = false;
+      return false;
+    }
+    if (_now < _codel->dropNext) return false;
+    _codel->count++;
+    _codel->dropNext = httpcodel_control(_codel, _codel->dropNext);
+    return true;
+  }
+  if (!above) return false;
+
+  // dropping again soon after the last episode resumes at its rate
+  unsigned int delta = _codel->count - _codel->lastCount;
+  _codel->dropping = true;
+  _codel->count = (delta > 1 && _now - _codel->dropNext < 16 * (uint64_t)_codel->interval) ? delta : 1;
+  _codel->lastCount = _codel->count;
+  _codel->dropNext = httpcodel_control(_codel, _now);
+  return true;
+}
+
+// per client rate limits (GCRA, the token bucket as a single number): every
+// bucket holds the time at which it is full again. a request is allowed while
+// that time is less than a burst ahead of now and pushes it one interval
+// further. the buckets live in a fixed table of sets of four that each fill
+// one cache line; a key that isn't there takes the slot that was full the
+// longest, which forgets nothing unless the table is too small. the table
+// belongs to one server and only its event loop touches it; the updates are
+// a compare-and-swap anyway, which costs next to nothing uncontended.
+
+#ifdef _MSC_VER
+#  define httpatomic_load(_p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(_p), 0, 0))
+#  define httpatomic_cas(_p, _expected, _desired) \
+     ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(_p), (LONG64)(_desired), (LONG64)(_expected)) == (_expected))
+#else
+#  define httpatomic_load(_p) __atomic_load_n((_p), __ATOMIC_RELAXED)
+#  define httpatomic_cas(_p, _expected, _desired) \
+     __sync_bool_compare_and_swap((_p), (_expected), (_desired))
+#endif
+
+#define HTTPRATE_WAYS 4
+
+typedef struct
+{
+  uint64_t      key;      // 0: free
+  uint64_t      full;     // us, when the bucket is full again
+} HttpBucket;
+
+typedef struct
+{
+  HttpBucket*   sets;     // HTTPRATE_WAYS buckets each, cache line aligned
+  void*         memory;
+  uint64_t      mask;     // sets - 1
+} HttpRateTable;
+
+static bool httprate_init( HttpRateTable* _table, size_t _slots )
+{
+  size_t sets = _slots / HTTPRATE_WAYS;
+  _table->memory = calloc(sets * HTTPRATE_WAYS + HTTPRATE_WAYS, sizeof(HttpBucket));
+  if (0 == _table->memory) return false;
+  _table->sets = (HttpBucket*)(((uintptr_t)_table->memory + 63) & ~(uintptr_t)63);
+  _table->mask = sets - 1;
+  return true;
+}
+
+// take one request from the bucket of _key. false if it is empty, *_wait
+// is the time in us until it lets the next one through.
+static bool httprate_take( HttpRateTable* _table, uint64_t _key, uint64_t _now, uint64_t _interval, uint64_t _burst, uint64_t* _wait )
+{
+  HttpBucket* set = _table->sets + ((_key ^ (_key >> 29)) & _table->mask) * HTTPRATE_WAYS;
+  HttpBucket* bucket = 0;
+  for (int attempt = 0; 0 == bucket; ++attempt)
+  {
+    HttpBucket* oldest = set;
+    uint64_t oldestKey = 0, oldestFull = ~(uint64_t)0;
+    for (int i = 0; i < HTTPRATE_WAYS && 0 == bucket; ++i)
+    {
+      uint64_t key = httpatomic_load(&set[i].key);
+      uint64_t full = httpatomic_load(&set[i].full);
+      if (key == _key) bucket = set + i;
+      else if (full < oldestFull || 0 == key)
+      {
+        oldest = set + i;
+        oldestKey = key;
+        oldestFull = 0 == key ? 0 : full;
+      }
+    }
+    if (bucket) break;
+    // a new key starts with a full bucket
+    if (httpatomic_cas(&oldest->key, oldestKey, _key))
+    {
+      bucket = oldest;
+      uint64_t full = httpatomic_load(&bucket->full);
+      if (full > _now) httpatomic_cas(&bucket->full, full, _now);
+    }
+    // somebody else took the slot, too busy to care for the request
+    else if (attempt) return true;
+  }
+  
+  for (;;)
+  {
+    uint64_t full = httpatomic_load(&bucket->full);
+    uint64_t next = (full > _now ? full : _now) + _interval;
+    if (next - _now > _burst * _interval)
+    {
+      *_wait = next - _now - _burst * _interval;
+      return false;
+    }
+    if (httpatomic_cas(&bucket->full, full, next)) return true;
+  }
+}
+
+typedef struct
+{
+  int           socket;
+  int           family;     // AF_INET, AF_INET6 or AF_UNIX
+  char*         path;       // AF_UNIX: removed by httpd_destroy, 0 for abstract names
+  bool          accepting;  // io_uring: the multishot accept is armed
+} HttpListener;
+
+struct _Httpd
+{
+  HttpListener        listeners[HTTPD_MAX_LISTENERS];
+  int                 n_listeners;
+  void*               userdata;
+	HttpRequestHandler  handler;
+  HttpConn*           conns;    // connections that outlived their request handler
+  int                 n_conns;
+  const HttpTlsBackend* tls;    // 0 for plain http
+  void*               tlsContext;
+  bool                http2;
+  size_t              lowWater; // output queue limits per connection
+  size_t              highWater;
+  HttpWheel           wheel;    // connection timeouts
+  uint64_t            now;      // ms, read once per httpd_process
+  uint64_t            arrival;  // ms, earliest the current batch of events can have arrived
+  int                 maxConns; // admission control, 0: no limit
+  int                 maxInflight;
+  int                 inflight; // requests whose response isn't sent completely
+  HttpCodel           codel;
+  unsigned long       shed;     // requests answered with 503
+  HttpRing*           ring;     // io_uring engine, 0 for poll
+  int                 control;  // unix socket a new process takes the listening socket from, -1 if none
+  char*               controlPath;
+  int                 drainTimeout; // ms the old process drains after the handoff
+  bool                handedOff;
+  bool                draining; // not accepting anymore, connections close when they are done
+  uint64_t            deadline; // ms, the draining server closes whatever is left
+  HttpProxy*          proxies;  // routes that are forwarded to upstreams
+  HttpRateLimit*      limits;   // per client rate limits, every one that matches applies
+  HttpRateTable       buckets;
+  unsigned long       limited;  // requests answered with 429
+  HttpLog*            log;      // access log, 0 if there's none
+};
+
+// reference counted output buffer. an event is serialized exactly once and
+// every subscriber queue only holds a reference to it.
+
+struct _HttpBuffer
+{
+  int     refs;
+  size_t  size;
+  size_t  capacity;   // an unshared buffer may grow up to here
+  char*   data;       // storage, or borrowed memory that outlives the server
+  char    storage[1];
+};
+
+static HttpBuffer* httpbuffer_create( size_t _size )
+{
+  HttpBuffer* buf = (HttpBuffer*) malloc(sizeof(HttpBuffer)+_size);
+  if (buf)
+  {
+    buf->refs = 1;
+    buf->size = _size;
+    buf->capacity = _size;
+    buf->data = buf->storage;
+  }
+  return buf;
+}
+
+// refers to _memory instead of copying it, nothing is ever appended
+static HttpBuffer* httpbuffer_borrow( const void* _memory, size_t _size )
+{
+  HttpBuffer* buf = (HttpBuffer*) malloc(sizeof(HttpBuffer));
+  if (buf)
+  {
+    buf->refs = 1;
+    buf->size = _size;
+    buf->capacity = _size;
+    buf->data = (char*)_memory;
+  }
+  return buf;
+}
+
+static void httpbuffer_release( HttpBuffer* _buffer )
+{
+  if (_buffer && 0 == --_buffer->refs)
+  {
+    free(_buffer);
+  }
+}
+
+typedef struct _HttpSegment HttpSegment;
+
+struct _HttpSegment
+{
+  HttpSegment*  next;
+  HttpBuffer*   buffer;   // 0 for a file range
+  size_t        offset;   // bytes already sent
+  int           fd;       // file ranges own a duplicate of the descriptor
+  off_t         fileOffset;
+  size_t        fileSize;
+};
+
+static void httpsegment_free( HttpSegment* _seg )
+{
+  if (_seg->buffer)
+  {
+    httpbuffer_release(_seg->buffer);
+  }
+  else
+  {
+#ifdef WIN32
+    _close(_seg->fd);
+#else
+    close(_seg->fd);
+#endif
+  }
+  free(_seg);
+}
+
+enum
+{
+  HTTPCONN_STREAM,        // text/event-stream or long-poll client
+  HTTPCONN_WEBSOCKET,
+  HTTPCONN_HTTP2,
+  HTTPCONN_REQUEST,       // reading the next HTTP/1.1 request
+  HTTPCONN_PROXY,         // a request that is forwarded to an upstream
+  HTTPCONN_UPSTREAM,      // our connection to an upstream, busy or pooled
+  HTTPCONN_FETCH,         // a request of ours, see httprequest_submit
+};
+
+struct _HttpConn
+{
+  HttpConn*     next;     // Httpd.conns
+  HttpConn*     prev;
+  HttpConn*     chnext;   // HttpChannel.clients
+  HttpConn*     chprev;
+  Httpd*        server;
+  HttpChannel*  channel;
+  int           netsocket;
+  const HttpTlsBackend* tls;
+  void*         tlsSession;
+  struct sockaddr_storage peer; // the client as accept saw it, zero for upstreams
+  int           kind;
+  bool          longpoll; // wants exactly one event, then the connection is closed
+  bool          closing;  // close as soon as the queue is drained
+  bool          dead;     // released by the next httpd_process
+  HttpSegment*  head;     // pending output
+  HttpSegment*  tail;
+  size_t        queued;   // buffered bytes pending in the queue, file ranges don't count
+  HttpResponse* response; // a request whose handler returned before its output was sent
+  char*         in;       // unprocessed input
+  size_t        inLength;
+  size_t        inSize;
+  HttpWebSocket* ws;
+  Http2Session* h2;
+  HttpRelay*    relay;    // proxy: shared by the client and the upstream connection
+  HttpFetch*    fetch;
+  HttpTimer     timer;
+  int           timeout;  // HTTPTIMER_*, what the armed timer stands for
+  bool          progress; // output was sent since the timer was armed
+  bool          handshake;// tls handshake still running
+  bool          wantWrite;// the handshake waits for POLLOUT
+  bool          served;   // at least one request was answered
+  bool          keepalive;// the last response leaves the connection open
+  size_t        expect;   // size of the request in progress, 0 until the header is complete
+  size_t        chunks;   // a chunked request body: where its next chunk starts, 0 otherwise
+  bool          inflight; // counted in Httpd.inflight
+  bool          ring;     // a plain socket that only the io_uring engine reads and writes
+#ifdef HTTPD_URING
+  int           ops;      // ring operations that still refer to the connection
+  bool          recving;  // the multishot recv is armed
+  bool          canceling;// ... and asked to stop because the input is full
+  bool          eof;      // the ring saw the end of the input
+  bool          shut;     // dead, waiting for the ring to let go
+  bool          polling;  // tls: a one-shot poll for ready events is armed
+  bool          unpoll;   // ... and being removed because the events changed
+  short         ready;
+  int           sending;  // send and splice operations in flight
+  int           pipe[2];  // file ranges are spliced through it, -1 until needed
+  size_t        piped;    // bytes in the pipe
+  struct msghdr msg;
+  struct iovec  iov[16];
+#endif
+};
+
+enum
+{
+  HTTPTIMER_NONE,
+  HTTPTIMER_HANDSHAKE,
+  HTTPTIMER_HEADER,
+  HTTPTIMER_BODY,
+  HTTPTIMER_IDLE,
+  HTTPTIMER_WRITE,
+  HTTPTIMER_UPSTREAM
+};
+
+struct _HttpChannel
+{
+  Httpd*        server;
+  HttpConn*     clients;
+  int           n_clients;
+  size_t        maxQueued;
+  int           policy;
+  unsigned int  lastId;
+  unsigned int  n_dropped;
+};
+
+static void httpconn_expired( void* _owner );
+static bool http2_blocked( Http2Session* _s );
+
+static HttpConn* httpconn_open( Httpd* _server, int _socket, const HttpTlsBackend* _tls, void* _session )
+{
+  HttpConn* conn = (HttpConn*) calloc(1,sizeof(HttpConn));
+  if (conn)
+  {
+    conn->server = _server;
+    conn->netsocket = _socket;
+    conn->tls = _tls;
+    conn->tlsSession = _session;
+    conn->timer.expired = httpconn_expired;
+    conn->timer.owner = conn;
+    conn->ring = 0 != _server->ring && 0 == _tls;
+#ifdef HTTPD_URING
+    conn->pipe[0] = conn->pipe[1] = -1;
+#endif
+    conn->next = _server->conns;
+    if (conn->next) conn->next->prev = conn;
+    _server->conns = conn;
+    _server->n_conns++;
+  }
+  return conn;
+}
+
+// take the socket (and tls session) away from a request
+static HttpConn* httpconn_create( Httpd* _server, HttpResponse* _context )
+{
+  HttpConn* conn = _context->conn;
+  if (conn)
+  {
+    // the connection changes hands together with whatever is queued
+    conn->response = 0;
+    _context->conn = 0;
+    return conn;
+  }
+  conn = httpconn_open(_server, _context->netsocket, _context->tls, _context->tlsSession);
+  if (conn)
+  {
+    _context->netsocket = -1;
+    _context->tls = 0;
+    _context->tlsSession = 0;
+  }
+  return conn;
+}
+
+static void httpchannel_link( HttpChannel* _channel, HttpConn* _conn )
+{
+  _conn->channel = _channel;
+  _conn->chnext = _channel->clients;
+  if (_conn->chnext) _conn->chnext->chprev = _conn;
+  _channel->clients = _conn;
+  _channel->n_clients++;
+}
+
+static void httpchannel_unlink( HttpConn* _conn )
+{
+  HttpChannel* channel = _conn->channel;
+  if (channel)
+  {
+    if (_conn->chprev) _conn->chprev->chnext = _conn->chnext;
+    else channel->clients = _conn->chnext;
+    if (_conn->chnext) _conn->chnext->chprev = _conn->chprev;
+    channel->n_clients--;
+    _conn->channel = 0;
+    _conn->chnext = _conn->chprev = 0;
+  }
+}
+
+static void httpwebsocket_release( HttpWebSocket* _ws );
+static void http2_release( Http2Session* _s );
+static void httprelay_detach( HttpConn* _conn );
+static void httprelay_expired( HttpConn* _conn );
+static int httprelay_timeout( HttpConn* _conn );
+static bool httpd_throttle( HttpConn* _conn, const char* _head, size_t _size, unsigned int* _retry );
+static bool httpfetch_event( HttpConn* _conn, short _events );
+static short httpfetch_events( HttpConn* _conn );
+static void httpfetch_finish( HttpConn* _conn, bool _ok );
+
+// connections are only marked here and released at the end of httpd_process,
+// so callbacks may close any connection while the server iterates over them
+static void httpconn_close( HttpConn* _conn )
+{
+  httpchannel_unlink(_conn);
+  _conn->dead = true;
+}
+
+static void httpconn_destroy( HttpConn* _conn )
+{
+  httpchannel_unlink(_conn);
+  httpwheel_remove(&_conn->server->wheel, &_conn->timer);
+  if (_conn->ws)
+  {
+    httpwebsocket_release(_conn->ws);
+  }
+  if (_conn->h2)
+  {
+    http2_release(_conn->h2);
+  }
+  if (_conn->relay)
+  {
+    httprelay_detach(_conn);
+  }
+  if (_conn->fetch)
+  {
+    httpfetch_finish(_conn, false);
+  }
+  if (_conn->response)
+  {
+    HttpResponse* response = _conn->response;
+    _conn->response = 0;
+    response->conn = 0;
+    httpresponse_destroy(response);
+  }
+  
+  if (_conn->prev) _conn->prev->next = _conn->next;
+  else _conn->server->conns = _conn->next;
+  if (_conn->next) _conn->next->prev = _conn->prev;
+  _conn->server->n_conns--;
+  if (_conn->inflight) _conn->server->inflight--;
+  
+  while (_conn->head)
+  {
+    HttpSegment* seg = _conn->head;
+    _conn->head = seg->next;
+    httpsegment_free(seg);
+  }
+  net_close(_conn->netsocket, _conn->tls, _conn->tlsSession);
+#ifdef HTTPD_URING
+  if (_conn->pipe[0] >= 0)
+  {
+    close(_conn->pipe[0]);
+    close(_conn->pipe[1]);
+  }
+#endif
+  free(_conn->in);
+  free(_conn);
+}
+
+// write as much of the queue as the socket accepts without blocking.
+// returns false if the connection is dead.
+static bool httpconn_flush( HttpConn* _conn )
+{
+  // the io_uring engine sends the queue once per loop iteration
+  if (_conn->ring) return true;
+  while (_conn->head)
+  {
+    HttpSegment* seg = _conn->head;
+    if (seg->buffer)
+    {
+      int ret = net_send(_conn->netsocket, _conn->tls, _conn->tlsSession, seg->buffer->data + seg->offset, (int)(seg->buffer->size - seg->offset));
+      if (ret == SOCKET_ERROR)
+      {
+        return would_block();
+      }
+      seg->offset += ret;
+      _conn->queued -= ret;
+      _conn->progress = true;
+      if (seg->offset < seg->buffer->size)
+      {
+        return true; // socket buffer is full
+      }
+    }
+    else
+    {
+      long ret = net_sendfile(_conn->netsocket, _conn->tls, _conn->tlsSession, seg->fd, seg->fileOffset + seg->offset, seg->fileSize - seg->offset);
+      if (ret == SOCKET_ERROR)
+      {
+        return would_block();
+      }
+      seg->offset += ret;
+      _conn->progress = true;
+      if (seg->offset < seg->fileSize)
+      {
+        continue; // the bounce buffer sends in pieces, ask again
+      }
+    }
+    _conn->head = seg->next;
+    if (0 == _conn->head) _conn->tail = 0;
+    httpsegment_free(seg);
+  }
+  return true;
+}
+
+// reads of the connection's protocol handlers. with the io_uring engine the
+// ring reads the socket and everything it got is in _conn->in already.
+static int httpconn_recv( HttpConn* _conn, void* _memory, int _size )
+{
+#ifdef HTTPD_URING
+  if (_conn->ring)
+  {
+    if (_conn->eof) return 0;
+    errno = EAGAIN;
+    return SOCKET_ERROR;
+  }
+#endif
+  return net_recv(_conn->netsocket, _conn->tls, _conn->tlsSession, _memory, _size);
+}
+
+// pick the deadline that matters for the state the connection is in.
+// header and body deadlines are absolute, idle and write deadlines move
+// with every bit of progress.
+static void httpconn_schedule( HttpConn* _conn )
+{
+  if (_conn->dead) return;
+  
+  int timeout = HTTPTIMER_NONE;
+  int ms = 0;
+  if (_conn->relay && (ms = httprelay_timeout(_conn)))
+  {
+    // the upstream's own deadlines, or the client holding up a relay
+    timeout = _conn->kind == HTTPCONN_UPSTREAM ? HTTPTIMER_UPSTREAM : HTTPTIMER_WRITE;
+  }
+  else if (_conn->head)
+  {
+    timeout = HTTPTIMER_WRITE;
+    ms = HTTPD_SEND_TIMEOUT;
+  }
+  else if (_conn->kind == HTTPCONN_REQUEST && 0 == _conn->response && !_conn->closing)
+  {
+    if (_conn->handshake)
+    {
+      timeout = HTTPTIMER_HANDSHAKE;
+      ms = HTTPD_TLS_HANDSHAKE_TIMEOUT;
+    }
+    else if (_conn->expect)
+    {
+      timeout = HTTPTIMER_BODY;
+      ms = HTTPD_BODY_TIMEOUT;
+    }
+    else if (_conn->inLength || !_conn->served)
+    {
+      timeout = HTTPTIMER_HEADER;
+      ms = HTTPD_HEADER_TIMEOUT;
+    }
+    else
+    {
+      timeout = HTTPTIMER_IDLE;
+      ms = _conn->server->draining ? HTTPD_DRAIN_IDLE_TIMEOUT : HTTPD_IDLE_TIMEOUT;
+    }
+  }
+  else if (_conn->h2 && http2_blocked(_conn->h2))
+  {
+    // the peer holds up a stream with its flow control window
+    timeout = HTTPTIMER_WRITE;
+    ms = HTTPD_SEND_TIMEOUT;
+  }
+  else if (_conn->kind == HTTPCONN_HTTP2)
+  {
+    timeout = HTTPTIMER_IDLE;
+    ms = HTTPD_IDLE_TIMEOUT;
+  }
+  else if (_conn->fetch)
+  {
+    timeout = HTTPTIMER_UPSTREAM;
+    ms = HTTPD_FETCH_TIMEOUT;
+  }
+  
+  bool rearm = timeout != _conn->timeout || _conn->progress ||
+               (timeout == HTTPTIMER_IDLE && _conn->kind == HTTPCONN_HTTP2);
+  _conn->progress = false;
+  if (!rearm) return;
+  _conn->timeout = timeout;
+  Httpd* server = _conn->server;
+  if (timeout == HTTPTIMER_NONE)
+  {
+    httpwheel_remove(&server->wheel, &_conn->timer);
+  }
+  else
+  {
+    // rounded up, a timeout never fires early
+    httpwheel_add(&server->wheel, &_conn->timer, (server->now + ms) / HTTPD_TIMER_TICK + 1);
+  }
+}
+
+static void httpconn_expired( void* _owner )
+{
+  HttpConn* conn = (HttpConn*)_owner;
+  if (conn->timeout == HTTPTIMER_HEADER || conn->timeout == HTTPTIMER_BODY)
+  {
+    // best effort, the client isn't going to wait for it anyway
+    char timeout[HTTPD_CLOSING_HEAD];
+    size_t len = httpd_closing_head(timeout, 408, 0);
+    net_send(conn->netsocket, conn->tls, conn->tlsSession, timeout, (int)len);
+  }
+  if (conn->relay)
+  {
+    httprelay_expired(conn);
+  }
+  if (conn->fetch)
+  {
+    httpfetch_finish(conn, false);
+  }
+  conn->timeout = HTTPTIMER_NONE;
+  httpconn_close(conn);
+}
+
+static bool httpconn_enqueue( HttpConn* _conn, HttpSegment* _seg )
+{
+  _seg->next = 0;
+  _seg->offset = 0;
+  if (_conn->tail) _conn->tail->next = _seg;
+  else _conn->head = _seg;
+  _conn->tail = _seg;
+  if (_conn->head != _seg) return true;
+  // an idle connection writes immediately, only the remainder stays queued
+  bool alive = httpconn_flush(_conn);
+  httpconn_schedule(_conn);
+  return alive;
+}
+
+// queue a reference to _buffer. the caller keeps its own reference.
+static bool httpconn_push( HttpConn* _conn, HttpBuffer* _buffer )
+{
+  HttpSegment* seg = (HttpSegment*) calloc(1,sizeof(HttpSegment));
+  if (0 == seg) return false;
+  _buffer->refs++;
+  seg->buffer = _buffer;
+  _conn->queued += _buffer->size;
+  return httpconn_enqueue(_conn, seg);
+}
+
+// copy _memory to the end of the queue. small writes are collected in the
+// last buffer as long as nobody else holds a reference to it.
+static bool httpconn_append( HttpConn* _conn, const void* _memory, size_t _size )
+{
+  HttpSegment* tail = _conn->tail;
+  if (tail && tail->buffer && 1 == tail->buffer->refs && tail->buffer->capacity - tail->buffer->size >= _size)
+  {
+    memcpy(tail->buffer->data + tail->buffer->size, _memory, _size);
+    tail->buffer->size += _size;
+    _conn->queued += _size;
+    return true;
+  }
+  HttpBuffer* buf = httpbuffer_create(_size < 16*1024 ? 16*1024 : _size);
+  if (0 == buf) return false;
+  memcpy(buf->data, _memory, _size);
+  buf->size = _size;
+  bool ok = httpconn_push(_conn, buf);
+  httpbuffer_release(buf);
+  return ok;
+}
+
+// write what the socket takes right now and queue the rest. this never
+// waits for the client: httpresponse_write keeps the queue near the high
+// watermark, the other callers write bounded amounts.
+static int httpconn_write( HttpConn* _conn, const void* _memory, size_t _size )
+{
+  const char* p = (const char*)_memory;
+  size_t left = _size;
+  bool failed = false;
+  while (left && 0 == _conn->head && !_conn->ring && !_conn->dead)
+  {
+    int ret = net_send(_conn->netsocket, _conn->tls, _conn->tlsSession, p, (int)left);
+    if (ret == SOCKET_ERROR && !would_block()) failed = true;
+    if (ret <= 0) break;
+    p += ret;
+    left -= ret;
+  }
+  if (failed || _conn->dead || (left && !httpconn_append(_conn, p, left)))
+  {
+    httpconn_close(_conn);
+    return -1;
+  }
+  return (int)_size;
+}
+
+// like httpconn_write, but what the socket doesn't take right away is queued
+// as a reference to _memory, without waiting for the high watermark
+static bool httpconn_write_static( HttpConn* _conn, const void* _memory, size_t _size )
+{
+  const char* p = (const char*)_memory;
+  while (_size && 0 == _conn->head && !_conn->ring && !_conn->dead)
+  {
+    int ret = net_send(_conn->netsocket, _conn->tls, _conn->tlsSession, p, (int)_size);
+    if (ret == SOCKET_ERROR && !would_block()) break;
+    if (ret <= 0) break;
+    p += ret;
+    _size -= ret;
+  }
+  if (0 == _size) return true;
+  
+  HttpBuffer* buf = _conn->dead ? 0 : httpbuffer_borrow(p, _size);
+  bool ok = buf && httpconn_push(_conn, buf);
+  if (buf) httpbuffer_release(buf);
+  if (!ok) httpconn_close(_conn);
+  return ok;
+}
+
+static bool httpconn_sendfile( HttpConn* _conn, int _fd, off_t _offset, size_t _size )
+{
+  HttpSegment* seg = (HttpSegment*) calloc(1,sizeof(HttpSegment));
+  if (0 == seg) return false;
+#ifdef WIN32
+  seg->fd = _dup(_fd);
+#else
+  seg->fd = dup(_fd);
+#endif
+  if (seg->fd < 0)
+  {
+    free(seg);
+    return false;
+  }
+  seg->fileOffset = _offset;
+  seg->fileSize = _size;
+  if (!httpconn_enqueue(_conn, seg))
+  {
+    httpconn_close(_conn);
+    return false;
+  }
+  return true;
+}
+
+// the response is complete: wait for the next request on a keep-alive
+// connection, close any other once the queue is drained
+static void httpconn_finish( HttpConn* _conn, bool _keepalive )
+{
+  _conn->response = 0;
+  if (_conn->kind == HTTPCONN_REQUEST && _keepalive && !_conn->closing && !_conn->server->draining)
+  {
+    httpconn_schedule(_conn);
+    return;
+  }
+  _conn->closing = true;
+  if (0 == _conn->head)
+  {
+    httpconn_close(_conn);
+  }
+}
+
+// a request stops counting against the in-flight limit once its response is
+// sent completely, or when the connection turned into a long-lived stream
+static void httpconn_settle( HttpConn* _conn )
+{
+  if (_conn->inflight && _conn->kind != HTTPCONN_PROXY && (_conn->kind != HTTPCONN_REQUEST || (0 == _conn->response && 0 == _conn->head)))
+  {
+    _conn->inflight = false;
+    _conn->server->inflight--;
+  }
+}
+
+// answered without parsing anything, straight from accept or before dispatch
+static const char httpd_unavailable[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Server: " HTTPD_SERVER "\r\n"
+  "Retry-After: " HTTPD_RETRY_AFTER "\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+// admission control for a complete request: the in-flight limit first (unless
+// the connection is _counted already), then how long the request waited since
+// the event loop could have seen it
+static bool httpd_admit( Httpd* _server, bool _counted )
+{
+  bool admit = _counted || 0 == _server->maxInflight || _server->inflight < _server->maxInflight;
+  if (admit && _server->codel.target)
+  {
+    uint64_t now = httpd_clock();
+    admit = !httpcodel_shed(&_server->codel, now, now - _server->arrival);
+  }
+  if (!admit) _server->shed++;
+  return admit;
+}
+
+// the server takes over the socket, the response writes through its queue
+static HttpConn* httpresponse_connection( HttpResponse* _context )
+{
+  if (0 == _context->conn)
+  {
+    HttpConn* conn = httpconn_create(_context->server, _context);
+    if (0 == conn) return 0;
+    conn->kind = HTTPCONN_STREAM;
+    conn->response = _context;
+    _context->conn = conn;
+  }
+  return _context->conn;
+}
+
+// event channels
+
+HTTPD_C_API HttpChannel* httpchannel_create( Httpd* _server, size_t _maxQueuedBytes, int _policy )
+{
+  HttpChannel* channel = (HttpChannel*) calloc(1,sizeof(HttpChannel));
+  if (channel)
+  {
+    channel->server = _server;
+    channel->maxQueued = _maxQueuedBytes ? _maxQueuedBytes : 64 * 1024;
+    channel->policy = _policy;
+  }
+  return channel;
+}
+
+HTTPD_C_API void httpchannel_destroy( HttpChannel* _channel )
+{
+  if (_channel)
+  {
+    while (_channel->clients)
+    {
+      httpconn_close(_channel->clients);
+    }
+    free(_channel);
+  }
+}
+
+HTTPD_C_API int httpchannel_get_n_clients( HttpChannel* _channel )
+{
+  return _channel->n_clients;
+}
+
+HTTPD_C_API unsigned int httpchannel_get_n_dropped( HttpChannel* _channel )
+{
+  return _channel->n_dropped;
+}
+
+HTTPD_C_API bool httpresponse_subscribe( HttpResponse* _context, HttpChannel* _channel, bool _longpoll )
+{
+  if (_context->h2)
+  {
+    // the connection is shared with other streams
+    httpresponse_response(_context, 505, 0, 0, 0);
+    return false;
+  }
+  if (!_longpoll)
+  {
+    static const char header[] =
+      "HTTP/1.1 200 OK\r\n"
+      "Server: " HTTPD_SERVER "\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Content-Type: text/event-stream\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+    if (httpresponse_send(_context, header, sizeof(header)-1) < 0)
+    {
+      return false;
+    }
+  }
+
+  // from now on the socket belongs to the channel
+  HttpConn* conn = httpconn_create(_channel->server, _context);
+  if (0 == conn)
+  {
+    return false;
+  }
+  conn->kind = HTTPCONN_STREAM;
+  conn->longpoll = _longpoll;
+  httpchannel_link(_channel, conn);
+  return true;
+}
+
+// "data: " prefix for every line of the payload. CR, LF and CRLF all end a
+// line of an event stream, each one starts a new "data: " line
+static size_t sse_format( char* _output, const char* _event, unsigned int _id, const char* _data, size_t _size )
+{
+  size_t o = 0;
+  char num[16];
+  int len = sprintf(num, "%u", _id);
+  
+#define SSE_PUT(p,n) do { if (_output) memcpy(_output+o,(p),(n)); o += (n); } while(0)
+  SSE_PUT("id: ",4);
+  SSE_PUT(num,len);
+  SSE_PUT("\n",1);
+  if (_event)
+  {
+    SSE_PUT("event: ",7);
+    SSE_PUT(_event,strlen(_event));
+    SSE_PUT("\n",1);
+  }
+  size_t start = 0;
+  for (size_t i=0; i<=_size; ++i)
+  {
+    if (i == _size || _data[i] == '\n' || _data[i] == '\r')
+    {
+      SSE_PUT("data: ",6);
+      SSE_PUT(_data+start,i-start);
+      SSE_PUT("\n",1);
+      if (i+1 < _size && _data[i] == '\r' && _data[i+1] == '\n') ++i;
+      start = i+1;
+    }
+  }
+  SSE_PUT("\n",1);
+#undef SSE_PUT
+  return o;
+}
+
+static HttpBuffer* websocket_frame( int _opcode, const void* _data, size_t _size );
+static bool header_has_token( const char* _value, const char* _token );
+
+HTTPD_C_API int httpchannel_broadcast( HttpChannel* _channel, const char* _event, const char* _data, size_t _size )
+{
+  if (0 == _data) _data = "";
+  if (0 == _size) _size = strlen(_data);
+  // a line break in the name would start fields or events of its own
+  if (_event && _event[strcspn(_event, "\r\n")]) return -1;
+  
+  unsigned int id = ++_channel->lastId;
+  HttpBuffer* stream = 0;
+  HttpBuffer* single = 0;
+  HttpBuffer* frame = 0;
+  int reached = 0;
+  
+  HttpConn* next;
+  for (HttpConn* conn = _channel->clients; conn; conn = next)
+  {
+    next = conn->chnext;
+    HttpBuffer* buf;
+    
+    if (conn->longpoll)
+    {
+      if (0 == single)
+      {
+        char header[256];
+        int len = sprintf(header, "HTTP/1.1 200 OK\r\n"
+                          "Server: " HTTPD_SERVER "\r\n"
+                          "Cache-Control: no-cache\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: %u\r\n"
+                          "Connection: close\r\n"
+                          "\r\n", (unsigned int)_size);
+        single = httpbuffer_create(len+_size);
+        if (0 == single) break;
+        memcpy(single->data, header, len);
+        memcpy(single->data+len, _data, _size);
+      }
+      buf = single;
+    }
+    else if (conn->kind == HTTPCONN_WEBSOCKET)
+    {
+      if (0 == frame)
+      {
+        frame = websocket_frame(HTTPWS_TEXT, _data, _size);
+        if (0 == frame) break;
+      }
+      buf = frame;
+    }
+    else
+    {
+      if (0 == stream)
+      {
+        stream = httpbuffer_create(sse_format(0, _event, id, _data, _size));
+        if (0 == stream) break;
+        sse_format(stream->data, _event, id, _data, _size);
+      }
+      buf = stream;
+    }
+    
+    // backpressure: a client that can't keep up either loses this event or
+    // the whole connection, but never makes the server wait for it
+    if (conn->queued + buf->size > _channel->maxQueued)
+    {
+      _channel->n_dropped++;
+      if (_channel->policy == HTTPCHANNEL_DROP_CLIENT)
+      {
+        httpconn_close(conn);
+      }
+      continue;
+    }
+    
+    if (!httpconn_push(conn, buf))
+    {
+      httpconn_close(conn);
+      continue;
+    }
+    
+    if (conn->longpoll)
+    {
+      // one answer per long-poll request
+      httpchannel_unlink(conn);
+      conn->closing = true;
+      if (0 == conn->head)
+      {
+        httpconn_close(conn);
+      }
+    }
+    ++reached;
+  }
+  
+  httpbuffer_release(stream);
+  httpbuffer_release(single);
+  httpbuffer_release(frame);
+  return reached;
+}
+
+
+// websockets (RFC 6455)
+
+#define HTTPWS_MAX_MESSAGE (1024*1024)
+
+struct _HttpWebSocket
+{
+  HttpConn*             conn;
+  HttpWebSocketHandler  handler;
+  void*                 userdata;
+  int                   opcode;   // opcode of the fragmented message in progress
+  char*                 message;  // reassembly buffer for fragmented messages
+  size_t                messageLength;
+  size_t                messageSize;
+  bool                  closeSent;
+};
+
+static unsigned int rol32( unsigned int _x, int _n )
+{
+  return (_x << _n) | (_x >> (32 - _n));
+}
+
+static void sha1_block( unsigned int _h[5], const unsigned char* _p )
+{
+  unsigned int w[80];
+  for (int i=0; i<16; ++i)
+  {
+    w[i] = (unsigned int)_p[i*4]<<24 | (unsigned int)_p[i*4+1]<<16 | (unsigned int)_p[i*4+2]<<8 | _p[i*4+3];
+  }
+  for (int i=16; i<80; ++i)
+  {
+    w[i] = rol32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+  }
+  unsigned int a = _h[0], b = _h[1], c = _h[2], d = _h[3], e = _h[4];
+  for (int i=0; i<80; ++i)
+  {
+    unsigned int f, k;
+    if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5a827999; }
+    else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ed9eba1; }
+    else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+    else             { f = b ^ c ^ d;                   k = 0xca62c1d6; }
+    unsigned int t = rol32(a, 5) + f + e + k + w[i];
+    e = d; d = c; c = rol32(b, 30); b = a; a = t;
+  }
+  _h[0] += a; _h[1] += b; _h[2] += c; _h[3] += d; _h[4] += e;
+}
+
+// only used for the handshake, the input is a few dozen bytes
+static void sha1( const void* _data, size_t _size, unsigned char _digest[20] )
+{
+  unsigned int h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  const unsigned char* p = (const unsigned char*) _data;
+  size_t i = 0;
+  for (; i + 64 <= _size; i += 64)
+  {
+    sha1_block(h, p + i);
+  }
+  unsigned char tail[128];
+  size_t rest = _size - i;
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, p + i, rest);
+  tail[rest] = 0x80;
+  size_t blocks = rest + 9 > 64 ? 2 : 1;
+  unsigned long long bits = (unsigned long long)_size * 8;
+  for (int j=0; j<8; ++j)
+  {
+    tail[blocks*64 - 1 - j] = (unsigned char)(bits >> (j*8));
+  }
+  for (size_t j=0; j<blocks; ++j)
+  {
+    sha1_block(h, tail + j*64);
+  }
+  for (int j=0; j<20; ++j)
+  {
+    _digest[j] = (unsigned char)(h[j/4] >> (24 - (j%4)*8));
+  }
+}
+
+static size_t base64_encode( char* _output, const unsigned char* _input, size_t _size )
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for (size_t i=0; i<_size; i+=3)
+  {
+    unsigned int v = _input[i] << 16;
+    if (i+1 < _size) v |= _input[i+1] << 8;
+    if (i+2 < _size) v |= _input[i+2];
+    _output[o++] = alphabet[(v >> 18) & 63];
+    _output[o++] = alphabet[(v >> 12) & 63];
+    _output[o++] = i+1 < _size ? alphabet[(v >> 6) & 63] : '=';
+    _output[o++] = i+2 < _size ? alphabet[v & 63] : '=';
+  }
+  _output[o] = 0;
+  return o;
+}
+
+// xor the payload with the rotating 4 byte key. the key pattern repeats
+// every 4 bytes, so it is widened once and applied a word (or vector) at a time.
+static void websocket_unmask( unsigned char* _data, size_t _size, const unsigned char _mask[4] )
+{
+  size_t i = 0;
+  if (_size >= 8)
+  {
+    unsigned char pattern[8];
+    for (int j=0; j<8; ++j) pattern[j] = _mask[j & 3];
+    uint64_t key;
+    memcpy(&key, pattern, 8);
+#ifdef __SSE2__
+    __m128i key128 = _mm_set1_epi64x((long long)key);
+    for (; i + 16 <= _size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*)(_data + i));
+      _mm_storeu_si128((__m128i*)(_data + i), _mm_xor_si128(v, key128));
+    }
+#endif
+    for (; i + 8 <= _size; i += 8)
+    {
+      uint64_t v;
+      memcpy(&v, _data + i, 8);
+      v ^= key;
+      memcpy(_data + i, &v, 8);
+    }
+  }
+  for (; i < _size; ++i)
+  {
+    _data[i] ^= _mask[i & 3];
+  }
+}
+
+static HttpBuffer* websocket_frame( int _opcode, const void* _data, size_t _size )
+{
+  size_t h = _size < 126 ? 2 : _size < 65536 ? 4 : 10;
+  HttpBuffer* buf = httpbuffer_create(h + _size);
+  if (buf)
+  {
+    unsigned char* p = (unsigned char*) buf->data;
+    p[0] = (unsigned char)(0x80 | _opcode);
+    if (h == 2)
+    {
+      p[1] = (unsigned char)_size;
+    }
+    else if (h == 4)
+    {
+      p[1] = 126;
+      p[2] = (unsigned char)(_size >> 8);
+      p[3] = (unsigned char)_size;
+    }
+    else
+    {
+      p[1] = 127;
+      for (int i=0; i<8; ++i)
+      {
+        p[9-i] = (unsigned char)((unsigned long long)_size >> (i*8));
+      }
+    }
+    if (_size)
+    {
+      memcpy(p + h, _data, _size);
+    }
+  }
+  return buf;
+}
+
+HTTPD_C_API bool httpwebsocket_send( HttpWebSocket* _ws, int _opcode, const void* _data, size_t _size )
+{
+  if (_ws->closeSent || _ws->conn->dead) return false;
+  HttpBuffer* frame = websocket_frame(_opcode, _data, _size);
+  if (0 == frame) return false;
+  bool result = httpconn_push(_ws->conn, frame);
+  httpbuffer_release(frame);
+  if (!result)
+  {
+    httpconn_close(_ws->conn);
+  }
+  return result;
+}
+
+HTTPD_C_API void httpwebsocket_close( HttpWebSocket* _ws, unsigned short _status, const char* _reason )
+{
+  if (!_ws->closeSent)
+  {
+    char payload[125];
+    size_t len = 0;
+    if (_status)
+    {
+      payload[0] = (char)(_status >> 8);
+      payload[1] = (char)_status;
+      len = 2;
+      if (_reason)
+      {
+        size_t rlen = strlen(_reason);
+        if (rlen > sizeof(payload) - 2) rlen = sizeof(payload) - 2;
+        memcpy(payload + 2, _reason, rlen);
+        len += rlen;
+      }
+    }
+    httpwebsocket_send(_ws, HTTPWS_CLOSE, payload, len);
+    _ws->closeSent = true;
+  }
+  // the socket is closed after the close frame went out
+  _ws->conn->closing = true;
+  httpchannel_unlink(_ws->conn);
+}
+
+HTTPD_C_API bool httpwebsocket_join( HttpWebSocket* _ws, HttpChannel* _channel )
+{
+  if (_ws->conn->dead || _ws->closeSent) return false;
+  httpchannel_unlink(_ws->conn);
+  httpchannel_link(_channel, _ws->conn);
+  return true;
+}
+
+static void httpwebsocket_release( HttpWebSocket* _ws )
+{
+  _ws->handler(_ws, HTTPWS_CLOSE, 0, 0, _ws->userdata);
+  free(_ws->message);
+  free(_ws);
+}
+
+static bool httpwebsocket_append( HttpWebSocket* _ws, const void* _data, size_t _size )
+{
+  if (_ws->messageLength + _size > HTTPWS_MAX_MESSAGE) return false;
+  if (_ws->messageLength + _size > _ws->messageSize)
+  {
+    size_t size = _ws->messageSize ? _ws->messageSize : 4096;
+    while (size < _ws->messageLength + _size) size *= 2;
+    char* message = (char*) realloc(_ws->message, size);
+    if (0 == message) return false;
+    _ws->message = message;
+    _ws->messageSize = size;
+  }
+  memcpy(_ws->message + _ws->messageLength, _data, _size);
+  _ws->messageLength += _size;
+  return true;
+}
+
+// consume one frame from _p. returns the size of the frame, 0 if the frame
+// is still incomplete or minus the close status on a protocol violation.
+static long websocket_parse( HttpWebSocket* _ws, unsigned char* _p, size_t _n )
+{
+  if (_n < 2) return 0;
+  bool fin = 0 != (_p[0] & 0x80);
+  int opcode = _p[0] & 0x0f;
+  if (_p[0] & 0x70) return -1002;  // no extensions negotiated
+  if (0 == (_p[1] & 0x80)) return -1002;  // clients must mask
+  
+  unsigned long long len = _p[1] & 0x7f;
+  size_t h = 2;
+  if (len == 126)
+  {
+    if (_n < 4) return 0;
+    len = (unsigned long long)_p[2] << 8 | _p[3];
+    h = 4;
+  }
+  else if (len == 127)
+  {
+    if (_n < 10) return 0;
+    len = 0;
+    for (int i=2; i<10; ++i) len = len << 8 | _p[i];
+    h = 10;
+  }
+  if (len > HTTPWS_MAX_MESSAGE) return -1009;
+  h += 4;
+  if (_n < h + len) return 0;
+  
+  unsigned char* payload = _p + h;
+  size_t size = (size_t)len;
+  websocket_unmask(payload, size, _p + h - 4);
+  
+  if (opcode >= HTTPWS_CLOSE)
+  {
+    if (!fin || size > 125) return -1002;
+  }
+  
+  switch (opcode)
+  {
+    case HTTPWS_CLOSE:
+      if (!_ws->closeSent)
+      {
+        unsigned short status = size >= 2 ? (unsigned short)(payload[0] << 8 | payload[1]) : 1000;
+        httpwebsocket_close(_ws, status, 0);
+      }
+      break;
+    case HTTPWS_PING:
+      httpwebsocket_send(_ws, HTTPWS_PONG, payload, size);
+      break;
+    case HTTPWS_PONG:
+      break;
+    case HTTPWS_TEXT:
+    case HTTPWS_BINARY:
+      if (_ws->opcode) return -1002;  // previous message isn't finished
+      if (fin)
+      {
+        // unfragmented messages are delivered straight from the receive buffer
+        _ws->handler(_ws, opcode, payload, size, _ws->userdata);
+      }
+      else
+      {
+        _ws->opcode = opcode;
+        _ws->messageLength = 0;
+        if (!httpwebsocket_append(_ws, payload, size)) return -1009;
+      }
+      break;
+    case HTTPWS_CONTINUATION:
+      if (0 == _ws->opcode) return -1002;
+      if (!httpwebsocket_append(_ws, payload, size)) return -1009;
+      if (fin)
+      {
+        int type = _ws->opcode;
+        _ws->opcode = 0;
+        _ws->handler(_ws, type, _ws->message, _ws->messageLength, _ws->userdata);
+      }
+      break;
+    default:
+      return -1002;
+  }
+  return (long)(h + size);
+}
+
+// read until the socket is drained: a tls session may hold decrypted bytes
+// that poll() doesn't know about
+static bool httpwebsocket_read( HttpConn* _conn )
+{
+  // frames that arrived right behind the upgrade request come first
+  while (!_conn->dead && !_conn->ws->closeSent)
+  {
+    size_t used = 0;
+    while (!_conn->dead && !_conn->ws->closeSent)
+    {
+      long n = websocket_parse(_conn->ws, (unsigned char*)_conn->in + used, _conn->inLength - used);
+      if (n == 0) break;
+      if (n < 0)
+      {
+        httpwebsocket_close(_conn->ws, (unsigned short)-n, 0);
+        break;
+      }
+      used += n;
+    }
+    if (used)
+    {
+      _conn->inLength -= used;
+      memmove(_conn->in, _conn->in + used, _conn->inLength);
+    }
+    if (_conn->dead || _conn->ws->closeSent) break;
+    
+    if (_conn->inLength == _conn->inSize)
+    {
+      // a frame is only processed when it's complete, grow up to the message
+      // limit plus the largest frame header
+      if (_conn->inSize >= HTTPWS_MAX_MESSAGE + 14) return false;
+      size_t size = _conn->inSize ? _conn->inSize * 2 : 4096;
+      if (size > HTTPWS_MAX_MESSAGE + 14) size = HTTPWS_MAX_MESSAGE + 14;
+      char* in = (char*) realloc(_conn->in, size);
+      if (0 == in) return false;
+      _conn->in = in;
+      _conn->inSize = size;
+    }
+    
+    int ret = httpconn_recv(_conn, _conn->in + _conn->inLength, (int)(_conn->inSize - _conn->inLength));
+    if (ret == 0) return false;
+    if (ret == SOCKET_ERROR) return would_block();
+    _conn->inLength += ret;
+  }
+  return true;
+}
+
+HTTPD_C_API HttpWebSocket* httpresponse_websocket( HttpResponse* _context, HttpWebSocketHandler _handler, void* _userdata )
+{
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  const char* upgrade = httpresponse_get_header(_context, "Upgrade");
+  const char* connection = httpresponse_get_header(_context, "Connection");
+  const char* key = httpresponse_get_header(_context, "Sec-WebSocket-Key");
+  const char* version = httpresponse_get_header(_context, "Sec-WebSocket-Version");
+  
+  if (_context->h2)
+  {
+    httpresponse_response(_context, 505, 0, 0, 0);
+    return 0;
+  }
+  if (0 == _context->server || 0 == upgrade || 0 == key || strlen(key) > 64 || 0 != strcasecmp(upgrade, "websocket")
+      || !header_has_token(connection, "upgrade"))
+  {
+    httpresponse_response(_context, 400, "websocket upgrade expected", 0, 0);
+    return 0;
+  }
+  if (0 == version || 0 != strcmp(version, "13"))
+  {
+    httpresponse_response(_context, 400, 0, 0, "Sec-WebSocket-Version: 13\r\n");
+    return 0;
+  }
+  
+  char text[128];
+  unsigned char digest[20];
+  char accept[32];
+  sprintf(text, "%s%s", key, guid);
+  sha1(text, strlen(text), digest);
+  base64_encode(accept, digest, sizeof(digest));
+  
+  HttpWebSocket* ws = (HttpWebSocket*) calloc(1,sizeof(HttpWebSocket));
+  if (0 == ws) return 0;
+  
+  char header[256];
+  int len = sprintf(header, "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: %s\r\n"
+                    "\r\n", accept);
+  HttpConn* conn = 0;
+  if (httpresponse_send(_context, header, len) == len)
+  {
+    conn = httpconn_create(_context->server, _context);
+  }
+  if (0 == conn)
+  {
+    free(ws);
+    return 0;
+  }
+  conn->kind = HTTPCONN_WEBSOCKET;
+  conn->ws = ws;
+  ws->conn = conn;
+  ws->handler = _handler;
+  ws->userdata = _userdata;
+  return ws;
+}
+
+// http/2 (RFC 7540) with HPACK header compression (RFC 7541).
+// every stream is turned back into an HTTP/1.1 request for the handler, and
+// whatever the handler writes is translated into HEADERS and DATA frames.
+
+#define HTTP2_DATA          0
+#define HTTP2_HEADERS       1
+#define HTTP2_PRIORITY      2
+#define HTTP2_RST_STREAM    3
+#define HTTP2_SETTINGS      4
+#define HTTP2_PUSH_PROMISE  5
+#define HTTP2_PING          6
+#define HTTP2_GOAWAY        7
+#define HTTP2_WINDOW_UPDATE 8
+#define HTTP2_CONTINUATION  9
+
+#define HTTP2_END_STREAM    0x01
+#define HTTP2_ACK           0x01
+#define HTTP2_END_HEADERS   0x04
+#define HTTP2_PADDED        0x08
+#define HTTP2_PRIORITY_FLAG 0x20
+
+#define HTTP2_NO_ERROR            0x0
+#define HTTP2_PROTOCOL_ERROR      0x1
+#define HTTP2_INTERNAL_ERROR      0x2
+#define HTTP2_FLOW_CONTROL_ERROR  0x3
+#define HTTP2_STREAM_CLOSED       0x5
+#define HTTP2_FRAME_SIZE_ERROR    0x6
+#define HTTP2_REFUSED_STREAM      0x7
+#define HTTP2_CANCEL              0x8
+#define HTTP2_COMPRESSION_ERROR   0x9
+
+#define HTTP2_MAX_FRAME       16384
+#define HTTP2_MAX_STREAMS     100
+#define HTTP2_MAX_HEADERS     (64*1024)   // decoded header block
+#define HTTP2_MAX_BODY        (1024*1024)
+#define HTTP2_DEFAULT_WINDOW  65535
+#define HTTP2_TABLE_SIZE      4096
+
+static const char http2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static const unsigned int hpack_huffman_codes[257] =
+{
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+  0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+  0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+  0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+  0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+  0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+  0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+  0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+  0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+  0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+  0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+  0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+  0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+  0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+  0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+  0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+  0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+  0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+  0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+  0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+  0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+  0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+  0x3fffffff
+};
+
+static const unsigned char hpack_huffman_lengths[257] =
+{
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+// canonical decoding: symbols ordered by code, and per code length the
+// first code and its position in that order
+
+static const unsigned short hpack_huffman_symbols[257] =
+{
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+  52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+  110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+  119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+  43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+  179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+  163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+  158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+  144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+  212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+  2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+  256
+};
+
+static const unsigned int hpack_huffman_first[31] =
+{
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c,
+  0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc,
+  0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+  0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc
+};
+
+static const unsigned short hpack_huffman_offset[31] =
+{
+  0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92,
+  0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253
+};
+
+static const unsigned short hpack_huffman_count[31] =
+{
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const char* const hpack_static[61][2] =
+{
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+  { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+  { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+  { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+  { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+  { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+  { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+  { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+  { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+  { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+  { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+  { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+  { "www-authenticate", "" }
+};
+
+typedef struct
+{
+  char*   name;     // name and value share one allocation
+  char*   value;
+  size_t  size;     // name + value + 32, see RFC 7541 4.1
+} HpackEntry;
+
+typedef struct
+{
+  HpackEntry* entries;  // newest first
+  int         count;
+  int         capacity;
+  size_t      size;
+  size_t      maxSize;
+} HpackTable;
+
+static void hpack_evict( HpackTable* _table, size_t _room )
+{
+  while (_table->count && _table->size + _room > _table->maxSize)
+  {
+    HpackEntry* e = &_table->entries[--_table->count];
+    _table->size -= e->size;
+    free(e->name);
+  }
+}
+
+static void hpack_insert( HpackTable* _table, const char* _name, const char* _value )
+{
+  size_t nl = strlen(_name);
+  size_t vl = strlen(_value);
+  size_t size = nl + vl + 32;
+  if (size > _table->maxSize)
+  {
+    // an entry that doesn't fit empties the table
+    hpack_evict(_table, _table->maxSize + 1);
+    return;
+  }
+  hpack_evict(_table, size);
+  if (_table->count == _table->capacity)
+  {
+    int capacity = _table->capacity ? _table->capacity * 2 : 16;
+    HpackEntry* entries = (HpackEntry*) realloc(_table->entries, capacity * sizeof(HpackEntry));
+    if (0 == entries) return;
+    _table->entries = entries;
+    _table->capacity = capacity;
+  }
+  char* mem = (char*) malloc(nl + vl + 2);
+  if (0 == mem) return;
+  memcpy(mem, _name, nl + 1);
+  memcpy(mem + nl + 1, _value, vl + 1);
+  memmove(_table->entries + 1, _table->entries, _table->count * sizeof(HpackEntry));
+  _table->entries[0].name = mem;
+  _table->entries[0].value = mem + nl + 1;
+  _table->entries[0].size = size;
+  _table->count++;
+  _table->size += size;
+}
+
+static void hpack_free( HpackTable* _table )
+{
+  hpack_evict(_table, _table->maxSize + 1);
+  free(_table->entries);
+}
+
+// 1..61 static table, 62.. dynamic table
+static bool hpack_get( HpackTable* _table, unsigned int _index, const char** _name, const char** _value )
+{
+  if (_index >= 1 && _index <= 61)
+  {
+    *_name = hpack_static[_index-1][0];
+    *_value = hpack_static[_index-1][1];
+    return true;
+  }
+  if (_index > 61 && _index - 62 < (unsigned int)_table->count)
+  {
+    *_name = _table->entries[_index-62].name;
+    *_value = _table->entries[_index-62].value;
+    return true;
+  }
+  return false;
+}
+
+static bool hpack_decode_int( const unsigned char** _p, const unsigned char* _end, int _prefix, unsigned int* _value )
+{
+  const unsigned char* p = *_p;
+  if (p >= _end) return false;
+  unsigned int max = (1u << _prefix) - 1;
+  unsigned int v = *p++ & max;
+  if (v == max)
+  {
+    int shift = 0;
+    unsigned char b;
+    do
+    {
+      if (p >= _end || shift > 21) return false;
+      b = *p++;
+      v += (unsigned int)(b & 127) << shift;
+      shift += 7;
+    }
+    while (b & 128);
+  }
+  *_p = p;
+  *_value = v;
+  return true;
+}
+
+static bool hpack_huffman_decode( HttpBytes* _out, const unsigned char* _p, size_t _size )
+{
+  unsigned int code = 0;
+  int len = 0;
+  for (size_t i=0; i<_size; ++i)
+  {
+    for (int bit=7; bit>=0; --bit)
+    {
+      code = code << 1 | ((_p[i] >> bit) & 1);
+      if (++len > 30) return false;
+      unsigned int n = code - hpack_huffman_first[len];
+      if (n < hpack_huffman_count[len])
+      {
+        unsigned short sym = hpack_huffman_symbols[hpack_huffman_offset[len] + n];
+        if (sym == 256) return false; // EOS must not appear
+        char c = (char)sym;
+        if (!httpbytes_append(_out, &c, 1)) return false;
+        code = 0;
+        len = 0;
+      }
+    }
+  }
+  // the padding is a prefix of EOS: less than a byte of 1 bits
+  return len < 8 && code == (1u << len) - 1;
+}
+
+// append the string literal at *_p to _out, zero terminated
+static bool hpack_decode_string( const unsigned char** _p, const unsigned char* _end, HttpBytes* _out )
+{
+  if (*_p >= _end) return false;
+  bool huffman = 0 != (**_p & 0x80);
+  unsigned int len;
+  if (!hpack_decode_int(_p, _end, 7, &len) || len > (size_t)(_end - *_p)) return false;
+  bool ok = huffman ? hpack_huffman_decode(_out, *_p, len) : httpbytes_append(_out, *_p, len);
+  *_p += len;
+  return ok && httpbytes_append(_out, "", 1);
+}
+
+typedef void (*HpackField)( void* _user, const char* _name, const char* _value );
+
+static bool hpack_decode( HpackTable* _table, HttpBytes* _scratch, const unsigned char* _p, size_t _size, HpackField _field, void* _user )
+{
+  const unsigned char* end = _p + _size;
+  size_t total = 0;
+  while (_p < end)
+  {
+    unsigned char b = *_p;
+    unsigned int index;
+    const char* name;
+    const char* value;
+    
+    if (b & 0x80)
+    {
+      // indexed header field
+      if (!hpack_decode_int(&_p, end, 7, &index) || !hpack_get(_table, index, &name, &value)) return false;
+      _field(_user, name, value);
+      total += strlen(name) + strlen(value) + 32;
+    }
+    else if ((b & 0xe0) == 0x20)
+    {
+      // dynamic table size update
+      if (!hpack_decode_int(&_p, end, 5, &index) || index > HTTP2_TABLE_SIZE) return false;
+      _table->maxSize = index;
+      hpack_evict(_table, 0);
+    }
+    else
+    {
+      // literal, with incremental indexing (01), without (0000) or never indexed (0001)
+      bool indexing = (b & 0xc0) == 0x40;
+      if (!hpack_decode_int(&_p, end, indexing ? 6 : 4, &index)) return false;
+      _scratch->length = 0;
+      if (index)
+      {
+        if (!hpack_get(_table, index, &name, &value)) return false;
+        if (!httpbytes_append(_scratch, name, strlen(name) + 1)) return false;
+      }
+      else if (!hpack_decode_string(&_p, end, _scratch))
+      {
+        return false;
+      }
+      size_t valueOffset = _scratch->length;
+      if (!hpack_decode_string(&_p, end, _scratch)) return false;
+      name = _scratch->data;
+      value = _scratch->data + valueOffset;
+      if (indexing)
+      {
+        hpack_insert(_table, name, value);
+      }
+      _field(_user, name, value);
+      total += _scratch->length + 30;
+    }
+    if (total > HTTP2_MAX_HEADERS) return false;
+  }
+  return true;
+}
+
+static void hpack_encode_int( HttpBytes* _out, unsigned char _first, int _prefix, unsigned int _value )
+{
+  unsigned int max = (1u << _prefix) - 1;
+  unsigned char b;
+  if (_value < max)
+  {
+    b = (unsigned char)(_first | _value);
+    httpbytes_append(_out, &b, 1);
+    return;
+  }
+  b = (unsigned char)(_first | max);
+  httpbytes_append(_out, &b, 1);
+  _value -= max;
+  while (_value >= 128)
+  {
+    b = (unsigned char)((_value & 127) | 128);
+    httpbytes_append(_out, &b, 1);
+    _value >>= 7;
+  }
+  b = (unsigned char)_value;
+  httpbytes_append(_out, &b, 1);
+}
+
+// huffman coded if that is shorter
+static void hpack_encode_string( HttpBytes* _out, const char* _text )
+{
+  const unsigned char* s = (const unsigned char*)_text;
+  size_t n = strlen(_text);
+  size_t bits = 0;
+  for (size_t i=0; i<n; ++i) bits += hpack_huffman_lengths[s[i]];
+  size_t hlen = (bits + 7) / 8;
+  
+  if (hlen >= n)
+  {
+    hpack_encode_int(_out, 0x00, 7, (unsigned int)n);
+    httpbytes_append(_out, _text, n);
+    return;
+  }
+  
+  hpack_encode_int(_out, 0x80, 7, (unsigned int)hlen);
+  uint64_t acc = 0;
+  int nbits = 0;
+  for (size_t i=0; i<n; ++i)
+  {
+    acc = acc << hpack_huffman_lengths[s[i]] | hpack_huffman_codes[s[i]];
+    nbits += hpack_huffman_lengths[s[i]];
+    while (nbits >= 8)
+    {
+      nbits -= 8;
+      unsigned char b = (unsigned char)(acc >> nbits);
+      httpbytes_append(_out, &b, 1);
+    }
+    acc &= ((uint64_t)1 << nbits) - 1;
+  }
+  if (nbits)
+  {
+    unsigned char b = (unsigned char)(acc << (8 - nbits) | (0xff >> nbits));
+    httpbytes_append(_out, &b, 1);
+  }
+}
+
+static void hpack_encode_field( HpackTable* _table, HttpBytes* _out, const char* _name, const char* _value, bool _index )
+{
+  unsigned int nameIndex = 0;
+  for (int i=0; i<_table->count; ++i)
+  {
+    if (0 == strcmp(_table->entries[i].name, _name))
+    {
+      if (0 == strcmp(_table->entries[i].value, _value))
+      {
+        hpack_encode_int(_out, 0x80, 7, 62 + i);
+        return;
+      }
+      if (0 == nameIndex) nameIndex = 62 + i;
+    }
+  }
+  for (int i=0; i<61; ++i)
+  {
+    if (0 == strcmp(hpack_static[i][0], _name))
+    {
+      if (0 == strcmp(hpack_static[i][1], _value))
+      {
+        hpack_encode_int(_out, 0x80, 7, i + 1);
+        return;
+      }
+      if (0 == nameIndex || nameIndex > 61) nameIndex = i + 1;
+    }
+  }
+  
+  hpack_encode_int(_out, _index ? 0x40 : 0x00, _index ? 6 : 4, nameIndex);
+  if (0 == nameIndex)
+  {
+    hpack_encode_string(_out, _name);
+  }
+  hpack_encode_string(_out, _value);
+  if (_index)
+  {
+    hpack_insert(_table, _name, _value);
+  }
+}
+
+struct _Http2Stream
+{
+  Http2Stream*  next;
+  unsigned int  id;
+  HttpBytes     method;     // pseudo headers
+  HttpBytes     path;
+  HttpBytes     authority;
+  HttpBytes     head;       // regular headers as HTTP/1.1 lines
+  HttpBytes     cookie;
+  HttpBytes     body;
+  bool          remoteClosed;
+  HttpBytes     response;   // HTTP/1.1 response head until it is complete
+  bool          headersSent;
+  HttpBytes     pending;    // response data waiting for the flow control window
+  size_t        pendingOffset;
+  long          sendWindow;
+  bool          endPending;
+  bool          endSent;
+  HttpResponse* context;    // the stream's response while its handler runs or waits
+};
+
+struct _Http2Session
+{
+  HttpConn*     conn;
+  bool          preface;        // client connection preface received
+  HpackTable    decoder;
+  HpackTable    encoder;
+  bool          tableUpdate;    // encoder table size changed, tell the peer
+  HttpBytes     out;            // frames not yet queued on the connection
+  HttpBytes     scratch;
+  HttpBytes     block;          // header block fragments
+  unsigned int  blockStream;
+  bool          blockEndStream;
+  Http2Stream*  streams;
+  int           n_streams;
+  unsigned int  lastStream;
+  long          sendWindow;
+  long          peerWindow;     // SETTINGS_INITIAL_WINDOW_SIZE of the peer
+  unsigned int  peerMaxFrame;
+};
+
+static void http2_frame( Http2Session* _s, int _type, int _flags, unsigned int _stream, const void* _payload, size_t _length )
+{
+  unsigned char h[9];
+  h[0] = (unsigned char)(_length >> 16);
+  h[1] = (unsigned char)(_length >> 8);
+  h[2] = (unsigned char)_length;
+  h[3] = (unsigned char)_type;
+  h[4] = (unsigned char)_flags;
+  h[5] = (unsigned char)((_stream >> 24) & 0x7f);
+  h[6] = (unsigned char)(_stream >> 16);
+  h[7] = (unsigned char)(_stream >> 8);
+  h[8] = (unsigned char)_stream;
+  httpbytes_append(&_s->out, h, 9);
+  if (_length)
+  {
+    httpbytes_append(&_s->out, _payload, _length);
+  }
+}
+
+static void http2_frame_u32( Http2Session* _s, int _type, unsigned int _stream, unsigned int _value )
+{
+  unsigned char p[4] = { (unsigned char)(_value >> 24), (unsigned char)(_value >> 16), (unsigned char)(_value >> 8), (unsigned char)_value };
+  http2_frame(_s, _type, 0, _stream, p, 4);
+}
+
+// hand the collected frames to the connection's output queue
+static void http2_commit( Http2Session* _s )
+{
+  if (0 == _s->out.length || _s->conn->dead) return;
+  HttpBuffer* buf = httpbuffer_create(_s->out.length);
+  if (buf)
+  {
+    memcpy(buf->data, _s->out.data, _s->out.length);
+    if (!httpconn_push(_s->conn, buf))
+    {
+      httpconn_close(_s->conn);
+    }
+    httpbuffer_release(buf);
+  }
+  _s->out.length = 0;
+}
+
+static void http2_goaway( Http2Session* _s, unsigned int _error )
+{
+  unsigned char p[8] =
+  {
+    (unsigned char)(_s->lastStream >> 24), (unsigned char)(_s->lastStream >> 16), (unsigned char)(_s->lastStream >> 8), (unsigned char)_s->lastStream,
+    (unsigned char)(_error >> 24), (unsigned char)(_error >> 16), (unsigned char)(_error >> 8), (unsigned char)_error
+  };
+  http2_frame(_s, HTTP2_GOAWAY, 0, 0, p, 8);
+  // without an error the client finishes its streams and closes the connection
+  if (_error) _s->conn->closing = true;
+}
+
+static Http2Stream* http2_stream( Http2Session* _s, unsigned int _id )
+{
+  for (Http2Stream* st = _s->streams; st; st = st->next)
+  {
+    if (st->id == _id) return st;
+  }
+  return 0;
+}
+
+static void http2_stream_free( Http2Session* _s, Http2Stream* _st )
+{
+  for (Http2Stream** p = &_s->streams; *p; p = &(*p)->next)
+  {
+    if (*p == _st)
+    {
+      *p = _st->next;
+      _s->n_streams--;
+      break;
+    }
+  }
+  httpbytes_free(&_st->method);
+  httpbytes_free(&_st->path);
+  httpbytes_free(&_st->authority);
+  httpbytes_free(&_st->head);
+  httpbytes_free(&_st->cookie);
+  httpbytes_free(&_st->body);
+  httpbytes_free(&_st->response);
+  httpbytes_free(&_st->pending);
+  if (_st->context)
+  {
+    // reset or the session went away while the response waited
+    HttpResponse* response = _st->context;
+    _st->context = 0;
+    response->h2stream = 0;
+    httpresponse_destroy(response);
+  }
+  free(_st);
+}
+
+static void http2_reset( Http2Session* _s, Http2Stream* _st, unsigned int _id, unsigned int _error )
+{
+  http2_frame_u32(_s, HTTP2_RST_STREAM, _id, _error);
+  if (_st)
+  {
+    http2_stream_free(_s, _st);
+  }
+}
+
+// send as much pending data as both flow control windows allow
+static void http2_flush_stream( Http2Session* _s, Http2Stream* _st )
+{
+  for (;;)
+  {
+    size_t left = _st->pending.length - _st->pendingOffset;
+    if (0 == left) break;
+    long window = _s->sendWindow < _st->sendWindow ? _s->sendWindow : _st->sendWindow;
+    if (window <= 0) return;
+    size_t n = left;
+    if (n > (size_t)window) n = (size_t)window;
+    if (n > _s->peerMaxFrame) n = _s->peerMaxFrame;
+    bool last = _st->endPending && n == left;
+    http2_frame(_s, HTTP2_DATA, last ? HTTP2_END_STREAM : 0, _st->id, _st->pending.data + _st->pendingOffset, n);
+    _st->pendingOffset += n;
+    _s->sendWindow -= (long)n;
+    _st->sendWindow -= (long)n;
+    _st->endSent = last;
+  }
+  _st->pending.length = 0;
+  _st->pendingOffset = 0;
+  if (_st->endPending && !_st->endSent)
+  {
+    http2_frame(_s, HTTP2_DATA, HTTP2_END_STREAM, _st->id, 0, 0);
+    _st->endSent = true;
+  }
+}
+
+// a stream that has data but no window to send it in
+static bool http2_blocked( Http2Session* _s )
+{
+  for (Http2Stream* st = _s->streams; st; st = st->next)
+  {
+    if (st->pending.length > st->pendingOffset && (_s->sendWindow <= 0 || st->sendWindow <= 0)) return true;
+  }
+  return false;
+}
+
+static void http2_flush( Http2Session* _s )
+{
+  Http2Stream* next;
+  for (Http2Stream* st = _s->streams; st; st = next)
+  {
+    next = st->next;
+    http2_flush_stream(_s, st);
+    if (st->endSent)
+    {
+      http2_stream_free(_s, st);
+    }
+  }
+}
+
+// translate an HTTP/1.1 response head into a HEADERS frame
+static void http2_headers( Http2Session* _s, Http2Stream* _st, char* _head )
+{
+  HttpBytes block = { 0, 0, 0 };
+  if (_s->tableUpdate)
+  {
+    hpack_encode_int(&block, 0x20, 5, (unsigned int)_s->encoder.maxSize);
+    _s->tableUpdate = false;
+  }
+  
+  char status[4] = "500";
+  char* sp = strchr(_head, ' ');
+  if (sp && strlen(sp) > 3)
+  {
+    memcpy(status, sp + 1, 3);
+  }
+  hpack_encode_field(&_s->encoder, &block, ":status", status, false);
+  
+  char* line = strstr(_head, "\r\n");
+  while (line && line[2] != '\r' && line[2])
+  {
+    char* name = line + 2;
+    line = strstr(name, "\r\n");
+    if (0 == line) break;
+    *line = 0;
+    char* colon = strchr(name, ':');
+    if (0 == colon) continue;
+    *colon = 0;
+    char* value = colon + 1;
+    while (*value == ' ') ++value;
+    for (char* c = name; *c; ++c)
+    {
+      if (*c >= 'A' && *c <= 'Z') *c += 'a' - 'A';
+    }
+    // connection specific headers are not allowed in http/2
+    if (0 == strcmp(name, "connection") || 0 == strcmp(name, "transfer-encoding") ||
+        0 == strcmp(name, "keep-alive") || 0 == strcmp(name, "upgrade") || 0 == strcmp(name, "proxy-connection"))
+    {
+      *line = '\r';
+      continue;
+    }
+    // values that change with every response would only flush the peer's table
+    bool index = 0 != strcmp(name, "content-length") && 0 != strcmp(name, "date") && 0 != strcmp(name, "etag");
+    hpack_encode_field(&_s->encoder, &block, name, value, index);
+    *line = '\r';
+  }
+  
+  size_t offset = 0;
+  int type = HTTP2_HEADERS;
+  do
+  {
+    size_t n = block.length - offset;
+    if (n > _s->peerMaxFrame) n = _s->peerMaxFrame;
+    http2_frame(_s, type, offset + n == block.length ? HTTP2_END_HEADERS : 0, _st->id, block.data + offset, n);
+    offset += n;
+    type = HTTP2_CONTINUATION;
+  }
+  while (offset < block.length);
+  httpbytes_free(&block);
+  _st->headersSent = true;
+}
+
+static int http2_write( HttpResponse* _context, const void* _memory, int _size )
+{
+  Http2Session* s = _context->h2;
+  Http2Stream* st = _context->h2stream;
+  const char* data = (const char*)_memory;
+  size_t size = _size;
+  if (0 == st) return -1;  // the stream is gone
+  
+  if (!st->headersSent)
+  {
+    if (!httpbytes_append(&st->response, data, size) || !httpbytes_append(&st->response, "", 1)) return -1;
+    st->response.length--;
+    char* eoh = strstr(st->response.data, "\r\n\r\n");
+    if (0 == eoh)
+    {
+      return _size;
+    }
+    eoh[2] = 0;
+    http2_headers(s, st, st->response.data);
+    data = eoh + 4;
+    size = st->response.data + st->response.length - data;
+  }
+  
+  if (size && !httpbytes_append(&st->pending, data, size)) return -1;
+  httpbytes_free(&st->response);
+  // small writes are collected into full frames, http2_end sends the rest
+  if (st->pending.length - st->pendingOffset >= s->peerMaxFrame)
+  {
+    http2_flush_stream(s, st);
+  }
+  // the frames move on to the connection's queue, which drains from the loop
+  if (s->out.length > s->conn->server->lowWater)
+  {
+    http2_commit(s);
+  }
+  return _size;
+}
+
+static void http2_end( HttpResponse* _context )
+{
+  Http2Session* s = _context->h2;
+  Http2Stream* st = _context->h2stream;
+  if (0 == st || st->endPending) return;
+  if (!st->headersSent)
+  {
+    // the handler didn't produce a (complete) response
+    char head[] = "HTTP/1.1 500 Internal Server Error\r\n";
+    http2_headers(s, st, head);
+  }
+  st->endPending = true;
+  http2_flush_stream(s, st);
+}
+
+static size_t httpresponse_queued( HttpResponse* _context );
+
+// a handler returned: its response is finished unless it waits for
+// httpresponse_on_writable, the stream goes once its end is sent
+static void http2_settle( Http2Session* _s, Http2Stream* _st )
+{
+  HttpResponse* response = _st->context;
+  if (response->writable || response->suspended)
+  {
+    // what the handler collected goes out while it waits
+    http2_flush_stream(_s, _st);
+    return;
+  }
+  _st->context = 0;
+  http2_end(response);
+  httpresponse_destroy(response);
+  if (_st->endSent)
+  {
+    http2_stream_free(_s, _st);
+  }
+}
+
+// a stream whose handler waits for httpresponse_on_writable and may go on
+static bool http2_ready( Http2Session* _s )
+{
+  for (Http2Stream* st = _s->streams; st; st = st->next)
+  {
+    if (st->context && st->context->writable && httpresponse_queued(st->context) <= _s->conn->server->lowWater) return true;
+  }
+  return false;
+}
+
+// call the writable handlers of the streams the peer's window and the
+// connection's queue have room for again
+static void http2_resume( Http2Session* _s )
+{
+  Http2Stream* next;
+  for (Http2Stream* st = _s->streams; st; st = next)
+  {
+    next = st->next;
+    HttpResponse* response = st->context;
+    if (0 == response || 0 == response->writable || httpresponse_queued(response) > _s->conn->server->lowWater) continue;
+    HttpWritableHandler handler = response->writable;
+    response->writable = 0;
+    handler(response, response->writableData);
+    http2_settle(_s, st);
+  }
+  http2_commit(_s);
+}
+
+static void http2_field( void* _user, const char* _name, const char* _value )
+{
+  Http2Stream* st = (Http2Stream*)_user;
+  if (0 == st) return;  // trailers and refused streams only keep the tables in sync
+  
+  if (_name[0] == ':')
+  {
+    HttpBytes* target = 0;
+    if (0 == strcmp(_name, ":method")) target = &st->method;
+    else if (0 == strcmp(_name, ":path")) target = &st->path;
+    else if (0 == strcmp(_name, ":authority")) target = &st->authority;
+    if (target && 0 == target->length)
+    {
+      httpbytes_append(target, _value, strlen(_value) + 1);
+    }
+  }
+  else if (0 == strcmp(_name, "cookie"))
+  {
+    // cookies may be split into several fields, HTTP/1.1 wants them joined
+    if (st->cookie.length) httpbytes_append(&st->cookie, "; ", 2);
+    httpbytes_append(&st->cookie, _value, strlen(_value));
+  }
+  else if (0 != strcmp(_name, "host") || 0 == st->authority.length)
+  {
+    // title case, like the HTTP/1.1 clients send them
+    size_t n = strlen(_name);
+    size_t at = st->head.length;
+    httpbytes_append(&st->head, _name, n);
+    for (size_t i=0; i<n; ++i)
+    {
+      char* c = st->head.data + at + i;
+      if ((0 == i || c[-1] == '-') && *c >= 'a' && *c <= 'z') *c -= 'a' - 'A';
+    }
+    httpbytes_append(&st->head, ": ", 2);
+    httpbytes_append(&st->head, _value, strlen(_value));
+    httpbytes_append(&st->head, "\r\n", 2);
+  }
+}
+
+static void http2_dispatch( Http2Session* _s, Http2Stream* _st, HttpResponse* _context )
+{
+  Httpd* server = _s->conn->server;
+  HttpResponse* req = _context;
+  
+  if (0 == req)
+  {
+    if (0 == _st->method.length || 0 == _st->path.length)
+    {
+      http2_reset(_s, _st, _st->id, HTTP2_PROTOCOL_ERROR);
+      return;
+    }
+    
+    // rebuild the request as HTTP/1.1 for the regular parser
+    HttpBytes text = { 0, 0, 0 };
+    httpbytes_append(&text, _st->method.data, _st->method.length - 1);
+    httpbytes_append(&text, " ", 1);
+    httpbytes_append(&text, _st->path.data, _st->path.length - 1);
+    httpbytes_append(&text, " HTTP/1.1\r\n", 11);
+    if (_st->authority.length)
+    {
+      httpbytes_append(&text, "Host: ", 6);
+      httpbytes_append(&text, _st->authority.data, _st->authority.length - 1);
+      httpbytes_append(&text, "\r\n", 2);
+    }
+    if (_st->cookie.length)
+    {
+      httpbytes_append(&text, "Cookie: ", 8);
+      httpbytes_append(&text, _st->cookie.data, _st->cookie.length);
+      httpbytes_append(&text, "\r\n", 2);
+    }
+    httpbytes_append(&text, _st->head.data, _st->head.length);
+    httpbytes_append(&text, "\r\n", 2);
+    httpbytes_append(&text, _st->body.data, _st->body.length);
+    if (!httpbytes_append(&text, "", 1))
+    {
+      httpbytes_free(&text);
+      http2_reset(_s, _st, _st->id, HTTP2_INTERNAL_ERROR);
+      return;
+    }
+    
+    req = httpresponse_create((unsigned int)-1);
+    if (req)
+    {
+      req->server = server;
+      req->h2 = _s;
+      req->h2stream = _st;
+      _st->context = req;
+      if (server->log)
+      {
+        req->began = httpd_micros();
+        req->wait = req->began > server->arrival * 1000 ? req->began - server->arrival * 1000 : 0;
+      }
+      unsigned int retry = 0;
+      if (server->limits && !httpd_throttle(_s->conn, text.data, text.length - 1, &retry))
+      {
+        char header[40];
+        sprintf(header, "Retry-After: %u\r\n", retry);
+        httpresponse_response(req, 429, 0, 0, header);
+      }
+      else if (httpresponse_parse_request(req, text.data, (int)text.length - 1))
+      {
+        if (httpd_admit(server, false))
+        {
+          server->handler(req, server->userdata);
+        }
+        else
+        {
+          httpresponse_response(req, 503, 0, 0, "Retry-After: " HTTPD_RETRY_AFTER "\r\n");
+        }
+      }
+    }
+    httpbytes_free(&text);
+  }
+  else
+  {
+    // the request that came in with an h2c upgrade
+    req->h2 = _s;
+    req->h2stream = _st;
+    server->handler(req, server->userdata);
+    http2_end(req);
+    req->h2 = 0;
+    req->h2stream = 0;
+  }
+  
+  if (!req)
+  {
+    http2_reset(_s, _st, _st->id, HTTP2_INTERNAL_ERROR);
+  }
+  else if (_st->context)
+  {
+    http2_settle(_s, _st);
+  }
+  else if (_st->endSent)
+  {
+    http2_stream_free(_s, _st);
+  }
+  http2_commit(_s);
+}
+
+static void http2_settings( Http2Session* _s, const unsigned char* _p, size_t _length )
+{
+  for (size_t i=0; i+6 <= _length; i+=6)
+  {
+    unsigned int id = _p[i] << 8 | _p[i+1];
+    unsigned int value = (unsigned int)_p[i+2] << 24 | _p[i+3] << 16 | _p[i+4] << 8 | _p[i+5];
+    switch (id)
+    {
+      case 1: // HEADER_TABLE_SIZE
+        if (value > HTTP2_TABLE_SIZE) value = HTTP2_TABLE_SIZE;
+        if (value != _s->encoder.maxSize)
+        {
+          _s->encoder.maxSize = value;
+          hpack_evict(&_s->encoder, 0);
+          _s->tableUpdate = true;
+        }
+        break;
+      case 4: // INITIAL_WINDOW_SIZE
+        if (value > 0x7fffffff)
+        {
+          http2_goaway(_s, HTTP2_FLOW_CONTROL_ERROR);
+          return;
+        }
+        for (Http2Stream* st = _s->streams; st; st = st->next)
+        {
+          st->sendWindow += (long)value - _s->peerWindow;
+        }
+        _s->peerWindow = value;
+        break;
+      case 5: // MAX_FRAME_SIZE
+        if (value < 16384 || value > 16777215)
+        {
+          http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+          return;
+        }
+        _s->peerMaxFrame = value;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+static Http2Stream* http2_open( Http2Session* _s, unsigned int _id )
+{
+  Http2Stream* st = (Http2Stream*) calloc(1,sizeof(Http2Stream));
+  if (st)
+  {
+    st->id = _id;
+    st->sendWindow = _s->peerWindow;
+    st->next = _s->streams;
+    _s->streams = st;
+    _s->n_streams++;
+  }
+  return st;
+}
+
+static void http2_end_headers( Http2Session* _s )
+{
+  unsigned int id = _s->blockStream;
+  _s->blockStream = 0;
+  
+  Http2Stream* st = http2_stream(_s, id);
+  bool trailers = st != 0;
+  if (0 == st && id > _s->lastStream)
+  {
+    _s->lastStream = id;
+    if (_s->n_streams < HTTP2_MAX_STREAMS)
+    {
+      st = http2_open(_s, id);
+    }
+  }
+  
+  if (!hpack_decode(&_s->decoder, &_s->scratch, (const unsigned char*)_s->block.data, _s->block.length, http2_field, trailers ? 0 : st))
+  {
+    http2_goaway(_s, HTTP2_COMPRESSION_ERROR);
+    return;
+  }
+  if (0 == st)
+  {
+    http2_reset(_s, 0, id, HTTP2_REFUSED_STREAM);
+    return;
+  }
+  if (_s->blockEndStream)
+  {
+    st->remoteClosed = true;
+    http2_dispatch(_s, st, 0);
+  }
+}
+
+static void http2_process_frame( Http2Session* _s, const unsigned char* _h, const unsigned char* _p )
+{
+  size_t length = (size_t)_h[0] << 16 | _h[1] << 8 | _h[2];
+  int type = _h[3];
+  int flags = _h[4];
+  unsigned int id = ((unsigned int)_h[5] << 24 | _h[6] << 16 | _h[7] << 8 | _h[8]) & 0x7fffffff;
+  
+  if (_s->blockStream && type != HTTP2_CONTINUATION)
+  {
+    http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+    return;
+  }
+  
+  // strip padding
+  if ((type == HTTP2_DATA || type == HTTP2_HEADERS) && (flags & HTTP2_PADDED))
+  {
+    if (0 == length || _p[0] >= length)
+    {
+      http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+      return;
+    }
+    length -= 1 + _p[0];
+    ++_p;
+  }
+  
+  switch (type)
+  {
+    case HTTP2_DATA:
+    {
+      size_t frameLength = (size_t)_h[0] << 16 | _h[1] << 8 | _h[2];
+      if (0 == id)
+      {
+        http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+        return;
+      }
+      // we don't limit uploads with flow control but with HTTP2_MAX_BODY,
+      // so every byte is credited back right away
+      if (frameLength)
+      {
+        http2_frame_u32(_s, HTTP2_WINDOW_UPDATE, 0, (unsigned int)frameLength);
+      }
+      Http2Stream* st = http2_stream(_s, id);
+      if (0 == st || st->remoteClosed)
+      {
+        http2_reset(_s, 0, id, HTTP2_STREAM_CLOSED);
+        return;
+      }
+      if (st->body.length + length > HTTP2_MAX_BODY)
+      {
+        http2_reset(_s, st, id, HTTP2_CANCEL);
+        return;
+      }
+      httpbytes_append(&st->body, _p, length);
+      if (flags & HTTP2_END_STREAM)
+      {
+        st->remoteClosed = true;
+        http2_dispatch(_s, st, 0);
+      }
+      else if (frameLength)
+      {
+        http2_frame_u32(_s, HTTP2_WINDOW_UPDATE, id, (unsigned int)frameLength);
+      }
+      break;
+    }
+    case HTTP2_HEADERS:
+      if (0 == (id & 1))
+      {
+        http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+        return;
+      }
+      if (flags & HTTP2_PRIORITY_FLAG)
+      {
+        if (length < 5)
+        {
+          http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+          return;
+        }
+        _p += 5;
+        length -= 5;
+      }
+      if (id <= _s->lastStream && 0 == http2_stream(_s, id))
+      {
+        http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+        return;
+      }
+      _s->block.length = 0;
+      _s->blockStream = id;
+      _s->blockEndStream = 0 != (flags & HTTP2_END_STREAM);
+      // fall through
+    case HTTP2_CONTINUATION:
+      if (id != _s->blockStream || _s->block.length + length > HTTP2_MAX_HEADERS)
+      {
+        http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+        return;
+      }
+      httpbytes_append(&_s->block, _p, length);
+      if (flags & HTTP2_END_HEADERS)
+      {
+        http2_end_headers(_s);
+      }
+      break;
+    case HTTP2_RST_STREAM:
+    {
+      Http2Stream* st = http2_stream(_s, id);
+      if (st) http2_stream_free(_s, st);
+      break;
+    }
+    case HTTP2_SETTINGS:
+      if (id || (length % 6))
+      {
+        http2_goaway(_s, HTTP2_PROTOCOL_ERROR);
+        return;
+      }
+      if (0 == (flags & HTTP2_ACK))
+      {
+        http2_settings(_s, _p, length);
+        http2_frame(_s, HTTP2_SETTINGS, HTTP2_ACK, 0, 0, 0);
+        http2_flush(_s);
+      }
+      break;
+    case HTTP2_PING:
+      if (length != 8)
+      {
+        http2_goaway(_s, HTTP2_FRAME_SIZE_ERROR);
+        return;
+      }
+      if (0 == (flags & HTTP2_ACK))
+      {
+        http2_frame(_s, HTTP2_PING, HTTP2_ACK, 0, _p, 8);
+      }
+      break;
+    case HTTP2_GOAWAY:
+      _s->conn->closing = true;
+      break;
+    case HTTP2_WINDOW_UPDATE:
+    {
+      if (length != 4)
+      {
+        http2_goaway(_s, HTTP2_FRAME_SIZE_ERROR);
+        return;
+      }
+      long increment = (long)(((unsigned int)_p[0] << 24 | _p[1] << 16 | _p[2] << 8 | _p[3]) & 0x7fffffff);
+      if (0 == id)
+      {
+        if (0 == increment || _s->sendWindow + increment > 0x7fffffffL)
+        {
+          http2_goaway(_s, HTTP2_FLOW_CONTROL_ERROR);
+          return;
+        }
+        _s->sendWindow += increment;
+      }
+      else
+      {
+        Http2Stream* st = http2_stream(_s, id);
+        if (st)
+        {
+          if (0 == increment || st->sendWindow + increment > 0x7fffffffL)
+          {
+            http2_reset(_s, st, id, HTTP2_FLOW_CONTROL_ERROR);
+            return;
+          }
+          st->sendWindow += increment;
+        }
+      }
+      http2_flush(_s);
+      break;
+    }
+    case HTTP2_PRIORITY:
+    case HTTP2_PUSH_PROMISE:
+    default:
+      // priorities are ignored, clients never push
+      break;
+  }
+}
+
+static bool http2_read( HttpConn* _conn )
+{
+  Http2Session* s = _conn->h2;
+  bool alive = true;
+  
+  // input that arrived with the request that started the session comes first
+  while (!_conn->dead && !_conn->closing)
+  {
+    const unsigned char* p = (const unsigned char*)_conn->in;
+    size_t used = 0;
+    if (!s->preface && _conn->inLength)
+    {
+      size_t n = _conn->inLength < 24 ? _conn->inLength : 24;
+      if (0 != memcmp(p, http2_preface, n))
+      {
+        alive = false;
+        break;
+      }
+      if (n == 24)
+      {
+        used = 24;
+        s->preface = true;
+      }
+    }
+    while (s->preface && !_conn->closing && _conn->inLength - used >= 9)
+    {
+      size_t length = (size_t)p[used] << 16 | p[used+1] << 8 | p[used+2];
+      if (length > HTTP2_MAX_FRAME)
+      {
+        http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+        break;
+      }
+      if (_conn->inLength - used < 9 + length) break;
+      http2_process_frame(s, p + used, p + used + 9);
+      used += 9 + length;
+    }
+    _conn->inLength -= used;
+    memmove(_conn->in, _conn->in + used, _conn->inLength);
+    http2_commit(s);
+    if (_conn->dead || _conn->closing) break;
+    
+    int ret = httpconn_recv(_conn, _conn->in + _conn->inLength, (int)(_conn->inSize - _conn->inLength));
+    if (ret == 0 || (ret == SOCKET_ERROR && !would_block()))
+    {
+      alive = false;
+      break;
+    }
+    if (ret == SOCKET_ERROR) break;
+    _conn->inLength += ret;
+  }
+  
+  http2_commit(s);
+  return alive;
+}
+
+static void http2_release( Http2Session* _s )
+{
+  while (_s->streams)
+  {
+    http2_stream_free(_s, _s->streams);
+  }
+  hpack_free(&_s->decoder);
+  hpack_free(&_s->encoder);
+  httpbytes_free(&_s->out);
+  httpbytes_free(&_s->scratch);
+  httpbytes_free(&_s->block);
+  free(_s);
+}
+
+// switch _conn to http/2 and greet the client with our SETTINGS
+static Http2Session* http2_start( HttpConn* _conn )
+{
+  Http2Session* s = (Http2Session*) calloc(1,sizeof(Http2Session));
+  if (0 == s) return 0;
+  if (_conn->inSize < 9 + HTTP2_MAX_FRAME)
+  {
+    char* in = (char*) realloc(_conn->in, 9 + HTTP2_MAX_FRAME);
+    if (0 == in)
+    {
+      free(s);
+      return 0;
+    }
+    _conn->in = in;
+    _conn->inSize = 9 + HTTP2_MAX_FRAME;
+  }
+  HttpConn* conn = _conn;
+  conn->kind = HTTPCONN_HTTP2;
+  conn->h2 = s;
+  s->conn = conn;
+  s->decoder.maxSize = HTTP2_TABLE_SIZE;
+  s->encoder.maxSize = HTTP2_TABLE_SIZE;
+  s->sendWindow = HTTP2_DEFAULT_WINDOW;
+  s->peerWindow = HTTP2_DEFAULT_WINDOW;
+  s->peerMaxFrame = HTTP2_MAX_FRAME;
+  
+  unsigned char settings[] =
+  {
+    0, 3, 0, 0, 0, HTTP2_MAX_STREAMS,       // MAX_CONCURRENT_STREAMS
+    0, 6, 0, 1, 0, 0                        // MAX_HEADER_LIST_SIZE 64k
+  };
+  http2_frame(s, HTTP2_SETTINGS, 0, 0, settings, sizeof(settings));
+  http2_commit(s);
+  return s;
+}
+
+static size_t base64url_decode( unsigned char* _output, const char* _input, size_t _size )
+{
+  size_t o = 0;
+  unsigned int v = 0;
+  int bits = 0;
+  for (const char* p = _input; *p && o < _size; ++p)
+  {
+    int d;
+    if (*p >= 'A' && *p <= 'Z') d = *p - 'A';
+    else if (*p >= 'a' && *p <= 'z') d = *p - 'a' + 26;
+    else if (*p >= '0' && *p <= '9') d = *p - '0' + 52;
+    else if (*p == '-' || *p == '+') d = 62;
+    else if (*p == '_' || *p == '/') d = 63;
+    else continue;
+    v = v << 6 | d;
+    bits += 6;
+    if (bits >= 8)
+    {
+      bits -= 8;
+      _output[o++] = (unsigned char)(v >> bits);
+    }
+  }
+  return o;
+}
+
+// HTTP/1.1 request with "Upgrade: h2c". returns false if it stays HTTP/1.1
+static bool http2_upgrade( HttpResponse* _context )
+{
+  const char* upgrade = httpresponse_get_header(_context, "Upgrade");
+  const char* settings = httpresponse_get_header(_context, "HTTP2-Settings");
+  if (0 == upgrade || 0 == settings || 0 == strstr(upgrade, "h2c") || 0 == _context->conn || _context->conn->tls) return false;
+  // a request body would have to be moved into the new stream, don't bother
+  if (0 == strcmp(_context->method, "POST")) return false;
+  
+  static const char switching[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+  // the connection changes hands with the 101 still queued, the frames follow it
+  if (httpresponse_send(_context, switching, sizeof(switching)-1) < 0) return true;
+  
+  HttpConn* conn = httpconn_create(_context->server, _context);
+  Http2Session* s = conn ? http2_start(conn) : 0;
+  if (0 == s)
+  {
+    if (conn) httpconn_close(conn);
+    return true;
+  }
+  unsigned char payload[256];
+  size_t length = base64url_decode(payload, settings, sizeof(payload));
+  http2_settings(s, payload, length - length % 6);
+  
+  // the upgraded request is stream 1, waiting for its response
+  s->lastStream = 1;
+  Http2Stream* st = http2_open(s, 1);
+  if (st)
+  {
+    st->remoteClosed = true;
+    http2_dispatch(s, st, _context);
+  }
+  // the client may have sent its preface right behind the request
+  if (!http2_read(conn))
+  {
+    httpconn_close(conn);
+  }
+  return true;
+}
+
+// output flow control for handlers that produce more than a client takes at once
+
+// what a response has waiting for the client: the connection's queue, and
+// for an http/2 stream the frames not yet queued and the data its flow
+// control window holds back
+static size_t httpresponse_queued( HttpResponse* _context )
+{
+  if (0 == _context->h2) return _context->conn ? _context->conn->queued : 0;
+  Http2Stream* st = _context->h2stream;
+  size_t queued = _context->h2->conn->queued + _context->h2->out.length;
+  return st ? queued + st->pending.length - st->pendingOffset : queued;
+}
+
+// the output is at the high watermark: the handler's copied writes take
+// nothing until the client catches up
+static bool httpresponse_full( HttpResponse* _context )
+{
+  HttpConn* conn = _context->h2 ? _context->h2->conn : _context->conn;
+  return !_context->discard && conn && httpresponse_queued(_context) >= conn->server->highWater;
+}
+
+HTTPD_C_API bool httpresponse_writable( HttpResponse* _context )
+{
+  HttpConn* conn = _context->h2 ? _context->h2->conn : _context->conn;
+  return 0 == conn || (!conn->dead && httpresponse_queued(_context) < conn->server->highWater);
+}
+
+// an http/2 stream can wait if it was dispatched as one, not the request an
+// h2c upgrade turned into stream 1
+static bool httpresponse_can_wait( HttpResponse* _context )
+{
+  if (_context->h2) return _context->h2stream && _context->h2stream->context == _context;
+  return _context->server && httpresponse_connection(_context);
+}
+
+HTTPD_C_API bool httpresponse_on_writable( HttpResponse* _context, HttpWritableHandler _handler, void* _userdata )
+{
+  if (!httpresponse_can_wait(_context))
+  {
+    return false;
+  }
+  _context->writable = _handler;
+  _context->writableData = _userdata;
+  _context->suspended = false;
+  return true;
+}
+
+HTTPD_C_API bool httpresponse_suspend( HttpResponse* _context )
+{
+  if (!httpresponse_can_wait(_context))
+  {
+    return false;
+  }
+  _context->suspended = true;
+  return true;
+}
+
+HTTPD_C_API void httpresponse_on_close( HttpResponse* _context, HttpWritableHandler _handler, void* _userdata )
+{
+  _context->closed = _handler;
+  _context->closedData = _userdata;
+}
+
+HTTPD_C_API const char* httpresponse_tls_info(HttpResponse* _context)
+{
+  HttpConn* conn = _context->h2 ? _context->h2->conn : _context->conn;
+  if (conn)
+  {
+    return conn->tls ? conn->tls->info(conn->tlsSession) : 0;
+  }
+  return _context->tls ? _context->tls->info(_context->tlsSession) : 0;
+}
+
+// HTTP/1.1 connections. requests are read without blocking and dispatched
+// when they are complete; keep-alive connections then wait for the next one.
+
+// is _token one of the comma separated values of a header?
+static bool header_has_token( const char* _value, const char* _token )
+{
+  size_t n = strlen(_token);
+  while (_value && *_value)
+  {
+    while (*_value == ' ' || *_value == ',') ++_value;
+    size_t len = strcspn(_value, ", ");
+    if (len == n && 0 == strncasecmp(_value, _token, n)) return true;
+    _value += len;
+  }
+  return false;
+}
+
+static void httpd_reject( HttpConn* _conn, int _code )
+{
+  char text[HTTPD_CLOSING_HEAD];
+  size_t len = httpd_closing_head(text, _code, 0);
+  httpconn_write(_conn, text, len);
+  httpconn_finish(_conn, false);
+}
+
+static void httpd_dispatch( HttpConn* _conn, size_t _size )
+{
+  Httpd* server = _conn->server;
+  
+  if (!httpd_admit(server, _conn->inflight))
+  {
+    _conn->inLength = 0;
+    httpconn_write(_conn, httpd_unavailable, sizeof(httpd_unavailable) - 1);
+    httpconn_finish(_conn, false);
+    return;
+  }
+  
+  // the parser works in place and needs a terminated copy
+  char* buffer = (char*) malloc(_size + 1);
+  HttpResponse* req = httpresponse_create((unsigned int)-1);
+  if (0 == buffer || 0 == req)
+  {
+    free(buffer);
+    free(req);
+    httpconn_close(_conn);
+    return;
+  }
+  memcpy(buffer, _conn->in, _size);
+  buffer[_size] = 0;
+  _conn->inLength -= _size;
+  memmove(_conn->in, _conn->in + _size, _conn->inLength);
+  _conn->expect = 0;
+  _conn->served = true;
+  _conn->timeout = HTTPTIMER_NONE;  // a pipelined request gets its own deadline
+  if (!_conn->inflight)
+  {
+    _conn->inflight = true;
+    server->inflight++;
+  }
+  
+  req->server = server;
+  req->conn = _conn;
+  _conn->response = req;
+  if (server->log)
+  {
+    req->began = httpd_micros();
+    req->wait = req->began > server->arrival * 1000 ? req->began - server->arrival * 1000 : 0;
+  }
+  if (httpresponse_parse_request(req, buffer, (int)_size))
+  {
+    req->keepalive = !server->draining && !header_has_token(httpresponse_get_header(req, "Connection"), "close");
+    if (!server->http2 || !http2_upgrade(req))
+    {
+      server->handler(req, server->userdata);
+    }
+  }
+  free(buffer);
+  
+  // a response waiting for its writable callback stays with the connection
+  if ((0 == req->writable && !req->suspended) || 0 == req->conn || req->conn->dead)
+  {
+    httpresponse_destroy(req);
+  }
+  httpconn_settle(_conn);
+}
+
+static uint64_t fnv1a( uint64_t _hash, const void* _data, size_t _size )
+{
+  const unsigned char* p = (const unsigned char*)_data;
+  for (size_t i = 0; i < _size; ++i)
+  {
+    _hash = (_hash ^ p[i]) * 0x100000001b3ull;
+  }
+  return _hash;
+}
+
+// access log. every thread that answers requests gets a ring of records of
+// its own (one producer, one consumer) that the writer thread empties with a
+// single writev for all of them. the request pays for a copy and a release
+// store; a full ring drops the record and counts it.
+
+#ifndef WIN32
+
+typedef struct _HttpLogRing HttpLogRing;
+
+struct _HttpLogRing
+{
+  HttpLogRing*  next;       // HttpLog.rings
+  pthread_t     thread;
+  unsigned int  head;       // the next record, written by the owning thread only
+  char          apart[60];  // head and tail live on cache lines of their own
+  unsigned int  tail;       // the first record not written, moved by the writer only
+  char          apart2[60];
+  unsigned long long dropped;
+  HttpLogRecord records[HTTPD_LOG_RING];
+};
+
+struct _HttpLog
+{
+  int           file;
+  unsigned long id;         // tells the thread local ring caches apart
+  HttpLogRing*  rings;      // prepended under the lock, read without it
+  pthread_mutex_t lock;
+  pthread_cond_t wake;      // httplog_close wakes the writer early
+  pthread_t     writer;
+  bool          stop;
+  unsigned long long lost;  // records a failed write took with it
+};
+
+static unsigned long httplog_ids;
+static __thread unsigned long httplog_owner;
+static __thread HttpLogRing* httplog_local;
+
+// the calling thread's ring, made the first time it logs
+static HttpLogRing* httplog_ring( HttpLog* _log )
+{
+  if (httplog_owner == _log->id) return httplog_local;
+  pthread_t self = pthread_self();
+  pthread_mutex_lock(&_log->lock);
+  HttpLogRing* ring = _log->rings;
+  while (ring && !pthread_equal(ring->thread, self)) ring = ring->next;
+  if (0 == ring && 0 != (ring = (HttpLogRing*) calloc(1,sizeof(HttpLogRing))))
+  {
+    ring->thread = self;
+    ring->next = _log->rings;
+    __atomic_store_n(&_log->rings, ring, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&_log->lock);
+  httplog_owner = _log->id;
+  httplog_local = ring;
+  return ring;
+}
+
+static bool writev_all( int _file, struct iovec* _iov, int _n )
+{
+  while (_n > 0)
+  {
+    ssize_t ret = writev(_file, _iov, _n);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return false;
+    for (; _n > 0 && (size_t)ret >= _iov->iov_len; ++_iov, --_n)
+    {
+      ret -= _iov->iov_len;
+    }
+    if (_n > 0)
+    {
+      _iov->iov_base = (char*)_iov->iov_base + ret;
+      _iov->iov_len -= ret;
+    }
+  }
+  return true;
+}
+
+// everything the rings have, one writev for up to 32 of them
+static void httplog_flush( HttpLog* _log )
+{
+  HttpLogRing* ring = __atomic_load_n(&_log->rings, __ATOMIC_ACQUIRE);
+  while (ring)
+  {
+    struct iovec iov[64];
+    HttpLogRing* batch[32];
+    unsigned int heads[32];
+    unsigned long long records = 0;
+    int n = 0, b = 0;
+    for (; ring && b < 32; ring = ring->next)
+    {
+      unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      unsigned int count = head - ring->tail;
+      if (0 == count) continue;
+      // the records up to the end of the ring, then the ones from its start
+      unsigned int from = ring->tail & (HTTPD_LOG_RING - 1);
+      unsigned int first = HTTPD_LOG_RING - from < count ? HTTPD_LOG_RING - from : count;
+      iov[n].iov_base = ring->records + from;
+      iov[n++].iov_len = first * sizeof(HttpLogRecord);
+      if (count > first)
+      {
+        iov[n].iov_base = ring->records;
+        iov[n++].iov_len = (count - first) * sizeof(HttpLogRecord);
+      }
+      batch[b] = ring;
+      heads[b++] = head;
+      records += count;
+    }
+    if (n && !writev_all(_log->file, iov, n))
+    {
+      __atomic_store_n(&_log->lost, _log->lost + records, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < b; ++i)
+    {
+      __atomic_store_n(&batch[i]->tail, heads[i], __ATOMIC_RELEASE);
+    }
+  }
+}
+
+static void* httplog_main( void* _log )
+{
+  HttpLog* log = (HttpLog*)_log;
+  pthread_mutex_lock(&log->lock);
+  while (!log->stop)
+  {
+    pthread_mutex_unlock(&log->lock);
+    httplog_flush(log);
+    pthread_mutex_lock(&log->lock);
+    if (log->stop) break;
+    // the producers never signal, that would cost them a system call
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += (HTTPD_LOG_INTERVAL % 1000) * 1000000L;
+    until.tv_sec += HTTPD_LOG_INTERVAL / 1000 + until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&log->wake, &log->lock, &until);
+  }
+  pthread_mutex_unlock(&log->lock);
+  // whatever came in until httplog_close
+  httplog_flush(log);
+  return 0;
+}
+
+HTTPD_C_API HttpLog* httplog_open( const char* _path )
+{
+  HttpLog* log = (HttpLog*) calloc(1,sizeof(HttpLog));
+  if (0 == log) return 0;
+  log->file = open(_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  struct stat st;
+  if (log->file >= 0 && 0 == fstat(log->file, &st) && 0 == st.st_size)
+  {
+    // a new file says what it holds
+    unsigned int header[4] = { 0, 0, HTTPLOG_VERSION, sizeof(HttpLogRecord) };
+    memcpy(header, "HTTPLOG", 8);
+    if (sizeof(header) != write(log->file, header, sizeof(header)))
+    {
+      close(log->file);
+      log->file = -1;
+    }
+  }
+  if (log->file < 0)
+  {
+    free(log);
+    return 0;
+  }
+  log->id = __atomic_add_fetch(&httplog_ids, 1, __ATOMIC_RELAXED);
+  pthread_mutex_init(&log->lock, 0);
+  pthread_cond_init(&log->wake, 0);
+  if (0 != pthread_create(&log->writer, 0, httplog_main, log))
+  {
+    pthread_cond_destroy(&log->wake);
+    pthread_mutex_destroy(&log->lock);
+    close(log->file);
+    free(log);
+    return 0;
+  }
+  return log;
+}
+
+HTTPD_C_API void httplog_close( HttpLog* _log )
+{
+  if (0 == _log) return;
+  pthread_mutex_lock(&_log->lock);
+  _log->stop = true;
+  pthread_cond_signal(&_log->wake);
+  pthread_mutex_unlock(&_log->lock);
+  pthread_join(_log->writer, 0);
+  while (_log->rings)
+  {
+    HttpLogRing* ring = _log->rings;
+    _log->rings = ring->next;
+    free(ring);
+  }
+  close(_log->file);
+  pthread_cond_destroy(&_log->wake);
+  pthread_mutex_destroy(&_log->lock);
+  free(_log);
+}
+
+HTTPD_C_API bool httplog_write( HttpLog* _log, const HttpLogRecord* _record )
+{
+  HttpLogRing* ring = httplog_ring(_log);
+  if (0 == ring) return false;
+  unsigned int head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= HTTPD_LOG_RING)
+  {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  ring->records[head & (HTTPD_LOG_RING - 1)] = *_record;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+HTTPD_C_API unsigned long long httplog_dropped( HttpLog* _log )
+{
+  unsigned long long dropped = __atomic_load_n(&_log->lost, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&_log->lock);
+  for (HttpLogRing* ring = _log->rings; ring; ring = ring->next)
+  {
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&_log->lock);
+  return dropped;
+}
+
+#else
+
+HTTPD_C_API HttpLog* httplog_open( const char* _path )
+{
+  return 0;
+}
+
+HTTPD_C_API void httplog_close( HttpLog* _log )
+{
+}
+
+HTTPD_C_API bool httplog_write( HttpLog* _log, const HttpLogRecord* _record )
+{
+  return false;
+}
+
+HTTPD_C_API unsigned long long httplog_dropped( HttpLog* _log )
+{
+  return 0;
+}
+
+#endif
+
+HTTPD_C_API void httpd_set_log( Httpd* _server, HttpLog* _log )
+{
+  _server->log = _log;
+}
+
+// one record for the request that _conn is answering
+static void httpd_log( HttpConn* _conn, const char* _method, const char* _path, size_t _pathLength, unsigned int _status,
+                       uint64_t _bytes, uint64_t _began, uint64_t _wait, int _flags )
+{
+  HttpLogRecord record;
+  memset(&record, 0, sizeof(record));
+  uint64_t now = httpd_micros();
+  uint64_t duration = now - _began;
+  record.time = httpd_realtime();
+  record.bytes = _bytes;
+  record.duration = duration < 0xffffffffu ? (unsigned int)duration : 0xffffffffu;
+  record.wait = _wait < 0xffffffffu ? (unsigned int)_wait : 0xffffffffu;
+  const struct sockaddr_storage* peer = &_conn->peer;
+  if (peer->ss_family == AF_INET6)
+  {
+    memcpy(record.peer, &((const struct sockaddr_in6*)peer)->sin6_addr, 16);
+  }
+  else if (peer->ss_family == AF_INET)
+  {
+    record.peer[10] = record.peer[11] = 0xff;
+    memcpy(record.peer + 12, &((const struct sockaddr_in*)peer)->sin_addr, 4);
+  }
+  const char* query = (const char*) memchr(_path, '?', _pathLength);
+  if (query) _pathLength = query - _path;
+  record.location = (unsigned int) fnv1a(0xcbf29ce484222325ull, _path, _pathLength);
+  record.status = (unsigned short)_status;
+  record.flags = (unsigned char)(_flags | (_conn->tls ? HTTPLOG_TLS : 0));
+  for (size_t i = 0; i < sizeof(record.method) && _method[i] && _method[i] != ' '; ++i)
+  {
+    record.method[i] = _method[i];
+  }
+  memcpy(record.path, _path, _pathLength < sizeof(record.path) ? _pathLength : sizeof(record.path));
+  httplog_write(_conn->server->log, &record);
+}
+
+static void httpresponse_log( HttpResponse* _context )
+{
+  HttpConn* conn = _context->h2 ? _context->h2->conn : _context->conn;
+  if (conn && _context->method && _context->location)
+  {
+    httpd_log(conn, _context->method, _context->location, strlen(_context->location), _context->status,
+              _context->sent, _context->began, _context->wait, _context->h2 ? HTTPLOG_H2 : 0);
+  }
+}
+
+// reverse proxy. a request on a proxy route is taken over as soon as its
+// header is complete: the header is rewritten for the upstream, the bodies
+// are passed through as they are, in both directions. between plain sockets
+// they go through a pipe with splice() and never enter user space; tls and
+// io_uring clients do their own reads and writes, so for them the bytes pass
+// through the connection buffers.
+
+typedef struct _HttpUpstream HttpUpstream;
+
+struct _HttpUpstream
+{
+  HttpProxy*    proxy;
+  struct sockaddr_storage address;
+  socklen_t     addressLength;
+  int           timeout;    // ms
+  int           maxIdle;
+  int           active;     // requests in progress, the least busy upstream gets the next one
+  int           n_idle;
+  HttpRelay*    idle;       // pooled connections, the most recently used first
+  uint64_t      downUntil;  // ms, skipped after a failed connect
+};
+
+struct _HttpProxy
+{
+  Httpd*        server;
+  HttpProxy*    next;       // Httpd.proxies
+  char*         prefix;
+  size_t        prefixLength;
+  HttpUpstream** upstreams;
+  int           n_upstreams;
+  int           start;      // upstreams with the same load take turns
+};
+
+// how much of a body is still to come
+typedef struct
+{
+  int                 mode;   // HTTPFRAMING_*
+  unsigned long long  left;   // bytes of the current piece
+  bool                last;   // the current piece ends the body
+} HttpFraming;
+
+enum
+{
+  HTTPFRAMING_LENGTH,   // Content-Length, or no body at all
+  HTTPFRAMING_CHUNKED,  // one piece per chunk, size line and CRLF included
+  HTTPFRAMING_CLOSE     // until the upstream closes the connection
+};
+
+enum
+{
+  HTTPRELAY_IDLE,       // pooled
+  HTTPRELAY_CONNECT,    // waiting for the connect
+  HTTPRELAY_SEND,       // request header and body to the upstream
+  HTTPRELAY_HEADER,     // reading the response header
+  HTTPRELAY_BODY        // response body to the client
+};
+
+struct _HttpRelay
+{
+  HttpConn*     upstream;   // the connection the relay belongs to
+  HttpConn*     client;     // 0 while it is pooled
+  HttpUpstream* target;
+  HttpRelay*    nextIdle;
+  int           phase;      // HTTPRELAY_*
+  bool          reused;     // the connection served a request before this one
+  bool          started;    // the client got the response header
+  bool          head;       // a HEAD request, the response has no body
+  bool          keepalive;  // the client connection stays open afterwards
+  bool          reusable;   // ... and the upstream connection
+  bool          sent;       // the request header is queued
+  bool          bodyless;   // the request has no body, it can go out again
+  HttpBytes     request;    // the rewritten header, sent again if a pooled connection was closed under us
+  HttpFraming   body;       // of the request, then of the response
+  HttpConn*     waitConn;   // what the relay waits for
+  short         waitEvents;
+  int           pipe[2];    // -1 until the first splice
+  size_t        piped;      // bytes in the pipe
+  uint64_t      began;      // us, 0 if nobody logs the request
+  uint64_t      wait;
+  unsigned long long bytes; // response bytes the client got
+  unsigned int  status;
+};
+
+static const char httprelay_bad_gateway[] =
+  "HTTP/1.1 502 Bad Gateway\r\n"
+  "Server: " HTTPD_SERVER "\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static const char httprelay_gateway_timeout[] =
+  "HTTP/1.1 504 Gateway Timeout\r\n"
+  "Server: " HTTPD_SERVER "\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static bool httpd_request_input( HttpConn* _conn );
+
+HTTPD_C_API HttpProxy* httpd_add_proxy( Httpd* _server, const char* _prefix )
+{
+  HttpProxy* proxy = (HttpProxy*) calloc(1,sizeof(HttpProxy));
+  if (proxy)
+  {
+    proxy->server = _server;
+    proxy->prefix = strdup(_prefix);
+    proxy->prefixLength = strlen(_prefix);
+    if (0 == proxy->prefix)
+    {
+      free(proxy);
+      return 0;
+    }
+    proxy->next = _server->proxies;
+    _server->proxies = proxy;
+  }
+  return proxy;
+}
+
+HTTPD_C_API bool httpproxy_add_upstream( HttpProxy* _proxy, const char* _host, unsigned short _port, int _timeoutMs, int _maxIdle )
+{
+  char port[8];
+  sprintf(port, "%u", _port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* found = 0;
+  if (0 != getaddrinfo(_host, port, &hints, &found) || 0 == found) return false;
+  
+  HttpUpstream* upstream = (HttpUpstream*) calloc(1,sizeof(HttpUpstream));
+  HttpUpstream** upstreams = (HttpUpstream**) realloc(_proxy->upstreams, (_proxy->n_upstreams + 1) * sizeof(HttpUpstream*));
+  if (upstreams) _proxy->upstreams = upstreams;
+  if (0 == upstream || 0 == upstreams || found->ai_addrlen > sizeof(upstream->address))
+  {
+    free(upstream);
+    freeaddrinfo(found);
+    return false;
+  }
+  upstream->proxy = _proxy;
+  memcpy(&upstream->address, found->ai_addr, found->ai_addrlen);
+  upstream->addressLength = (socklen_t)found->ai_addrlen;
+  upstream->timeout = _timeoutMs > 0 ? _timeoutMs : HTTPD_PROXY_TIMEOUT;
+  upstream->maxIdle = _maxIdle > 0 ? _maxIdle : HTTPD_PROXY_MAX_IDLE;
+  freeaddrinfo(found);
+  _proxy->upstreams[_proxy->n_upstreams++] = upstream;
+  return true;
+}
+
+// the connections are gone already, see httpd_destroy
+static void httpproxy_free( HttpProxy* _proxy )
+{
+  for (int i = 0; i < _proxy->n_upstreams; ++i)
+  {
+    free(_proxy->upstreams[i]);
+  }
+  free(_proxy->upstreams);
+  free(_proxy->prefix);
+  free(_proxy);
+}
+
+// the proxy whose prefix the request target starts with
+static HttpProxy* httpproxy_route( Httpd* _server, const char* _head, size_t _size )
+{
+  const char* target = (const char*) memchr(_head, ' ', _size);
+  if (0 == target) return 0;
+  ++target;
+  size_t length = _head + _size - target;
+  for (HttpProxy* proxy = _server->proxies; proxy; proxy = proxy->next)
+  {
+    if (proxy->n_upstreams && length > proxy->prefixLength && 0 == memcmp(target, proxy->prefix, proxy->prefixLength))
+    {
+      return proxy;
+    }
+  }
+  return 0;
+}
+
+// least connections: the upstream with the fewest requests in progress
+static HttpUpstream* httpproxy_pick( HttpProxy* _proxy, uint64_t _now )
+{
+  HttpUpstream* best = 0;
+  for (int i = 0; i < _proxy->n_upstreams; ++i)
+  {
+    HttpUpstream* upstream = _proxy->upstreams[(_proxy->start + i) % _proxy->n_upstreams];
+    if (upstream->downUntil > _now) continue;
+    if (0 == best || upstream->active < best->active) best = upstream;
+  }
+  _proxy->start = (_proxy->start + 1) % _proxy->n_upstreams;
+  return best;
+}
+
+static void httpupstream_unpool( HttpUpstream* _upstream, HttpRelay* _relay )
+{
+  for (HttpRelay** p = &_upstream->idle; *p; p = &(*p)->nextIdle)
+  {
+    if (*p == _relay)
+    {
+      *p = _relay->nextIdle;
+      _relay->nextIdle = 0;
+      _upstream->n_idle--;
+      return;
+    }
+  }
+}
+
+// a pooled connection, or a new one that is still connecting
+static HttpRelay* httpupstream_relay( HttpUpstream* _upstream, bool _pooled )
+{
+  HttpRelay* relay = _pooled ? _upstream->idle : 0;
+  if (relay)
+  {
+    httpupstream_unpool(_upstream, relay);
+    relay->reused = true;
+    relay->phase = HTTPRELAY_SEND;
+    return relay;
+  }
+  
+  Httpd* server = _upstream->proxy->server;
+  int s = (int) socket(_upstream->address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (s < 0) return 0;
+  int on = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+  if (!set_nonblocking(s) ||
+      (0 != connect(s, (struct sockaddr*)&_upstream->address, _upstream->addressLength) && !would_block() && errno != EINPROGRESS))
+  {
+    closesocket(s);
+    _upstream->downUntil = server->now + HTTPD_PROXY_RETRY;
+    return 0;
+  }
+  relay = (HttpRelay*) calloc(1,sizeof(HttpRelay));
+  HttpConn* conn = relay ? httpconn_open(server, s, 0, 0) : 0;
+  if (0 == conn)
+  {
+    free(relay);
+    closesocket(s);
+    return 0;
+  }
+  conn->kind = HTTPCONN_UPSTREAM;
+  conn->ring = false;   // the relay does its own reads and splices, the ring only polls
+  conn->relay = relay;
+  relay->upstream = conn;
+  relay->target = _upstream;
+  relay->phase = HTTPRELAY_CONNECT;
+  relay->pipe[0] = relay->pipe[1] = -1;
+  return relay;
+}
+
+static HttpConn* httprelay_client( HttpConn* _conn )
+{
+  return _conn->relay ? _conn->relay->client : 0;
+}
+
+static int httprelay_timeout( HttpConn* _conn )
+{
+  HttpRelay* relay = _conn->relay;
+  if (_conn == relay->upstream)
+  {
+    if (0 == relay->client) return HTTPD_PROXY_IDLE_TIMEOUT;
+    // a slow client isn't the upstream's fault
+    return relay->waitConn == relay->client ? 0 : relay->target->timeout;
+  }
+  // a client that doesn't send or read its part of the body
+  return relay->waitConn == _conn ? HTTPD_SEND_TIMEOUT : 0;
+}
+
+static short httprelay_events( HttpConn* _conn )
+{
+  HttpRelay* relay = _conn->relay;
+  short events = _conn->head ? POLLOUT : 0;
+  if (relay->waitConn == _conn) events |= relay->waitEvents;
+  // a pooled connection only listens for its close
+  if (0 == relay->client) events |= POLLIN;
+  return events;
+}
+
+static int httprelay_wait( HttpRelay* _relay, HttpConn* _conn, short _events )
+{
+  _relay->waitConn = _conn;
+  _relay->waitEvents = _events;
+  return 0;
+}
+
+// the client and the relay go separate ways
+static HttpConn* httprelay_release( HttpRelay* _relay )
+{
+  HttpConn* client = _relay->client;
+  if (client)
+  {
+    client->relay = 0;
+    client->kind = HTTPCONN_REQUEST;
+    _relay->client = 0;
+    _relay->target->active--;
+  }
+  _relay->waitConn = 0;
+  return client;
+}
+
+static void httprelay_attach( HttpRelay* _relay, HttpConn* _client )
+{
+  _relay->client = _client;
+  _relay->started = false;
+  _relay->sent = false;
+  _relay->piped = 0;
+  _relay->waitConn = 0;
+  _relay->began = 0;
+  _relay->bytes = 0;
+  _relay->status = 0;
+  _client->relay = _relay;
+  _client->kind = HTTPCONN_PROXY;
+  _relay->target->active++;
+}
+
+// the access log record of the request, method and path come from the
+// header that went upstream
+static void httprelay_log( HttpRelay* _relay, unsigned int _status )
+{
+  HttpConn* client = _relay->client;
+  const char* method = _relay->request.data;
+  const char* path = method ? (const char*) memchr(method, ' ', _relay->request.length) : 0;
+  const char* end = path ? (const char*) memchr(path + 1, ' ', _relay->request.length - (path + 1 - method)) : 0;
+  if (_relay->began && client && end)
+  {
+    httpd_log(client, method, path + 1, end - path - 1, _status, _relay->bytes, _relay->began, _relay->wait, HTTPLOG_PROXY);
+  }
+  _relay->began = 0;
+}
+
+// answer the client with _failure unless the response is on its way already,
+// then close it; the upstream connection can't be trusted anymore either
+static void httprelay_fail( HttpRelay* _relay, const char* _failure, size_t _size )
+{
+  bool started = _relay->started;
+  if (!started)
+  {
+    _relay->bytes += _size;
+    _relay->status = _failure == httprelay_gateway_timeout ? 504 : 502;
+  }
+  httprelay_log(_relay, _relay->status);
+  HttpConn* client = httprelay_release(_relay);
+  httpconn_close(_relay->upstream);
+  if (client && !client->dead)
+  {
+    if (!started) httpconn_write(client, _failure, _size);
+    httpconn_finish(client, false);
+    httpconn_settle(client);
+    httpconn_schedule(client);
+  }
+}
+
+// read what the socket has into the connection's input buffer, at most _max
+// bytes. returns the count, 0 at the end of the input, -1 if there's nothing
+// right now and -2 on errors.
+static int httprelay_fill( HttpConn* _conn, size_t _max )
+{
+  if (_conn->inSize - _conn->inLength < 4096)
+  {
+    size_t size = _conn->inSize < 8192 ? 16384 : _conn->inSize * 2;
+    char* in = (char*) realloc(_conn->in, size);
+    if (0 == in) return -2;
+    _conn->in = in;
+    _conn->inSize = size;
+  }
+  size_t room = _conn->inSize - _conn->inLength;
+  int ret = httpconn_recv(_conn, _conn->in + _conn->inLength, (int)(room < _max ? room : _max));
+  if (ret > 0)
+  {
+    _conn->inLength += ret;
+    _conn->progress = true;
+    return ret;
+  }
+  if (ret == 0) return 0;
+  return would_block() ? -1 : -2;
+}
+
+static void httprelay_consume( HttpConn* _conn, size_t _size )
+{
+  _conn->inLength -= _size;
+  memmove(_conn->in, _conn->in + _size, _conn->inLength);
+}
+
+// the next piece of a chunked body: size line, data and CRLF, or the last
+// chunk with its trailers. 0 if the bytes at hand don't tell yet, -1 if
+// they are malformed.
+static long long httpframing_chunk( HttpFraming* _body, const char* _data, size_t _size )
+{
+  const char* eol = (const char*) memchr(_data, '\n', _size);
+  if (0 == eol) return _size > 1024 ? -1 : 0;
+  unsigned long long size = 0;
+  const char* p = _data;
+  for (; p < eol && ((*p >= '0' && *p <= '9') || ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')); ++p)
+  {
+    size = size * 16 + hexnibble(*p);
+    if (size >> 40) return -1;
+  }
+  if (p == _data) return -1;
+  if (size)
+  {
+    return (eol + 1 - _data) + (long long)size + 2;
+  }
+  // trailers, up to the empty line
+  for (p = eol + 1;;)
+  {
+    const char* end = (const char*) memchr(p, '\n', _data + _size - p);
+    if (0 == end) return _size > HTTPD_MAX_HEADER ? -1 : 0;
+    if (end == p || (end == p + 1 && *p == '\r'))
+    {
+      _body->last = true;
+      return end + 1 - _data;
+    }
+    p = end + 1;
+  }
+}
+
+static bool httprelay_spliceable( HttpConn* _conn )
+{
+#ifdef HTTPD_SPLICE
+  return 0 == _conn->tls && !_conn->ring;
+#else
+  return false;
+#endif
+}
+
+// move a body from _src to _dst as _body describes it. bytes that were read
+// already go through _dst's queue, the rest is spliced when both sides are
+// plain sockets and copied when they aren't. returns 1 when the body is
+// complete, 0 when the relay waits, -1 on errors.
+static int httprelay_pump( HttpRelay* _relay, HttpConn* _src, HttpConn* _dst, HttpFraming* _body )
+{
+  Httpd* server = _src->server;
+  bool direct = httprelay_spliceable(_src) && httprelay_spliceable(_dst);
+  for (;;)
+  {
+#ifdef HTTPD_SPLICE
+    if (_relay->piped)
+    {
+      ssize_t n = splice(_relay->pipe[0], 0, _dst->netsocket, 0, _relay->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && would_block()) return httprelay_wait(_relay, _dst, POLLOUT);
+      if (n <= 0) return -1;
+      _relay->piped -= n;
+      if (_dst == _relay->client) _relay->bytes += n;
+      _dst->progress = true;
+      continue;
+    }
+#endif
+    if (0 == _body->left)
+    {
+      if (_body->mode != HTTPFRAMING_CHUNKED || _body->last) return 1;
+      long long piece = 0;
+      if (_src->inLength)
+      {
+        piece = httpframing_chunk(_body, _src->in, _src->inLength);
+      }
+      else if (direct)
+      {
+        // the size line is looked at where it is, the chunk stays in the socket
+        char peek[128];
+        int n = (int) recv(_src->netsocket, peek, sizeof(peek), MSG_PEEK);
+        if (n < 0 && would_block()) return httprelay_wait(_relay, _src, POLLIN);
+        if (n <= 0) return -1;
+        piece = httpframing_chunk(_body, peek, n);
+      }
+      if (piece < 0) return -1;
+      if (piece > 0)
+      {
+        _body->left = piece;
+        continue;
+      }
+      // a size line that didn't arrive completely
+      int n = httprelay_fill(_src, 1024);
+      if (n == -1) return httprelay_wait(_relay, _src, POLLIN);
+      if (n <= 0) return -1;
+      continue;
+    }
+    
+    if (_src->inLength)
+    {
+      if (_dst->queued >= server->highWater) return httprelay_wait(_relay, _dst, POLLOUT);
+      size_t n = _body->left < _src->inLength ? (size_t)_body->left : _src->inLength;
+      if (!httpconn_append(_dst, _src->in, n) || !httpconn_flush(_dst)) return -1;
+      if (_dst == _relay->client) _relay->bytes += n;
+      httprelay_consume(_src, n);
+      _body->left -= n;
+      continue;
+    }
+#ifdef HTTPD_SPLICE
+    if (direct)
+    {
+      // whatever is queued goes first
+      if (_dst->head) return httprelay_wait(_relay, _dst, POLLOUT);
+      if (_relay->pipe[0] < 0 && 0 != pipe2(_relay->pipe, O_NONBLOCK | O_CLOEXEC))
+      {
+        _relay->pipe[0] = _relay->pipe[1] = -1;
+        return -1;
+      }
+      size_t size = _body->left < 65536 ? (size_t)_body->left : 65536;
+      ssize_t n = splice(_src->netsocket, 0, _relay->pipe[1], 0, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && would_block()) return httprelay_wait(_relay, _src, POLLIN);
+      if (n == 0 && _body->mode == HTTPFRAMING_CLOSE) return 1;
+      if (n <= 0) return -1;
+      _relay->piped += n;
+      _body->left -= n;
+      _src->progress = true;
+      continue;
+    }
+#endif
+    if (_dst->queued >= server->highWater) return httprelay_wait(_relay, _dst, POLLOUT);
+    int n = httprelay_fill(_src, _body->left < 65536 ? (size_t)_body->left : 65536);
+    if (n == -1) return httprelay_wait(_relay, _src, POLLIN);
+    if (n == 0 && _body->mode == HTTPFRAMING_CLOSE) return 1;
+    if (n <= 0) return -1;
+  }
+}
+
+// header lines: name and value of the line at _p, the next line or 0 at the end
+static const char* header_line( const char* _p, const char* _end, const char** _name, size_t* _nameLength, const char** _value, size_t* _valueLength )
+{
+  const char* eol = (const char*) memchr(_p, '\n', _end - _p);
+  if (0 == eol) return 0;
+  const char* line = eol > _p && eol[-1] == '\r' ? eol - 1 : eol;
+  if (line == _p) return 0;
+  const char* colon = (const char*) memchr(_p, ':', line - _p);
+  if (0 == colon) colon = line;
+  *_name = _p;
+  *_nameLength = colon - _p;
+  const char* v = colon < line ? colon + 1 : line;
+  while (v < line && (*v == ' ' || *v == '\t')) ++v;
+  const char* e = line;
+  while (e > v && (e[-1] == ' ' || e[-1] == '\t')) --e;
+  *_value = v;
+  *_valueLength = e - v;
+  return eol + 1;
+}
+
+static bool header_is( const char* _name, size_t _length, const char* _header )
+{
+  return strlen(_header) == _length && 0 == strncasecmp(_name, _header, _length);
+}
+
+// hop-by-hop headers belong to one connection and aren't forwarded, nor
+// are the ones the Connection header names, except for those the message
+// can't do without
+static bool header_hop( const char* _name, size_t _length, const char* _connection )
+{
+  if (header_is(_name, _length, "transfer-encoding") || header_is(_name, _length, "content-length") ||
+      header_is(_name, _length, "host"))
+  {
+    return false;
+  }
+  static const char* const hop[] =
+  {
+    "connection", "keep-alive", "proxy-connection", "proxy-authorization", "te", "trailer", "upgrade"
+  };
+  for (size_t i = 0; i < sizeof(hop) / sizeof(hop[0]); ++i)
+  {
+    if (header_is(_name, _length, hop[i])) return true;
+  }
+  char name[64];
+  if (_length >= sizeof(name)) return false;
+  memcpy(name, _name, _length);
+  name[_length] = 0;
+  return header_has_token(_connection, name);
+}
+
+// the values of all _header lines, joined with commas as if it was one line
+static bool header_join( const char* _head, const char* _end, const char* _header, HttpBytes* _out )
+{
+  const char *name, *value;
+  size_t nameLength, valueLength;
+  _out->length = 0;
+  bool ok = true;
+  const char* p = (const char*) memchr(_head, '\n', _end - _head);
+  for (p = p ? p + 1 : 0; ok && p && (p = header_line(p, _end, &name, &nameLength, &value, &valueLength)) != 0;)
+  {
+    if (header_is(name, nameLength, _header))
+    {
+      ok = (0 == _out->length || httpbytes_append(_out, ", ", 2)) && httpbytes_append(_out, value, valueLength);
+    }
+  }
+  return ok && httpbytes_append(_out, "", 1);
+}
+
+// the value of the first _header, copied into _out
+static void header_find( const char* _head, const char* _end, const char* _header, char* _out, size_t _size )
+{
+  const char *name, *value;
+  size_t nameLength, valueLength;
+  *_out = 0;
+  const char* p = (const char*) memchr(_head, '\n', _end - _head);
+  for (p = p ? p + 1 : 0; p && (p = header_line(p, _end, &name, &nameLength, &value, &valueLength)) != 0;)
+  {
+    if (header_is(name, nameLength, _header))
+    {
+      if (valueLength >= _size) valueLength = _size - 1;
+      memcpy(_out, value, valueLength);
+      _out[valueLength] = 0;
+      return;
+    }
+  }
+}
+
+// the framing headers of a message. Transfer-Encoding has to be "chunked" and
+// nothing else, all Content-Length values have to be the same number, and a
+// request can't have both (a response can, the chunks win); a message without
+// either has no body (a request) or ends with the connection (a response).
+// the header lines of a request have to be well formed. returns false if any
+// of that doesn't hold: a message the upstream could frame differently than
+// the proxy would smuggle a request past it.
+static bool httprelay_framing( const char* _head, const char* _end, bool _request, HttpFraming* _body )
+{
+  const char *name, *value;
+  size_t nameLength, valueLength;
+  int encodings = 0;
+  bool chunked = false, sized = false;
+  unsigned long long length = 0;
+  memset(_body, 0, sizeof(*_body));
+  const char* p = (const char*) memchr(_head, '\n', _end - _head);
+  for (p = p ? p + 1 : 0; p && (p = header_line(p, _end, &name, &nameLength, &value, &valueLength)) != 0;)
+  {
+    if (_request && (0 == nameLength || name[nameLength] != ':' ||
+                     memchr(name, ' ', nameLength) || memchr(name, '\t', nameLength)))
+    {
+      return false;
+    }
+    if (header_is(name, nameLength, "transfer-encoding"))
+    {
+      encodings++;
+      chunked = valueLength == 7 && 0 == strncasecmp(value, "chunked", 7);
+    }
+    else if (header_is(name, nameLength, "content-length"))
+    {
+      // "5, 5" is the same as two lines with 5, anything else is an error
+      for (const char* v = value, *e = value + valueLength; v <= e; ++v)
+      {
+        while (v < e && (*v == ' ' || *v == '\t')) ++v;
+        if (v == e || *v < '0' || *v > '9') return false;
+        unsigned long long n = 0;
+        for (; v < e && *v >= '0' && *v <= '9'; ++v)
+        {
+          if (n > (~0ull - 9) / 10) return false;
+          n = n * 10 + (*v - '0');
+        }
+        while (v < e && (*v == ' ' || *v == '\t')) ++v;
+        if ((v < e && *v != ',') || (sized && n != length)) return false;
+        length = n;
+        sized = true;
+      }
+    }
+  }
+  if (encodings)
+  {
+    if (encodings > 1 || !chunked || (_request && sized)) return false;
+    _body->mode = HTTPFRAMING_CHUNKED;
+    return true;
+  }
+  if (sized)
+  {
+    _body->left = length;
+    _body->mode = HTTPFRAMING_LENGTH;
+    _body->last = true;
+    return true;
+  }
+  _body->mode = _request ? HTTPFRAMING_LENGTH : HTTPFRAMING_CLOSE;
+  _body->last = _request;
+  _body->left = _request ? 0 : ~0ull;
+  return true;
+}
+
+// the request header as the upstream gets it: HTTP/1.1, without hop-by-hop
+// headers, with X-Forwarded-For and X-Forwarded-Proto
+// " HTTP/1.x" of the request line, 0 if it isn't "method target HTTP/1.x"
+static const char* httprelay_version( const char* _head, size_t _size )
+{
+  const char* eol = (const char*) memchr(_head, '\n', _size);
+  const char* version = eol ? (const char*) memchr(_head, ' ', eol - _head) : 0;
+  version = version ? (const char*) memchr(version + 1, ' ', eol - version - 1) : 0;
+  if (0 == version || eol - version < 9 || 0 != memcmp(version, " HTTP/1.", 8)) return 0;
+  return version;
+}
+
+static bool httprelay_request( HttpRelay* _relay, HttpConn* _client, const char* _head, size_t _size, const HttpFraming* _body )
+{
+  const char* end = _head + _size;
+  const char* version = httprelay_version(_head, _size);
+  if (0 == version) return false;
+  const char* eol = (const char*) memchr(version, '\n', end - version);
+  bool http10 = version[8] == '0';
+  _relay->head = 0 == memcmp(_head, "HEAD ", 5);
+  
+  char forwarded[256];
+  HttpBytes connection = { 0, 0, 0 };
+  if (!header_join(_head, end, "connection", &connection))
+  {
+    httpbytes_free(&connection);
+    return false;
+  }
+  header_find(_head, end, "x-forwarded-for", forwarded, sizeof(forwarded));
+  _relay->keepalive = !_client->server->draining &&
+    (http10 ? header_has_token(connection.data, "keep-alive") : !header_has_token(connection.data, "close"));
+  
+  char address[INET6_ADDRSTRLEN] = "unknown";
+  struct sockaddr_storage* peer = &_client->peer;
+  const unsigned char* a6 = (const unsigned char*)&((struct sockaddr_in6*)peer)->sin6_addr;
+  static const unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+  if (peer->ss_family == AF_INET) inet_ntop(AF_INET, &((struct sockaddr_in*)peer)->sin_addr, address, sizeof(address));
+  // an IPv4 client of a dual stack listener
+  else if (peer->ss_family == AF_INET6 && 0 == memcmp(a6, mapped, 12)) inet_ntop(AF_INET, a6 + 12, address, sizeof(address));
+  else if (peer->ss_family == AF_INET6) inet_ntop(AF_INET6, a6, address, sizeof(address));
+  
+  HttpBytes* out = &_relay->request;
+  out->length = 0;
+  bool ok = httpbytes_append(out, _head, version - _head) && httpbytes_append(out, " HTTP/1.1\r\n", 11);
+  const char *name, *value;
+  size_t nameLength, valueLength;
+  for (const char* p = eol + 1; ok && (p = header_line(p, end, &name, &nameLength, &value, &valueLength)) != 0;)
+  {
+    // the chunks go upstream as they are, a length next to them would be a lie
+    if (header_hop(name, nameLength, connection.data) || header_is(name, nameLength, "x-forwarded-for") ||
+        header_is(name, nameLength, "x-forwarded-proto") ||
+        (_body->mode == HTTPFRAMING_CHUNKED && header_is(name, nameLength, "content-length")))
+    {
+      continue;
+    }
+    ok = httpbytes_append(out, name, p - name);
+  }
+  httpbytes_free(&connection);
+  char line[600];
+  int n = sprintf(line, "X-Forwarded-For: %s%s%s\r\nX-Forwarded-Proto: %s\r\n\r\n",
+                  forwarded, *forwarded ? ", " : "", address, _client->tls ? "https" : "http");
+  return ok && httpbytes_append(out, line, n);
+}
+
+// the response header as the client gets it, without hop-by-hop headers
+// and with "Connection: close" if this is the last response
+static bool httprelay_response( HttpRelay* _relay, const char* _head, size_t _size, int* _code )
+{
+  const char* end = _head + _size;
+  const char* eol = (const char*) memchr(_head, '\n', _size);
+  if (0 == eol || _size < 12 || 0 != memcmp(_head, "HTTP/1.", 7) || _head[8] != ' ') return false;
+  *_code = atoi(_head + 9);
+  if (*_code < 100 || *_code > 999) return false;
+  bool http10 = _head[7] == '0';
+  
+  HttpBytes connection = { 0, 0, 0 };
+  if (!header_join(_head, end, "connection", &connection))
+  {
+    httpbytes_free(&connection);
+    return false;
+  }
+  bool informational = *_code < 200;
+  if (!informational)
+  {
+    if (!httprelay_framing(_head, end, false, &_relay->body))
+    {
+      httpbytes_free(&connection);
+      return false;
+    }
+    if (_relay->head || *_code == 204 || *_code == 304)
+    {
+      memset(&_relay->body, 0, sizeof(_relay->body));
+      _relay->body.last = true;
+    }
+    bool close = _relay->body.mode == HTTPFRAMING_CLOSE;
+    _relay->reusable = !close && (http10 ? header_has_token(connection.data, "keep-alive") : !header_has_token(connection.data, "close"));
+    _relay->keepalive = _relay->keepalive && !close;
+    _relay->status = *_code;
+  }
+  
+  HttpConn* client = _relay->client;
+  size_t length = eol + 1 - _head + 2;
+  bool ok = httpconn_append(client, "HTTP/1.1", 8) && httpconn_append(client, _head + 8, eol + 1 - _head - 8);
+  const char *name, *value;
+  size_t nameLength, valueLength;
+  for (const char* p = eol + 1; ok && (p = header_line(p, end, &name, &nameLength, &value, &valueLength)) != 0;)
+  {
+    if (header_hop(name, nameLength, connection.data) ||
+        (!informational && _relay->body.mode == HTTPFRAMING_CHUNKED && header_is(name, nameLength, "content-length")))
+    {
+      continue;
+    }
+    ok = httpconn_append(client, name, p - name);
+    length += p - name;
+  }
+  httpbytes_free(&connection);
+  if (ok && !informational && !_relay->keepalive)
+  {
+    ok = httpconn_append(client, "Connection: close\r\n", 19);
+    length += 19;
+  }
+  _relay->bytes += length;
+  return ok && httpconn_append(client, "\r\n", 2) && httpconn_flush(client);
+}
+
+// the request is answered: the client waits for the next one, the upstream
+// connection goes back to the pool if it can
+static void httprelay_finish( HttpRelay* _relay )
+{
+  bool keepalive = _relay->keepalive;
+  HttpConn* upstream = _relay->upstream;
+  HttpUpstream* target = _relay->target;
+  httprelay_log(_relay, _relay->status);
+  HttpConn* client = httprelay_release(_relay);
+  
+  if (_relay->reusable && 0 == upstream->inLength && !upstream->dead && !upstream->server->draining && target->n_idle < target->maxIdle)
+  {
+    _relay->phase = HTTPRELAY_IDLE;
+    _relay->nextIdle = target->idle;
+    target->idle = _relay;
+    target->n_idle++;
+    upstream->timeout = HTTPTIMER_NONE;
+    httpconn_schedule(upstream);
+  }
+  else
+  {
+    httpconn_close(upstream);
+  }
+  
+  httpconn_finish(client, keepalive);
+  httpconn_settle(client);
+  httpconn_schedule(client);
+  // requests the client pipelined behind this one
+  if (keepalive && client->inLength && !client->dead)
+  {
+    httpd_request_input(client);
+  }
+}
+
+static bool httprelay_send( HttpRelay* _relay )
+{
+  HttpConn* upstream = _relay->upstream;
+  return httpconn_append(upstream, _relay->request.data, _relay->request.length) && httpconn_flush(upstream);
+}
+
+static void httprelay_run( HttpRelay* _relay, short _events );
+
+// a pooled connection that the upstream closed while it was on its way to
+// us: a request without a body can simply go out again on a fresh one
+static bool httprelay_retry( HttpRelay* _relay )
+{
+  if (!_relay->reused || !_relay->bodyless || _relay->started || _relay->upstream->inLength)
+  {
+    return false;
+  }
+  HttpRelay* fresh = httpupstream_relay(_relay->target, false);
+  if (0 == fresh) return false;
+  if (!httpbytes_append(&fresh->request, _relay->request.data, _relay->request.length))
+  {
+    httpconn_close(fresh->upstream);
+    return false;
+  }
+  fresh->keepalive = _relay->keepalive;
+  fresh->head = _relay->head;
+  fresh->bodyless = true;
+  uint64_t began = _relay->began;
+  HttpConn* client = httprelay_release(_relay);
+  httpconn_close(_relay->upstream);
+  httprelay_attach(fresh, client);
+  fresh->began = began;
+  fresh->wait = _relay->wait;
+  httprelay_run(fresh, 0);
+  httpconn_schedule(fresh->upstream);
+  return true;
+}
+
+// everything the relay can do right now
+static void httprelay_run( HttpRelay* _relay, short _events )
+{
+  HttpConn* upstream = _relay->upstream;
+  _relay->waitConn = 0;
+  for (;;)
+  {
+    HttpConn* client = _relay->client;
+    if (0 == client || client->dead || upstream->dead) return;
+    switch (_relay->phase)
+    {
+      case HTTPRELAY_CONNECT:
+      {
+        if (0 == (_events & (POLLOUT|POLLERR|POLLHUP)))
+        {
+          httprelay_wait(_relay, upstream, POLLOUT);
+          return;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (0 != getsockopt(upstream->netsocket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) || error)
+        {
+          _relay->target->downUntil = upstream->server->now + HTTPD_PROXY_RETRY;
+          httprelay_fail(_relay, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+          return;
+        }
+        upstream->progress = true;
+        _relay->phase = HTTPRELAY_SEND;
+        break;
+      }
+      case HTTPRELAY_SEND:
+      {
+        if (!_relay->sent)
+        {
+          if (!httprelay_send(_relay))
+          {
+            if (!httprelay_retry(_relay)) httprelay_fail(_relay, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+            return;
+          }
+          _relay->sent = true;
+        }
+        int done = httprelay_pump(_relay, client, upstream, &_relay->body);
+        if (done < 0)
+        {
+          httprelay_fail(_relay, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+          return;
+        }
+        if (0 == done) return;
+        _relay->phase = HTTPRELAY_HEADER;
+        break;
+      }
+      case HTTPRELAY_HEADER:
+      {
+        const char* eoh = 0;
+        for (size_t i = 3; i < upstream->inLength && 0 == eoh; ++i)
+        {
+          if (upstream->in[i] == '\n' && 0 == memcmp(upstream->in + i - 3, "\r\n\r\n", 4)) eoh = upstream->in + i + 1;
+        }
+        if (0 == eoh)
+        {
+          int n = upstream->inLength >= HTTPD_MAX_HEADER ? -2 : httprelay_fill(upstream, HTTPD_MAX_HEADER);
+          if (n == -1)
+          {
+            httprelay_wait(_relay, upstream, POLLIN);
+            return;
+          }
+          if (n <= 0)
+          {
+            if (!httprelay_retry(_relay)) httprelay_fail(_relay, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+            return;
+          }
+          break;
+        }
+        int code;
+        size_t size = eoh - upstream->in;
+        if (!httprelay_response(_relay, upstream->in, size, &code) || code == 101)
+        {
+          httprelay_fail(_relay, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+          return;
+        }
+        httprelay_consume(upstream, size);
+        // 100 Continue and friends are passed on, the real response follows
+        if (code >= 200)
+        {
+          _relay->started = true;
+          _relay->phase = HTTPRELAY_BODY;
+        }
+        break;
+      }
+      case HTTPRELAY_BODY:
+      {
+        int done = httprelay_pump(_relay, upstream, client, &_relay->body);
+        if (done < 0)
+        {
+          httprelay_fail(_relay, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+          return;
+        }
+        if (0 == done) return;
+        // the end of a close delimited body
+        if (upstream->inLength) _relay->reusable = false;
+        httprelay_finish(_relay);
+        return;
+      }
+      default:
+        return;
+    }
+  }
+}
+
+static bool httprelay_event( HttpConn* _conn, short _events )
+{
+  HttpRelay* relay = _conn->relay;
+  if (0 == relay->client)
+  {
+    // a pooled connection has nothing to say, this is its close
+    return 0 == (_events & (POLLIN|POLLHUP));
+  }
+  HttpConn* other = _conn == relay->upstream ? relay->client : relay->upstream;
+  httprelay_run(relay, _conn == relay->upstream ? _events : 0);
+  // the relay may wait for the other connection now, with its deadline
+  if (other && !other->dead)
+  {
+    httpconn_schedule(other);
+  }
+  return !_conn->dead;
+}
+
+// a client whose header is complete: the relay takes over
+static void httprelay_start( HttpConn* _client, HttpProxy* _proxy, size_t _headerLength )
+{
+  Httpd* server = _client->server;
+  if (!httpd_admit(server, _client->inflight))
+  {
+    _client->inLength = 0;
+    httpconn_write(_client, httpd_unavailable, sizeof(httpd_unavailable) - 1);
+    httpconn_finish(_client, false);
+    return;
+  }
+  _client->expect = 0;
+  _client->served = true;
+  _client->timeout = HTTPTIMER_NONE;
+  if (!_client->inflight)
+  {
+    _client->inflight = true;
+    server->inflight++;
+  }
+  
+  HttpFraming body;
+  const char* head = _client->in;
+  // a broken request line is the client's fault, not the upstream's
+  if (0 == httprelay_version(head, _headerLength) || !httprelay_framing(head, head + _headerLength, true, &body))
+  {
+    httpd_reject(_client, 400);
+    return;
+  }
+  HttpUpstream* target = httpproxy_pick(_proxy, server->now);
+  HttpRelay* relay = target ? httpupstream_relay(target, true) : 0;
+  if (0 == relay || !httprelay_request(relay, _client, head, _headerLength, &body))
+  {
+    if (relay && relay->phase == HTTPRELAY_SEND)
+    {
+      relay->phase = HTTPRELAY_IDLE;
+      relay->nextIdle = target->idle;
+      target->idle = relay;
+      target->n_idle++;
+    }
+    else if (relay)
+    {
+      httpconn_close(relay->upstream);
+    }
+    const char* path = (const char*) memchr(head, ' ', _headerLength);
+    const char* end = path ? (const char*) memchr(path + 1, ' ', head + _headerLength - path - 1) : 0;
+    if (server->log && end)
+    {
+      uint64_t now = httpd_micros();
+      httpd_log(_client, head, path + 1, end - path - 1, 502, sizeof(httprelay_bad_gateway) - 1, now, 0, HTTPLOG_PROXY);
+    }
+    _client->inLength = 0;
+    httpconn_write(_client, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+    httpconn_finish(_client, false);
+    return;
+  }
+  httprelay_consume(_client, _headerLength);
+  relay->body = body;
+  relay->bodyless = body.mode == HTTPFRAMING_LENGTH && 0 == body.left;
+  httprelay_attach(relay, _client);
+  if (server->log)
+  {
+    relay->began = httpd_micros();
+    relay->wait = relay->began > server->arrival * 1000 ? relay->began - server->arrival * 1000 : 0;
+  }
+  httprelay_run(relay, 0);
+  httpconn_schedule(relay->upstream);
+}
+
+static void httprelay_expired( HttpConn* _conn )
+{
+  HttpRelay* relay = _conn->relay;
+  if (_conn == relay->upstream && relay->client)
+  {
+    if (relay->phase == HTTPRELAY_CONNECT) relay->target->downUntil = _conn->server->now + HTTPD_PROXY_RETRY;
+    httprelay_fail(relay, httprelay_gateway_timeout, sizeof(httprelay_gateway_timeout) - 1);
+  }
+}
+
+// one of the two connections is destroyed
+static void httprelay_detach( HttpConn* _conn )
+{
+  HttpRelay* relay = _conn->relay;
+  if (_conn != relay->upstream || relay->client)
+  {
+    // one side is gone in the middle of a request, the other can't go on
+    httprelay_fail(relay, httprelay_bad_gateway, sizeof(httprelay_bad_gateway) - 1);
+    if (_conn != relay->upstream) return;
+  }
+  _conn->relay = 0;
+  if (relay->phase == HTTPRELAY_IDLE)
+  {
+    httpupstream_unpool(relay->target, relay);
+  }
+#ifdef HTTPD_SPLICE
+  if (relay->pipe[0] >= 0)
+  {
+    close(relay->pipe[0]);
+    close(relay->pipe[1]);
+  }
+#endif
+  httpbytes_free(&relay->request);
+  free(relay);
+}
+
+// rate limits, checked as soon as a request header is complete
+
+struct _HttpRateLimit
+{
+  HttpRateLimit* next;
+  char*         prefix;
+  size_t        prefixLength;
+  char*         header;     // 0: per client address
+  uint64_t      interval;   // us per request
+  uint64_t      burst;
+  uint64_t      seed;       // keeps the buckets of the rules apart
+};
+
+// the client address as a bucket key. an IPv6 client usually has the whole
+// /64 to itself, so that's what counts.
+static uint64_t httpconn_peer_key( HttpConn* _conn, uint64_t _hash )
+{
+  const struct sockaddr_storage* peer = &_conn->peer;
+  if (peer->ss_family == AF_INET)
+  {
+    return fnv1a(_hash, &((const struct sockaddr_in*)peer)->sin_addr, 4);
+  }
+  if (peer->ss_family == AF_INET6)
+  {
+    const unsigned char* a = (const unsigned char*)&((const struct sockaddr_in6*)peer)->sin6_addr;
+    static const unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+    return 0 == memcmp(a, mapped, 12) ? fnv1a(_hash, a + 12, 4) : fnv1a(_hash, a, 8);
+  }
+  return _hash;
+}
+
+// false if one of the rules that apply has nothing left for the request,
+// *_retry is the number of seconds until it has
+static bool httpd_throttle( HttpConn* _conn, const char* _head, size_t _size, unsigned int* _retry )
+{
+  Httpd* server = _conn->server;
+  const char* end = _head + _size;
+  const char* target = (const char*) memchr(_head, ' ', _size);
+  if (0 == target) return true;
+  ++target;
+  for (HttpRateLimit* rule = server->limits; rule; rule = rule->next)
+  {
+    if ((size_t)(end - target) < rule->prefixLength || 0 != memcmp(target, rule->prefix, rule->prefixLength)) continue;
+    uint64_t key = rule->seed;
+    char value[256] = "";
+    if (rule->header) header_find(_head, end, rule->header, value, sizeof(value));
+    key = *value ? fnv1a(key, value, strlen(value)) : httpconn_peer_key(_conn, key);
+    uint64_t wait;
+    if (!httprate_take(&server->buckets, key ? key : 1, server->now * 1000, rule->interval, rule->burst, &wait))
+    {
+      server->limited++;
+      *_retry = (unsigned int)((wait + 999999) / 1000000);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void httpd_too_many( HttpConn* _conn, unsigned int _retry )
+{
+  char retry[40] = "Retry-After: ";
+  size_t n = 13 + httpd_utoa(retry + 13, _retry);
+  memcpy(retry + n, "\r\n", 3);
+  char text[HTTPD_CLOSING_HEAD];
+  size_t len = httpd_closing_head(text, 429, retry);
+  _conn->inLength = 0;
+  httpconn_write(_conn, text, len);
+  httpconn_finish(_conn, false);
+}
+
+HTTPD_C_API bool httpd_add_rate_limit( Httpd* _server, const char* _prefix, const char* _header, double _perSecond, int _burst )
+{
+  if (_perSecond <= 0 || _burst < 1) return false;
+  if (0 == _server->buckets.sets && !httprate_init(&_server->buckets, HTTPD_RATE_SLOTS)) return false;
+  HttpRateLimit* rule = (HttpRateLimit*) calloc(1,sizeof(HttpRateLimit));
+  if (0 == rule) return false;
+  rule->prefix = strdup(_prefix ? _prefix : "");
+  rule->header = _header ? strdup(_header) : 0;
+  if (0 == rule->prefix || (_header && 0 == rule->header))
+  {
+    free(rule->prefix);
+    free(rule);
+    return false;
+  }
+  rule->prefixLength = strlen(rule->prefix);
+  rule->interval = (uint64_t)(1000000 / _perSecond);
+  if (0 == rule->interval) rule->interval = 1;
+  rule->burst = (uint64_t)_burst;
+  HttpRateLimit** tail = &_server->limits;
+  int n = 0;
+  for (; *tail; tail = &(*tail)->next) ++n;
+  rule->seed = fnv1a(0xcbf29ce484222325ull, &n, sizeof(n));
+  *tail = rule;
+  return true;
+}
+
+// a chunked request body is joined in place once the last chunk is in, so the
+// handler gets it like any other (the Transfer-Encoding header stays). 1 when
+// the request is complete, 0 while chunks are missing, -1 if they are
+// malformed and -2 if they are too large.
+static int httpd_request_chunks( HttpConn* _conn )
+{
+  HttpFraming body;
+  memset(&body, 0, sizeof(body));
+  while (!body.last)
+  {
+    long long piece = httpframing_chunk(&body, _conn->in + _conn->chunks, _conn->inLength - _conn->chunks);
+    if (piece < 0) return -1;
+    if (_conn->chunks + piece - _conn->expect > HTTPD_MAX_BODY) return -2;
+    if (0 == piece || _conn->chunks + piece > _conn->inLength) return 0;
+    if (!body.last && 0 != memcmp(_conn->in + _conn->chunks + piece - 2, "\r\n", 2)) return -1;
+    _conn->chunks += piece;
+  }
+  // the data of every chunk moves down to where the body starts, the input
+  // that follows the request after it
+  char* out = _conn->in + _conn->expect;
+  for (const char* p = out; p < _conn->in + _conn->chunks;)
+  {
+    size_t size = (size_t) strtoull(p, 0, 16);
+    if (0 == size) break;
+    p = (const char*) memchr(p, '\n', _conn->in + _conn->chunks - p) + 1;
+    memmove(out, p, size);
+    out += size;
+    p += size + 2;
+  }
+  size_t rest = _conn->inLength - _conn->chunks;
+  memmove(out, _conn->in + _conn->chunks, rest);
+  _conn->expect = out - _conn->in;
+  _conn->inLength = _conn->expect + rest;
+  _conn->chunks = 0;
+  return 1;
+}
+
+// dispatch every complete request in the input buffer, one after the other.
+// the next one waits while the responses before it fill the output queue.
+static bool httpd_request_input( HttpConn* _conn )
+{
+  Httpd* server = _conn->server;
+  while (!_conn->dead && !_conn->closing && _conn->kind == HTTPCONN_REQUEST && 0 == _conn->response && _conn->inLength &&
+         _conn->queued < server->highWater)
+  {
+    if (server->http2 && 0 == _conn->tls && !_conn->served)
+    {
+      // prior knowledge: the client starts right away with the http/2 preface
+      size_t n = _conn->inLength < 24 ? _conn->inLength : 24;
+      if (0 == memcmp(_conn->in, http2_preface, n))
+      {
+        if (n < 24) return true;
+        return 0 != http2_start(_conn) && http2_read(_conn);
+      }
+    }
+    
+    if (0 == _conn->expect)
+    {
+      const char* eoh = 0;
+      for (size_t i = 3; i < _conn->inLength; ++i)
+      {
+        if (_conn->in[i] == '\n' && 0 == memcmp(_conn->in + i - 3, "\r\n\r\n", 4))
+        {
+          eoh = _conn->in + i + 1;
+          break;
+        }
+      }
+      if (0 == eoh)
+      {
+        if (_conn->inLength >= HTTPD_MAX_HEADER) httpd_reject(_conn, 400);
+        return true;
+      }
+      unsigned int retry;
+      if (server->limits && !httpd_throttle(_conn, _conn->in, eoh - _conn->in, &retry))
+      {
+        httpd_too_many(_conn, retry);
+        return true;
+      }
+      HttpProxy* proxy = server->proxies ? httpproxy_route(server, _conn->in, eoh - _conn->in) : 0;
+      if (proxy)
+      {
+        // the body is streamed to the upstream, it isn't read here
+        httprelay_start(_conn, proxy, eoh - _conn->in);
+        continue;
+      }
+      HttpFraming body;
+      if (!httprelay_framing(_conn->in, eoh, true, &body))
+      {
+        httpd_reject(_conn, 400);
+        return true;
+      }
+      if (body.mode == HTTPFRAMING_LENGTH && body.left > HTTPD_MAX_BODY)
+      {
+        httpd_reject(_conn, 413);
+        return true;
+      }
+      _conn->expect = (eoh - _conn->in) + (size_t)body.left;
+      _conn->chunks = body.mode == HTTPFRAMING_CHUNKED ? _conn->expect : 0;
+    }
+    if (_conn->chunks)
+    {
+      int chunks = httpd_request_chunks(_conn);
+      if (chunks < 0)
+      {
+        httpd_reject(_conn, chunks == -2 ? 413 : 400);
+        return true;
+      }
+      if (0 == chunks) return true;
+    }
+    if (_conn->inLength < _conn->expect) return true;
+    httpd_dispatch(_conn, _conn->expect);
+  }
+  return true;
+}
+
+static bool httpd_request_read( HttpConn* _conn )
+{
+  for (;;)
+  {
+    if (!httpd_request_input(_conn)) return false;
+    // stop reading while a response is pending, the client has to wait for it
+    if (_conn->dead || _conn->closing || _conn->kind != HTTPCONN_REQUEST || _conn->response ||
+        _conn->queued >= _conn->server->highWater)
+    {
+      return true;
+    }
+    
+    if (_conn->inLength == _conn->inSize)
+    {
+      size_t size = _conn->inSize ? _conn->inSize * 2 : 4096;
+      if (size > HTTPD_MAX_HEADER + HTTPD_MAX_BODY) size = HTTPD_MAX_HEADER + HTTPD_MAX_BODY;
+      if (size <= _conn->inLength) return false;
+      char* in = (char*) realloc(_conn->in, size);
+      if (0 == in) return false;
+      _conn->in = in;
+      _conn->inSize = size;
+    }
+    int ret = httpconn_recv(_conn, _conn->in + _conn->inLength, (int)(_conn->inSize - _conn->inLength));
+    if (ret == 0) return false;
+    if (ret == SOCKET_ERROR) return would_block();
+    _conn->inLength += ret;
+  }
+}
+
+static bool httpd_handshake( HttpConn* _conn )
+{
+  int ret = _conn->tls->handshake(_conn->tlsSession);
+  if (ret == HTTPTLS_WANT_READ || ret == HTTPTLS_WANT_WRITE)
+  {
+    _conn->wantWrite = ret == HTTPTLS_WANT_WRITE;
+    return true;
+  }
+  if (ret != HTTPTLS_OK) return false;
+  _conn->handshake = false;
+  _conn->wantWrite = false;
+  
+  const char* protocol = _conn->tls->protocol ? _conn->tls->protocol(_conn->tlsSession) : 0;
+  if (_conn->server->http2 && protocol && 0 == strcmp(protocol, "h2"))
+  {
+    return 0 != http2_start(_conn);
+  }
+  return true;
+}
+
+// listening sockets. _address is "8080" (every address, IPv6 and IPv4),
+// "0.0.0.0:8080", "[::1]:8080", "localhost:8080", "unix:/path" or
+// "unix:@name" for linux's abstract namespace. -1 if it can't be had.
+static int listen_address( const char* _address, int _flags )
+{
+  struct sockaddr_storage sa;
+  socklen_t length = 0;
+  bool any = false;
+  memset(&sa, 0, sizeof(sa));
+#ifndef WIN32
+  if (0 == strncmp(_address, "unix:", 5))
+  {
+    struct sockaddr_un* un = (struct sockaddr_un*)&sa;
+    const char* path = _address + 5;
+    size_t n = strlen(path);
+    if (0 == n || n >= sizeof(un->sun_path)) return -1;
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path, n);
+    if (*path == '@')
+    {
+      // an abstract name has no file and no terminator
+      un->sun_path[0] = 0;
+      length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n);
+    }
+    else
+    {
+      length = (socklen_t)sizeof(*un);
+      // a socket left behind by the last run goes, one that somebody still
+      // listens on or anything that isn't a socket stays
+      struct stat st;
+      if (0 == lstat(path, &st))
+      {
+        int probe = S_ISSOCK(st.st_mode) ? (int) socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+        bool stale = probe >= 0 && 0 != connect(probe, (struct sockaddr*)un, length) && errno == ECONNREFUSED;
+        if (probe >= 0) closesocket(probe);
+        if (!stale || 0 != unlink(path))
+        {
+          errno = EADDRINUSE;
+          return -1;
+        }
+      }
+    }
+  }
+  else
+#endif
+  {
+    char host[256] = "";
+    const char* port = strrchr(_address, ':');
+    if (port)
+    {
+      size_t n = port++ - _address;
+      if (n >= 2 && _address[0] == '[' && _address[n-1] == ']')
+      {
+        ++_address;
+        n -= 2;
+      }
+      if (n >= sizeof(host)) return -1;
+      memcpy(host, _address, n);
+      host[n] = 0;
+    }
+    else
+    {
+      port = _address;
+    }
+    any = 0 == *host || 0 == strcmp(host, "*");
+    if (any)
+    {
+      struct sockaddr_in6* in6 = (struct sockaddr_in6*)&sa;
+      in6->sin6_family = AF_INET6;
+      in6->sin6_addr = in6addr_any;
+      in6->sin6_port = htons((unsigned short)atoi(port));
+      length = (socklen_t)sizeof(*in6);
+    }
+    else
+    {
+      struct addrinfo hints;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_PASSIVE;
+      struct addrinfo* found = 0;
+      if (0 != getaddrinfo(host, port, &hints, &found) || 0 == found) return -1;
+      bool fits = found->ai_addrlen <= sizeof(sa);
+      if (fits)
+      {
+        memcpy(&sa, found->ai_addr, found->ai_addrlen);
+        length = (socklen_t)found->ai_addrlen;
+      }
+      freeaddrinfo(found);
+      if (!fits) return -1;
+    }
+  }
+  
+  int s = (int) socket(sa.ss_family, SOCK_STREAM, 0);
+  if (s < 0 && any)
+  {
+    // no IPv6 on this machine
+    struct sockaddr_in* in = (struct sockaddr_in*)&sa;
+    unsigned short port = ((struct sockaddr_in6*)&sa)->sin6_port;
+    memset(&sa, 0, sizeof(sa));
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = INADDR_ANY;
+    in->sin_port = port;
+    length = (socklen_t)sizeof(*in);
+    s = (int) socket(AF_INET, SOCK_STREAM, 0);
+  }
+  if (s < 0) return -1;
+  
+  int on = 1;
+  if (sa.ss_family == AF_INET6)
+  {
+    // [::] takes the IPv4 clients as well, as ::ffff:a.b.c.d
+    int only = 0 != (_flags & HTTPLISTEN_V6ONLY);
+    setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&only, sizeof(only));
+  }
+  if (sa.ss_family != AF_UNIX)
+  {
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+    // accepted connections inherit it, no system call per connection
+    if (_flags & HTTPLISTEN_NODELAY)
+    {
+      setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+    }
+#ifdef TCP_DEFER_ACCEPT
+    // the connection is accepted once the request is there, not after the handshake
+    if (_flags & HTTPLISTEN_DEFER_ACCEPT)
+    {
+      int seconds = (HTTPD_HEADER_TIMEOUT + 999) / 1000;
+      setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char*)&seconds, sizeof(seconds));
+    }
+#endif
+#ifdef TCP_FASTOPEN
+    // a returning client sends its request with the SYN
+    if (_flags & HTTPLISTEN_FASTOPEN)
+    {
+      int queue = HTTPD_FASTOPEN_QUEUE;
+      setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&queue, sizeof(queue));
+    }
+#endif
+  }
+  if (bind(s, (struct sockaddr*)&sa, length) || -1 == listen(s, HTTPD_BACKLOG))
+  {
+    closesocket(s);
+    return -1;
+  }
+  return s;
+}
+
+static bool httpd_add_listener( Httpd* _server, int _socket )
+{
+  // accept takes whatever is pending, up to HTTPD_ACCEPT_BATCH at a time
+  if (_server->n_listeners == HTTPD_MAX_LISTENERS || !set_nonblocking(_socket)) return false;
+  HttpListener* listener = &_server->listeners[_server->n_listeners++];
+  memset(listener, 0, sizeof(*listener));
+  listener->socket = _socket;
+  struct sockaddr_storage sa;
+  socklen_t length = sizeof(sa);
+  memset(&sa, 0, sizeof(sa));
+  if (0 == getsockname(_socket, (struct sockaddr*)&sa, &length))
+  {
+    listener->family = sa.ss_family;
+#ifndef WIN32
+    // the file of a unix socket goes away with the server, an inherited one too
+    const char* path = ((struct sockaddr_un*)&sa)->sun_path;
+    if (sa.ss_family == AF_UNIX && *path) listener->path = strdup(path);
+#endif
+  }
+  return true;
+}
+
+Httpd* httpd_create ( unsigned short _port, HttpRequestHandler _handler, void* _userdata )
+{
+  char address[8];
+  sprintf(address, "%u", _port);
+  int s = listen_address(address, HTTPLISTEN_NODELAY);
+  if (s == -1)
+  {
+    printf ("listen");
+    return 0;
+  }
+  Httpd* server = httpd_create_socket(s, _handler, _userdata);
+  if (0 == server) closesocket(s);
+  return server;
+}
+
+HTTPD_C_API bool httpd_listen (Httpd* _server, const char* _address, int _flags)
+{
+  if (_server->draining || _server->n_listeners == HTTPD_MAX_LISTENERS) return false;
+  int s = listen_address(_address, _flags);
+  if (s == -1) return false;
+  if (!httpd_add_listener(_server, s))
+  {
+    closesocket(s);
+    return false;
+  }
+  return true;
+}
+
+HTTPD_C_API Httpd* httpd_create_socket ( int _socket, HttpRequestHandler _handler, void* _userdata )
+{
+	Httpd* server = (Httpd*) calloc(1,sizeof(Httpd));
+  if (0 == server) return 0;
+		
+	server->handler = _handler;
+  server->userdata = _userdata;
+  server->lowWater = HTTPD_LOW_WATERMARK;
+  server->highWater = HTTPD_HIGH_WATERMARK;
+  server->now = httpd_clock();
+  server->wheel.now = server->now / HTTPD_TIMER_TICK;
+  server->arrival = server->now;
+  server->maxConns = HTTPD_MAX_CONNECTIONS;
+  server->maxInflight = HTTPD_MAX_INFLIGHT;
+  server->codel.target = HTTPD_CODEL_TARGET;
+  server->codel.interval = HTTPD_CODEL_INTERVAL;
+  server->control = -1;
+#ifndef WIN32
+  // sendfile has no MSG_NOSIGNAL, a client that hangs up would take the server with it
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
+  if (!httpd_add_listener(server, _socket))
+  {
+    free(server);
+    return 0;
+  }
+
+  return server;
+}
+
+void httpd_destroy (Httpd* _server)
+{
+  if (_server)
+  {
+#ifdef HTTPD_URING
+    // closing the ring cancels everything it still does for the connections
+    if (_server->ring)
+    {
+      httpring_destroy(_server->ring);
+    }
+#endif
+    while (_server->conns)
+    {
+      httpconn_destroy(_server->conns);
+    }
+    while (_server->proxies)
+    {
+      HttpProxy* proxy = _server->proxies;
+      _server->proxies = proxy->next;
+      httpproxy_free(proxy);
+    }
+    while (_server->limits)
+    {
+      HttpRateLimit* rule = _server->limits;
+      _server->limits = rule->next;
+      free(rule->prefix);
+      free(rule->header);
+      free(rule);
+    }
+    free(_server->buckets.memory);
+    for (int i = 0; i < _server->n_listeners; ++i)
+    {
+      HttpListener* listener = &_server->listeners[i];
+      if (listener->socket >= 0)
+      {
+        closesocket(listener->socket);
+      }
+#ifndef WIN32
+      if (listener->path && !_server->handedOff)
+      {
+        unlink(listener->path);
+      }
+#endif
+      free(listener->path);
+    }
+    if (_server->control >= 0)
+    {
+      closesocket(_server->control);
+    }
+#ifndef WIN32
+    // after a handoff the path belongs to the new process
+    if (_server->controlPath && !_server->handedOff)
+    {
+      unlink(_server->controlPath);
+    }
+#endif
+    free(_server->controlPath);
+    if (_server->tls)
+    {
+      _server->tls->destroy(_server->tlsContext);
+    }
+    free (_server);
+  }
+}
+
+// service one connection. nothing in here blocks: sockets are drained as far
+// as they accept data right now.
+static void httpconn_event (HttpConn* _conn, short _events)
+{
+  bool alive = 0 == (_events & (POLLERR|POLLNVAL));
+  if (_conn->relay && (_events & POLLHUP) && !(_events & POLLIN))
+  {
+    // poll reports the hangup whether the relay asked or not
+    alive = false;
+  }
+  
+  if (alive && _conn->handshake && (_events & (POLLIN|POLLOUT|POLLHUP)))
+  {
+    alive = httpd_handshake(_conn);
+    // the client's first bytes may be buffered in the tls session already
+    if (alive && !_conn->handshake) _events |= POLLIN;
+  }
+  if (alive && !_conn->handshake && (_events & (POLLIN|POLLHUP)))
+  {
+    if (_conn->kind == HTTPCONN_REQUEST)
+    {
+      alive = httpd_request_read(_conn);
+    }
+    else if (_conn->kind == HTTPCONN_WEBSOCKET)
+    {
+      alive = httpwebsocket_read(_conn);
+    }
+    else if (_conn->kind == HTTPCONN_HTTP2)
+    {
+      alive = http2_read(_conn);
+    }
+    else if (_conn->relay || _conn->fetch)
+    {
+      // the relay reads when it is ready for it, below
+    }
+    else
+    {
+      // subscribers don't talk to us, anything but a hangup is discarded
+      char scratch[512];
+      int ret = httpconn_recv(_conn, scratch, sizeof(scratch));
+      alive = ret > 0 || (ret == SOCKET_ERROR && would_block());
+    }
+  }
+  if (alive && (_events & POLLOUT))
+  {
+    alive = httpconn_flush(_conn);
+  }
+  if (alive && _conn->relay)
+  {
+    alive = httprelay_event(_conn, _events);
+  }
+  if (alive && _conn->fetch)
+  {
+    alive = httpfetch_event(_conn, _events);
+  }
+  if (alive && _conn->h2)
+  {
+    // the peer opened its window or the queue drained
+    http2_resume(_conn->h2);
+    alive = !_conn->dead;
+  }
+  if (alive && _conn->response && _conn->response->writable && _conn->queued <= _conn->server->lowWater)
+  {
+    // the handler asked to continue once the client caught up
+    HttpResponse* response = _conn->response;
+    HttpWritableHandler handler = response->writable;
+    response->writable = 0;
+    handler(response, response->writableData);
+    if (0 == response->writable && !response->suspended)
+    {
+      httpresponse_destroy(response);
+    }
+  }
+  if (alive && (_events & POLLOUT) && _conn->kind == HTTPCONN_REQUEST && 0 == _conn->response && _conn->inLength)
+  {
+    // requests that were pipelined behind a response that just finished or
+    // whose output was queued up
+    alive = httpd_request_input(_conn);
+  }
+  if (!alive || (_conn->closing && 0 == _conn->head))
+  {
+    httpconn_close(_conn);
+  }
+  httpconn_settle(_conn);
+  httpconn_schedule(_conn);
+}
+
+static void httpd_sweep (Httpd* _server)
+{
+  HttpConn* next;
+  if (_server->draining && _server->now >= _server->deadline)
+  {
+    // out of time: whatever is still open goes now
+    for (HttpConn* conn = _server->conns; conn; conn = conn->next)
+    {
+      httpconn_close(conn);
+    }
+  }
+  for (HttpConn* conn = _server->conns; conn; conn = next)
+  {
+    next = conn->next;
+    if (conn->dead)
+    {
+#ifdef HTTPD_URING
+      if (conn->ops)
+      {
+        // the ring still refers to it: a shut down socket makes it let go
+        httpwheel_remove(&_server->wheel, &conn->timer);
+        if (!conn->shut) shutdown(conn->netsocket, SHUT_RDWR);
+        conn->shut = true;
+        continue;
+      }
+#endif
+      httpconn_destroy(conn);
+    }
+  }
+}
+
+// over the connection limit a client gets the 503 before the socket is closed,
+// a tls client can't be told anything before the handshake
+static void httpd_refuse (Httpd* _server, int _client)
+{
+  _server->shed++;
+  if (0 == _server->tls)
+  {
+    send(_client, httpd_unavailable, sizeof(httpd_unavailable) - 1, HTTPD_SEND_FLAGS);
+    // unread request bytes would turn the close into a reset
+    char scratch[1024];
+    recv(_client, scratch, sizeof(scratch), 0);
+  }
+  closesocket(_client);
+}
+
+static void httpd_accept_socket (Httpd* _server, int _client, const struct sockaddr* _peer, socklen_t _peerLength)
+{
+  if (_server->maxConns && _server->n_conns >= _server->maxConns)
+  {
+    httpd_refuse(_server, _client);
+    return;
+  }
+
+  void* session = 0;
+  if (_server->tls)
+  {
+    session = _server->tls->accept(_server->tlsContext, _client);
+    if (0 == session)
+    {
+      closesocket(_client);
+      return;
+    }
+  }
+
+  HttpConn* conn = httpconn_open(_server, _client, _server->tls, session);
+  if (0 == conn)
+  {
+    net_close(_client, _server->tls, session);
+    return;
+  }
+  conn->kind = HTTPCONN_REQUEST;
+  conn->handshake = 0 != session;
+  if (_peer && _peerLength <= (socklen_t)sizeof(conn->peer))
+  {
+    memcpy(&conn->peer, _peer, _peerLength);
+  }
+  else
+  {
+    // io_uring's multishot accept has nowhere to put it
+    socklen_t length = sizeof(conn->peer);
+    getpeername(_client, (struct sockaddr*)&conn->peer, &length);
+  }
+  // the request (or client hello) is usually there already
+  httpconn_event(conn, POLLIN);
+}
+
+static void httpd_accept (Httpd* _server, HttpListener* _listener)
+{
+  for (int i = 0; i < HTTPD_ACCEPT_BATCH && _listener->socket >= 0; ++i)
+  {
+    struct sockaddr_storage sa;
+    socklen_t sin_size = sizeof(sa);
+#ifdef __linux__
+    // non-blocking right away, saves two fcntl per connection
+    int client = (int)accept4(_listener->socket, (struct sockaddr*)&sa, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int client = (int)accept(_listener->socket, (struct sockaddr*)&sa, &sin_size);
+    if (client >= 0 && !set_nonblocking(client))
+    {
+      closesocket(client);
+      continue;
+    }
+#endif
+    if (client < 0) return;
+    httpd_accept_socket(_server, client, (struct sockaddr*)&sa, sin_size);
+  }
+}
+
+// what a connection waits for
+static short httpconn_events (HttpConn* _conn)
+{
+  if (_conn->relay)
+  {
+    return httprelay_events(_conn);
+  }
+  if (_conn->fetch)
+  {
+    return httpfetch_events(_conn);
+  }
+  // a connection with a pending response doesn't read the next request yet,
+  // nor one whose responses fill the output queue
+  bool input = _conn->kind != HTTPCONN_REQUEST ||
+               (0 == _conn->response && !_conn->closing && _conn->queued < _conn->server->highWater);
+  bool output = _conn->head || _conn->wantWrite || (_conn->response && _conn->response->writable) ||
+                (_conn->h2 && http2_ready(_conn->h2));
+  return (input ? POLLIN : 0) | (output ? POLLOUT : 0);
+}
+
+// sleep no longer than until the next timeout
+static int httpd_timeout (Httpd* _server, bool _blocking, uint64_t _now)
+{
+  int ticks = httpwheel_next(&_server->wheel);
+  if (!_blocking) return 0;
+  uint64_t due = ticks < 0 ? 0 : (_server->wheel.now + ticks) * HTTPD_TIMER_TICK;
+  if (_server->draining && (0 == due || _server->deadline < due))
+  {
+    due = _server->deadline;
+  }
+  if (0 == due) return -1;
+  return due > _now ? (int)(due - _now) : 0;
+}
+
+#ifdef HTTPD_URING
+
+// io_uring engine. the listening socket has a multishot accept and every
+// plain connection a multishot recv that picks its buffers from a provided
+// buffer ring. output queues go out with sendmsg, file ranges with a pair of
+// linked splices through a pipe. tls sessions do their own socket i/o and are
+// only told about readiness by one-shot polls. whatever an iteration of the
+// loop asks from the kernel is submitted with a single io_uring_enter, which
+// also waits for the next completions.
+
+#define HTTPRING_SPLICE (64*1024)   // what fits into an empty pipe
+
+enum
+{
+  HTTPRING_CANCEL = 0,  // user_data of the operations whose completion is ignored
+  HTTPRING_ACCEPT,
+  HTTPRING_RECV,
+  HTTPRING_SEND,
+  HTTPRING_SPLICE_IN,
+  HTTPRING_SPLICE_OUT,
+  HTTPRING_POLL,
+  HTTPRING_CONTROL      // the handoff socket has a new process waiting
+};
+
+struct _HttpRing
+{
+  int           fd;
+  unsigned int  sqEntries;
+  unsigned int  sqMask;
+  unsigned int* sqHead;
+  unsigned int* sqTail;
+  unsigned int  sqLocal;    // tail including the entries not submitted yet
+  unsigned int  pending;
+  struct io_uring_sqe* sqes;
+  unsigned int  cqMask;
+  unsigned int* cqHead;
+  unsigned int* cqTail;
+  struct io_uring_cqe* cqes;
+  void*         map;
+  size_t        mapSize;
+  size_t        sqesSize;
+  struct io_uring_buf_ring* bufRing;
+  size_t        bufRingSize;
+  char*         buffers;
+  bool          controlling;// a poll on the handoff socket is armed
+};
+
+static void httpring_destroy( HttpRing* _ring )
+{
+  if (_ring->fd >= 0) close(_ring->fd);
+  if (_ring->sqes) munmap(_ring->sqes, _ring->sqesSize);
+  if (_ring->map) munmap(_ring->map, _ring->mapSize);
+  if (_ring->bufRing) munmap(_ring->bufRing, _ring->bufRingSize);
+  free(_ring->buffers);
+  free(_ring);
+}
+
+// hand receive buffer _bid back to the kernel
+static void httpring_recycle( HttpRing* _ring, int _bid )
+{
+  unsigned short tail = _ring->bufRing->tail;
+  struct io_uring_buf* buf = &_ring->bufRing->bufs[tail & (HTTPD_URING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(_ring->buffers + (size_t)_bid * HTTPD_URING_BUFSIZE);
+  buf->len = HTTPD_URING_BUFSIZE;
+  buf->bid = (unsigned short)_bid;
+  __atomic_store_n(&_ring->bufRing->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// 0 if the kernel doesn't have what the engine needs (6.0 and later)
+static HttpRing* httpring_create( void )
+{
+  HttpRing* ring = (HttpRing*) calloc(1,sizeof(HttpRing));
+  if (0 == ring) return 0;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+  p.cq_entries = 4 * HTTPD_URING_ENTRIES;
+  ring->fd = (int)syscall(__NR_io_uring_setup, HTTPD_URING_ENTRIES, &p);
+  if (ring->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG))
+  {
+    httpring_destroy(ring);
+    return 0;
+  }
+
+  // submission and completion queue share one mapping
+  size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->mapSize = sqSize > cqSize ? sqSize : cqSize;
+  ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* map = mmap(0, ring->mapSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  void* sqes = mmap(0, ring->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  ring->map = map == MAP_FAILED ? 0 : map;
+  ring->sqes = sqes == MAP_FAILED ? 0 : (struct io_uring_sqe*)sqes;
+  if (0 == ring->map || 0 == ring->sqes)
+  {
+    httpring_destroy(ring);
+    return 0;
+  }
+  char* base = (char*)ring->map;
+  ring->sqEntries = p.sq_entries;
+  ring->sqMask = *(unsigned int*)(base + p.sq_off.ring_mask);
+  ring->sqHead = (unsigned int*)(base + p.sq_off.head);
+  ring->sqTail = (unsigned int*)(base + p.sq_off.tail);
+  ring->sqLocal = *ring->sqTail;
+  unsigned int* array = (unsigned int*)(base + p.sq_off.array);
+  for (unsigned int i = 0; i < p.sq_entries; ++i)
+  {
+    array[i] = i;
+  }
+  ring->cqMask = *(unsigned int*)(base + p.cq_off.ring_mask);
+  ring->cqHead = (unsigned int*)(base + p.cq_off.head);
+  ring->cqTail = (unsigned int*)(base + p.cq_off.tail);
+  ring->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+
+  // provided buffers for the receives, group 0
+  ring->bufRingSize = HTTPD_URING_BUFFERS * sizeof(struct io_uring_buf);
+  void* bufRing = mmap(0, ring->bufRingSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  ring->bufRing = bufRing == MAP_FAILED ? 0 : (struct io_uring_buf_ring*)bufRing;
+  ring->buffers = (char*) malloc((size_t)HTTPD_URING_BUFFERS * HTTPD_URING_BUFSIZE);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+  reg.ring_entries = HTTPD_URING_BUFFERS;
+  reg.bgid = 0;
+  if (0 == ring->bufRing || 0 == ring->buffers || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    httpring_destroy(ring);
+    return 0;
+  }
+  for (int i = 0; i < HTTPD_URING_BUFFERS; ++i)
+  {
+    httpring_recycle(ring, i);
+  }
+  return ring;
+}
+
+// submit what is queued, and wait for _wait completions at most _timeout ms
+static void httpring_enter( HttpRing* _ring, unsigned int _wait, int _timeout )
+{
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned int flags = _wait ? IORING_ENTER_GETEVENTS : 0;
+  void* argp = 0;
+  size_t argsz = 0;
+  if (_wait && _timeout >= 0)
+  {
+    ts.tv_sec = _timeout / 1000;
+    ts.tv_nsec = (long long)(_timeout % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    argp = &arg;
+    argsz = sizeof(arg);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  if (0 == _ring->pending && 0 == _wait) return;
+  long ret = syscall(__NR_io_uring_enter, _ring->fd, _ring->pending, _wait, flags, argp, argsz);
+  if (ret > 0)
+  {
+    _ring->pending -= (unsigned int)ret;
+  }
+}
+
+// a cleared submission queue entry, 0 if the queue is full even after submitting
+static struct io_uring_sqe* httpring_sqe( HttpRing* _ring, unsigned int _count )
+{
+  if (_ring->sqLocal + _count - __atomic_load_n(_ring->sqHead, __ATOMIC_ACQUIRE) > _ring->sqEntries)
+  {
+    httpring_enter(_ring, 0, 0);
+    if (_ring->sqLocal + _count - __atomic_load_n(_ring->sqHead, __ATOMIC_ACQUIRE) > _ring->sqEntries) return 0;
+  }
+  struct io_uring_sqe* sqe = &_ring->sqes[_ring->sqLocal & _ring->sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  _ring->sqLocal++;
+  _ring->pending++;
+  __atomic_store_n(_ring->sqTail, _ring->sqLocal, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static void httpring_prep( struct io_uring_sqe* _sqe, int _op, int _fd, HttpConn* _conn, int _kind )
+{
+  _sqe->opcode = (unsigned char)_op;
+  _sqe->fd = _fd;
+  _sqe->user_data = (uint64_t)(uintptr_t)_conn | (uint64_t)_kind;
+  if (_conn && _kind != HTTPRING_CANCEL && _kind != HTTPRING_ACCEPT) _conn->ops++;
+}
+
+// accepts carry the index of their listener instead of a connection
+static HttpConn* httpring_listener( int _index )
+{
+  return (HttpConn*)(uintptr_t)((uint64_t)_index << 3);
+}
+
+static void httpring_cancel( HttpRing* _ring, HttpConn* _conn, int _kind )
+{
+  struct io_uring_sqe* sqe = httpring_sqe(_ring, 1);
+  if (0 == sqe) return;
+  bool poll = _kind == HTTPRING_POLL || _kind == HTTPRING_CONTROL;
+  httpring_prep(sqe, poll ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL, -1, 0, HTTPRING_CANCEL);
+  sqe->addr = (uint64_t)(uintptr_t)_conn | (uint64_t)_kind;
+}
+
+// send the head of the queue: buffers in one sendmsg, a file range through the pipe
+static void httpring_send( HttpRing* _ring, HttpConn* _conn )
+{
+  // a file range that was sent completely before it was taken off the queue
+  while (_conn->head && 0 == _conn->head->buffer && 0 == _conn->piped && _conn->head->offset >= _conn->head->fileSize)
+  {
+    HttpSegment* seg = _conn->head;
+    _conn->head = seg->next;
+    if (0 == _conn->head) _conn->tail = 0;
+    httpsegment_free(seg);
+  }
+  HttpSegment* seg = _conn->head;
+  if (0 == seg) return;
+  
+  if (_conn->piped)
+  {
+    // what the last splice left in the pipe goes first
+    struct io_uring_sqe* sqe = httpring_sqe(_ring, 1);
+    if (0 == sqe) return;
+    httpring_prep(sqe, IORING_OP_SPLICE, _conn->netsocket, _conn, HTTPRING_SPLICE_OUT);
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = _conn->pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = (unsigned int)_conn->piped;
+    _conn->sending = 1;
+  }
+  else if (seg->buffer)
+  {
+    int n = 0;
+    for (; seg && seg->buffer && n < (int)(sizeof(_conn->iov) / sizeof(_conn->iov[0])); seg = seg->next, ++n)
+    {
+      _conn->iov[n].iov_base = seg->buffer->data + seg->offset;
+      _conn->iov[n].iov_len = seg->buffer->size - seg->offset;
+    }
+    struct io_uring_sqe* sqe = httpring_sqe(_ring, 1);
+    if (0 == sqe) return;
+    memset(&_conn->msg, 0, sizeof(_conn->msg));
+    _conn->msg.msg_iov = _conn->iov;
+    _conn->msg.msg_iovlen = n;
+    httpring_prep(sqe, IORING_OP_SENDMSG, _conn->netsocket, _conn, HTTPRING_SEND);
+    sqe->addr = (uint64_t)(uintptr_t)&_conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    _conn->sending = 1;
+  }
+  else
+  {
+    if (_conn->pipe[0] < 0 && 0 != pipe(_conn->pipe))
+    {
+      _conn->pipe[0] = _conn->pipe[1] = -1;
+      httpconn_close(_conn);
+      return;
+    }
+    size_t left = seg->fileSize - seg->offset;
+    unsigned int len = left < HTTPRING_SPLICE ? (unsigned int)left : HTTPRING_SPLICE;
+    struct io_uring_sqe* in = httpring_sqe(_ring, 2);
+    if (0 == in) return;
+    httpring_prep(in, IORING_OP_SPLICE, _conn->pipe[1], _conn, HTTPRING_SPLICE_IN);
+    in->off = (uint64_t)-1;
+    in->splice_fd_in = seg->fd;
+    in->splice_off_in = (uint64_t)(seg->fileOffset + seg->offset);
+    in->len = len;
+    in->flags = IOSQE_IO_LINK;  // a short read cancels the second half
+    struct io_uring_sqe* out = httpring_sqe(_ring, 1);
+    httpring_prep(out, IORING_OP_SPLICE, _conn->netsocket, _conn, HTTPRING_SPLICE_OUT);
+    out->off = (uint64_t)-1;
+    out->splice_fd_in = _conn->pipe[0];
+    out->splice_off_in = (uint64_t)-1;
+    out->len = len;
+    _conn->sending = 2;
+  }
+}
+
+// a send or splice completed: take what went out off the queue
+static void httpring_sent( HttpConn* _conn, int _kind, int _result )
+{
+  _conn->sending--;
+  if (_result == -ECANCELED) return;   // the splice before it came up short
+  if (_result <= 0)
+  {
+    httpconn_close(_conn);
+    return;
+  }
+  _conn->progress = true;
+  if (_kind == HTTPRING_SPLICE_IN)
+  {
+    _conn->piped += _result;
+  }
+  else if (_kind == HTTPRING_SPLICE_OUT)
+  {
+    _conn->piped -= _result;
+    _conn->head->offset += _result;
+  }
+  else
+  {
+    size_t sent = (size_t)_result;
+    while (sent && _conn->head && _conn->head->buffer)
+    {
+      HttpSegment* seg = _conn->head;
+      size_t n = seg->buffer->size - seg->offset;
+      if (n > sent) n = sent;
+      seg->offset += n;
+      _conn->queued -= n;
+      sent -= n;
+      if (seg->offset < seg->buffer->size) break;
+      _conn->head = seg->next;
+      if (0 == _conn->head) _conn->tail = 0;
+      httpsegment_free(seg);
+    }
+  }
+}
+
+// received bytes go where the protocol handlers read from
+static void httpring_input( HttpConn* _conn, const char* _data, size_t _size )
+{
+  if (_conn->kind != HTTPCONN_REQUEST && _conn->kind != HTTPCONN_WEBSOCKET && _conn->kind != HTTPCONN_HTTP2 && _conn->kind != HTTPCONN_PROXY)
+  {
+    return;   // subscribers don't talk to us
+  }
+  // one byte more than needed: the handlers treat a full buffer as a reason to grow it
+  if (_conn->inLength + _size >= _conn->inSize)
+  {
+    size_t size = _conn->inSize ? _conn->inSize : 4096;
+    while (size <= _conn->inLength + _size) size *= 2;
+    char* in = (char*) realloc(_conn->in, size);
+    if (0 == in)
+    {
+      httpconn_close(_conn);
+      return;
+    }
+    _conn->in = in;
+    _conn->inSize = size;
+  }
+  memcpy(_conn->in + _conn->inLength, _data, _size);
+  _conn->inLength += _size;
+}
+
+static void httpring_complete( Httpd* _server, const struct io_uring_cqe* _cqe )
+{
+  HttpRing* ring = _server->ring;
+  HttpConn* conn = (HttpConn*)(uintptr_t)(_cqe->user_data & ~(uint64_t)7);
+  int kind = (int)(_cqe->user_data & 7);
+  bool more = 0 != (_cqe->flags & IORING_CQE_F_MORE);
+  
+  if (kind == HTTPRING_CANCEL) return;
+  if (kind == HTTPRING_ACCEPT)
+  {
+    HttpListener* listener = &_server->listeners[_cqe->user_data >> 3];
+    if (!more) listener->accepting = false;
+    if (_cqe->res >= 0) httpd_accept_socket(_server, _cqe->res, 0, 0);
+    return;
+  }
+  if (kind == HTTPRING_CONTROL)
+  {
+    ring->controlling = false;
+    if (_cqe->res > 0 && _server->control >= 0) httpd_handoff(_server);
+    return;
+  }
+  if (!more) conn->ops--;
+  
+  if (kind == HTTPRING_RECV)
+  {
+    if (!more)
+    {
+      conn->recving = false;
+      conn->canceling = false;
+    }
+    if (_cqe->flags & IORING_CQE_F_BUFFER)
+    {
+      int bid = (int)(_cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      if (_cqe->res > 0 && !conn->dead)
+      {
+        httpring_input(conn, ring->buffers + (size_t)bid * HTTPD_URING_BUFSIZE, _cqe->res);
+      }
+      httpring_recycle(ring, bid);
+    }
+    // out of buffers or stopped: armed again by the next httpd_process
+    if (_cqe->res == -ENOBUFS || _cqe->res == -ECANCELED || conn->dead) return;
+    if (_cqe->res <= 0) conn->eof = true;
+    httpconn_event(conn, _cqe->res < 0 ? POLLERR : POLLIN);
+  }
+  else if (kind == HTTPRING_POLL)
+  {
+    conn->polling = false;
+    conn->unpoll = false;
+    if (_cqe->res == -ECANCELED || conn->dead) return;
+    httpconn_event(conn, _cqe->res < 0 ? POLLERR : (short)_cqe->res);
+  }
+  else
+  {
+    httpring_sent(conn, kind, _cqe->res);
+    // the socket took it all: the same as POLLOUT for the poll loop
+    if (0 == conn->sending && !conn->dead) httpconn_event(conn, POLLOUT);
+  }
+}
+
+// arm whatever the connection needs from the kernel for the next round
+static void httpring_arm( Httpd* _server, HttpConn* _conn )
+{
+  HttpRing* ring = _server->ring;
+  if (_conn->dead) return;
+  if (!_conn->ring)
+  {
+    // tls: readiness, exactly like the poll loop
+    short events = httpconn_events(_conn);
+    if (_conn->polling && events != _conn->ready && !_conn->unpoll)
+    {
+      httpring_cancel(ring, _conn, HTTPRING_POLL);
+      _conn->unpoll = true;
+    }
+    else if (!_conn->polling)
+    {
+      struct io_uring_sqe* sqe = httpring_sqe(ring, 1);
+      if (0 == sqe) return;
+      httpring_prep(sqe, IORING_OP_POLL_ADD, _conn->netsocket, _conn, HTTPRING_POLL);
+      sqe->poll32_events = (unsigned short)events;
+      _conn->polling = true;
+      _conn->ready = events;
+    }
+    return;
+  }
+
+  if (0 == _conn->sending && ((_conn->response && _conn->response->writable && _conn->queued <= _server->lowWater) ||
+                               (_conn->h2 && http2_ready(_conn->h2))))
+  {
+    // a handler that waits for the client to catch up, it did
+    httpconn_event(_conn, POLLOUT);
+    if (_conn->dead) return;
+  }
+  if (_conn->eof && (httpconn_events(_conn) & POLLIN))
+  {
+    // poll would report the hangup again once the connection reads
+    httpconn_event(_conn, POLLIN);
+    if (_conn->dead) return;
+  }
+  bool full = _conn->inLength >= HTTPD_MAX_HEADER + HTTPD_MAX_BODY;
+  if (!_conn->recving && !_conn->eof && !full)
+  {
+    struct io_uring_sqe* sqe = httpring_sqe(ring, 1);
+    if (0 == sqe) return;
+    httpring_prep(sqe, IORING_OP_RECV, _conn->netsocket, _conn, HTTPRING_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    _conn->recving = true;
+  }
+  else if (_conn->recving && full && !_conn->canceling)
+  {
+    // a pipelining client that doesn't read its responses waits for us
+    httpring_cancel(ring, _conn, HTTPRING_RECV);
+    _conn->canceling = true;
+  }
+  if (_conn->head && 0 == _conn->sending)
+  {
+    httpring_send(ring, _conn);
+  }
+}
+
+static void httpring_process( Httpd* _server, bool _blocking )
+{
+  HttpRing* ring = _server->ring;
+  for (int i = 0; i < _server->n_listeners; ++i)
+  {
+    HttpListener* listener = &_server->listeners[i];
+    struct io_uring_sqe* sqe = listener->accepting || listener->socket < 0 ? 0 : httpring_sqe(ring, 1);
+    if (sqe)
+    {
+      // the index of the listener where the connection goes otherwise
+      httpring_prep(sqe, IORING_OP_ACCEPT, listener->socket, httpring_listener(i), HTTPRING_ACCEPT);
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      listener->accepting = true;
+    }
+  }
+  if (!ring->controlling && _server->control >= 0)
+  {
+    struct io_uring_sqe* sqe = httpring_sqe(ring, 1);
+    if (sqe)
+    {
+      httpring_prep(sqe, IORING_OP_POLL_ADD, _server->control, 0, HTTPRING_CONTROL);
+      sqe->poll32_events = POLLIN;
+      ring->controlling = true;
+    }
+  }
+  for (HttpConn* conn = _server->conns; conn; conn = conn->next)
+  {
+    httpring_arm(_server, conn);
+  }
+
+  uint64_t polled = httpd_clock();
+  httpring_enter(ring, _blocking ? 1 : 0, httpd_timeout(_server, _blocking, polled));
+  uint64_t now = httpd_clock();
+  _server->arrival = now == polled ? _server->now : now;
+  _server->now = now;
+
+  unsigned int head = *ring->cqHead;
+  while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+  {
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+    __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+    httpring_complete(_server, &cqe);
+    // a handler may have waited for its sends and taken completions out
+    head = *ring->cqHead;
+  }
+  
+  httpwheel_advance(&_server->wheel, _server->now / HTTPD_TIMER_TICK);
+  httpd_sweep(_server);
+}
+
+#endif
+
+// a draining server lets every connection finish what it is doing
+static void httpconn_drain (HttpConn* _conn)
+{
+  if (_conn->dead) return;
+  if (_conn->kind == HTTPCONN_HTTP2)
+  {
+    // streams that were started are answered, new ones go to the next server
+    http2_goaway(_conn->h2, HTTP2_NO_ERROR);
+    http2_commit(_conn->h2);
+  }
+  else if (_conn->kind == HTTPCONN_WEBSOCKET)
+  {
+    httpwebsocket_close(_conn->ws, 1001, "going away");
+  }
+  else if (_conn->kind == HTTPCONN_STREAM)
+  {
+    // EventSource reconnects, to the next server
+    _conn->closing = true;
+  }
+  else if (_conn->kind == HTTPCONN_UPSTREAM && 0 == httprelay_client(_conn))
+  {
+    // pooled, nobody is going to need it
+    _conn->closing = true;
+  }
+  else if (_conn->timeout == HTTPTIMER_IDLE)
+  {
+    // keep-alive between two requests: a request that is on its way still
+    // gets an answer (with "Connection: close"), a quiet client is let go soon
+    _conn->timeout = HTTPTIMER_NONE;
+    httpconn_schedule(_conn);
+  }
+  if (_conn->closing && 0 == _conn->head)
+  {
+    httpconn_close(_conn);
+  }
+}
+
+HTTPD_C_API void httpd_drain (Httpd* _server, int _timeoutMs)
+{
+  if (_server->draining) return;
+  _server->draining = true;
+  _server->deadline = httpd_clock() + (_timeoutMs > 0 ? _timeoutMs : 0);
+#ifdef HTTPD_URING
+  // the ring keeps using the listening socket until its accept is canceled
+  for (int i = 0; _server->ring && i < _server->n_listeners; ++i)
+  {
+    if (_server->listeners[i].accepting) httpring_cancel(_server->ring, httpring_listener(i), HTTPRING_ACCEPT);
+  }
+  if (_server->ring && _server->ring->controlling) httpring_cancel(_server->ring, 0, HTTPRING_CONTROL);
+#endif
+  for (int i = 0; i < _server->n_listeners; ++i)
+  {
+    if (_server->listeners[i].socket >= 0)
+    {
+      closesocket(_server->listeners[i].socket);
+      _server->listeners[i].socket = -1;
+    }
+  }
+  if (_server->control >= 0)
+  {
+    closesocket(_server->control);
+    _server->control = -1;
+  }
+  for (HttpConn* conn = _server->conns; conn; conn = conn->next)
+  {
+    httpconn_drain(conn);
+  }
+}
+
+// a new process connected to the control socket: it gets the listening
+// socket, this one stops accepting and drains
+static void httpd_handoff (Httpd* _server)
+{
+#ifndef WIN32
+  int client = (int)accept(_server->control, 0, 0);
+  if (client < 0) return;
+  
+  char tag = 'L';
+  struct iovec iov = { &tag, 1 };
+  union { struct cmsghdr align; char data[CMSG_SPACE(sizeof(int) * HTTPD_MAX_LISTENERS)]; } control;
+  int sockets[HTTPD_MAX_LISTENERS];
+  int n = 0;
+  for (int i = 0; i < _server->n_listeners; ++i)
+  {
+    if (_server->listeners[i].socket >= 0) sockets[n++] = _server->listeners[i].socket;
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+  memcpy(CMSG_DATA(cmsg), sockets, sizeof(int) * n);
+  // one byte into an empty socket buffer doesn't block
+  bool sent = 1 == sendmsg(client, &msg, HTTPD_SEND_FLAGS);
+  closesocket(client);
+  if (sent)
+  {
+    _server->handedOff = true;
+    httpd_drain(_server, _server->drainTimeout);
+  }
+#endif
+}
+
+void httpd_process (Httpd* _server, bool _blocking)
+{
+  if ((0 == _server->n_listeners && !_server->draining) || httpd_drained(_server)) return;
+#ifdef HTTPD_URING
+  if (_server->ring)
+  {
+    httpring_process(_server, _blocking);
+    return;
+  }
+#endif
+
+  int n = _server->n_conns;
+  int l = _server->n_listeners;
+  struct pollfd* fds = (struct pollfd*) malloc((n+l+1) * sizeof(struct pollfd));
+  HttpConn** conns = (HttpConn**) malloc((n+1) * sizeof(HttpConn*));
+  if (0 == fds || 0 == conns)
+  {
+    free(fds);
+    free(conns);
+    return;
+  }
+
+  int i = 0;
+  for (HttpConn* conn = _server->conns; conn; conn = conn->next, ++i)
+  {
+    conns[i] = conn;
+    fds[i].fd = conn->netsocket;
+    fds[i].events = httpconn_events(conn);
+    fds[i].revents = 0;
+  }
+  // a draining server has neither, poll skips them
+  for (int j = 0; j <= l; ++j)
+  {
+    fds[n+j].fd = j < l ? _server->listeners[j].socket : _server->control;
+    fds[n+j].events = POLLIN;
+    fds[n+j].revents = 0;
+  }
+
+  uint64_t polled = httpd_clock();
+  int rc = poll(fds, n+l+1, httpd_timeout(_server, _blocking, polled));
+  uint64_t now = httpd_clock();
+  // events that were ready right away came in while the last batch was handled
+  _server->arrival = now == polled ? _server->now : now;
+  _server->now = now;
+  for (i = 0; rc > 0 && i < n; ++i)
+  {
+    if (fds[i].revents && !conns[i]->dead)
+    {
+      httpconn_event(conns[i], fds[i].revents);
+    }
+  }
+  bool pending[HTTPD_MAX_LISTENERS];
+  for (int j = 0; j < l; ++j)
+  {
+    pending[j] = rc > 0 && (fds[n+j].revents & POLLIN);
+  }
+  bool handoff = rc > 0 && (fds[n+l].revents & POLLIN);
+  free(fds);
+  free(conns);
+  
+  httpwheel_advance(&_server->wheel, _server->now / HTTPD_TIMER_TICK);
+  for (int j = 0; j < l; ++j)
+  {
+    if (pending[j]) httpd_accept(_server, &_server->listeners[j]);
+  }
+  if (handoff)
+  {
+    httpd_handoff(_server);
+  }
+  httpd_sweep(_server);
+}
+
+HTTPD_C_API bool httpd_set_tls (Httpd* _server, const HttpTlsBackend* _backend, const char* _certfile, const char* _keyfile)
+{
+  void* context = _backend ? _backend->create(_certfile, _keyfile) : 0;
+  if (_backend && 0 == context)
+  {
+    return false;
+  }
+#ifndef WIN32
+  // tls libraries write to the socket themselves, without MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  if (_server->tls)
+  {
+    _server->tls->destroy(_server->tlsContext);
+  }
+  _server->tls = _backend;
+  _server->tlsContext = context;
+  return true;
+}
+
+HTTPD_C_API void httpd_set_watermarks (Httpd* _server, size_t _low, size_t _high)
+{
+  _server->highWater = _high;
+  _server->lowWater = _low < _high ? _low : _high;
+}
+
+HTTPD_C_API void httpd_set_limits (Httpd* _server, int _backlog, int _maxConnections, int _maxInflight)
+{
+  if (_backlog > 0)
+  {
+    for (int i = 0; i < _server->n_listeners; ++i)
+    {
+      listen(_server->listeners[i].socket, _backlog);
+    }
+  }
+  _server->maxConns = _maxConnections > 0 ? _maxConnections : 0;
+  _server->maxInflight = _maxInflight > 0 ? _maxInflight : 0;
+}
+
+HTTPD_C_API void httpd_set_shedding (Httpd* _server, int _targetMs, int _intervalMs)
+{
+  memset(&_server->codel, 0, sizeof(_server->codel));
+  _server->codel.target = _targetMs > 0 ? _targetMs : 0;
+  _server->codel.interval = _intervalMs > 0 ? _intervalMs : HTTPD_CODEL_INTERVAL;
+}
+
+HTTPD_C_API bool httpd_set_uring (Httpd* _server, bool _enable)
+{
+#ifdef HTTPD_URING
+  if (_enable == (0 != _server->ring)) return true;
+  if (_server->conns) return false;
+  if (_server->ring)
+  {
+    httpring_destroy(_server->ring);
+    _server->ring = 0;
+    return true;
+  }
+  _server->ring = httpring_create();
+  if (0 == _server->ring) return false;
+  // splicing into a socket the client closed raises SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+  return true;
+#else
+  (void)_server;
+  return !_enable;
+#endif
+}
+
+HTTPD_C_API bool httpd_set_http2 (Httpd* _server, bool _enable)
+{
+  if (_server->tls && _server->tls->alpn)
+  {
+    if (!_server->tls->alpn(_server->tlsContext, _enable ? "h2,http/1.1" : "http/1.1")) return false;
+  }
+  else if (_server->tls && _enable)
+  {
+    // without alpn a tls client never gets to speak http/2
+    return false;
+  }
+  _server->http2 = _enable;
+  return true;
+}
+
+#ifndef WIN32
+static bool unix_address( struct sockaddr_un* _sa, const char* _path )
+{
+  memset(_sa, 0, sizeof(*_sa));
+  if (strlen(_path) >= sizeof(_sa->sun_path)) return false;
+  _sa->sun_family = AF_UNIX;
+  strcpy(_sa->sun_path, _path);
+  return true;
+}
+#endif
+
+HTTPD_C_API bool httpd_set_handoff (Httpd* _server, const char* _path, int _timeoutMs)
+{
+#ifdef WIN32
+  return false;
+#else
+  struct sockaddr_un sa;
+  if (_server->control >= 0 || _server->draining || !unix_address(&sa, _path)) return false;
+  int s = (int)socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) return false;
+  // a path left behind, or the one of the process we took over from
+  unlink(_path);
+  if (bind(s, (struct sockaddr*)&sa, sizeof(sa)) || listen(s, 1) || !set_nonblocking(s))
+  {
+    closesocket(s);
+    return false;
+  }
+  _server->control = s;
+  _server->controlPath = strdup(_path);
+  _server->drainTimeout = _timeoutMs;
+  return true;
+#endif
+}
+
+HTTPD_C_API Httpd* httpd_create_handoff (const char* _path, HttpRequestHandler _handler, void* _userdata)
+{
+#ifdef WIN32
+  return 0;
+#else
+  struct sockaddr_un sa;
+  if (!unix_address(&sa, _path)) return 0;
+  int s = (int)socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) return 0;
+  
+  int listeners[HTTPD_MAX_LISTENERS];
+  int n = 0;
+  struct timeval tv = { HTTPD_HANDOFF_TIMEOUT / 1000, (HTTPD_HANDOFF_TIMEOUT % 1000) * 1000 };
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+  if (0 == connect(s, (struct sockaddr*)&sa, sizeof(sa)))
+  {
+    char tag;
+    struct iovec iov = { &tag, 1 };
+    union { struct cmsghdr align; char data[CMSG_SPACE(sizeof(int) * HTTPD_MAX_LISTENERS)]; } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    struct cmsghdr* cmsg;
+    if (1 == recvmsg(s, &msg, 0) && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+        cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      memcpy(listeners, CMSG_DATA(cmsg), sizeof(int) * n);
+    }
+  }
+  closesocket(s);
+  if (0 == n) return 0;
+  
+  // the sockets come in the order they were added, the first one is httpd_create's
+  Httpd* server = httpd_create_socket(listeners[0], _handler, _userdata);
+  for (int i = 1; i < n; ++i)
+  {
+    if (0 == server || !httpd_add_listener(server, listeners[i])) closesocket(listeners[i]);
+  }
+  if (0 == server) closesocket(listeners[0]);
+  return server;
+#endif
+}
+
+HTTPD_C_API bool httpd_drained (Httpd* _server)
+{
+  return _server->draining && 0 == _server->n_conns;
+}
+
+
+struct _HttpRequest {
+  unsigned short  result;
+  unsigned short  port;
+  size_t          bytesUsed;
+  size_t          maxBytes;
+  // internal scratchpad
+  char            bytes[1];  
+};
+
+void* httprequest_alloc( HttpRequest* _req, size_t _size )
+{
+  char* p = _req->bytes + _req->bytesUsed;
+  _req->bytesUsed += _size;
+  return p;
+}
+
+HTTPD_C_API bool httprequest_sprintf( HttpRequest* _req, const char* _fmt, ... )
+{
+  // bytes[] has room for maxBytes and the terminating 0
+  size_t room = _req->maxBytes - _req->bytesUsed;
+  va_list ap;
+  va_start(ap,_fmt);
+  int len = vsnprintf(_req->bytes + _req->bytesUsed,room + 1,_fmt,ap);
+  va_end(ap);
+  if (len < 0 || (size_t)len > room)
+  {
+    // nothing is appended if it doesn't fit
+    _req->bytes[_req->bytesUsed] = 0;
+    return false;
+  }
+  _req->bytesUsed += len;
+  return true;
+}
+
+HTTPD_C_API void httprequest_strcat( HttpRequest* _req, const char* _orig )
+{
+  char* p = _req->bytes + _req->bytesUsed;
+  int i=0;
+  while (*_orig && _req->bytesUsed<_req->maxBytes)
+  {
+    p[i++] = *_orig++;
+    _req->bytesUsed++;
+  }
+}
+
+static char* httprequest_strdup( HttpRequest* _req, const char* _orig )
+{
+  char* p = _req->bytes + _req->bytesUsed;
+  int i=0;
+  while (*_orig && _req->bytesUsed<_req->maxBytes)
+  {
+    p[i++] = *_orig++;
+    _req->bytesUsed++;
+  }
+  p[i] = 0;
+  _req->bytesUsed++;
+  return p;
+}
+
+HTTPD_C_API HttpRequest* httprequest_create( const char* _hostname, unsigned short _port, const char* _location, const char* _method, size_t _maxBytes )
+{
+  HttpRequest* req = (HttpRequest*) calloc(1,sizeof(HttpRequest)+_maxBytes);
+  if (req)
+  {
+    req->maxBytes = _maxBytes;
+    req->bytesUsed = 0;    
+    httprequest_strdup(req,_hostname);
+    req->port = _port;    
+    httprequest_sprintf(req,"%s %s HTTP/1.1\r\n",_method,_location);
+    httprequest_strcat(req,"Host: dbalster\r\n");
+    httprequest_strcat(req,"Connection: close\r\n");
+    httprequest_strcat(req,"Content-Length: 00000000\r\n");
+    
+    httprequest_reset(req);
+  }
+  return req;
+}
+
+HTTPD_C_API void httprequest_reset( HttpRequest* _req )
+{
+  char* p = _req->bytes+1+strlen(_req->bytes);
+  p = strstr(p,"Content-Length:");
+  if (p)
+  {
+    _req->bytesUsed = p-_req->bytes;
+    httprequest_strcat(_req,"Content-Length: 00000000\r\n");
+  }
+}
+
+HTTPD_C_API HttpRequest* httprequest_clone( const HttpRequest* _template, const char* _location, size_t _maxBytes )
+{
+  // hostname, method and everything after the target are taken as they are.
+  // an executed request holds its response instead ("HTTP/1.1 200 ...", a
+  // hostname never has a '/'), there is nothing left to copy then
+  if (_template->result || 0 == strncmp(_template->bytes, "HTTP/", 5)) return 0;
+  const char* end = _template->bytes + _template->bytesUsed;
+  const char* line = _template->bytes + strlen(_template->bytes) + 1;
+  if (line >= end) return 0;
+  const char* target = strchr(line, ' ');
+  const char* version = target ? strchr(target + 1, ' ') : 0;
+  if (0 == version || version > end || 0 != strncmp(version, " HTTP/1.", 8)) return 0;
+  size_t head = target + 1 - _template->bytes;
+  size_t location = strlen(_location);
+  if (head + location + (end - version) > _maxBytes) return 0;
+  HttpRequest* req = (HttpRequest*) calloc(1,sizeof(HttpRequest)+_maxBytes);
+  if (req)
+  {
+    req->maxBytes = _maxBytes;
+    req->port = _template->port;
+    memcpy(req->bytes, _template->bytes, head);
+    memcpy(req->bytes + head, _location, location);
+    memcpy(req->bytes + head + location, version, end - version);
+    req->bytesUsed = head + location + (end - version);
+  }
+  return req;
+}
+
+static bool httprequest_error(const char* _msg, ... )
+{
+  char msg[1000];
+  va_list ap;
+  va_start(ap,_msg);
+  vsnprintf(msg,sizeof(msg),_msg,ap);
+  va_end(ap);
+  fprintf(stderr,"ERROR: %s: %s\n",strerror(errno),msg);
+  return false;
+}
+
+// terminates the header and fills in the Content-Length, returns the request
+// as it goes out (after the hostname) or 0 if it is malformed
+static char* httprequest_finish( HttpRequest* _req )
+{
+  char* hostname = _req->bytes;
+  char* start = hostname+strlen(hostname)+1;
+  char* p = strstr(start,"\r\n\r\n");
+  if (p==0)
+  {
+    httprequest_strcat(_req,"\r\n");
+    p = strstr(start,"\r\n\r\n");
+  }
+  char* contentLength = strstr(start,"Content-Length: ");
+  if (0 == p || 0 == contentLength)
+  {
+    return 0;
+  }
+  p += 4; // skip CRLFCRLF
+  char* end = _req->bytes + _req->bytesUsed;
+  int contentSize = (int)(end - p);
+  contentLength += strlen("Content-Length: ");
+  sprintf(contentLength,"%8d",contentSize);
+  contentLength[8] = '\r';
+  return start;
+}
+
+// the response to a HEAD request has no body, whatever its header says
+static bool httprequest_head( HttpRequest* _req )
+{
+  return 0 == strncmp(_req->bytes + strlen(_req->bytes) + 1, "HEAD ", 5);
+}
+
+HTTPD_C_API bool httprequest_execute( HttpRequest* _req )
+{
+  bool result = false;
+  char* hostname = _req->bytes;
+  char* start = httprequest_finish(_req);
+  if (start)
+  {
+    struct hostent* server = gethostbyname(hostname);
+    if (0==server)
+    {
+      return httprequest_error("%s", hostname);
+    }
+    int sock = (int) socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+    if (sock==-1)
+    {
+      return httprequest_error("socket()");
+    }
+    struct sockaddr_in serv_addr;
+    memset((char *) &serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    memcpy((char *)&serv_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
+    serv_addr.sin_port = htons(_req->port);
+    if (connect(sock,(struct sockaddr*)&serv_addr,sizeof(serv_addr)) < 0)
+    {
+      httprequest_error("connect()");
+    }
+    else
+    {
+      int len = strlen(start);
+      int written = send(sock,start,len,0);
+      if (written == len)
+      {
+        int read = recv(sock,_req->bytes,_req->maxBytes,0);
+        if (read>=0)
+        {
+          _req->bytes[read]=0;
+
+          if ( recv(sock,_req->bytes+read,_req->maxBytes-read,MSG_PEEK) || errno==EAGAIN)
+          {
+            int read2 = recv(sock,_req->bytes+read,_req->maxBytes-read,0);
+            if (read2>0) _req->bytes[read+read2]=0; 
+          }
+          result = true;
+        }
+      }
+    }
+    closesocket(sock);
+  }
+  else
+  {
+    httprequest_error("invalid header and content");
+  }
+  
+  return result;
+}
+
+// httprequest_submit: the same exchange on a connection of the event loop.
+// the response collects in the connection's input and is copied into the
+// request once it is complete.
+
+struct _HttpFetch
+{
+  HttpRequest*    request;
+  HttpRequestDone done;
+  void*           userdata;
+  bool            connecting;
+  bool            head;         // a HEAD request, the response has no body
+  size_t          headerLength; // of the response, 0 until it is complete
+  size_t          checked;      // how far the chunks of a chunked body are known
+  size_t          end;          // where the response ends in the input, once complete
+  HttpFraming     body;
+};
+
+HTTPD_C_API bool httprequest_submit( HttpRequest* _req, Httpd* _server, HttpRequestDone _done, void* _userdata )
+{
+  char* start = httprequest_finish(_req);
+  if (0 == start) return false;
+  char port[8];
+  sprintf(port, "%u", _req->port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* found = 0;
+  if (0 != getaddrinfo(_req->bytes, port, &hints, &found) || 0 == found) return false;
+  
+  int s = (int) socket(found->ai_family, SOCK_STREAM, IPPROTO_TCP);
+  if (s >= 0)
+  {
+    int on = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+  }
+  if (s < 0 || !set_nonblocking(s) ||
+      (0 != connect(s, found->ai_addr, (socklen_t)found->ai_addrlen) && !would_block() && errno != EINPROGRESS))
+  {
+    if (s >= 0) closesocket(s);
+    freeaddrinfo(found);
+    return false;
+  }
+  freeaddrinfo(found);
+  HttpFetch* fetch = (HttpFetch*) calloc(1,sizeof(HttpFetch));
+  HttpConn* conn = fetch ? httpconn_open(_server, s, 0, 0) : 0;
+  if (0 == conn)
+  {
+    closesocket(s);
+    free(fetch);
+    return false;
+  }
+  conn->kind = HTTPCONN_FETCH;
+  conn->ring = false;   // reads and writes of its own, the ring only polls
+  conn->fetch = fetch;
+  fetch->request = _req;
+  fetch->done = _done;
+  fetch->userdata = _userdata;
+  fetch->connecting = true;
+  fetch->head = httprequest_head(_req);
+  httpconn_schedule(conn);
+  return true;
+}
+
+// copies the complete response at _in into the request, where the accessors
+// find it
+static void httpfetch_store( HttpFetch* _fetch, HttpRequest* _req, const char* _in )
+{
+  if (_fetch->body.mode == HTTPFRAMING_CHUNKED)
+  {
+    // the chunks are joined, the trailers dropped
+    size_t length = _fetch->headerLength;
+    memcpy(_req->bytes, _in, length);
+    for (const char* p = _in + _fetch->headerLength;;)
+    {
+      size_t size = (size_t) strtoull(p, 0, 16);
+      if (0 == size) break;
+      p = (const char*) memchr(p, '\n', _in + _fetch->end - p) + 1;
+      memcpy(_req->bytes + length, p, size);
+      length += size;
+      p += size + 2;
+    }
+    _req->bytes[length] = 0;
+    _req->bytesUsed = length;
+  }
+  else
+  {
+    memcpy(_req->bytes, _in, _fetch->end);
+    _req->bytes[_fetch->end] = 0;
+    _req->bytesUsed = _fetch->end;
+  }
+  _req->result = (unsigned short) httprequest_get_result(_req);
+}
+
+// the response is complete or the exchange failed, either way it's over
+static void httpfetch_finish( HttpConn* _conn, bool _ok )
+{
+  HttpFetch* fetch = _conn->fetch;
+  HttpRequest* req = fetch->request;
+  _conn->fetch = 0;
+  httpconn_close(_conn);
+  if (_ok)
+  {
+    httpfetch_store(fetch, req, _conn->in);
+  }
+  fetch->done(req, _ok, fetch->userdata);
+  free(fetch);
+}
+
+// true once _in holds the whole response, its end is in _fetch->end then.
+// interim responses ahead of it are dropped from _in.
+static bool httpfetch_complete( HttpFetch* _fetch, char* _in, size_t* _length, bool _eof, bool* _bad )
+{
+  if (0 == _fetch->headerLength)
+  {
+    const char* eoh = 0;
+    for (size_t i = 3; i < *_length && 0 == eoh; ++i)
+    {
+      if (_in[i] == '\n' && 0 == memcmp(_in + i - 3, "\r\n\r\n", 4)) eoh = _in + i + 1;
+    }
+    if (0 == eoh) return false;
+    size_t size = eoh - _in;
+    if (size < 12 || 0 != memcmp(_in, "HTTP/1.", 7) || !httprelay_framing(_in, eoh, false, &_fetch->body))
+    {
+      *_bad = true;
+      return false;
+    }
+    int code = atoi(_in + 9);
+    if (code < 200)
+    {
+      // 100 Continue and friends, the real response follows
+      *_length -= size;
+      memmove(_in, _in + size, *_length);
+      return httpfetch_complete(_fetch, _in, _length, _eof, _bad);
+    }
+    if (_fetch->head || code == 204 || code == 304)
+    {
+      memset(&_fetch->body, 0, sizeof(_fetch->body));
+    }
+    _fetch->headerLength = _fetch->checked = size;
+  }
+  size_t body = *_length - _fetch->headerLength;
+  switch (_fetch->body.mode)
+  {
+    case HTTPFRAMING_LENGTH:
+      if (body < _fetch->body.left) return false;
+      _fetch->end = _fetch->headerLength + (size_t)_fetch->body.left;
+      return true;
+    case HTTPFRAMING_CHUNKED:
+      while (!_fetch->body.last)
+      {
+        long long piece = httpframing_chunk(&_fetch->body, _in + _fetch->checked, *_length - _fetch->checked);
+        if (piece < 0) *_bad = true;
+        if (piece <= 0 || _fetch->checked + piece > *_length)
+        {
+          _fetch->body.last = false;
+          return false;
+        }
+        _fetch->checked += piece;
+      }
+      _fetch->end = _fetch->checked;
+      return true;
+    default:
+      _fetch->end = *_length;
+      return _eof;
+  }
+}
+
+static short httpfetch_events( HttpConn* _conn )
+{
+  return _conn->fetch->connecting ? POLLOUT : POLLIN | (_conn->head ? POLLOUT : 0);
+}
+
+static bool httpfetch_event( HttpConn* _conn, short _events )
+{
+  HttpFetch* fetch = _conn->fetch;
+  if (fetch->connecting)
+  {
+    if (0 == (_events & (POLLOUT|POLLERR|POLLHUP))) return true;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (0 != getsockopt(_conn->netsocket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) || error)
+    {
+      httpfetch_finish(_conn, false);
+      return false;
+    }
+    fetch->connecting = false;
+    _conn->progress = true;
+    const char* request = fetch->request->bytes + strlen(fetch->request->bytes) + 1;
+    if (!httpconn_append(_conn, request, strlen(request)) || !httpconn_flush(_conn))
+    {
+      httpfetch_finish(_conn, false);
+      return false;
+    }
+  }
+  size_t room = fetch->request->maxBytes;
+  for (;;)
+  {
+    int n = _conn->inLength < room ? httprelay_fill(_conn, room - _conn->inLength) : -2;
+    if (n == -1) return true;
+    bool bad = false;
+    bool complete = n >= 0 && httpfetch_complete(fetch, _conn->in, &_conn->inLength, n == 0, &bad);
+    if (complete || bad || n <= 0)
+    {
+      httpfetch_finish(_conn, complete && !bad);
+      return false;
+    }
+  }
+}
+
+// httprequest_execute_batch: the requests share one connection and go out
+// back to back, one gather write (writev, WSASend on windows) for up to
+// HTTPD_BATCH_IOV pieces. the responses come back in the same order and are
+// read as they arrive, so the server never waits for the client to take them.
+
+#ifdef WIN32
+typedef WSABUF HttpPiece;
+#else
+typedef struct iovec HttpPiece;
+#endif
+
+static void httppiece_set( HttpPiece* _piece, const char* _data, size_t _size )
+{
+#ifdef WIN32
+  _piece->buf = (char*)_data;
+  _piece->len = (ULONG)_size;
+#else
+  _piece->iov_base = (void*)_data;
+  _piece->iov_len = _size;
+#endif
+}
+
+static size_t httppiece_size( const HttpPiece* _piece )
+{
+#ifdef WIN32
+  return _piece->len;
+#else
+  return _piece->iov_len;
+#endif
+}
+
+static const char* httppiece_data( const HttpPiece* _piece )
+{
+#ifdef WIN32
+  return _piece->buf;
+#else
+  return (const char*)_piece->iov_base;
+#endif
+}
+
+// what the socket took of _n pieces, -1 on errors
+static long httppiece_send( int _socket, HttpPiece* _pieces, int _n )
+{
+#ifdef WIN32
+  DWORD sent = 0;
+  return 0 == WSASend((SOCKET)_socket, _pieces, (DWORD)_n, &sent, 0, 0, 0) ? (long)sent : -1;
+#else
+  return (long) writev(_socket, _pieces, _n);
+#endif
+}
+
+HTTPD_C_API size_t httprequest_execute_batch( HttpRequest** _reqs, size_t _count )
+{
+  if (0 == _count) return 0;
+  const char* hostname = _reqs[0]->bytes;
+  // up to two pieces per request, the last of a request's pieces in ends[]
+  HttpPiece* iov = (HttpPiece*) calloc(_count, 2*sizeof(HttpPiece) + sizeof(size_t));
+  if (0 == iov) return 0;
+  size_t* ends = (size_t*)(iov + 2*_count);
+  size_t n_iov = 0;
+  size_t room = 0;
+  for (size_t i = 0; i < _count; ++i)
+  {
+    HttpRequest* req = _reqs[i];
+    req->result = 0;
+    if (req->port != _reqs[0]->port || 0 != strcmp(req->bytes, hostname))
+    {
+      free(iov);
+      httprequest_error("%s: all requests of a batch go to the same host", req->bytes);
+      return 0;
+    }
+    char* start = httprequest_finish(req);
+    if (0 == start)
+    {
+      free(iov);
+      httprequest_error("invalid header and content");
+      return 0;
+    }
+    // the connection stays open for the next request, the last one closes it
+    char* eoh = strstr(start, "\r\n\r\n");
+    char* close = i + 1 < _count ? strstr(start, "\r\nConnection: close\r\n") : 0;
+    if (close && close < eoh)
+    {
+      httppiece_set(&iov[n_iov++], start, close - start);
+      start = close + strlen("\r\nConnection: close");
+    }
+    httppiece_set(&iov[n_iov++], start, req->bytes + req->bytesUsed - start);
+    ends[i] = n_iov - 1;
+    if (req->maxBytes > room) room = req->maxBytes;
+  }
+
+  char port[8];
+  sprintf(port, "%u", _reqs[0]->port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* found = 0;
+  if (0 != getaddrinfo(hostname, port, &hints, &found) || 0 == found)
+  {
+    free(iov);
+    httprequest_error("%s", hostname);
+    return 0;
+  }
+  int sock = (int) socket(found->ai_family, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0 || 0 != connect(sock, found->ai_addr, (socklen_t)found->ai_addrlen) || !set_nonblocking(sock))
+  {
+    httprequest_error("connect()");
+    if (sock >= 0) closesocket(sock);
+    freeaddrinfo(found);
+    free(iov);
+    return 0;
+  }
+  freeaddrinfo(found);
+  int on = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+
+  // every response has to fit into its request, so the input never holds
+  // more than the largest of them
+  char* in = (char*) malloc(room);
+  size_t length = 0;
+  size_t sent = 0;    // pieces written
+  size_t done = 0;    // responses read
+  bool eof = false;
+  HttpFetch response;
+  memset(&response, 0, sizeof(response));
+  response.head = httprequest_head(_reqs[0]);
+  while (in && done < _count)
+  {
+    HttpRequest* req = _reqs[done];
+    bool bad = false;
+    if (httpfetch_complete(&response, in, &length, eof, &bad) && !bad && response.end <= req->maxBytes)
+    {
+      // a server that answers before it has the whole request is done with
+      // the connection, the rest isn't sent and the buffer is reused now
+      if (sent <= ends[done]) n_iov = sent;
+      httpfetch_store(&response, req, in);
+      length -= response.end;
+      memmove(in, in + response.end, length);
+      memset(&response, 0, sizeof(response));
+      if (++done < _count) response.head = httprequest_head(_reqs[done]);
+      continue;
+    }
+    if (bad || eof || length >= req->maxBytes) break;
+
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN | (sent < n_iov ? POLLOUT : 0);
+    pfd.revents = 0;
+    if (poll(&pfd, 1, HTTPD_FETCH_TIMEOUT) <= 0) break;
+    if (sent < n_iov && (pfd.revents & POLLOUT))
+    {
+      int n = (int)(n_iov - sent < HTTPD_BATCH_IOV ? n_iov - sent : HTTPD_BATCH_IOV);
+      long ret = httppiece_send(sock, iov + sent, n);
+      if (ret < 0 && !would_block()) break;
+      for (; ret > 0 && sent < n_iov; ++sent)
+      {
+        size_t size = httppiece_size(&iov[sent]);
+        if ((size_t)ret < size)
+        {
+          httppiece_set(&iov[sent], httppiece_data(&iov[sent]) + ret, size - ret);
+          break;
+        }
+        ret -= (long)size;
+      }
+    }
+    if (pfd.revents & (POLLIN|POLLHUP|POLLERR))
+    {
+      int ret = recv(sock, in + length, (int)(room - length), 0);
+      if (ret == 0) eof = true;
+      else if (ret > 0) length += ret;
+      else if (!would_block()) break;
+    }
+  }
+  closesocket(sock);
+  free(in);
+  free(iov);
+  return done;
+}
+
+HTTPD_C_API size_t httprequest_get_content_length( HttpRequest* _req )
+{
+  return strtoul(httprequest_get_header(_req,"Content-Length:"),0,0);
+}
+
+HTTPD_C_API const char* httprequest_get_header( HttpRequest* _req, const char* _header )
+{
+  char* p = strstr(_req->bytes,_header);
+  if (p)
+  {
+    return p+strlen(_header);
+  }
+  return 0;
+}
+
+HTTPD_C_API const char* httprequest_get_content( HttpRequest* _req )
 {
-  int                 socket;
-  void*               userdata;
-	HttpRequestHandler  handler;
-};
+  return strstr(_req->bytes,"\r\n\r\n") + 4;
+}
 
-Httpd* httpd_create ( unsigned short _port, HttpRequestHandler _handler, void* _userdata )
+HTTPD_C_API int httprequest_get_result( HttpRequest* _req )
 {
-  bool result = false;
-	Httpd* server = (Httpd*) calloc(1,sizeof(Httpd));
-		
-	server->handler = _handler;
-  server->userdata = _userdata;
+  int result = 0;
+  result = strtoul( _req->bytes + strlen("HTTP/1.1"),0,0);
+  return result;
+}
 
-  server->socket = (int) socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (server->socket == -1)
+HTTPD_C_API void httprequest_destroy( HttpRequest* _req )
+{
+  if (_req)
   {
-    printf ("socket");
+    free(_req);
   }
+}
 
-  int opt = 1;
-  if (setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)))
-  {
-    printf ("setsocketopt");
-  }
 
-  struct sockaddr_in sa;
-  sa.sin_port = htons(_port);
-  sa.sin_family = AF_INET;
-  sa.sin_addr.s_addr = INADDR_ANY;
-  if (bind(server->socket, (struct sockaddr*)&sa, sizeof(sa)))
-  {
-    printf ("bind");
-  }
+// tls backends. build with -DHTTPD_WITH_OPENSSL (-lssl -lcrypto) or
+// -DHTTPD_WITH_MBEDTLS (-lmbedtls -lmbedx509 -lmbedcrypto)
 
-  if (-1 == listen(server->socket, 5))
-  {
-    printf ("listen");
-  }
-  else
-  {
-    result = true;
-  }
+#ifdef HTTPD_WITH_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static void* openssl_create( const char* _certfile, const char* _keyfile )
+{
+  SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+  if (0 == ctx) return 0;
+  
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+  // hand the record layer to the kernel once the handshake is done
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  // resumption: a server side cache for session ids and stateless tickets
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"dbalster/httpd", 14);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, HTTPD_TLS_CACHE_SIZE);
+  SSL_CTX_set_timeout(ctx, HTTPD_TLS_SESSION_TIMEOUT);
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
   
-  if (result==false)
+  if (SSL_CTX_use_certificate_chain_file(ctx, _certfile) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, _keyfile, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1)
   {
-    httpd_destroy(server);
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
     return 0;
   }
+  return ctx;
+}
 
-  return server;
+static void openssl_destroy( void* _context )
+{
+  SSL_CTX* ctx = (SSL_CTX*)_context;
+  free(SSL_CTX_get_app_data(ctx));
+  SSL_CTX_free(ctx);
 }
 
-void httpd_destroy (Httpd* _server)
+static int openssl_alpn_select( SSL* _ssl, const unsigned char** _out, unsigned char* _outlen, const unsigned char* _in, unsigned int _inlen, void* _arg )
 {
-  if (_server)
+  (void)_arg;
+  const unsigned char* wire = (const unsigned char*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(_ssl));
+  if (0 == wire) return SSL_TLSEXT_ERR_NOACK;
+  // our preference wins, the client list only filters
+  if (OPENSSL_NPN_NEGOTIATED != SSL_select_next_proto((unsigned char**)_out, _outlen, wire + 1, wire[0], _in, _inlen))
   {
-    closesocket(_server->socket);
-    free (_server);
+    return SSL_TLSEXT_ERR_NOACK;
   }
+  return SSL_TLSEXT_ERR_OK;
 }
 
-void httpd_process (Httpd* _server, bool _blocking)
+// "h2,http/1.1" becomes length prefixed wire format, itself prefixed with its length
+static bool openssl_alpn( void* _context, const char* _protocols )
 {
-  if (-1 == _server->socket) return;
-
-  struct sockaddr_in sa;
-  int sin_size = sizeof(sa);
-
-  if (false == _blocking)
+  SSL_CTX* ctx = (SSL_CTX*)_context;
+  size_t n = strlen(_protocols);
+  if (n + 1 > 255) return false;
+  unsigned char* wire = (unsigned char*) malloc(n + 2);
+  if (0 == wire) return false;
+  wire[0] = (unsigned char)(n + 1);
+  unsigned char* len = wire + 1;
+  *len = 0;
+  for (size_t i=0; i<n; ++i)
   {
-    fd_set fds;
-    struct timeval tv;
-    int rc;
-
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-
-    FD_ZERO(&fds);
-    FD_SET(_server->socket, &fds);
-    rc = select(_server->socket + 1, &fds, NULL, NULL, &tv);
-
-    if (rc <= 0) return;
+    if (_protocols[i] == ',')
+    {
+      len = wire + 2 + i;
+      *len = 0;
+    }
+    else
+    {
+      wire[2+i] = (unsigned char)_protocols[i];
+      ++*len;
+    }
   }
+  free(SSL_CTX_get_app_data(ctx));
+  SSL_CTX_set_app_data(ctx, wire);
+  SSL_CTX_set_alpn_select_cb(ctx, openssl_alpn_select, 0);
+  return true;
+}
 
-  int client = (int)accept(_server->socket, (struct sockaddr*)&sa, (socklen_t*)&sin_size);
-  if (client < 0) return;
+static const char* openssl_protocol( void* _session )
+{
+  static char protocol[32];
+  const unsigned char* data = 0;
+  unsigned int len = 0;
+  SSL_get0_alpn_selected((SSL*)_session, &data, &len);
+  if (0 == len || len >= sizeof(protocol)) return 0;
+  memcpy(protocol, data, len);
+  protocol[len] = 0;
+  return protocol;
+}
 
-  HttpResponse* req = httpresponse_create (client); 
-  if (req)
+static void* openssl_accept( void* _context, int _socket )
+{
+  SSL* ssl = SSL_new((SSL_CTX*)_context);
+  if (ssl && 1 != SSL_set_fd(ssl, _socket))
   {
-    if (httpresponse_parse (req))
-    {
-      _server->handler(req,_server->userdata);
-    }
-    httpresponse_destroy(req);
+    SSL_free(ssl);
+    ssl = 0;
   }
-  else
+  return ssl;
+}
+
+static int openssl_result( SSL* _ssl, int _ret )
+{
+  switch (SSL_get_error(_ssl, _ret))
   {
-    closesocket(client);
+    case SSL_ERROR_NONE: return _ret;
+    case SSL_ERROR_ZERO_RETURN: return 0;
+    case SSL_ERROR_WANT_READ: return HTTPTLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE: return HTTPTLS_WANT_WRITE;
+    default:
+      ERR_clear_error();
+      return HTTPTLS_ERROR;
   }
 }
 
+static int openssl_handshake( void* _session )
+{
+  SSL* ssl = (SSL*)_session;
+  int ret = SSL_accept(ssl);
+  if (ret == 1) return HTTPTLS_OK;
+  ret = openssl_result(ssl, ret);
+  return ret < 0 ? ret : HTTPTLS_ERROR;
+}
 
-struct _HttpRequest {
-  unsigned short  result;
-  unsigned short  port;
-  size_t          bytesUsed;
-  size_t          maxBytes;
-  // internal scratchpad
-  char            bytes[1];  
-};
-
-void* httprequest_alloc( HttpRequest* _req, size_t _size )
+static int openssl_read( void* _session, void* _memory, int _size )
 {
-  char* p = _req->bytes + _req->bytesUsed;
-  _req->bytesUsed += _size;
-  return p;
+  SSL* ssl = (SSL*)_session;
+  return openssl_result(ssl, SSL_read(ssl, _memory, _size));
 }
 
-HTTPD_C_API void httprequest_sprintf( HttpRequest* _req, const char* _fmt, ... )
+static int openssl_write( void* _session, const void* _memory, int _size )
 {
-  va_list ap;
-  va_start(ap,_fmt);
-  // TODO: vsnprintf
-  int len = vsprintf(_req->bytes + _req->bytesUsed,_fmt,ap);
-  _req->bytesUsed += len;
-  va_end(ap);
+  SSL* ssl = (SSL*)_session;
+  int ret = openssl_result(ssl, SSL_write(ssl, _memory, _size));
+  return ret == 0 ? HTTPTLS_ERROR : ret;
 }
 
-HTTPD_C_API void httprequest_strcat( HttpRequest* _req, const char* _orig )
+static long openssl_sendfile( void* _session, int _fd, off_t _offset, size_t _size )
 {
-  char* p = _req->bytes + _req->bytesUsed;
-  int i=0;
-  while (*_orig && _req->bytesUsed<_req->maxBytes)
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+  SSL* ssl = (SSL*)_session;
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
   {
-    p[i++] = *_orig++;
-    _req->bytesUsed++;
+    ossl_ssize_t ret = SSL_sendfile(ssl, _fd, _offset, _size, 0);
+    if (ret >= 0) return (long)ret;
+    return would_block() ? HTTPTLS_WANT_WRITE : HTTPTLS_ERROR;
   }
+#endif
+  return HTTPTLS_UNSUPPORTED;
 }
 
-static char* httprequest_strdup( HttpRequest* _req, const char* _orig )
+static const char* openssl_info( void* _session )
 {
-  char* p = _req->bytes + _req->bytesUsed;
-  int i=0;
-  while (*_orig && _req->bytesUsed<_req->maxBytes)
-  {
-    p[i++] = *_orig++;
-    _req->bytesUsed++;
-  }
-  p[i] = 0;
-  _req->bytesUsed++;
-  return p;
+  SSL* ssl = (SSL*)_session;
+  static char info[128];
+  int ktls = 0;
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+  ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0;
+#endif
+  sprintf(info, "%s %s%s%s", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+          SSL_session_reused(ssl) ? " resumed" : "", ktls ? " ktls" : "");
+  return info;
 }
 
-HTTPD_C_API HttpRequest* httprequest_create( const char* _hostname, unsigned short _port, const char* _location, const char* _method, size_t _maxBytes )
+static void openssl_close( void* _session )
 {
-  HttpRequest* req = (HttpRequest*) calloc(1,sizeof(HttpRequest)+_maxBytes);
-  if (req)
-  {
-    req->maxBytes = _maxBytes;
-    req->bytesUsed = 0;    
-    httprequest_strdup(req,_hostname);
-    req->port = _port;    
-    httprequest_sprintf(req,"%s %s HTTP/1.1\r\n",_method,_location);
-    httprequest_strcat(req,"Host: dbalster\r\n");
-    httprequest_strcat(req,"Connection: close\r\n");
-    httprequest_strcat(req,"Content-Length: 00000000\r\n");
-    
-    httprequest_reset(req);
-  }
-  return req;
+  SSL* ssl = (SSL*)_session;
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
 }
 
-HTTPD_C_API void httprequest_reset( HttpRequest* _req )
+HTTPD_C_API const HttpTlsBackend* httpd_tls_openssl (void)
 {
-  char* p = _req->bytes+1+strlen(_req->bytes);
-  p = strstr(p,"Content-Length:");
-  if (p)
+  static const HttpTlsBackend backend =
   {
-    _req->bytesUsed = p-_req->bytes;
-    httprequest_strcat(_req,"Content-Length: 00000000\r\n");
-  }
+    openssl_create,
+    openssl_destroy,
+    openssl_accept,
+    openssl_handshake,
+    openssl_read,
+    openssl_write,
+    openssl_sendfile,
+    openssl_info,
+    openssl_close,
+    openssl_alpn,
+    openssl_protocol
+  };
+  return &backend;
 }
+#endif
 
-static bool httprequest_error(const char* _msg, ... )
+#ifdef HTTPD_WITH_MBEDTLS
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+typedef struct
 {
-  char msg[1000];
-  va_list ap;
-  va_start(ap,_msg);
-  vsprintf(msg,_msg,ap);
-  va_end(ap);
-  fprintf(stderr,"ERROR: %s: %s\n",strerror(errno),msg);
-  return false;
+  mbedtls_ssl_config        conf;
+  mbedtls_x509_crt          cert;
+  mbedtls_pk_context        key;
+  mbedtls_entropy_context   entropy;
+  mbedtls_ctr_drbg_context  drbg;
+#ifdef MBEDTLS_SSL_CACHE_C
+  mbedtls_ssl_cache_context cache;
+#endif
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  mbedtls_ssl_ticket_context tickets;
+#endif
+  char                      alpn[64];       // the config only keeps pointers
+  const char*               protocols[8];
+} MbedtlsContext;
+
+typedef struct
+{
+  mbedtls_ssl_context       ssl;
+  int                       socket;
+} MbedtlsSession;
+
+static void mbed_destroy( void* _context )
+{
+  MbedtlsContext* ctx = (MbedtlsContext*)_context;
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  mbedtls_ssl_ticket_free(&ctx->tickets);
+#endif
+#ifdef MBEDTLS_SSL_CACHE_C
+  mbedtls_ssl_cache_free(&ctx->cache);
+#endif
+  mbedtls_ssl_config_free(&ctx->conf);
+  mbedtls_x509_crt_free(&ctx->cert);
+  mbedtls_pk_free(&ctx->key);
+  mbedtls_ctr_drbg_free(&ctx->drbg);
+  mbedtls_entropy_free(&ctx->entropy);
+  free(ctx);
 }
 
-HTTPD_C_API bool httprequest_execute( HttpRequest* _req )
+static void* mbed_create( const char* _certfile, const char* _keyfile )
 {
-  bool result = false;
-  char* hostname = _req->bytes;
-  char* start = hostname+strlen(hostname)+1;
-  char* p = strstr(start,"\r\n\r\n");
-  if (p==0)
+  MbedtlsContext* ctx = (MbedtlsContext*) calloc(1,sizeof(MbedtlsContext));
+  if (0 == ctx) return 0;
+  
+  mbedtls_ssl_config_init(&ctx->conf);
+  mbedtls_x509_crt_init(&ctx->cert);
+  mbedtls_pk_init(&ctx->key);
+  mbedtls_entropy_init(&ctx->entropy);
+  mbedtls_ctr_drbg_init(&ctx->drbg);
+#ifdef MBEDTLS_SSL_CACHE_C
+  mbedtls_ssl_cache_init(&ctx->cache);
+#endif
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  mbedtls_ssl_ticket_init(&ctx->tickets);
+#endif
+  
+  bool ok =
+    0 == mbedtls_ctr_drbg_seed(&ctx->drbg, mbedtls_entropy_func, &ctx->entropy, (const unsigned char*)"dbalster/httpd", 14) &&
+    0 == mbedtls_x509_crt_parse_file(&ctx->cert, _certfile) &&
+    0 == mbedtls_pk_parse_keyfile(&ctx->key, _keyfile, 0, mbedtls_ctr_drbg_random, &ctx->drbg) &&
+    0 == mbedtls_ssl_config_defaults(&ctx->conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ok)
   {
-    httprequest_strcat(_req,"\r\n");
-    p = strstr(start,"\r\n\r\n");
+    mbedtls_ssl_conf_rng(&ctx->conf, mbedtls_ctr_drbg_random, &ctx->drbg);
+    ok = 0 == mbedtls_ssl_conf_own_cert(&ctx->conf, &ctx->cert, &ctx->key);
   }
-  if (p)
+#ifdef MBEDTLS_SSL_CACHE_C
+  if (ok)
   {
-    p += 4; // skip CRLFCRLF
-    char* end = _req->bytes + _req->bytesUsed;
-    int contentSize = (int)(end - p);
-    char* contentLength = strstr(start,"Content-Length: ") + strlen("Content-Length: ");
-    sprintf(contentLength,"%8d",contentSize);
-    contentLength[8] = '\r';
-  
-    struct hostent* server = gethostbyname(hostname);
-    if (0==server)
-    {
-      return httprequest_error(hostname);
-    }
-    int sock = (int) socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-    if (sock==-1)
-    {
-      return httprequest_error("socket()");
-    }
-    struct sockaddr_in serv_addr;
-    memset((char *) &serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    memcpy((char *)&serv_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
-    serv_addr.sin_port = htons(_req->port);
-    if (connect(sock,(struct sockaddr*)&serv_addr,sizeof(serv_addr)) < 0)
-    {
-      httprequest_error("connect()");
-    }
-    else
-    {
-      int len = strlen(start);
-      int written = send(sock,start,len,0);
-      if (written == len)
-      {
-        int read = recv(sock,_req->bytes,_req->maxBytes,0);
-        if (read>=0)
-        {
-          _req->bytes[read]=0;
-
-          if ( recv(sock,_req->bytes+read,_req->maxBytes-read,MSG_PEEK) || errno==EAGAIN)
-          {
-            int read2 = recv(sock,_req->bytes+read,_req->maxBytes-read,0);
-            if (read2>0) _req->bytes[read+read2]=0; 
-          }
-          result = true;
-        }
-      }
-    }
-    closesocket(sock);
+    mbedtls_ssl_cache_set_max_entries(&ctx->cache, HTTPD_TLS_CACHE_SIZE);
+    mbedtls_ssl_cache_set_timeout(&ctx->cache, HTTPD_TLS_SESSION_TIMEOUT);
+    mbedtls_ssl_conf_session_cache(&ctx->conf, &ctx->cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
   }
-  else
+#endif
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  if (ok && 0 == mbedtls_ssl_ticket_setup(&ctx->tickets, mbedtls_ctr_drbg_random, &ctx->drbg, MBEDTLS_CIPHER_AES_256_GCM, HTTPD_TLS_SESSION_TIMEOUT))
   {
-    httprequest_error("invalid header and content");
+    mbedtls_ssl_conf_session_tickets_cb(&ctx->conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &ctx->tickets);
   }
-  
-  return result;
+#endif
+  if (!ok)
+  {
+    mbed_destroy(ctx);
+    return 0;
+  }
+  return ctx;
 }
 
-HTTPD_C_API size_t httprequest_get_content_length( HttpRequest* _req )
+static int mbed_net_write( void* _session, const unsigned char* _memory, size_t _size )
 {
-  return strtoul(httprequest_get_header(_req,"Content-Length:"),0,0);
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  int ret = send(s->socket, (const char*)_memory, (int)_size, HTTPD_SEND_FLAGS);
+  if (ret == SOCKET_ERROR) return would_block() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+  return ret;
 }
 
-HTTPD_C_API const char* httprequest_get_header( HttpRequest* _req, const char* _header )
+static int mbed_net_read( void* _session, unsigned char* _memory, size_t _size )
 {
-  char* p = strstr(_req->bytes,_header);
-  if (p)
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  int ret = recv(s->socket, (char*)_memory, (int)_size, 0);
+  if (ret == SOCKET_ERROR) return would_block() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+  return ret;
+}
+
+static void* mbed_accept( void* _context, int _socket )
+{
+  MbedtlsContext* ctx = (MbedtlsContext*)_context;
+  MbedtlsSession* s = (MbedtlsSession*) calloc(1,sizeof(MbedtlsSession));
+  if (0 == s) return 0;
+  mbedtls_ssl_init(&s->ssl);
+  s->socket = _socket;
+  if (0 != mbedtls_ssl_setup(&s->ssl, &ctx->conf))
   {
-    return p+strlen(_header);
+    mbedtls_ssl_free(&s->ssl);
+    free(s);
+    return 0;
   }
-  return 0;
+  mbedtls_ssl_set_bio(&s->ssl, s, mbed_net_write, mbed_net_read, 0);
+  return s;
 }
 
-HTTPD_C_API const char* httprequest_get_content( HttpRequest* _req )
+static int mbed_result( int _ret )
 {
-  return strstr(_req->bytes,"\r\n\r\n") + 4;
+  if (_ret >= 0) return _ret;
+  switch (_ret)
+  {
+    case MBEDTLS_ERR_SSL_WANT_READ: return HTTPTLS_WANT_READ;
+    case MBEDTLS_ERR_SSL_WANT_WRITE: return HTTPTLS_WANT_WRITE;
+    case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY: return 0;
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+    case MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET: return HTTPTLS_WANT_READ;
+#endif
+    default: return HTTPTLS_ERROR;
+  }
 }
 
-HTTPD_C_API int httprequest_get_result( HttpRequest* _req )
+static int mbed_handshake( void* _session )
 {
-  int result = 0;
-  result = strtoul( _req->bytes + strlen("HTTP/1.1"),0,0);
-  return result;
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  int ret = mbedtls_ssl_handshake(&s->ssl);
+  return ret == 0 ? HTTPTLS_OK : mbed_result(ret) < 0 ? mbed_result(ret) : HTTPTLS_ERROR;
 }
 
-HTTPD_C_API void httprequest_destroy( HttpRequest* _req )
+static int mbed_read( void* _session, void* _memory, int _size )
 {
-  if (_req)
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  return mbed_result(mbedtls_ssl_read(&s->ssl, (unsigned char*)_memory, _size));
+}
+
+static int mbed_write( void* _session, const void* _memory, int _size )
+{
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  return mbed_result(mbedtls_ssl_write(&s->ssl, (const unsigned char*)_memory, _size));
+}
+
+static const char* mbed_info( void* _session )
+{
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  static char info[128];
+  sprintf(info, "%s %s", mbedtls_ssl_get_version(&s->ssl), mbedtls_ssl_get_ciphersuite(&s->ssl));
+  return info;
+}
+
+static bool mbed_alpn( void* _context, const char* _protocols )
+{
+#ifdef MBEDTLS_SSL_ALPN
+  MbedtlsContext* ctx = (MbedtlsContext*)_context;
+  if (strlen(_protocols) >= sizeof(ctx->alpn)) return false;
+  strcpy(ctx->alpn, _protocols);
+  int n = 0;
+  for (char* p = strtok(ctx->alpn, ","); p && n < 7; p = strtok(0, ","))
   {
-    free(_req);
+    ctx->protocols[n++] = p;
   }
+  ctx->protocols[n] = 0;
+  return 0 == mbedtls_ssl_conf_alpn_protocols(&ctx->conf, ctx->protocols);
+#else
+  return false;
+#endif
+}
+
+static const char* mbed_protocol( void* _session )
+{
+#ifdef MBEDTLS_SSL_ALPN
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  return mbedtls_ssl_get_alpn_protocol(&s->ssl);
+#else
+  return 0;
+#endif
+}
+
+static void mbed_close( void* _session )
+{
+  MbedtlsSession* s = (MbedtlsSession*)_session;
+  mbedtls_ssl_close_notify(&s->ssl);
+  mbedtls_ssl_free(&s->ssl);
+  free(s);
 }
 
+HTTPD_C_API const HttpTlsBackend* httpd_tls_mbedtls (void)
+{
+  // no ktls for mbedtls: files go through the bounce buffer
+  static const HttpTlsBackend backend =
+  {
+    mbed_create,
+    mbed_destroy,
+    mbed_accept,
+    mbed_handshake,
+    mbed_read,
+    mbed_write,
+    0,
+    mbed_info,
+    mbed_close,
+    mbed_alpn,
+    mbed_protocol
+  };
+  return &backend;
+}
+#endif
@@ -45,23 +45,254 @@ typedef struct _HttpResponse HttpResponse;
 typedef struct _HttpHeader HttpHeader;
 typedef struct _Httpd Httpd;
 typedef struct _HttpRequest HttpRequest;
+typedef struct _HttpChannel HttpChannel;
+typedef struct _HttpWebSocket HttpWebSocket;
+typedef struct _HttpTlsBackend HttpTlsBackend;
+typedef struct _HttpAsset HttpAsset;
+typedef struct _HttpBundle HttpBundle;
+typedef struct _HttpWriter HttpWriter;
+typedef struct _HttpProxy HttpProxy;
+typedef struct _HttpLog HttpLog;
+typedef struct _HttpLogRecord HttpLogRecord;
 
 typedef void  (*HttpRequestHandler)( HttpResponse* _response, void* _userdata );
 
+// tls backend results, everything >= 0 is a byte count
+enum
+{
+  HTTPTLS_OK          =  0,
+  HTTPTLS_ERROR       = -1,
+  HTTPTLS_WANT_READ   = -2,
+  HTTPTLS_WANT_WRITE  = -3,
+  HTTPTLS_UNSUPPORTED = -4
+};
+
+// a tls implementation. the library ships openssl and mbedtls backends,
+// applications can plug in their own.
+struct _HttpTlsBackend
+{
+  void*       (*create)( const char* _certfile, const char* _keyfile );
+  void        (*destroy)( void* _context );
+  void*       (*accept)( void* _context, int _socket );
+  int         (*handshake)( void* _session );
+  int         (*read)( void* _session, void* _memory, int _size );
+  int         (*write)( void* _session, const void* _memory, int _size );
+  long        (*sendfile)( void* _session, int _fd, off_t _offset, size_t _size );  // optional
+  const char* (*info)( void* _session );  // protocol and cipher, for logging
+  void        (*close)( void* _session );
+  bool        (*alpn)( void* _context, const char* _protocols );  // optional, e.g. "h2,http/1.1"
+  const char* (*protocol)( void* _session );  // optional, the protocol chosen by alpn
+};
+
+// websocket opcodes. the handler receives complete TEXT/BINARY messages and
+// one final CLOSE (with no data) after which the HttpWebSocket is gone.
+enum
+{
+  HTTPWS_CONTINUATION = 0,
+  HTTPWS_TEXT         = 1,
+  HTTPWS_BINARY       = 2,
+  HTTPWS_CLOSE        = 8,
+  HTTPWS_PING         = 9,
+  HTTPWS_PONG         = 10
+};
+
+typedef void  (*HttpWebSocketHandler)( HttpWebSocket* _ws, int _opcode, const void* _data, size_t _size, void* _userdata );
+typedef void  (*HttpWritableHandler)( HttpResponse* _context, void* _userdata );
+typedef void  (*HttpRequestDone)( HttpRequest* _req, bool _ok, void* _userdata );
+
+// what happens to a channel client that has more than _maxQueuedBytes pending
+enum
+{
+  HTTPCHANNEL_DROP_CLIENT = 0,  // disconnect it, EventSource will reconnect
+  HTTPCHANNEL_DROP_EVENT  = 1   // skip the event for this client only
+};
+
+// options of a listener, see httpd_listen
+enum
+{
+  HTTPLISTEN_NODELAY      = 1,  // TCP_NODELAY for every connection
+  HTTPLISTEN_DEFER_ACCEPT = 2,  // linux: wake up when the request is there, not after the handshake
+  HTTPLISTEN_FASTOPEN     = 4,  // a returning client may send its request with the SYN
+  HTTPLISTEN_V6ONLY       = 8   // [::] without the IPv4 clients
+};
+
 struct _HttpHeader
 {
   char* name;
   char* value;
 };
 
+// the access log is a 16 byte header ("HTTPLOG", version, record size)
+// followed by these, in native byte order
+enum
+{
+  HTTPLOG_VERSION = 1,
+  HTTPLOG_H2      = 1,    // flags: the request came on an http/2 stream
+  HTTPLOG_TLS     = 2,
+  HTTPLOG_PROXY   = 4     // forwarded to an upstream
+};
+
+struct _HttpLogRecord
+{
+  unsigned long long  time;       // us since 1970, when the response was complete
+  unsigned long long  bytes;      // response bytes, header included
+  unsigned int        duration;   // us until the response was handed to the connection
+  unsigned int        wait;       // us the request waited for the event loop
+  unsigned char       peer[16];   // IPv6, IPv4 as ::ffff:a.b.c.d, zero for unix sockets
+  unsigned int        location;   // 64 bit fnv-1a of the path without the query, the low half
+  unsigned short      status;
+  unsigned char       flags;      // HTTPLOG_H2, ...
+  char                method[4];  // "GET", "POST", "DELE", not terminated if it's longer
+  char                path[13];   // the start of the path, the same
+};
+
+// a file compiled into the program by the bundle tool (make ASSETS=dir)
+struct _HttpAsset
+{
+  const char*           path;         // "/index.html"
+  const char*           mime;
+  const unsigned char*  data;
+  size_t                size;
+  const unsigned char*  gzip;         // 0 if compressing didn't pay off
+  size_t                gzipSize;
+  const char*           etag;         // strong validators, quotes included
+  const char*           gzipEtag;
+  const char*           lastModified; // "Sun, 06 Nov 1994 08:49:37 GMT"
+  long long             modified;     // the same in seconds since 1970
+};
+
+// the assets and a perfect hash of their paths: the slot of a path is
+// httpbundle_hash(path, seeds[httpbundle_hash(path, 0) % n_seeds]) & (n_slots - 1)
+struct _HttpBundle
+{
+  const HttpAsset*      assets;
+  unsigned int          n_assets;
+  const unsigned short* seeds;
+  unsigned int          n_seeds;
+  const unsigned short* slots;        // asset index + 1, 0 for an empty slot
+  unsigned int          n_slots;      // a power of 2
+};
+
+// listens on _port for IPv6 and IPv4 clients alike (IPv4 only if the machine has no IPv6)
 HTTPD_C_API Httpd* httpd_create (unsigned short _port, HttpRequestHandler _handler, void* _userdata);
+
+// one more socket to accept on, up to HTTPD_MAX_LISTENERS: "8080" (IPv6 and
+// IPv4), "127.0.0.1:8080", "[::1]:8080", "localhost:8080", "unix:/run/app.sock"
+// (a stale socket file is replaced and the new one removed again; a file that
+// isn't a socket, or one a server still listens on, fails with EADDRINUSE),
+// "unix:@app" (linux abstract name).
+// _flags are HTTPLISTEN_*, the tcp ones don't apply to unix sockets.
+HTTPD_C_API bool httpd_listen (Httpd* _server, const char* _address, int _flags);
 HTTPD_C_API void httpd_destroy (Httpd* _server);
 HTTPD_C_API void httpd_process (Httpd* _server, bool _blocking);
+HTTPD_C_API bool httpd_set_tls (Httpd* _server, const HttpTlsBackend* _backend, const char* _certfile, const char* _keyfile);
+HTTPD_C_API const HttpTlsBackend* httpd_tls_openssl (void);  // -DHTTPD_WITH_OPENSSL
+HTTPD_C_API const HttpTlsBackend* httpd_tls_mbedtls (void);  // -DHTTPD_WITH_MBEDTLS
+
+// http/2: prior knowledge and "Upgrade: h2c" on plain sockets, alpn "h2" with tls.
+// requests of all streams are passed to the same handler as HTTP/1.1 requests,
+// and the responses are translated into frames. call after httpd_set_tls.
+HTTPD_C_API bool httpd_set_http2 (Httpd* _server, bool _enable);
+
+// io_uring instead of poll for the event loop (linux, -DHTTPD_WITH_URING):
+// multishot accept and receive, sends and file ranges batched into one system
+// call per httpd_process. false if the kernel can't do it (before 6.0), the
+// server keeps using poll then. call before the first connection.
+HTTPD_C_API bool httpd_set_uring (Httpd* _server, bool _enable);
+
+// responses never make the server wait for a slow client: whatever the socket
+// doesn't take is queued and sent by httpd_process. once a connection has _high
+// bytes queued (file ranges from httpresponse_sendfile don't count),
+// httpresponse_write and httpresponse_write_body take nothing and return 0
+// until the client is down to _low, see httpresponse_on_writable. the next
+// pipelined request waits for that, too.
+HTTPD_C_API void httpd_set_watermarks (Httpd* _server, size_t _low, size_t _high);
+
+// admission control: the kernel queues _backlog connections for accept, at most
+// _maxConnections sockets are open and at most _maxInflight requests are being
+// answered at once (0: no limit). beyond that a client gets a prepared
+// "503 Service Unavailable" with Retry-After, without parsing its request.
+HTTPD_C_API void httpd_set_limits (Httpd* _server, int _backlog, int _maxConnections, int _maxInflight);
+
+// load shedding: once requests wait longer than _targetMs for at least
+// _intervalMs, more and more of them are answered with 503 until the wait is
+// back below target (CoDel). off unless HTTPD_CODEL_TARGET is set at build
+// time, a _targetMs of 0 turns it off again.
+HTTPD_C_API void httpd_set_shedding (Httpd* _server, int _targetMs, int _intervalMs);
+
+// per client rate limits: requests whose target starts with _prefix ("" for
+// all of them) are let through at _perSecond on average and _burst at once,
+// per client address (an IPv6 client by its /64) or per value of _header,
+// an api key say, when it isn't 0 and the request has it. a request over the
+// limit is answered with "429 Too Many Requests" and Retry-After before it is
+// parsed. every rule that matches applies. the buckets are a fixed table of
+// HTTPD_RATE_SLOTS, a client under its limit costs a hash and a compare-and-swap.
+HTTPD_C_API bool httpd_add_rate_limit (Httpd* _server, const char* _prefix, const char* _header, double _perSecond, int _burst);
+
+// serve a listening socket that was inherited by fd number (exec, socket activation)
+HTTPD_C_API Httpd* httpd_create_socket (int _socket, HttpRequestHandler _handler, void* _userdata);
+
+// zero downtime restarts: the running server listens on the unix socket _path.
+// a new process that calls httpd_create_handoff with the same path gets the
+// listening socket (SCM_RIGHTS) and serves right away, the old one stops
+// accepting and drains for at most _timeoutMs.
+HTTPD_C_API bool httpd_set_handoff (Httpd* _server, const char* _path, int _timeoutMs);
+HTTPD_C_API Httpd* httpd_create_handoff (const char* _path, HttpRequestHandler _handler, void* _userdata);  // 0 if nobody serves there
+
+// stop accepting and let the connections finish: requests in progress are
+// answered with "Connection: close", idle keep-alive connections are closed,
+// http/2 clients get a GOAWAY and websockets a 1001. whatever is open after
+// _timeoutMs is closed. httpd_drained is true once nothing is left.
+HTTPD_C_API void httpd_drain (Httpd* _server, int _timeoutMs);
+HTTPD_C_API bool httpd_drained (Httpd* _server);
+
+// access log: one binary record per request, written to _path by a thread of
+// its own. the server only copies the record into a ring of the thread that
+// answered the request; when that ring is full the record is dropped and
+// counted instead of making the request wait. logdump turns the file into text.
+// the log has to outlive the servers that write to it.
+HTTPD_C_API HttpLog* httplog_open (const char* _path);
+HTTPD_C_API void httplog_close (HttpLog* _log);   // writes what's left
+HTTPD_C_API bool httplog_write (HttpLog* _log, const HttpLogRecord* _record);  // any thread, false if dropped
+HTTPD_C_API unsigned long long httplog_dropped (HttpLog* _log);
+HTTPD_C_API void httpd_set_log (Httpd* _server, HttpLog* _log);
+
+// reverse proxy: requests whose target starts with _prefix are forwarded to
+// the upstreams of the route instead of the handler, the least busy one gets
+// the next request. headers are rewritten (hop-by-hop headers dropped,
+// X-Forwarded-For/-Proto added), bodies are streamed in both directions and
+// spliced between plain sockets. idle upstream connections are pooled, at
+// most _maxIdle per upstream; a request that takes longer than _timeoutMs
+// between two bits of progress gets a 504, an unreachable upstream a 502.
+// 0 picks the default for either.
+HTTPD_C_API HttpProxy* httpd_add_proxy (Httpd* _server, const char* _prefix);
+HTTPD_C_API bool httpproxy_add_upstream (HttpProxy* _proxy, const char* _host, unsigned short _port, int _timeoutMs, int _maxIdle);
 
 HTTPD_C_API HttpRequest* httprequest_create( const char* _hostname, unsigned short _port, const char* _location, const char* _method, size_t _maxBytes );
-HTTPD_C_API void httprequest_sprintf( HttpRequest* _req, const char* _fmt, ... );
+// false if the text doesn't fit into the _maxBytes of the request, nothing is added then
+HTTPD_C_API bool httprequest_sprintf( HttpRequest* _req, const char* _fmt, ... );
 HTTPD_C_API void httprequest_strcat( HttpRequest* _req, const char* _orig );
 HTTPD_C_API bool httprequest_execute( HttpRequest* _req );
+// httprequest_execute without blocking: the exchange runs in httpd_process of
+// _server and _done is called from there exactly once, with the response in
+// _req (the accessors below apply, a chunked body is joined) or with _ok
+// false if the connection failed, timed out or the response doesn't fit into
+// _maxBytes. the name lookup still blocks, an address doesn't. false if the
+// request can't be started, _done isn't called then. _req has to stay alive
+// until _done.
+HTTPD_C_API bool httprequest_submit( HttpRequest* _req, Httpd* _server, HttpRequestDone _done, void* _userdata );
+// httprequest_execute for _count requests to the same host and port, pipelined
+// on one connection: they are written in a burst and the responses are read
+// back in order, so they all take about one round trip. returns how many got
+// their response, always the first ones: a failed connection, a server that
+// closes early or a response that doesn't fit into its request's _maxBytes
+// end the batch.
+HTTPD_C_API size_t httprequest_execute_batch( HttpRequest** _reqs, size_t _count );
+// a new request like _template (host, method, headers, body) for another
+// _location. nothing is formatted again, _template has to be one that wasn't
+// executed yet: an executed one holds its response and gives 0, as does a
+// clone that doesn't fit into _maxBytes.
+HTTPD_C_API HttpRequest* httprequest_clone( const HttpRequest* _template, const char* _location, size_t _maxBytes );
 HTTPD_C_API int httprequest_get_result( HttpRequest* _req );
 HTTPD_C_API const char* httprequest_get_header( HttpRequest* _req, const char* _header );
 HTTPD_C_API const char* httprequest_get_content( HttpRequest* _req );
@@ -73,10 +304,72 @@ HTTPD_C_API HttpResponse* httpresponse_create (unsigned int _socket);
 HTTPD_C_API void httpresponse_destroy (HttpResponse* _context);
 HTTPD_C_API bool httpresponse_parse(HttpResponse* _context);
 HTTPD_C_API bool httpresponse_response(HttpResponse* _context, unsigned int _code, const char* _content, size_t _contentLength, const char* _userHeader);
+// never waits: _size bytes, or 0 with the output queue full (nothing taken,
+// httpresponse_on_writable says when to go on), or -1 if the client is gone
 HTTPD_C_API int httpresponse_write(HttpResponse* _context, const void* _memory, const int _size);
+HTTPD_C_API long httpresponse_sendfile(HttpResponse* _context, int _fd, off_t _offset, size_t _size);
+HTTPD_C_API const char* httpresponse_tls_info(HttpResponse* _context);
+HTTPD_C_API bool httpresponse_writable(HttpResponse* _context);  // below the high watermark
+// _handler is called by httpd_process when the queue is below the low watermark,
+// for an http/2 stream once the peer's flow control window takes its data, too.
+// the response stays valid until _handler returns without registering again.
+HTTPD_C_API bool httpresponse_on_writable(HttpResponse* _context, HttpWritableHandler _handler, void* _userdata);
+// the handler returns without finishing the response, which stays valid
+// until httpresponse_on_writable continues it (from any callback of the same
+// server, a httprequest_submit say). false for the request of an h2c upgrade.
+HTTPD_C_API bool httpresponse_suspend(HttpResponse* _context);
+// _handler is called if the client goes away while the response waits for
+// on_writable or is suspended; the response is destroyed when it returns.
+HTTPD_C_API void httpresponse_on_close(HttpResponse* _context, HttpWritableHandler _handler, void* _userdata);
 HTTPD_C_API void	httpresponse_begin(HttpResponse* _context, unsigned int _code, const char* _userHeader);
+// printf formats plus %H, a string that is html escaped (&<>"' become entities)
 HTTPD_C_API int httpresponse_writef(HttpResponse* _context, const char* _fmt, ...);   
+// writes _text html escaped, a _size of 0 means strlen
+HTTPD_C_API int httpresponse_write_escaped(HttpResponse* _context, const char* _text, size_t _size);
+
+// a writer lives on the stack and collects text, html and json in its
+// buffer; it goes out in one write (or chunk) whenever the buffer is full
+// and on httpwriter_flush, which returns the bytes written so far.
+// strings with a _size of 0 are measured with strlen.
+#ifndef HTTPWRITER_SIZE
+#define HTTPWRITER_SIZE 4096
+#endif
+
+struct _HttpWriter
+{
+  HttpResponse* context;
+  int total;
+  size_t length;
+  unsigned int depth;         // json nesting
+  unsigned long long values;  // a bit per level: it has a value, the next one needs a comma
+  bool key;                   // a key was written, its value follows
+  char data[8 + HTTPWRITER_SIZE + 2];
+};
+
+HTTPD_C_API void httpwriter_init(HttpWriter* _writer, HttpResponse* _context);
+HTTPD_C_API int httpwriter_flush(HttpWriter* _writer);
+HTTPD_C_API void httpwriter_text(HttpWriter* _writer, const char* _text, size_t _size);
+HTTPD_C_API void httpwriter_html(HttpWriter* _writer, const char* _text, size_t _size);
+HTTPD_C_API void httpwriter_printf(HttpWriter* _writer, const char* _fmt, ...);
+// json values. commas are inserted for up to 64 levels of nesting, doubles
+// are written with the fewest digits that read back the same, NaN as null.
+HTTPD_C_API void httpwriter_begin_object(HttpWriter* _writer);
+HTTPD_C_API void httpwriter_end_object(HttpWriter* _writer);
+HTTPD_C_API void httpwriter_begin_array(HttpWriter* _writer);
+HTTPD_C_API void httpwriter_end_array(HttpWriter* _writer);
+HTTPD_C_API void httpwriter_key(HttpWriter* _writer, const char* _key);
+HTTPD_C_API void httpwriter_string(HttpWriter* _writer, const char* _text, size_t _size);
+HTTPD_C_API void httpwriter_int(HttpWriter* _writer, long long _value);
+HTTPD_C_API void httpwriter_uint(HttpWriter* _writer, unsigned long long _value);
+HTTPD_C_API void httpwriter_double(HttpWriter* _writer, double _value);
+HTTPD_C_API void httpwriter_bool(HttpWriter* _writer, bool _value);
+HTTPD_C_API void httpwriter_null(HttpWriter* _writer);
 HTTPD_C_API void	httpresponse_end(HttpResponse* _context);
+// a piece of the body, a chunk of its own after httpresponse_begin. like
+// httpresponse_write it's taken as a whole or, with the queue full, not at all (0)
+HTTPD_C_API int httpresponse_write_body(HttpResponse* _context, const void* _memory, size_t _size);
+// _memory has to stay valid until the response is sent, it's queued without a copy
+HTTPD_C_API int httpresponse_write_static(HttpResponse* _context, const void* _memory, size_t _size);
 HTTPD_C_API const char* httpresponse_location (HttpResponse* _context);
 HTTPD_C_API const char* httpresponse_method(HttpResponse* _context);
 HTTPD_C_API int httpresponse_get_n_args(HttpResponse* _context);
@@ -85,6 +378,36 @@ HTTPD_C_API const char* httpresponse_get_arg(HttpResponse* _context, const char*
 HTTPD_C_API const HttpHeader* httpresponse_get_arg_by_index(HttpResponse* _context, int _index);
 HTTPD_C_API const char* httpresponse_get_header(HttpResponse* _context, const char* _key);
 HTTPD_C_API const HttpHeader*	httpresponse_get_header_by_index(HttpResponse* _context, int _index);
+// the request body as it came in, terminated
+HTTPD_C_API const char* httpresponse_get_content(HttpResponse* _context, size_t* _size);
+
+// static assets straight from the program image: gzip if the client takes it,
+// ETag/Last-Modified with 304 for conditional requests, HEAD, 405 for other
+// methods. false if the location isn't in the bundle, nothing is sent then.
+HTTPD_C_API bool httpresponse_asset(HttpResponse* _context, const HttpBundle* _bundle);
+HTTPD_C_API const HttpAsset* httpbundle_find(const HttpBundle* _bundle, const char* _path);
+HTTPD_C_API unsigned int httpbundle_hash(const char* _path, unsigned int _seed);
+
+// server-sent events (text/event-stream) and long-poll.
+// httpresponse_subscribe hands the connection over to the channel, the handler
+// returns immediately. every broadcast is formatted once and queued for all
+// clients without blocking; httpd_process drains the queues.
+HTTPD_C_API HttpChannel* httpchannel_create(Httpd* _server, size_t _maxQueuedBytes, int _policy);
+HTTPD_C_API void httpchannel_destroy(HttpChannel* _channel);
+HTTPD_C_API bool httpresponse_subscribe(HttpResponse* _context, HttpChannel* _channel, bool _longpoll);
+// the number of clients reached, -1 for an _event name with CR or LF in it.
+HTTPD_C_API int httpchannel_broadcast(HttpChannel* _channel, const char* _event, const char* _data, size_t _size);
+HTTPD_C_API int httpchannel_get_n_clients(HttpChannel* _channel);
+HTTPD_C_API unsigned int httpchannel_get_n_dropped(HttpChannel* _channel);
+
+// websockets. httpresponse_websocket answers the upgrade request and hands the
+// connection over to the event loop in httpd_process (or answers 400 and returns 0).
+// message data passed to the handler is only valid during the call.
+// websockets that joined a channel receive its broadcasts as TEXT messages.
+HTTPD_C_API HttpWebSocket* httpresponse_websocket(HttpResponse* _context, HttpWebSocketHandler _handler, void* _userdata);
+HTTPD_C_API bool httpwebsocket_send(HttpWebSocket* _ws, int _opcode, const void* _data, size_t _size);
+HTTPD_C_API void httpwebsocket_close(HttpWebSocket* _ws, unsigned short _status, const char* _reason);
+HTTPD_C_API bool httpwebsocket_join(HttpWebSocket* _ws, HttpChannel* _channel);
 
 #endif
 
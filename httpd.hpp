@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) Daniel Balster
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Daniel Balster nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DANIEL BALSTER ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL DANIEL BALSTER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DBALSTER_WEBRESPONSE_HPP
+#define DBALSTER_WEBRESPONSE_HPP
+
+// C++20 on top of httpd.h, header only. routes take lambdas, a lambda that
+// returns httpd::Task is a coroutine and may co_await client requests and
+// the client catching up, driven by httpd_process like everything else:
+//
+//   httpd::Server server(8080);
+//   server.on("GET", "/hello", [](httpd::Response& r) { r.respond(200, "hello"); });
+//   server.on("GET", "/weather", [&](httpd::Response r) -> httpd::Task
+//   {
+//     httpd::Request req("localhost", 8081, "/api/weather");
+//     if (co_await req.send(server)) r.respond(200, req.content(), "Content-Type: application/json\r\n");
+//     else r.respond(502, "no weather");
+//   });
+//   server.run();
+//
+// a coroutine takes its Response by value: the response stays open as long
+// as the Response does. strings are views into the request, valid as long as
+// the Response (the Request for its response).
+
+#include <climits>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <string.h>
+
+#include "httpd.h"
+
+namespace httpd
+{
+
+class Server;
+class Response;
+
+namespace detail
+{
+  // what a Response shares with the callbacks of the library
+  struct State
+  {
+    HttpResponse*           response;   // 0 once the client is gone
+    bool                    calling;    // the route handler hasn't returned yet
+    bool                    held;       // suspended or waiting for on_writable
+    bool                    finished;   // the Response is gone
+    std::coroutine_handle<> writable;   // waits for the client to catch up
+
+    // keep the response open beyond the handler, false for http/2 streams
+    bool hold()
+    {
+      if (!held && response) held = httpresponse_suspend(response);
+      return held;
+    }
+  };
+
+  inline void finish( HttpResponse*, void* _state )
+  {
+    // nothing registered again: the library ends the response
+    delete static_cast<State*>(_state);
+  }
+
+  inline void closed( HttpResponse*, void* _state )
+  {
+    State* state = static_cast<State*>(_state);
+    state->response = nullptr;
+    if (state->finished)
+    {
+      delete state;
+    }
+    else if (state->writable)
+    {
+      // it finds the response gone
+      std::exchange(state->writable, nullptr).resume();
+    }
+  }
+
+  inline void writable( HttpResponse*, void* _state )
+  {
+    State* state = static_cast<State*>(_state);
+    state->held = false;
+    std::exchange(state->writable, nullptr).resume();
+    if (!state->finished)
+    {
+      // a coroutine that waits for something else keeps the response open
+      state->hold();
+    }
+    else if (!state->held)
+    {
+      // it ends when this returns
+      httpresponse_on_close(state->response, nullptr, nullptr);
+      delete state;
+    }
+  }
+
+  inline std::string_view view( const char* _text )
+  {
+    return _text ? std::string_view(_text) : std::string_view();
+  }
+}
+
+// the coroutine of a route. it starts right away and runs until its first
+// co_await that can't be satisfied yet; nobody waits for it, it ends with
+// its last statement.
+class Task
+{
+public:
+  struct promise_type
+  {
+    detail::State* state = nullptr;   // of the Response among the arguments
+
+    promise_type() = default;
+    template<class... A> promise_type( A&... _args ) { (find(_args), ...); }
+
+    Task get_return_object() { return Task(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+  private:
+    void find( Response& _response );
+    template<class T> void find( T& ) {}
+  };
+};
+
+namespace detail
+{
+  template<class P> State* state_of( std::coroutine_handle<P> _handle )
+  {
+    if constexpr (std::is_same_v<P, Task::promise_type>) return _handle.promise().state;
+    else return nullptr;
+  }
+}
+
+// a request and its response: only the route handler gets one, moving it
+// into a coroutine keeps the response open until the coroutine ends
+class Response
+{
+public:
+  Response( Response&& _other ) noexcept : m_state(std::exchange(_other.m_state, nullptr)) {}
+  Response& operator=( Response&& _other ) noexcept
+  {
+    if (this != &_other)
+    {
+      release();
+      m_state = std::exchange(_other.m_state, nullptr);
+    }
+    return *this;
+  }
+  Response( const Response& ) = delete;
+  Response& operator=( const Response& ) = delete;
+  ~Response() { release(); }
+
+  // false once the client is gone, everything below does nothing then
+  explicit operator bool() const { return m_state && m_state->response; }
+  HttpResponse* get() const { return m_state ? m_state->response : nullptr; }
+
+  std::string_view method() const { return get() ? detail::view(httpresponse_method(get())) : std::string_view(); }
+  std::string_view location() const { return get() ? detail::view(httpresponse_location(get())) : std::string_view(); }
+  std::string_view body() const
+  {
+    size_t size = 0;
+    const char* content = get() ? httpresponse_get_content(get(), &size) : nullptr;
+    return content ? std::string_view(content, size) : std::string_view();
+  }
+
+  // names are looked up as they came, without the colon ("Content-Type")
+  std::optional<std::string_view> header( const char* _name ) const
+  {
+    const char* value = get() ? httpresponse_get_header(get(), _name) : nullptr;
+    if (value) return std::string_view(value);
+    return std::nullopt;
+  }
+  std::optional<std::string_view> arg( const char* _name ) const
+  {
+    const char* value = get() ? httpresponse_get_arg(get(), _name) : nullptr;
+    if (value) return std::string_view(value);
+    return std::nullopt;
+  }
+
+  // for (auto [name, value] : r.headers())
+  class Fields
+  {
+  public:
+    typedef const HttpHeader* (*At)( HttpResponse*, int );
+    class iterator
+    {
+    public:
+      iterator( HttpResponse* _response, At _at, int _index ) : m_response(_response), m_at(_at), m_index(_index) {}
+      std::pair<std::string_view, std::string_view> operator*() const
+      {
+        const HttpHeader* field = m_at(m_response, m_index);
+        return { detail::view(field->name), detail::view(field->value) };
+      }
+      iterator& operator++() { ++m_index; return *this; }
+      bool operator!=( const iterator& _other ) const { return m_index != _other.m_index; }
+    private:
+      HttpResponse* m_response;
+      At            m_at;
+      int           m_index;
+    };
+    Fields( HttpResponse* _response, At _at, int _size ) : m_response(_response), m_at(_at), m_size(_size) {}
+    iterator begin() const { return iterator(m_response, m_at, 0); }
+    iterator end() const { return iterator(m_response, m_at, m_size); }
+    int size() const { return m_size; }
+  private:
+    HttpResponse* m_response;
+    At            m_at;
+    int           m_size;
+  };
+  Fields headers() const { return Fields(get(), httpresponse_get_header_by_index, get() ? httpresponse_get_n_headers(get()) : 0); }
+  Fields args() const { return Fields(get(), httpresponse_get_arg_by_index, get() ? httpresponse_get_n_args(get()) : 0); }
+
+  // _headers are complete lines ("Content-Type: text/plain\r\n"), 0 means text/html
+  void respond( unsigned int _code, std::string_view _content = std::string_view(), const char* _headers = nullptr )
+  {
+    if (get()) httpresponse_response(get(), _code, _content.empty() ? nullptr : _content.data(), _content.size(), _headers);
+  }
+  // a chunked response: begin, any number of writes, end
+  void begin( unsigned int _code, const char* _headers = nullptr )
+  {
+    if (get()) httpresponse_begin(get(), _code, _headers);
+  }
+  // false if nothing was taken: the client is gone or the queue is full,
+  // co_await writable() before the next piece
+  bool write( std::string_view _data )
+  {
+    return get() && httpresponse_write_body(get(), _data.data(), _data.size()) == (int)_data.size();
+  }
+  void end()
+  {
+    if (get()) httpresponse_end(get());
+  }
+
+  // co_await r.writable() continues once the client took most of what is
+  // queued, right away if it has room (or is gone)
+  auto writable()
+  {
+    struct Awaiter
+    {
+      detail::State* state;
+      bool await_ready() const { return 0 == state || 0 == state->response || httpresponse_writable(state->response); }
+      bool await_suspend( std::coroutine_handle<> _handle )
+      {
+        // http/2 streams are buffered as frames anyway
+        if (!httpresponse_on_writable(state->response, detail::writable, state)) return false;
+        state->held = true;
+        state->writable = _handle;
+        return true;
+      }
+      bool await_resume() const { return state && state->response; }
+    };
+    return Awaiter{ m_state };
+  }
+
+  // co_await r.read_body(): the library has the whole body before it calls
+  // the route (up to HTTPD_MAX_BODY), so this never waits
+  auto read_body()
+  {
+    struct Awaiter
+    {
+      const Response* response;
+      bool await_ready() const { return true; }
+      void await_suspend( std::coroutine_handle<> ) {}
+      std::string_view await_resume() const { return response->body(); }
+    };
+    return Awaiter{ this };
+  }
+
+private:
+  friend class Server;
+  friend struct Task::promise_type;
+  explicit Response( detail::State* _state ) : m_state(_state) {}
+
+  void release()
+  {
+    detail::State* state = std::exchange(m_state, nullptr);
+    if (0 == state) return;
+    state->finished = true;
+    if (0 == state->response)
+    {
+      delete state;
+    }
+    else if (state->held)
+    {
+      // the library ends it from httpd_process, and the state with it
+      httpresponse_on_writable(state->response, detail::finish, state);
+    }
+    // else the route handler or the writable callback is still running,
+    // the response ends when it returns
+  }
+
+  detail::State* m_state;
+};
+
+inline void Task::promise_type::find( Response& _response )
+{
+  state = _response.m_state;
+}
+
+// a client request, httprequest_* underneath. headers go in before the body.
+// a header or body that doesn't fit into _maxBytes fails the request: it is
+// false from then on and never goes out.
+class Request
+{
+public:
+  Request( const char* _host, unsigned short _port, const char* _location, const char* _method = "GET", size_t _maxBytes = 64*1024 )
+    : m_request(httprequest_create(_host, _port, _location, _method, _maxBytes)) {}
+  Request( Request&& _other ) noexcept
+    : m_request(std::exchange(_other.m_request, nullptr)), m_ok(_other.m_ok), m_overflow(_other.m_overflow) {}
+  Request& operator=( Request&& _other ) noexcept
+  {
+    std::swap(m_request, _other.m_request);
+    m_ok = _other.m_ok;
+    m_overflow = _other.m_overflow;
+    return *this;
+  }
+  Request( const Request& ) = delete;
+  Request& operator=( const Request& ) = delete;
+  ~Request() { httprequest_destroy(m_request); }
+
+  explicit operator bool() const { return 0 != m_request && !m_overflow; }
+  HttpRequest* get() const { return m_request; }
+
+  Request& header( std::string_view _name, std::string_view _value )
+  {
+    if (*this && (_name.size() > INT_MAX || _value.size() > INT_MAX ||
+        !httprequest_sprintf(m_request, "%.*s: %.*s\r\n", (int)_name.size(), _name.data(), (int)_value.size(), _value.data())))
+    {
+      fail();
+    }
+    return *this;
+  }
+  // ends the header, once
+  Request& body( std::string_view _content )
+  {
+    if (*this && (_content.size() > INT_MAX ||
+        !httprequest_sprintf(m_request, "\r\n%.*s", (int)_content.size(), _content.data())))
+    {
+      fail();
+    }
+    return *this;
+  }
+
+  // blocks, see httprequest_execute
+  bool execute()
+  {
+    m_ok = *this && httprequest_execute(m_request);
+    return m_ok;
+  }
+
+  // co_await req.send(server): the exchange runs in httpd_process, the
+  // coroutine continues when the response is complete. in a route of an
+  // http/2 stream, which can't outlive its handler, it's an execute().
+  class Sending;
+  Sending send( Server& _server );
+
+  // of the response
+  int status() const { return m_ok ? httprequest_get_result(m_request) : 0; }
+  std::optional<std::string_view> header( const char* _name ) const
+  {
+    std::string field = std::string("\r\n") + _name + ":";
+    const char* value = m_ok ? httprequest_get_header(m_request, field.c_str()) : nullptr;
+    if (0 == value) return std::nullopt;
+    while (*value == ' ' || *value == '\t') ++value;
+    const char* eol = strstr(value, "\r\n");
+    return std::string_view(value, eol ? eol - value : strlen(value));
+  }
+  std::string_view content() const
+  {
+    return m_ok && status() ? detail::view(httprequest_get_content(m_request)) : std::string_view();
+  }
+
+private:
+  void fail()
+  {
+    m_overflow = true;
+    m_ok = false;
+  }
+
+  HttpRequest* m_request;
+  bool         m_ok = false;
+  bool         m_overflow = false;   // a header or the body didn't fit
+};
+
+// the server, its routes are tried in the order they were added
+class Server
+{
+public:
+  explicit Server( unsigned short _port ) : m_routes(new Routes())
+  {
+    m_server = httpd_create(_port, dispatch, m_routes.get());
+  }
+  Server( Server&& _other ) noexcept : m_server(std::exchange(_other.m_server, nullptr)), m_routes(std::move(_other.m_routes)) {}
+  Server& operator=( Server&& _other ) noexcept
+  {
+    std::swap(m_server, _other.m_server);
+    std::swap(m_routes, _other.m_routes);
+    return *this;
+  }
+  Server( const Server& ) = delete;
+  Server& operator=( const Server& ) = delete;
+  ~Server() { if (m_server) httpd_destroy(m_server); }
+
+  explicit operator bool() const { return 0 != m_server; }
+  Httpd* get() const { return m_server; }
+
+  // _method "" takes any method, _prefix "/" any location. _handler takes a
+  // Response& (or a Response, which it may keep); one that returns a Task
+  // is a coroutine and has to take it by value.
+  template<class F> Server& on( std::string _method, std::string _prefix, F&& _handler )
+  {
+    Route route{ std::move(_method), std::move(_prefix), {} };
+    if constexpr (std::is_invocable_r_v<Task, F, Response&&>)
+    {
+      route.handler = [f = std::forward<F>(_handler)]( Response& _r ) mutable { f(std::move(_r)); };
+    }
+    else if constexpr (std::is_invocable_v<F, Response&>)
+    {
+      static_assert(!std::is_same_v<std::invoke_result_t<F, Response&>, Task>, "a coroutine route takes its Response by value");
+      route.handler = std::forward<F>(_handler);
+    }
+    else
+    {
+      route.handler = [f = std::forward<F>(_handler)]( Response& _r ) mutable { f(std::move(_r)); };
+    }
+    m_routes->list.push_back(std::move(route));
+    return *this;
+  }
+
+  void process( bool _blocking = true ) { httpd_process(m_server, _blocking); }
+  void drain( int _timeoutMs ) { httpd_drain(m_server, _timeoutMs); }
+  // until httpd_drain let everybody go
+  void run()
+  {
+    while (!httpd_drained(m_server)) httpd_process(m_server, true);
+  }
+
+private:
+  struct Route
+  {
+    std::string method;
+    std::string prefix;
+    std::function<void(Response&)> handler;
+  };
+  struct Routes
+  {
+    std::vector<Route> list;
+  };
+
+  static void dispatch( HttpResponse* _response, void* _routes )
+  {
+    const char* method = httpresponse_method(_response);
+    std::string_view location = detail::view(httpresponse_location(_response));
+    for (Route& route : static_cast<Routes*>(_routes)->list)
+    {
+      if ((route.method.empty() || route.method == method) && location.substr(0, route.prefix.size()) == route.prefix)
+      {
+        detail::State* state = new detail::State{ _response, true, false, false, nullptr };
+        httpresponse_on_close(_response, detail::closed, state);
+        {
+          Response response(state);
+          route.handler(response);
+        }
+        state->calling = false;
+        if (state->finished)
+        {
+          // a Response that was let go while the handler ran: the library
+          // ends it now, or later if it was held on the way
+          if (!state->held)
+          {
+            httpresponse_on_close(_response, nullptr, nullptr);
+            delete state;
+          }
+        }
+        else if (!state->hold())
+        {
+          // kept beyond the handler, but an http/2 stream ends here
+          httpresponse_on_close(_response, nullptr, nullptr);
+          state->response = nullptr;
+        }
+        return;
+      }
+    }
+    httpresponse_response(_response, 404, "<h1>not found</h1>", 0, 0);
+  }
+
+  Httpd*                  m_server = nullptr;
+  std::unique_ptr<Routes> m_routes;
+};
+
+class Request::Sending
+{
+public:
+  Sending( Request* _request, Httpd* _server ) : m_request(_request), m_server(_server) {}
+  bool await_ready() const { return !*m_request; }
+  template<class P> bool await_suspend( std::coroutine_handle<P> _handle )
+  {
+    detail::State* state = detail::state_of(_handle);
+    if (state && state->response && !state->hold())
+    {
+      m_request->execute();
+      return false;
+    }
+    m_handle = _handle;
+    if (!httprequest_submit(m_request->m_request, m_server, done, this))
+    {
+      m_request->m_ok = false;
+      return false;
+    }
+    return true;
+  }
+  bool await_resume() const { return m_request->m_ok; }
+
+private:
+  static void done( HttpRequest*, bool _ok, void* _self )
+  {
+    Sending* self = static_cast<Sending*>(_self);
+    self->m_request->m_ok = _ok;
+    self->m_handle.resume();
+  }
+
+  Request*                m_request;
+  Httpd*                  m_server;
+  std::coroutine_handle<> m_handle;
+};
+
+inline Request::Sending Request::send( Server& _server )
+{
+  return Sending(this, _server.get());
+}
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+// logdump prints the binary access log that httplog_open writes:
+//
+//   ./logdump access.log
+//
+// one line per request: time (UTC), client, method, path, status, response
+// bytes, duration and queue wait in microseconds, and flags (h2, tls, proxy).
+// the path is cut at 13 bytes, the location hash tells longer ones apart.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "httpd.h"
+
+static void print_record(const HttpLogRecord* r)
+{
+  char when[32], peer[INET6_ADDRSTRLEN] = "-";
+  time_t seconds = (time_t)(r->time / 1000000);
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  static const unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+  static const unsigned char none[16] = { 0 };
+  if (0 == memcmp(r->peer, mapped, 12)) inet_ntop(AF_INET, r->peer + 12, peer, sizeof(peer));
+  else if (0 != memcmp(r->peer, none, 16)) inet_ntop(AF_INET6, r->peer, peer, sizeof(peer));
+
+  printf("%s.%06uZ %s %.*s %.*s %08x %u %llu %u %u%s%s%s\n",
+         when, (unsigned int)(r->time % 1000000), peer,
+         (int)strnlen(r->method, sizeof(r->method)), r->method,
+         (int)strnlen(r->path, sizeof(r->path)), r->path, r->location,
+         r->status, r->bytes, r->duration, r->wait,
+         r->flags & HTTPLOG_H2 ? " h2" : "", r->flags & HTTPLOG_TLS ? " tls" : "",
+         r->flags & HTTPLOG_PROXY ? " proxy" : "");
+}
+
+int main (int argc, const char * argv[])
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: logdump <access.log>\n");
+    return 1;
+  }
+  FILE* in = fopen(argv[1], "rb");
+  if (0 == in)
+  {
+    fprintf(stderr, "logdump: can't read %s\n", argv[1]);
+    return 1;
+  }
+  unsigned int header[4];
+  if (1 != fread(header, sizeof(header), 1, in) || 0 != memcmp(header, "HTTPLOG", 8))
+  {
+    fprintf(stderr, "logdump: %s is no access log\n", argv[1]);
+    return 1;
+  }
+  if (header[2] != HTTPLOG_VERSION || header[3] != sizeof(HttpLogRecord))
+  {
+    fprintf(stderr, "logdump: %s has version %u with %u byte records, this is version %u\n",
+            argv[1], header[2], header[3], (unsigned int)HTTPLOG_VERSION);
+    return 1;
+  }
+  HttpLogRecord records[256];
+  size_t n;
+  while ((n = fread(records, sizeof(HttpLogRecord), 256, in)) > 0)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      print_record(&records[i]);
+    }
+  }
+  fclose(in);
+  return 0;
+}
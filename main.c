@@ -4,21 +4,13 @@
 
 #include "httpd.h"
 
-void* loadfile( const char* _filename, size_t* _size )
-{
-  void* mem = 0;
-  FILE* file = fopen(_filename,"rb");
-  if (file)
-  {
-    fseek(file, 0, SEEK_END);
-    *_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    mem = malloc(*_size);
-    fread(mem, 1, *_size, file);
-    fclose(file);
-  }
-  return mem;
-}
+// every browser that opened /events gets whatever is posted to /input
+static HttpChannel* events = 0;
+
+#ifdef HTTPD_WITH_ASSETS
+// make ASSETS=www compiles the files below www into the program, see bundle.c
+extern const HttpBundle assets;
+#endif
 
 static void indexpage( HttpResponse* R )
 {
@@ -49,7 +41,7 @@ static void svgpage( HttpResponse* R )
                      "<body>"
                      );
   
-  httpresponse_writef(R, "<h1>%s</h1>",httpresponse_location(R));
+  httpresponse_writef(R, "<h1>%H</h1>",httpresponse_location(R));
 
   httpresponse_writef(R,
    "<svg:svg version=\"1.1\">"
@@ -72,6 +64,7 @@ static void inputpage( HttpResponse* R )
   // is using a binary search
   const char* name = httpresponse_get_arg(R, "field1");
   if (name==0) name = "???";
+  else httpchannel_broadcast(events, "input", name, 0);
   
   httpresponse_begin(R,220,0);
   
@@ -81,24 +74,80 @@ static void inputpage( HttpResponse* R )
   for (size_t i=0; i<httpresponse_get_n_headers(R); ++i)
   {
     const HttpHeader* hdr = httpresponse_get_header_by_index(R, i);
-    httpresponse_writef(R,"<li><b>%s</b> : %s</li>",hdr->name,hdr->value);
+    httpresponse_writef(R,"<li><b>%H</b> : %H</li>",hdr->name,hdr->value);
   }
   httpresponse_writef(R, "<h2>http parameters (POST+GET)</h2>");
   for (size_t i=0; i<httpresponse_get_n_args(R); ++i)
   {
     const HttpHeader* hdr = httpresponse_get_arg_by_index(R, i);
-    httpresponse_writef(R,"<li><b>%s</b> : %s</li>",hdr->name,hdr->value);
+    httpresponse_writef(R,"<li><b>%H</b> : %H</li>",hdr->name,hdr->value);
   }
   
-  httpresponse_writef(R,"<html><body><form method=\"POST\" action=\"%s\">",httpresponse_location(R));
-  // yes, user input needs to be verified, but that's not the topic of this example
-  httpresponse_writef(R,"<input type=\"text\" name=\"field1\" value=\"%s\"/>",name);
+  // everything that came from the client is escaped, so it can't
+  // close the attribute or open a tag of its own
+  httpresponse_writef(R,"<html><body><form method=\"POST\" action=\"%H\">",httpresponse_location(R));
+  httpresponse_writef(R,"<input type=\"text\" name=\"field1\" value=\"");
+  httpresponse_write_escaped(R, name, 0);
+  httpresponse_writef(R,"\"/>");
   httpresponse_writef(R,"<input type=\"submit\"/>");
   httpresponse_writef(R,"</form></body></form>");
   
   httpresponse_end(R);
 }
 
+static void chatmessage( HttpWebSocket* _ws, int _opcode, const void* _data, size_t _size, void* _userdata )
+{
+  // whatever one websocket says goes to everybody on the channel,
+  // event-stream and websocket clients alike
+  if (_opcode == HTTPWS_TEXT)
+  {
+    httpchannel_broadcast(events, "chat", (const char*) _data, _size);
+  }
+}
+
+// a long response that is produced only as fast as the client reads it
+static void countpage( HttpResponse* R, void* _userdata )
+{
+  int* n = (int*) _userdata;
+  if (0 == n)
+  {
+    n = (int*) calloc(1,sizeof(int));
+    httpresponse_begin(R, 200, "Content-Type: text/plain\r\n");
+  }
+  while (*n < 1000000 && httpresponse_writable(R))
+  {
+    httpresponse_writef(R, "%d\n", (*n)++);
+  }
+  if (*n < 1000000 && httpresponse_on_writable(R, countpage, n))
+  {
+    return;
+  }
+  httpresponse_end(R);
+  free(n);
+}
+
+// json without format strings: the writer collects the values on the stack
+// and sends a chunk whenever its buffer is full
+static void samplespage( HttpResponse* R )
+{
+  HttpWriter w;
+  httpresponse_begin(R, 200, "Content-Type: application/json\r\n");
+  httpwriter_init(&w, R);
+  httpwriter_begin_object(&w);
+  httpwriter_key(&w, "sensor");
+  httpwriter_string(&w, "demo \"ramp\"", 0);
+  httpwriter_key(&w, "samples");
+  httpwriter_begin_array(&w);
+  for (int i=0; i<10000; ++i)
+  {
+    httpwriter_double(&w, 0.001 * i);
+  }
+  httpwriter_end_array(&w);
+  httpwriter_end_object(&w);
+  httpwriter_flush(&w);
+  httpresponse_end(R);
+}
+
 static void http_handler( HttpResponse* R, void* _userdata )
 {
   // normally you would use a hashtable, map or something similar here
@@ -106,14 +155,31 @@ static void http_handler( HttpResponse* R, void* _userdata )
   if (0==strcmp(loc,"/")) indexpage(R);
   else if (0==strcmp(loc,"/svg")) svgpage(R);
   else if (0==strcmp(loc,"/input")) inputpage(R);
+  else if (0==strcmp(loc,"/count")) countpage(R, 0);
+  else if (0==strcmp(loc,"/samples")) samplespage(R);
+  // the connection is handed over to the channel, the handler returns at once
+  else if (0==strcmp(loc,"/events")) httpresponse_subscribe(R, events, false);
+  else if (0==strcmp(loc,"/poll")) httpresponse_subscribe(R, events, true);
+  else if (0==strcmp(loc,"/ws"))
+  {
+    HttpWebSocket* ws = httpresponse_websocket(R, chatmessage, 0);
+    if (ws) httpwebsocket_join(ws, events);
+  }
+#ifdef HTTPD_WITH_ASSETS
+  else if (httpresponse_asset(R, &assets)) return;
+#endif
   else
   {
-    void* mem;
-    size_t size;
-    mem = loadfile(httpresponse_location(R)+1,&size);
-    if (mem)
+    // the file goes out as a file range: a slow download neither copies it
+    // into memory nor holds up the server
+    FILE* file = fopen(httpresponse_location(R)+1,"rb");
+    if (file)
     {
-      httpresponse_response(R, 220, (const char*) mem, size, "Content-Type: text/xml\r\n");
+      fseek(file, 0, SEEK_END);
+      long size = ftell(file);
+      httpresponse_response(R, 220, 0, size, "Content-Type: text/xml\r\n");
+      httpresponse_sendfile(R, fileno(file), 0, size);
+      fclose(file);
     }
     else
     {
@@ -141,9 +207,50 @@ static void download_something()
   }
 }
 
+static size_t sync_something( const char* _host, unsigned short _port )
+{
+  // the header lines are written once, every clone only gets its own target
+  HttpRequest* tmpl = httprequest_create(_host, _port, "/", "GET", 1024);
+  HttpRequest* reqs[100];
+  size_t n = 0;
+  if (tmpl)
+  {
+    httprequest_strcat(tmpl,"Accept: application/json\r\n");
+    for (n = 0; n < 100; ++n)
+    {
+      char location[64];
+      sprintf(location,"/config/%u.json",(unsigned)n);
+      if (0 == (reqs[n] = httprequest_clone(tmpl,location,16*1024))) break;
+    }
+    httprequest_destroy(tmpl);
+  }
+  // one connection, one burst of requests, the responses in the same order
+  size_t done = httprequest_execute_batch(reqs,n);
+  size_t found = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (i < done && 200 == httprequest_get_result(reqs[i]))
+    {
+      // OK, httprequest_get_content(reqs[i])
+      ++found;
+    }
+    httprequest_destroy(reqs[i]);
+  }
+  return found;
+}
+
 #ifdef WIN32
-#include <winsock.h>
-#pragma comment(lib,"wsock32.lib")
+#include <winsock2.h>
+#pragma comment(lib,"ws2_32.lib")
+#else
+#include <signal.h>
+
+// kill -TERM lets the server finish its requests before it exits
+static volatile sig_atomic_t stopping = 0;
+static void on_term (int _signal)
+{
+  stopping = 1;
+}
 #endif
 
 int main (int argc, const char * argv[])
@@ -153,17 +260,103 @@ int main (int argc, const char * argv[])
   WSAStartup(MAKEWORD(2,2),&data);
 #endif
 
-  printf("server runs on http://localhost:8080/\n(default port 80 requires admin rights)\n");
+  // HTTPD_SYNC=localhost:8080 ./httpd is a client instead: it fetches
+  // /config/0.json ... /config/99.json from there in one batch
+  const char* sync = getenv("HTTPD_SYNC");
+  if (sync && strchr(sync, ':'))
+  {
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(strchr(sync, ':') - sync), sync);
+    size_t found = sync_something(host, (unsigned short)atoi(strchr(sync, ':') + 1));
+    printf("%u of 100 files from %s\n", (unsigned)found, sync);
+    return found ? 0 : 1;
+  }
+
+  // HTTPD_PORT=8081 ./httpd runs a second instance next to the first one
+  int port = getenv("HTTPD_PORT") ? atoi(getenv("HTTPD_PORT")) : 8080;
+  printf("server runs on http://localhost:%d/\n(default port 80 requires admin rights)\n", port);
   
-  Httpd* srv = httpd_create(8080, http_handler, 0);
+  // HTTPD_HANDOFF=/tmp/httpd.sock ./httpd takes over the port from the instance
+  // that was started the same way, which then finishes its requests and exits
+  const char* handoff = getenv("HTTPD_HANDOFF");
+  Httpd* srv = handoff ? httpd_create_handoff(handoff, http_handler, 0) : 0;
+  if (0 == srv)
+  {
+    srv = httpd_create(port, http_handler, 0);
+  }
   if (srv)
   {
-    while (1)
+#ifdef HTTPD_WITH_OPENSSL
+    // ./httpd cert.pem key.pem serves https://localhost:8080/ instead
+    if (argc == 3 && !httpd_set_tls(srv, httpd_tls_openssl(), argv[1], argv[2]))
+    {
+      printf("can't load %s / %s\n", argv[1], argv[2]);
+    }
+#endif
+    httpd_set_http2(srv, true);
+#ifdef HTTPD_WITH_URING
+    // HTTPD_URING=1 ./httpd serves the same pages with io_uring, to compare the two
+    if (getenv("HTTPD_URING") && !httpd_set_uring(srv, true))
     {
+      printf("io_uring is not available, using poll\n");
+    }
+#endif
+    // HTTPD_LISTEN=unix:/tmp/httpd.sock ./httpd serves the same pages there, try
+    // curl --unix-socket /tmp/httpd.sock http://localhost/
+    if (getenv("HTTPD_LISTEN") && !httpd_listen(srv, getenv("HTTPD_LISTEN"), HTTPLISTEN_NODELAY | HTTPLISTEN_DEFER_ACCEPT))
+    {
+      printf("can't listen on %s\n", getenv("HTTPD_LISTEN"));
+    }
+    // HTTPD_RATE=20 ./httpd answers a client with 429 beyond 20 requests a second
+    if (getenv("HTTPD_RATE"))
+    {
+      double rate = atof(getenv("HTTPD_RATE"));
+      httpd_add_rate_limit(srv, "", 0, rate, (int)rate + 1);
+    }
+    // HTTPD_UPSTREAM=localhost:8081 ./httpd forwards /api/... to the other instance
+    const char* upstream = getenv("HTTPD_UPSTREAM");
+    if (upstream && strchr(upstream, ':'))
+    {
+      char host[256];
+      snprintf(host, sizeof(host), "%.*s", (int)(strchr(upstream, ':') - upstream), upstream);
+      HttpProxy* api = httpd_add_proxy(srv, "/api/");
+      if (0 == api || !httpproxy_add_upstream(api, host, (unsigned short)atoi(strchr(upstream, ':') + 1), 0, 0))
+      {
+        printf("can't proxy to %s\n", upstream);
+      }
+    }
+    // HTTPD_LOG=access.log ./httpd writes a record per request, ./logdump access.log reads them
+    HttpLog* log = getenv("HTTPD_LOG") ? httplog_open(getenv("HTTPD_LOG")) : 0;
+    if (log)
+    {
+      httpd_set_log(srv, log);
+    }
+    if (handoff && !httpd_set_handoff(srv, handoff, 30000))
+    {
+      printf("can't listen on %s\n", handoff);
+    }
+#ifndef WIN32
+    signal(SIGTERM, on_term);
+#endif
+    events = httpchannel_create(srv, 0, HTTPCHANNEL_DROP_CLIENT);
+    while (!httpd_drained(srv))
+    {
+#ifndef WIN32
+      if (stopping)
+      {
+        httpd_drain(srv, 30000);
+      }
+#endif
       // httpd_process can be used in polling or waiting mode
       httpd_process(srv, true);
     }
+    httpchannel_destroy(events);
     httpd_destroy(srv);
+    if (log && httplog_dropped(log))
+    {
+      printf("%llu access log records dropped\n", httplog_dropped(log));
+    }
+    httplog_close(log);
   }
 
   return 0;
@@ -0,0 +1,255 @@
+// hpack against the examples of RFC 7541 appendix C: integers, single
+// literals, the request and response sequences with and without huffman
+// coding, eviction and dynamic table size updates.
+
+#include "../httpd.c"
+
+static int failures;
+#define CHECK(_x) do { if (!(_x)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_x); ++failures; } } while (0)
+
+// "8286 84be" to bytes
+static size_t hex( unsigned char* _out, const char* _text )
+{
+  size_t n = 0;
+  for (; *_text; ++_text)
+  {
+    if (*_text == ' ') continue;
+    unsigned int b;
+    sscanf(_text, "%2x", &b);
+    _out[n++] = (unsigned char)b;
+    ++_text;
+  }
+  return n;
+}
+
+// the decoded header list, one "name: value\n" per field
+static void collect( void* _user, const char* _name, const char* _value )
+{
+  HttpBytes* list = (HttpBytes*)_user;
+  httpbytes_append(list, _name, strlen(_name));
+  httpbytes_append(list, ": ", 2);
+  httpbytes_append(list, _value, strlen(_value));
+  httpbytes_append(list, "\n", 1);
+}
+
+static bool decodes( HpackTable* _table, const char* _block, const char* _expected )
+{
+  unsigned char block[512];
+  size_t size = hex(block, _block);
+  HttpBytes scratch = {0, 0, 0};
+  HttpBytes list = {0, 0, 0};
+  bool ok = hpack_decode(_table, &scratch, block, size, collect, &list);
+  httpbytes_append(&list, "", 1);
+  if (ok && 0 != strcmp(list.data, _expected))
+  {
+    fprintf(stderr, "decoded:\n%s", list.data);
+    ok = false;
+  }
+  httpbytes_free(&scratch);
+  httpbytes_free(&list);
+  return ok;
+}
+
+// the dynamic table, newest first, "name: value\n" per entry
+static bool holds( HpackTable* _table, size_t _size, const char* _expected )
+{
+  HttpBytes list = {0, 0, 0};
+  for (int i = 0; i < _table->count; ++i)
+  {
+    collect(&list, _table->entries[i].name, _table->entries[i].value);
+  }
+  httpbytes_append(&list, "", 1);
+  bool ok = _table->size == _size && 0 == strcmp(list.data, _expected);
+  if (!ok) fprintf(stderr, "table (%zu):\n%s", _table->size, list.data);
+  httpbytes_free(&list);
+  return ok;
+}
+
+// the fields, each one indexed, encode to _block
+static bool encodes( HpackTable* _table, const char* const* _fields, const char* _block )
+{
+  unsigned char block[512];
+  size_t size = hex(block, _block);
+  HttpBytes out = {0, 0, 0};
+  for (; *_fields; _fields += 2)
+  {
+    hpack_encode_field(_table, &out, _fields[0], _fields[1], true);
+  }
+  bool ok = out.length == size && 0 == memcmp(out.data, block, size);
+  if (!ok)
+  {
+    for (size_t i = 0; i < out.length; ++i) fprintf(stderr, "%02x", (unsigned char)out.data[i]);
+    fprintf(stderr, "\n");
+  }
+  httpbytes_free(&out);
+  return ok;
+}
+
+static bool encodes_int( int _prefix, unsigned int _value, const char* _block )
+{
+  unsigned char block[16];
+  size_t size = hex(block, _block);
+  HttpBytes out = {0, 0, 0};
+  hpack_encode_int(&out, 0, _prefix, _value);
+  bool ok = out.length == size && 0 == memcmp(out.data, block, size);
+  const unsigned char* p = block;
+  unsigned int value = 0;
+  ok = ok && hpack_decode_int(&p, block + size, _prefix, &value) && value == _value && p == block + size;
+  httpbytes_free(&out);
+  return ok;
+}
+
+static const char request1[] =
+  ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n";
+static const char request2[] =
+  ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n";
+static const char request3[] =
+  ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n";
+static const char* const request1_fields[] =
+  { ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com", 0 };
+static const char* const request2_fields[] =
+  { ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com", "cache-control", "no-cache", 0 };
+static const char* const request3_fields[] =
+  { ":method", "GET", ":scheme", "https", ":path", "/index.html", ":authority", "www.example.com", "custom-key", "custom-value", 0 };
+static const char table1[] = ":authority: www.example.com\n";
+static const char table2[] = "cache-control: no-cache\n:authority: www.example.com\n";
+static const char table3[] = "custom-key: custom-value\ncache-control: no-cache\n:authority: www.example.com\n";
+
+static const char response1[] =
+  ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n";
+static const char response2[] =
+  ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n";
+static const char response3[] =
+  ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\n"
+  "content-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n";
+static const char* const response1_fields[] =
+  { ":status", "302", "cache-control", "private", "date", "Mon, 21 Oct 2013 20:13:21 GMT", "location", "https://www.example.com", 0 };
+static const char* const response2_fields[] =
+  { ":status", "307", "cache-control", "private", "date", "Mon, 21 Oct 2013 20:13:21 GMT", "location", "https://www.example.com", 0 };
+static const char* const response3_fields[] =
+  { ":status", "200", "cache-control", "private", "date", "Mon, 21 Oct 2013 20:13:22 GMT", "location", "https://www.example.com",
+    "content-encoding", "gzip", "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1", 0 };
+static const char rtable1[] =
+  "location: https://www.example.com\ndate: Mon, 21 Oct 2013 20:13:21 GMT\ncache-control: private\n:status: 302\n";
+static const char rtable2[] =
+  ":status: 307\nlocation: https://www.example.com\ndate: Mon, 21 Oct 2013 20:13:21 GMT\ncache-control: private\n";
+static const char rtable3[] =
+  "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\ncontent-encoding: gzip\n"
+  "date: Mon, 21 Oct 2013 20:13:22 GMT\n";
+
+static const char c4_1[] = "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff";
+static const char c4_2[] = "8286 84be 5886 a8eb 1064 9cbf";
+static const char c4_3[] = "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf";
+
+static const char c6_1[] =
+  "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 "
+  "e9ae 82ae 43d3";
+static const char c6_2[] = "4883 640e ffc1 c0bf";
+static const char c6_3[] =
+  "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b "
+  "3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07";
+
+int main( void )
+{
+  // C.1 integers
+  CHECK(encodes_int(5, 10, "0a"));
+  CHECK(encodes_int(5, 1337, "1f9a 0a"));
+  CHECK(encodes_int(8, 42, "2a"));
+
+  // C.2 one field each, with, without and never indexed, then an indexed one
+  HpackTable table;
+  memset(&table, 0, sizeof(table));
+  table.maxSize = HTTP2_TABLE_SIZE;
+  CHECK(decodes(&table, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", "custom-key: custom-header\n"));
+  CHECK(holds(&table, 55, "custom-key: custom-header\n"));
+  hpack_free(&table);
+  memset(&table, 0, sizeof(table));
+  table.maxSize = HTTP2_TABLE_SIZE;
+  CHECK(decodes(&table, "040c 2f73 616d 706c 652f 7061 7468", ":path: /sample/path\n"));
+  CHECK(decodes(&table, "1008 7061 7373 776f 7264 0673 6563 7265 74", "password: secret\n"));
+  CHECK(decodes(&table, "82", ":method: GET\n"));
+  CHECK(holds(&table, 0, ""));
+  hpack_free(&table);
+
+  // C.3 requests without huffman coding, one connection
+  memset(&table, 0, sizeof(table));
+  table.maxSize = HTTP2_TABLE_SIZE;
+  CHECK(decodes(&table, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", request1));
+  CHECK(holds(&table, 57, table1));
+  CHECK(decodes(&table, "8286 84be 5808 6e6f 2d63 6163 6865", request2));
+  CHECK(holds(&table, 110, table2));
+  CHECK(decodes(&table, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", request3));
+  CHECK(holds(&table, 164, table3));
+
+  // dynamic table size updates: 0 empties it, more than we announced is an error
+  CHECK(decodes(&table, "20", ""));
+  CHECK(holds(&table, 0, ""));
+  CHECK(decodes(&table, "3fe1 1f", ""));
+  CHECK(table.maxSize == 4096);
+  CHECK(!decodes(&table, "3fe2 1f", ""));
+  hpack_free(&table);
+
+  // C.4 the same requests huffman coded, decoded and encoded
+  HpackTable encoder;
+  memset(&table, 0, sizeof(table));
+  memset(&encoder, 0, sizeof(encoder));
+  table.maxSize = encoder.maxSize = HTTP2_TABLE_SIZE;
+  CHECK(decodes(&table, c4_1, request1));
+  CHECK(holds(&table, 57, table1));
+  CHECK(encodes(&encoder, request1_fields, c4_1));
+  CHECK(decodes(&table, c4_2, request2));
+  CHECK(holds(&table, 110, table2));
+  CHECK(encodes(&encoder, request2_fields, c4_2));
+  CHECK(decodes(&table, c4_3, request3));
+  CHECK(holds(&table, 164, table3));
+  CHECK(encodes(&encoder, request3_fields, c4_3));
+  CHECK(holds(&encoder, 164, table3));
+  hpack_free(&table);
+  hpack_free(&encoder);
+
+  // C.5 responses without huffman coding in a 256 byte table, which evicts
+  memset(&table, 0, sizeof(table));
+  table.maxSize = 256;
+  CHECK(decodes(&table,
+    "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 "
+    "7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", response1));
+  CHECK(holds(&table, 222, rtable1));
+  CHECK(decodes(&table, "4803 3330 37c1 c0bf", response2));
+  CHECK(holds(&table, 222, rtable2));
+  CHECK(decodes(&table,
+    "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 "
+    "444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e "
+    "3d31", response3));
+  CHECK(holds(&table, 215, rtable3));
+  hpack_free(&table);
+
+  // C.6 the same responses huffman coded, decoded and encoded
+  memset(&table, 0, sizeof(table));
+  memset(&encoder, 0, sizeof(encoder));
+  table.maxSize = encoder.maxSize = 256;
+  CHECK(decodes(&table, c6_1, response1));
+  CHECK(holds(&table, 222, rtable1));
+  CHECK(encodes(&encoder, response1_fields, c6_1));
+  CHECK(decodes(&table, c6_2, response2));
+  CHECK(holds(&table, 222, rtable2));
+  // "307" is no shorter huffman coded, the encoder keeps it literal as in C.5.2
+  CHECK(encodes(&encoder, response2_fields, "4803 3330 37c1 c0bf"));
+  CHECK(decodes(&table, c6_3, response3));
+  CHECK(holds(&table, 215, rtable3));
+  CHECK(encodes(&encoder, response3_fields, c6_3));
+  CHECK(holds(&encoder, 215, rtable3));
+
+  // an entry larger than the whole table empties it and isn't added (4.4)
+  table.maxSize = 60;
+  CHECK(decodes(&table, "20", ""));
+  CHECK(decodes(&table, "3f1d", ""));
+  CHECK(decodes(&table, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", "custom-key: custom-header\n"));
+  CHECK(holds(&table, 55, "custom-key: custom-header\n"));
+  CHECK(decodes(&table, "4003 6b65 791c 6120 7661 6c75 6520 7468 6174 2069 7320 6661 7220 746f 6f20 6c6f 6e67", "key: a value that is far too long\n"));
+  CHECK(holds(&table, 0, ""));
+  hpack_free(&table);
+  hpack_free(&encoder);
+
+  printf("hpack: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
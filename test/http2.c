@@ -0,0 +1,185 @@
+// http/2 flow control: a response waits for the peer's window with no more
+// than the high watermark buffered, goes on when WINDOW_UPDATEs open it and
+// is closed when the peer never does.
+
+#define HTTPD_SEND_TIMEOUT 1000
+#include "../httpd.c"
+
+#include <pthread.h>
+
+#define HTTP2_PORT 18491
+#define HTTP2_NUMBERS 100000
+#define HTTP2_LENGTH 588890   // "0\n" to "99999\n"
+#define HTTP2_STREAMS 8
+
+static int failures;
+#define CHECK(_x) do { if (!(_x)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_x); ++failures; } } while (0)
+
+static volatile bool stop;
+static size_t most;     // the most a stream had buffered, server thread only
+static volatile int closed;
+
+static void count_closed( HttpResponse* _context, void* _userdata )
+{
+  (void)_context;
+  free(_userdata);
+  ++closed;
+}
+
+// like the demo's /count, only as fast as the client reads it
+static void count_handler( HttpResponse* _context, void* _userdata )
+{
+  int* n = (int*)_userdata;
+  if (0 == n)
+  {
+    n = (int*) calloc(1,sizeof(int));
+    httpresponse_on_close(_context, count_closed, n);
+    httpresponse_begin(_context, 200, "Content-Type: text/plain\r\n");
+  }
+  while (*n < HTTP2_NUMBERS && httpresponse_writable(_context))
+  {
+    httpresponse_writef(_context, "%d\n", (*n)++);
+  }
+  if (httpresponse_queued(_context) > most) most = httpresponse_queued(_context);
+  if (*n < HTTP2_NUMBERS && httpresponse_on_writable(_context, count_handler, n))
+  {
+    return;
+  }
+  httpresponse_on_close(_context, 0, 0);
+  httpresponse_end(_context);
+  free(n);
+}
+
+static void* http2_server( void* _server )
+{
+  while (!stop) httpd_process((Httpd*)_server, false);
+  return 0;
+}
+
+static void put_frame( unsigned char* _out, size_t* _at, int _type, int _flags, unsigned int _stream, const void* _payload, size_t _length )
+{
+  unsigned char* h = _out + *_at;
+  h[0] = (unsigned char)(_length >> 16);
+  h[1] = (unsigned char)(_length >> 8);
+  h[2] = (unsigned char)_length;
+  h[3] = (unsigned char)_type;
+  h[4] = (unsigned char)_flags;
+  h[5] = (unsigned char)(_stream >> 24);
+  h[6] = (unsigned char)(_stream >> 16);
+  h[7] = (unsigned char)(_stream >> 8);
+  h[8] = (unsigned char)_stream;
+  memcpy(h + 9, _payload, _length);
+  *_at += 9 + _length;
+}
+
+// the preface, SETTINGS with the initial window and a GET /count per stream
+static int open_session( unsigned int _window )
+{
+  int sock = (int) socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(HTTP2_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(0 == connect(sock, (struct sockaddr*)&addr, sizeof(addr)));
+  struct timeval tv = { 10, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+
+  unsigned char out[1024];
+  size_t at = 24;
+  memcpy(out, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+  unsigned char settings[6] = { 0, 4, (unsigned char)(_window >> 24), (unsigned char)(_window >> 16), (unsigned char)(_window >> 8), (unsigned char)_window };
+  put_frame(out, &at, HTTP2_SETTINGS, 0, 0, settings, 6);
+  // :method GET, :scheme http, :path /count and :authority test without indexing
+  static const unsigned char get[] = { 0x82, 0x86, 0x04, 6, '/', 'c', 'o', 'u', 'n', 't', 0x01, 4, 't', 'e', 's', 't' };
+  for (unsigned int i = 0; i < HTTP2_STREAMS; ++i)
+  {
+    put_frame(out, &at, HTTP2_HEADERS, HTTP2_END_HEADERS | HTTP2_END_STREAM, 1 + 2*i, get, sizeof(get));
+  }
+  CHECK((int)at == send(sock, out, at, MSG_NOSIGNAL));
+  return sock;
+}
+
+static bool read_all( int _sock, unsigned char* _out, size_t _size )
+{
+  while (_size)
+  {
+    int n = (int) recv(_sock, _out, _size, 0);
+    if (n <= 0) return false;
+    _out += n;
+    _size -= n;
+  }
+  return true;
+}
+
+// a peer that reads everything and credits it back: every stream ends
+static void flowing( void )
+{
+  int sock = open_session(65535);
+  size_t received[HTTP2_STREAMS] = { 0 };
+  int ended = 0;
+  unsigned char h[9];
+  static unsigned char p[HTTP2_MAX_FRAME];
+  while (ended < HTTP2_STREAMS && read_all(sock, h, 9))
+  {
+    size_t length = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+    unsigned int id = ((unsigned int)h[5] << 24 | h[6] << 16 | h[7] << 8 | h[8]) & 0x7fffffff;
+    if (!read_all(sock, p, length)) break;
+    if (h[3] != HTTP2_DATA || 0 == id || id > 2*HTTP2_STREAMS) continue;
+    received[id/2] += length;
+    if (h[4] & HTTP2_END_STREAM) ++ended;
+    if (length)
+    {
+      unsigned char update[26];
+      unsigned char credit[4] = { (unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length };
+      size_t at = 0;
+      put_frame(update, &at, HTTP2_WINDOW_UPDATE, 0, 0, credit, 4);
+      put_frame(update, &at, HTTP2_WINDOW_UPDATE, 0, id, credit, 4);
+      send(sock, update, at, MSG_NOSIGNAL);
+    }
+  }
+  CHECK(ended == HTTP2_STREAMS);
+  for (int i = 0; i < HTTP2_STREAMS; ++i)
+  {
+    CHECK(received[i] == HTTP2_LENGTH);
+  }
+  close(sock);
+}
+
+// a peer with a window of one byte that never opens it: the responses wait
+// with bounded buffers and the connection is closed after the send timeout
+static void stalled( Httpd* _server )
+{
+  closed = 0;
+  int sock = open_session(1);
+  uint64_t start = httpd_clock();
+  char scratch[4096];
+  int n;
+  while ((n = (int) recv(sock, scratch, sizeof(scratch), 0)) > 0) {}
+  CHECK(0 == n);
+  CHECK(httpd_clock() - start < 5000);
+  close(sock);
+  // the server thread destroys the streams when it closes the connection
+  for (int i = 0; i < 100 && closed < HTTP2_STREAMS; ++i) usleep(10000);
+  CHECK(closed == HTTP2_STREAMS);
+  CHECK(most >= _server->highWater && most < _server->highWater + _server->lowWater);
+}
+
+int main( void )
+{
+  Httpd* server = httpd_create(HTTP2_PORT, count_handler, 0);
+  CHECK(server);
+  if (0 == server) return 1;
+  CHECK(httpd_set_http2(server, true));
+  pthread_t thread;
+  pthread_create(&thread, 0, http2_server, server);
+
+  flowing();
+  stalled(server);
+
+  stop = true;
+  pthread_join(thread, 0);
+  httpd_destroy(server);
+  printf("http2: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
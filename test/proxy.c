@@ -0,0 +1,338 @@
+// the reverse proxy over loopback: pooled upstream connections, least
+// connections, 504 for an upstream that doesn't answer in time, 502 for one
+// that refuses the connection, chunked request bodies and the framing a
+// request smuggler would try.
+
+#include "../httpd.c"
+
+#include <pthread.h>
+
+#define PROXY_PORT 18480
+
+static int failures;
+#define CHECK(_x) do { if (!(_x)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_x); ++failures; } } while (0)
+
+static volatile bool stop;
+static volatile bool released;
+
+// a minimal upstream: a thread per connection, requests one after the other
+typedef struct
+{
+  const char*   name;
+  unsigned short port;
+  int           listener;
+  volatile int  accepted;
+  volatile int  requests;
+  char          last[4096];   // the last request as it arrived, header and body
+} Upstream;
+
+typedef struct
+{
+  Upstream* upstream;
+  int       sock;
+} UpstreamConn;
+
+static void sleep_ms( int _ms )
+{
+  struct timespec t = { _ms / 1000, (_ms % 1000) * 1000000L };
+  nanosleep(&t, 0);
+}
+
+// the end of a request or response in _data, 0 if it isn't complete yet
+static size_t message_end( const char* _data, size_t _length )
+{
+  const char* eoh = strstr(_data, "\r\n\r\n");
+  if (0 == eoh) return 0;
+  size_t header = eoh + 4 - _data;
+  const char* te = strcasestr(_data, "\r\nTransfer-Encoding: chunked");
+  if (te && te < eoh)
+  {
+    const char* last = strstr(eoh + 2, "\r\n0\r\n\r\n");
+    return last ? last + 7 - _data : 0;
+  }
+  const char* cl = strcasestr(_data, "\r\nContent-Length:");
+  size_t body = cl && cl < eoh ? strtoul(cl + 17, 0, 10) : 0;
+  return _length >= header + body ? header + body : 0;
+}
+
+static void* upstream_conn( void* _arg )
+{
+  UpstreamConn* c = (UpstreamConn*)_arg;
+  Upstream* u = c->upstream;
+  char in[4096];
+  size_t length = 0;
+  for (;;)
+  {
+    int n = (int) recv(c->sock, in + length, sizeof(in) - 1 - length, 0);
+    if (n <= 0) break;
+    length += n;
+    in[length] = 0;
+    size_t end;
+    while ((end = message_end(in, length)) != 0)
+    {
+      memcpy(u->last, in, end);
+      u->last[end] = 0;
+      u->requests++;
+      char out[256];
+      int size;
+      if (strstr(u->last, " /lc/hold "))
+      {
+        for (int i = 0; i < 500 && !released; ++i) sleep_ms(10);
+      }
+      if (strstr(u->last, " /to/slow ")) sleep_ms(1000);
+      if (strstr(u->last, " /lc/tecl "))
+      {
+        // a smuggler's response: the chunks win and the length must not pass
+        size = sprintf(out, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n5\r\nhello\r\n0\r\n\r\n");
+      }
+      else
+      {
+        size = sprintf(out, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s", (int)strlen(u->name), u->name);
+      }
+      send(c->sock, out, size, MSG_NOSIGNAL);
+      length -= end;
+      memmove(in, in + end, length);
+      in[length] = 0;
+    }
+  }
+  close(c->sock);
+  free(c);
+  return 0;
+}
+
+static void* upstream_accept( void* _arg )
+{
+  Upstream* u = (Upstream*)_arg;
+  for (;;)
+  {
+    int sock = (int) accept(u->listener, 0, 0);
+    if (sock < 0) break;
+    u->accepted++;
+    UpstreamConn* c = (UpstreamConn*) malloc(sizeof(UpstreamConn));
+    c->upstream = u;
+    c->sock = sock;
+    pthread_t thread;
+    pthread_create(&thread, 0, upstream_conn, c);
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+static bool upstream_start( Upstream* _u )
+{
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(_u->port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int on = 1;
+  _u->listener = (int) socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  setsockopt(_u->listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+  if (bind(_u->listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(_u->listener, 16) < 0) return false;
+  pthread_t thread;
+  pthread_create(&thread, 0, upstream_accept, _u);
+  pthread_detach(thread);
+  return true;
+}
+
+static void proxy_handler( HttpResponse* _context, void* _userdata )
+{
+  (void)_userdata;
+  if (0 == strcmp(httpresponse_location(_context), "/stop")) stop = true;
+  httpresponse_response(_context, 200, "proxy", 0, 0);
+}
+
+static void* proxy_server( void* _server )
+{
+  while (!stop) httpd_process((Httpd*)_server, true);
+  return 0;
+}
+
+static int client_connect( void )
+{
+  int sock = (int) socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PROXY_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// one response from _sock into _out, or what came until the connection closed
+static size_t client_response( int _sock, char* _out, size_t _size )
+{
+  size_t length = 0;
+  _out[0] = 0;
+  while (length + 1 < _size && 0 == message_end(_out, length))
+  {
+    int n = (int) recv(_sock, _out + length, _size - 1 - length, 0);
+    if (n <= 0) break;
+    length += n;
+    _out[length] = 0;
+  }
+  return length;
+}
+
+// _request on a new connection, the response in _out
+static void exchange( const char* _request, char* _out, size_t _size )
+{
+  int sock = client_connect();
+  _out[0] = 0;
+  if (sock < 0) return;
+  send(sock, _request, strlen(_request), MSG_NOSIGNAL);
+  client_response(sock, _out, _size);
+  close(sock);
+}
+
+static bool body_is( const char* _response, const char* _body )
+{
+  const char* eoh = strstr(_response, "\r\n\r\n");
+  return eoh && 0 == strcmp(eoh + 4, _body);
+}
+
+int main( void )
+{
+  static Upstream a = { "A", PROXY_PORT + 1, -1, 0, 0, "" };
+  static Upstream b = { "B", PROXY_PORT + 2, -1, 0, 0, "" };
+  static Upstream c = { "C", PROXY_PORT + 3, -1, 0, 0, "" };
+  CHECK(upstream_start(&a) && upstream_start(&b) && upstream_start(&c));
+
+  Httpd* server = httpd_create(PROXY_PORT, proxy_handler, 0);
+  CHECK(server);
+  if (0 == server) return 1;
+  HttpProxy* lc = httpd_add_proxy(server, "/lc/");
+  HttpProxy* to = httpd_add_proxy(server, "/to/");
+  HttpProxy* down = httpd_add_proxy(server, "/down/");
+  CHECK(httpproxy_add_upstream(lc, "127.0.0.1", a.port, 0, 0));
+  CHECK(httpproxy_add_upstream(lc, "127.0.0.1", b.port, 0, 0));
+  CHECK(httpproxy_add_upstream(to, "127.0.0.1", c.port, 300, 0));
+  // nobody listens there
+  CHECK(httpproxy_add_upstream(down, "127.0.0.1", PROXY_PORT + 9, 0, 0));
+  pthread_t thread;
+  pthread_create(&thread, 0, proxy_server, server);
+
+  char out[4096];
+
+  // keep-alive: the upstreams take turns, the second round reuses their
+  // pooled connections, and so does a keep-alive client
+  const char* previous = "";
+  for (int i = 0; i < 4; ++i)
+  {
+    exchange("GET /lc/who HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n", out, sizeof(out));
+    CHECK(0 == strncmp(out, "HTTP/1.1 200 OK\r\n", 17));
+    const char* who = body_is(out, "A") ? "A" : "B";
+    CHECK(body_is(out, who) && who != previous);
+    previous = who;
+  }
+  int sock = client_connect();
+  for (int i = 0; i < 2; ++i)
+  {
+    static const char request[] = "GET /lc/who HTTP/1.1\r\nHost: test\r\n\r\n";
+    send(sock, request, sizeof(request) - 1, MSG_NOSIGNAL);
+    client_response(sock, out, sizeof(out));
+    CHECK(0 == strncmp(out, "HTTP/1.1 200 OK\r\n", 17));
+  }
+  close(sock);
+  CHECK(a.requests == 3 && b.requests == 3);
+  CHECK(a.accepted == 1 && b.accepted == 1);
+  CHECK(strstr(a.last, "X-Forwarded-For: 127.0.0.1\r\n"));
+
+  // least connections: while one upstream holds a request the other gets all
+  // the new ones, whatever the turn
+  int held = client_connect();
+  static const char hold[] = "GET /lc/hold HTTP/1.1\r\nHost: test\r\n\r\n";
+  send(held, hold, sizeof(hold) - 1, MSG_NOSIGNAL);
+  for (int i = 0; i < 500 && a.requests + b.requests < 7; ++i) sleep_ms(10);
+  Upstream* busy = strstr(a.last, " /lc/hold ") ? &a : &b;
+  Upstream* other = busy == &a ? &b : &a;
+  for (int i = 0; i < 3; ++i)
+  {
+    exchange("GET /lc/who HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n", out, sizeof(out));
+    CHECK(body_is(out, other->name));
+  }
+  released = true;
+  client_response(held, out, sizeof(out));
+  CHECK(body_is(out, busy->name));
+  close(held);
+
+  // an upstream that takes longer than its timeout, one that isn't there
+  uint64_t began = httpd_micros();
+  exchange("GET /to/slow HTTP/1.1\r\nHost: test\r\n\r\n", out, sizeof(out));
+  CHECK(0 == strncmp(out, "HTTP/1.1 504 ", 13));
+  CHECK(httpd_micros() - began < 900000);
+  exchange("GET /down/x HTTP/1.1\r\nHost: test\r\n\r\n", out, sizeof(out));
+  CHECK(0 == strncmp(out, "HTTP/1.1 502 ", 13));
+
+  // a chunked body goes upstream as it is, without a length. Connection
+  // can't take away the framing or the host
+  exchange("POST /lc/echo HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n"
+           "Connection: close, Content-Length, Host, Transfer-Encoding\r\n\r\n"
+           "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", out, sizeof(out));
+  CHECK(0 == strncmp(out, "HTTP/1.1 200 OK\r\n", 17));
+  Upstream* echo = strstr(a.last, " /lc/echo ") ? &a : &b;
+  CHECK(strstr(echo->last, "\r\nHost: test\r\n"));
+  CHECK(strstr(echo->last, "\r\nTransfer-Encoding: chunked\r\n"));
+  CHECK(0 == strcasestr(echo->last, "content-length"));
+  CHECK(strstr(echo->last, "\r\n\r\n5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n"));
+
+  // the chunks of a response win over its length, which is dropped
+  exchange("GET /lc/tecl HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n", out, sizeof(out));
+  CHECK(strstr(out, "\r\nTransfer-Encoding: chunked\r\n"));
+  CHECK(0 == strcasestr(out, "content-length"));
+  CHECK(strstr(out, "\r\n\r\n5\r\nhello\r\n0\r\n\r\n"));
+
+  // ambiguous framing never reaches an upstream
+  static const char* const smuggled[] =
+  {
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n0\r\n\r\n",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\nhello!",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nContent-Length: 5, 6\r\n\r\nhello!",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nContent-Length: 5x\r\n\r\nhello",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nContent-Length : 5\r\n\r\nhello",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: gzip, chunked\r\n\r\n0\r\n\r\n",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nTransfer-Encoding : chunked\r\n\r\n0\r\n\r\n",
+    "POST /lc/x HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: xchunked\r\n\r\n0\r\n\r\n",
+    0
+  };
+  int requests = a.requests + b.requests;
+  for (int i = 0; smuggled[i]; ++i)
+  {
+    exchange(smuggled[i], out, sizeof(out));
+    if (0 != strncmp(out, "HTTP/1.1 400 ", 13)) fprintf(stderr, "not rejected: %s", smuggled[i]);
+    CHECK(0 == strncmp(out, "HTTP/1.1 400 ", 13));
+  }
+  CHECK(a.requests + b.requests == requests);
+  // a request line the proxy can't forward is the client's mistake, not a 502
+  static const char* const malformed[] =
+  {
+    "GET /lc/x HTTP/2.0\r\nHost: test\r\n\r\n",
+    "GET /lc/x  HTTP/1.1\r\nHost: test\r\n\r\n",
+    "GET /lc/x FTP/1.1\r\nHost: test\r\n\r\n",
+    0
+  };
+  for (int i = 0; malformed[i]; ++i)
+  {
+    exchange(malformed[i], out, sizeof(out));
+    if (0 != strncmp(out, "HTTP/1.1 400 ", 13)) fprintf(stderr, "not rejected: %s", malformed[i]);
+    CHECK(0 == strncmp(out, "HTTP/1.1 400 ", 13));
+  }
+  CHECK(a.requests + b.requests == requests);
+  // the same length twice is no contradiction
+  exchange("POST /lc/x HTTP/1.1\r\nHost: test\r\nContent-Length: 5, 5\r\nConnection: close\r\n\r\nhello", out, sizeof(out));
+  CHECK(0 == strncmp(out, "HTTP/1.1 200 OK\r\n", 17));
+
+  exchange("GET /stop HTTP/1.1\r\nHost: test\r\n\r\n", out, sizeof(out));
+  pthread_join(thread, 0);
+  httpd_destroy(server);
+
+  printf("proxy: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
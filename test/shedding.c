@@ -0,0 +1,90 @@
+// load shedding: a stock server answers every request of a burst however
+// long they wait, with a CoDel target the late ones get 503.
+
+#include "../httpd.c"
+
+#include <pthread.h>
+
+#define SHEDDING_PORT 18490
+#define SHEDDING_CLIENTS 32
+
+static int failures;
+#define CHECK(_x) do { if (!(_x)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_x); ++failures; } } while (0)
+
+static volatile bool stop;
+
+// every request takes 10ms, the burst waits in line
+static void slow_handler( HttpResponse* _context, void* _userdata )
+{
+  (void)_userdata;
+  struct timespec t = { 0, 10000000L };
+  nanosleep(&t, 0);
+  httpresponse_response(_context, 200, "ok", 0, 0);
+}
+
+static void* shedding_server( void* _server )
+{
+  while (!stop) httpd_process((Httpd*)_server, false);
+  return 0;
+}
+
+// SHEDDING_CLIENTS requests at once, how many got a 503
+static int burst( Httpd* _server )
+{
+  stop = false;
+  pthread_t thread;
+  pthread_create(&thread, 0, shedding_server, _server);
+  int socks[SHEDDING_CLIENTS];
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(SHEDDING_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int i = 0; i < SHEDDING_CLIENTS; ++i)
+  {
+    socks[i] = (int) socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    CHECK(0 == connect(socks[i], (struct sockaddr*)&addr, sizeof(addr)));
+  }
+  static const char request[] = "GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+  for (int i = 0; i < SHEDDING_CLIENTS; ++i)
+  {
+    send(socks[i], request, sizeof(request) - 1, MSG_NOSIGNAL);
+  }
+  int shed = 0, served = 0;
+  for (int i = 0; i < SHEDDING_CLIENTS; ++i)
+  {
+    char out[1024];
+    int n = (int) recv(socks[i], out, sizeof(out) - 1, 0);
+    out[n > 0 ? n : 0] = 0;
+    if (0 == strncmp(out, "HTTP/1.1 503 ", 13)) ++shed;
+    else if (0 == strncmp(out, "HTTP/1.1 200 ", 13)) ++served;
+    close(socks[i]);
+  }
+  CHECK(shed + served == SHEDDING_CLIENTS);
+  stop = true;
+  pthread_join(thread, 0);
+  return shed;
+}
+
+int main( void )
+{
+  Httpd* server = httpd_create(SHEDDING_PORT, slow_handler, 0);
+  CHECK(server);
+  if (0 == server) return 1;
+
+  // off by default: everybody waits their turn
+  CHECK(0 == burst(server));
+
+  // a 5ms target: the wait stays above it for more than the 20ms interval
+  httpd_set_shedding(server, 5, 20);
+  int shed = burst(server);
+  CHECK(shed > 0 && shed < SHEDDING_CLIENTS);
+
+  // and off again
+  httpd_set_shedding(server, 0, 0);
+  CHECK(0 == burst(server));
+
+  httpd_destroy(server);
+  printf("shedding: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
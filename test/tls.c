@@ -0,0 +1,203 @@
+// tls over loopback with a self-signed certificate: the handshake, session
+// resumption (tls 1.2 session ids and tls 1.3 tickets) and alpn.
+// built by "make test OPENSSL=1", links -lssl -lcrypto
+
+#define HTTPD_WITH_OPENSSL
+#include "../httpd.c"
+
+#include <pthread.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+
+#define TLS_PORT 18443
+
+static int failures;
+#define CHECK(_x) do { if (!(_x)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_x); ++failures; } } while (0)
+
+static volatile bool stop;
+
+// the body is what the server side of the session looks like
+static void tls_handler( HttpResponse* _context, void* _userdata )
+{
+  (void)_userdata;
+  const char* info = httpresponse_tls_info(_context);
+  if (0 == strcmp(httpresponse_location(_context), "/stop")) stop = true;
+  httpresponse_response(_context, 200, info ? info : "plain", 0, "Content-Type: text/plain\r\n");
+}
+
+static void* tls_server( void* _server )
+{
+  while (!stop) httpd_process((Httpd*)_server, true);
+  return 0;
+}
+
+// a p-256 key and a certificate for localhost signed by itself
+static bool tls_certificate( const char* _certfile, const char* _keyfile )
+{
+  EVP_PKEY* key = EVP_EC_gen("P-256");
+  X509* cert = X509_new();
+  bool ok = false;
+  if (key && cert)
+  {
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    FILE* c = fopen(_certfile, "w");
+    FILE* k = fopen(_keyfile, "w");
+    ok = X509_sign(cert, key, EVP_sha256()) > 0 && c && k &&
+      PEM_write_X509(c, cert) && PEM_write_PrivateKey(k, key, 0, 0, 0, 0, 0);
+    if (c) fclose(c);
+    if (k) fclose(k);
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return ok;
+}
+
+static int tls_connect( void )
+{
+  int sock = (int) socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(TLS_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    close(sock);
+    sock = -1;
+  }
+  return sock;
+}
+
+// one request on a new connection. the response goes to _out, the session
+// (with its ticket, which tls 1.3 sends after the handshake) to _session
+static bool tls_get( SSL_CTX* _ctx, const char* _alpn, SSL_SESSION** _session, char* _out, size_t _size, char* _protocol )
+{
+  int sock = tls_connect();
+  if (sock < 0) return false;
+  SSL* ssl = SSL_new(_ctx);
+  SSL_set_fd(ssl, sock);
+  if (_alpn) SSL_set_alpn_protos(ssl, (const unsigned char*)_alpn, (unsigned int)strlen(_alpn));
+  if (*_session) SSL_set_session(ssl, *_session);
+  size_t length = 0;
+  _protocol[0] = 0;
+  bool ok = 1 == SSL_connect(ssl);
+  if (ok)
+  {
+    const unsigned char* data = 0;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(ssl, &data, &len);
+    if (len) memcpy(_protocol, data, len);
+    _protocol[len] = 0;
+    if (len == 2 && 0 == memcmp(data, "h2", 2))
+    {
+      // the preface and an empty SETTINGS, the server answers with its SETTINGS
+      static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n\0\0\0\4\0\0\0\0\0";
+      ok = SSL_write(ssl, preface, sizeof(preface) - 1) == (int)sizeof(preface) - 1;
+      unsigned char frame[9];
+      ok = ok && SSL_read(ssl, frame, 9) == 9 && frame[3] == 4;
+    }
+    else
+    {
+      static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+      ok = SSL_write(ssl, request, sizeof(request) - 1) == (int)sizeof(request) - 1;
+      int ret;
+      while (ok && length + 1 < _size && (ret = SSL_read(ssl, _out + length, (int)(_size - 1 - length))) > 0)
+      {
+        length += ret;
+      }
+    }
+  }
+  _out[length] = 0;
+  SSL_SESSION_free(*_session);
+  *_session = SSL_get1_session(ssl);
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(sock);
+  return ok;
+}
+
+static void tls_resumption( int _version )
+{
+  SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_min_proto_version(ctx, _version);
+  SSL_CTX_set_max_proto_version(ctx, _version);
+  SSL_SESSION* session = 0;
+  char out[4096];
+  char protocol[32];
+  CHECK(tls_get(ctx, "\x08http/1.1", &session, out, sizeof(out), protocol));
+  CHECK(0 == strncmp(out, "HTTP/1.1 200 OK\r\n", 17));
+  CHECK(0 == strstr(out, "resumed"));
+  CHECK(0 != strstr(out, _version == TLS1_3_VERSION ? "TLSv1.3" : "TLSv1.2"));
+  CHECK(0 == strcmp(protocol, "http/1.1"));
+  CHECK(session && SSL_SESSION_is_resumable(session));
+
+  CHECK(tls_get(ctx, "\x08http/1.1", &session, out, sizeof(out), protocol));
+  CHECK(0 != strstr(out, "resumed"));
+  SSL_SESSION_free(session);
+  SSL_CTX_free(ctx);
+}
+
+int main( void )
+{
+  char certfile[64], keyfile[64];
+  sprintf(certfile, "/tmp/httpd-tls-%d.crt", (int)getpid());
+  sprintf(keyfile, "/tmp/httpd-tls-%d.key", (int)getpid());
+  if (!tls_certificate(certfile, keyfile))
+  {
+    fprintf(stderr, "tls: no certificate\n");
+    return 1;
+  }
+
+  Httpd* server = httpd_create(TLS_PORT, tls_handler, 0);
+  CHECK(server);
+  if (0 == server) return 1;
+  CHECK(httpd_set_tls(server, httpd_tls_openssl(), certfile, keyfile));
+  CHECK(httpd_set_http2(server, true));
+  unlink(certfile);
+  unlink(keyfile);
+  pthread_t thread;
+  pthread_create(&thread, 0, tls_server, server);
+
+  tls_resumption(TLS1_2_VERSION);
+  tls_resumption(TLS1_3_VERSION);
+
+  // alpn: h2 when offered, http/1.1 otherwise, nothing for clients without alpn
+  SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+  SSL_SESSION* session = 0;
+  char out[4096];
+  char protocol[32];
+  CHECK(tls_get(ctx, "\x08http/1.1\x02h2", &session, out, sizeof(out), protocol));
+  CHECK(0 == strcmp(protocol, "h2"));
+  SSL_SESSION_free(session);
+  session = 0;
+  CHECK(tls_get(ctx, "\x06spdy/1\x08http/1.1", &session, out, sizeof(out), protocol));
+  CHECK(0 == strcmp(protocol, "http/1.1"));
+  SSL_SESSION_free(session);
+  session = 0;
+  CHECK(tls_get(ctx, 0, &session, out, sizeof(out), protocol));
+  CHECK(0 == protocol[0]);
+  CHECK(0 == strncmp(out, "HTTP/1.1 200 OK\r\n", 17));
+  SSL_SESSION_free(session);
+
+  // the last request stops the server
+  int sock = tls_connect();
+  SSL* ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, sock);
+  static const char request[] = "GET /stop HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+  CHECK(1 == SSL_connect(ssl) && SSL_write(ssl, request, sizeof(request) - 1) > 0);
+  while (SSL_read(ssl, out, sizeof(out)) > 0) {}
+  SSL_free(ssl);
+  close(sock);
+  SSL_CTX_free(ctx);
+  pthread_join(thread, 0);
+  httpd_destroy(server);
+
+  printf("tls: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}